@@ -0,0 +1,187 @@
+#include "asynchandlers.h"
+
+#include <cstdio>
+#include <stdexcept>
+
+#include "vendor/flashmq_plugin.h"
+
+using namespace dbus_flashmq;
+
+AsyncHandlers::AsyncHandlers() :
+    slots(64)
+{
+
+}
+
+size_t AsyncHandlers::get_index(dbus_uint32_t serial) const
+{
+    return serial & (slots.size() - 1);
+}
+
+/**
+ * @brief AsyncHandlers::grow doubles the ring until all used slots have a place of their own.
+ */
+void AsyncHandlers::grow()
+{
+    size_t new_size = slots.size() * 2;
+
+    while (true)
+    {
+        std::vector<Slot> new_slots(new_size);
+        bool collision = false;
+
+        for (Slot &slot : slots)
+        {
+            if (!slot.used)
+                continue;
+
+            Slot &new_slot = new_slots[slot.serial & (new_size - 1)];
+
+            if (new_slot.used)
+            {
+                collision = true;
+                break;
+            }
+
+            new_slot = std::move(slot);
+            slot.used = false;
+        }
+
+        if (!collision)
+        {
+            slots = std::move(new_slots);
+            return;
+        }
+
+        // Undo, and try bigger.
+        for (Slot &new_slot : new_slots)
+        {
+            if (new_slot.used)
+            {
+                Slot &slot = slots[get_index(new_slot.serial)];
+                slot = std::move(new_slot);
+            }
+        }
+
+        new_size *= 2;
+    }
+}
+
+void AsyncHandlers::add(dbus_uint32_t serial, AsyncHandler &&handler, std::chrono::milliseconds timeout, std::string_view method,
+                        std::string_view service)
+{
+    while (slots[get_index(serial)].used)
+    {
+        if (slots[get_index(serial)].serial == serial)
+            throw std::runtime_error("Programming error: dbus serial " + std::to_string(serial) + " is already pending.");
+
+        grow();
+    }
+
+    Slot &slot = slots[get_index(serial)];
+    slot.handler = std::move(handler);
+    slot.sent_at = std::chrono::steady_clock::now();
+    slot.timeout = timeout;
+    slot.serial = serial;
+    slot.used = true;
+
+    snprintf(slot.description, sizeof(slot.description), "%.*s on %.*s", static_cast<int>(method.size()), method.data(),
+             static_cast<int>(service.size()), service.data());
+
+    in_flight++;
+}
+
+/**
+ * @brief AsyncHandlers::take removes the handler of a serial, for calling it.
+ * @return the handler, or an empty one if we don't know the serial (anymore).
+ */
+AsyncHandler AsyncHandlers::take(dbus_uint32_t serial)
+{
+    Slot &slot = slots[get_index(serial)];
+
+    if (!slot.used || slot.serial != serial)
+        return AsyncHandler();
+
+    slot.used = false;
+    in_flight--;
+    return std::move(slot.handler);
+}
+
+/**
+ * @brief AsyncHandlers::expire_lost removes handlers that are pending for longer than their timeout plus grace.
+ * @return the number of handlers removed.
+ *
+ * The handlers are called with a NoReply error, like dbus would have done, because a coroutine waiting on it would never be resumed
+ * otherwise. They are taken out first, because a handler may make new calls.
+ */
+size_t AsyncHandlers::expire_lost(std::chrono::milliseconds grace)
+{
+    const auto now = std::chrono::steady_clock::now();
+    std::vector<AsyncHandler> lost;
+
+    for (Slot &slot : slots)
+    {
+        if (!slot.used || now - slot.sent_at <= slot.timeout + grace)
+            continue;
+
+        flashmq_logf(LOG_WARNING, "Giving up on reply to dbus call '%s', with serial %u. It never completed.", slot.description, slot.serial);
+
+        lost.push_back(std::move(slot.handler));
+        slot.handler.reset();
+        slot.used = false;
+        in_flight--;
+    }
+
+    lost_count += lost.size();
+
+    if (lost.empty())
+        return 0;
+
+    DBusMessage *error = dbus_message_new(DBUS_MESSAGE_TYPE_ERROR);
+
+    if (!error)
+        throw std::runtime_error("Out of memory creating dbus error message.");
+
+    dbus_message_set_error_name(error, DBUS_ERROR_NO_REPLY);
+
+    for (AsyncHandler &handler : lost)
+    {
+        try
+        {
+            handler(error);
+        }
+        catch (std::exception &ex)
+        {
+            flashmq_logf(LOG_ERR, ex.what());
+        }
+    }
+
+    dbus_message_unref(error);
+    return lost.size();
+}
+
+size_t AsyncHandlers::get_in_flight_count() const
+{
+    return in_flight;
+}
+
+size_t AsyncHandlers::get_lost_count() const
+{
+    return lost_count;
+}
+
+std::optional<std::chrono::milliseconds> AsyncHandlers::get_oldest_age() const
+{
+    std::optional<std::chrono::time_point<std::chrono::steady_clock>> oldest;
+
+    for (const Slot &slot : slots)
+    {
+        if (slot.used && (!oldest || slot.sent_at < oldest.value()))
+            oldest = slot.sent_at;
+    }
+
+    if (!oldest)
+        return {};
+
+    return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - oldest.value());
+}
@@ -0,0 +1,63 @@
+#ifndef ASYNCHANDLERS_H
+#define ASYNCHANDLERS_H
+
+#include <vector>
+#include <chrono>
+#include <optional>
+#include <string_view>
+#include <dbus-1.0/dbus/dbus.h>
+
+#include "smallfunction.h"
+
+#define ASYNC_HANDLER_CAPACITY 96
+#define ASYNC_HANDLER_DESCRIPTION_SIZE 64
+
+namespace dbus_flashmq
+{
+
+using AsyncHandler = SmallFunction<void(DBusMessage *msg), ASYNC_HANDLER_CAPACITY>;
+
+/**
+ * @brief The AsyncHandlers class holds the reply handlers of pending dbus method calls, indexed by the serial of the call.
+ *
+ * It's a ring of slots, indexed by the low bits of the serial. Serials of one connection only go up, so as long as there are no calls
+ * pending for longer than it takes to wrap around the ring, there are no collisions. When there is one, the ring is doubled. In the steady
+ * state, adding and taking handlers doesn't allocate.
+ *
+ * Dbus calls us back with a NoReply error when a call times out, so a handler that is still there well after its timeout was lost somewhere.
+ * Those are expired by expire_lost(), and counted.
+ */
+class AsyncHandlers
+{
+    struct Slot
+    {
+        AsyncHandler handler;
+        std::chrono::time_point<std::chrono::steady_clock> sent_at;
+        std::chrono::milliseconds timeout = std::chrono::milliseconds(0);
+        dbus_uint32_t serial = 0;
+        bool used = false;
+        char description[ASYNC_HANDLER_DESCRIPTION_SIZE];
+    };
+
+    std::vector<Slot> slots;
+    size_t in_flight = 0;
+    size_t lost_count = 0;
+
+    size_t get_index(dbus_uint32_t serial) const;
+    void grow();
+
+public:
+    AsyncHandlers();
+
+    void add(dbus_uint32_t serial, AsyncHandler &&handler, std::chrono::milliseconds timeout, std::string_view method, std::string_view service);
+    AsyncHandler take(dbus_uint32_t serial);
+    size_t expire_lost(std::chrono::milliseconds grace);
+
+    size_t get_in_flight_count() const;
+    size_t get_lost_count() const;
+    std::optional<std::chrono::milliseconds> get_oldest_age() const;
+};
+
+}
+
+#endif // ASYNCHANDLERS_H
@@ -0,0 +1,50 @@
+#include "clientprofile.h"
+
+#include "utils.h"
+
+using namespace dbus_flashmq;
+
+ClientProfile::ClientProfile(const std::string &username, bool privileged, bool localhost) :
+    username(username),
+    bridge(username_is_bridge(username)),
+    integrations_user(username == DBUS_MQTT_INTEGRATIONS_USERNAME),
+    privileged(privileged || bridge),
+    localhost(localhost)
+{
+    if (!username.starts_with("token/"))
+        return;
+
+    const std::vector<std::string> fields = splitToVector(username, '/');
+
+    if (fields.size() != 3)
+        return;
+
+    token = true;
+    token_role = fields.at(1);
+    token_unique_id = fields.at(2);
+}
+
+void ClientProfiles::set(const std::string &clientid, ClientProfile &&profile)
+{
+    profiles[clientid] = std::move(profile);
+}
+
+const ClientProfile *ClientProfiles::find(const std::string &clientid, const std::string &username) const
+{
+    auto pos = profiles.find(clientid);
+
+    if (pos == profiles.end() || pos->second.username != username)
+        return nullptr;
+
+    return &pos->second;
+}
+
+void ClientProfiles::remove(const std::string &clientid)
+{
+    profiles.erase(clientid);
+}
+
+size_t ClientProfiles::size() const
+{
+    return profiles.size();
+}
@@ -0,0 +1,52 @@
+#ifndef CLIENTPROFILE_H
+#define CLIENTPROFILE_H
+
+#include <string>
+#include <unordered_map>
+
+#define DBUS_MQTT_INTEGRATIONS_USERNAME "dbus-mqtt-integrations"
+
+namespace dbus_flashmq
+{
+
+/**
+ * @brief The ClientProfile struct is what the ACL checks need to know about a client, worked out once instead of on every message.
+ *
+ * Whether a client is privileged or on localhost normally takes session and client pointer lookups, and the address of the client.
+ */
+struct ClientProfile
+{
+    std::string username;
+    bool bridge = false;
+    bool integrations_user = false;
+    bool privileged = false;
+    bool localhost = false;
+
+    // Of token usernames, like 'token/evcharger/HQ2501ABCDE'.
+    bool token = false;
+    std::string token_role;
+    std::string token_unique_id;
+
+    ClientProfile() = default;
+    ClientProfile(const std::string &username, bool privileged, bool localhost);
+};
+
+/**
+ * @brief The ClientProfiles class keeps the profiles of connected clients, by client id.
+ *
+ * A profile is only valid for the username it was made for, because a client id can be reused by another user.
+ */
+class ClientProfiles
+{
+    std::unordered_map<std::string, ClientProfile> profiles;
+
+public:
+    void set(const std::string &clientid, ClientProfile &&profile);
+    const ClientProfile *find(const std::string &clientid, const std::string &username) const;
+    void remove(const std::string &clientid);
+    size_t size() const;
+};
+
+}
+
+#endif // CLIENTPROFILE_H
@@ -0,0 +1,268 @@
+#include "credentialscache.h"
+
+#include <sys/inotify.h>
+#include <unistd.h>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <filesystem>
+
+#include "vendor/flashmq_plugin.h"
+#include "vendor/json.hpp"
+#include "utils.h"
+
+using namespace dbus_flashmq;
+
+CredentialsCache::WatchedFile::WatchedFile(const std::string &path) :
+    path(path),
+    name(std::filesystem::path(path).filename())
+{
+
+}
+
+bool CredentialsCache::WatchedFile::needs_loading() const
+{
+    return stale || wd < 0;
+}
+
+CredentialsCache::CredentialsCache(const std::string &tokens_path, const std::string &vnc_password_path) :
+    tokens_file(tokens_path),
+    vnc_password_file(vnc_password_path)
+{
+
+}
+
+CredentialsCache::~CredentialsCache()
+{
+    if (fd >= 0)
+        close(fd);
+    fd = -1;
+}
+
+void CredentialsCache::watch(WatchedFile &file)
+{
+    const std::string dir = std::filesystem::path(file.path).parent_path();
+    const uint32_t mask = IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO;
+
+    // Watching the directory, because the files are often replaced, or don't exist (yet).
+    file.wd = inotify_add_watch(fd, dir.c_str(), mask);
+    file.stale = true;
+
+    if (file.wd < 0)
+        flashmq_logf(LOG_WARNING, "Can't watch '%s' for changes to '%s', so reading it on every login: %s", dir.c_str(), file.name.c_str(), strerror(errno));
+}
+
+/**
+ * @brief CredentialsCache::start_watching sets up the inotify watches. The caller must add the fd to the event loop, and call
+ * handle_events() when it's readable.
+ */
+void CredentialsCache::start_watching()
+{
+    if (fd >= 0)
+        return;
+
+    fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+
+    if (fd < 0)
+    {
+        flashmq_logf(LOG_WARNING, "Can't create inotify instance, so reading credentials on every login: %s", strerror(errno));
+        return;
+    }
+
+    watch(tokens_file);
+    watch(vnc_password_file);
+}
+
+int CredentialsCache::get_fd() const
+{
+    return fd;
+}
+
+/**
+ * @brief CredentialsCache::handle_events drains the inotify queue, and marks the files that changed for reloading.
+ */
+void CredentialsCache::handle_events()
+{
+    if (fd < 0)
+        return;
+
+    alignas(struct inotify_event) char buf[4096];
+
+    while (true)
+    {
+        const ssize_t len = read(fd, buf, sizeof(buf));
+
+        if (len <= 0)
+            break;
+
+        for (ssize_t pos = 0; pos < len; )
+        {
+            const struct inotify_event *event = reinterpret_cast<const struct inotify_event*>(buf + pos);
+            pos += static_cast<ssize_t>(sizeof(struct inotify_event) + event->len);
+
+            // Lost events, or the directory itself is gone, so we don't know anymore.
+            if (event->mask & (IN_Q_OVERFLOW | IN_IGNORED))
+            {
+                for (WatchedFile *file : {&tokens_file, &vnc_password_file})
+                {
+                    if ((event->mask & IN_Q_OVERFLOW) || event->wd == file->wd)
+                        file->stale = true;
+
+                    if ((event->mask & IN_IGNORED) && event->wd == file->wd)
+                        file->wd = -1;
+                }
+
+                continue;
+            }
+
+            if (event->len == 0)
+                continue;
+
+            for (WatchedFile *file : {&tokens_file, &vnc_password_file})
+            {
+                if (event->wd == file->wd && file->name == event->name)
+                    file->stale = true;
+            }
+        }
+    }
+}
+
+/**
+ * These are tokens set for pairing, like:
+ *
+ *   curl --insecure --user "remoteconsole:securityprofilepassword" -X POST \
+ *     -d "role=evcharger&device_id=mydevice123" 'https://venus.local/auth/generate-token/'
+ *
+ * Answer: {"token_name":"token/evcharger/mydevice123","password":"hfNWPw7UmCKg4CiSZ1CKnnkjlBbArStO"}
+ *
+ * Example tokens file:
+ *
+ * [
+ *    {
+ *       "password_hash": "$2y$10$SIQlG707GEsg2J6ek.FH/Od9DEr8NeBC/1xdNmdz3So7ilwKbOUw6",
+ *       "token_name": "token/evcharger/mydevice123"
+ *    }
+ * ]
+ *
+ */
+void CredentialsCache::load_tokens()
+{
+    token_password_hashes.clear();
+    load_count++;
+
+    if (!std::filesystem::exists(tokens_file.path))
+    {
+        tokens_file.stale = false;
+        return;
+    }
+
+    std::ifstream infile(tokens_file.path);
+
+    if (!infile.is_open())
+    {
+        throw std::runtime_error("Error opening " + tokens_file.path);
+    }
+
+    std::stringstream buffer;
+    buffer << infile.rdbuf();
+    std::string json_text = buffer.str();
+
+    const nlohmann::json j = nlohmann::json::parse(json_text);
+
+    if (!j.is_array())
+        throw std::runtime_error("The file '" + tokens_file.path + "' is not valid json (array)");
+
+    for (auto &row : j)
+    {
+        const std::string &token_name = row.at("token_name");
+        const std::string &password_hash = row.at("password_hash");
+
+        // Like before, the first one wins.
+        token_password_hashes.try_emplace(token_name, password_hash);
+    }
+
+    tokens_file.stale = false;
+}
+
+void CredentialsCache::load_vnc_password()
+{
+    vnc_password_crypt.reset();
+    load_count++;
+
+    if (!std::filesystem::exists(vnc_password_file.path))
+    {
+        vnc_password_file.stale = false;
+        return;
+    }
+
+    if (std::filesystem::file_size(vnc_password_file.path) == 0)
+    {
+        vnc_password_crypt = "";
+        vnc_password_file.stale = false;
+        return;
+    }
+
+    std::fstream file(vnc_password_file.path, std::ios::in);
+
+    if (!file)
+    {
+        std::string error_str(strerror(errno));
+        throw std::runtime_error(error_str);
+    }
+
+    std::string crypt;
+
+    if (!getline(file, crypt))
+    {
+        std::string error_str(strerror(errno));
+        throw std::runtime_error(error_str);
+    }
+
+    // The file is normally 0 bytes, but disabling it again makes it 1 byte, with a newline. This is also approved.
+    trim(crypt);
+
+    vnc_password_crypt = crypt;
+    vnc_password_file.stale = false;
+}
+
+/**
+ * @brief CredentialsCache::get_token_password_hash
+ * @return the hash, or nullptr when there is no such token, or no tokens file.
+ *
+ * Errors reading the file are thrown, and the file is read again on the next call.
+ */
+const std::string *CredentialsCache::get_token_password_hash(const std::string &token_name)
+{
+    handle_events();
+
+    if (tokens_file.needs_loading())
+        load_tokens();
+
+    auto pos = token_password_hashes.find(token_name);
+
+    if (pos == token_password_hashes.end())
+        return nullptr;
+
+    return &pos->second;
+}
+
+/**
+ * @brief CredentialsCache::get_vnc_password_crypt
+ * @return the hash, empty when there is no password, or nothing when there is no password file.
+ *
+ * Errors reading the file are thrown, and the file is read again on the next call.
+ */
+const std::optional<std::string> &CredentialsCache::get_vnc_password_crypt()
+{
+    handle_events();
+
+    if (vnc_password_file.needs_loading())
+        load_vnc_password();
+
+    return vnc_password_crypt;
+}
+
+size_t CredentialsCache::get_load_count() const
+{
+    return load_count;
+}
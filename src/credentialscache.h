@@ -0,0 +1,60 @@
+#ifndef CREDENTIALSCACHE_H
+#define CREDENTIALSCACHE_H
+
+#include <string>
+#include <optional>
+#include <unordered_map>
+
+namespace dbus_flashmq
+{
+
+/**
+ * @brief The CredentialsCache class keeps the parsed tokens file and the VNC password hash, so that logins don't read and parse them every
+ * time. That matters when all clients reconnect at once, after a network blip.
+ *
+ * The directories of the files are watched with inotify, and a file is only read again after an event for it. The inotify queue is also
+ * drained before each lookup, which is a cheap non-blocking read, so a change is seen by the very next login. When a watch can't be made,
+ * like when the directory doesn't exist, the file is read every time, like before.
+ */
+class CredentialsCache
+{
+    struct WatchedFile
+    {
+        std::string path;
+        std::string name;
+        int wd = -1;
+        bool stale = true;
+
+        WatchedFile(const std::string &path);
+        bool needs_loading() const;
+    };
+
+    int fd = -1;
+    WatchedFile tokens_file;
+    WatchedFile vnc_password_file;
+    std::unordered_map<std::string, std::string> token_password_hashes; // keyed by token name, like 'token/evcharger/mydevice123'.
+    std::optional<std::string> vnc_password_crypt; // Empty means no password, not set means no file.
+    size_t load_count = 0;
+
+    void watch(WatchedFile &file);
+    void load_tokens();
+    void load_vnc_password();
+
+public:
+    CredentialsCache(const std::string &tokens_path, const std::string &vnc_password_path);
+    CredentialsCache(const CredentialsCache &other) = delete;
+    ~CredentialsCache();
+    CredentialsCache &operator=(const CredentialsCache &other) = delete;
+
+    void start_watching();
+    int get_fd() const;
+    void handle_events();
+
+    const std::string *get_token_password_hash(const std::string &token_name);
+    const std::optional<std::string> &get_vnc_password_crypt();
+    size_t get_load_count() const;
+};
+
+}
+
+#endif // CREDENTIALSCACHE_H
@@ -0,0 +1,165 @@
+#include "cryptworkers.h"
+
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <cstring>
+#include <stdexcept>
+
+#include "vendor/flashmq_plugin.h"
+#include "utils.h"
+
+using namespace dbus_flashmq;
+
+CryptWorkers::~CryptWorkers()
+{
+    stop();
+}
+
+void CryptWorkers::start(size_t thread_count)
+{
+    if (running() || thread_count == 0)
+        return;
+
+    event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+    if (event_fd < 0)
+        throw std::runtime_error(std::string("Error creating eventfd for crypt workers: ") + strerror(errno));
+
+    stopping = false;
+
+    for (size_t i = 0; i < thread_count; i++)
+    {
+        std::thread &t = threads.emplace_back(&CryptWorkers::work, this);
+        pthread_setname_np(t.native_handle(), "dbus-crypt");
+    }
+}
+
+/**
+ * @brief CryptWorkers::stop waits for the workers to finish their current job. Jobs still queued are dropped, and their completions aren't
+ * called.
+ */
+void CryptWorkers::stop()
+{
+    {
+        std::lock_guard<std::mutex> locker(mutex);
+        stopping = true;
+    }
+
+    jobs_available.notify_all();
+
+    for (std::thread &t : threads)
+    {
+        if (t.joinable())
+            t.join();
+    }
+
+    threads.clear();
+    jobs.clear();
+    results.clear();
+    completions.clear();
+
+    if (event_fd >= 0)
+        close(event_fd);
+    event_fd = -1;
+}
+
+bool CryptWorkers::running() const
+{
+    return !threads.empty();
+}
+
+int CryptWorkers::get_fd() const
+{
+    return event_fd;
+}
+
+void CryptWorkers::work()
+{
+    while (true)
+    {
+        Job job;
+
+        {
+            std::unique_lock<std::mutex> locker(mutex);
+            jobs_available.wait(locker, [this]() { return stopping || !jobs.empty(); });
+
+            if (stopping)
+                return;
+
+            job = std::move(jobs.front());
+            jobs.pop_front();
+        }
+
+        const bool match = crypt_match(job.phrase, job.crypted);
+
+        {
+            std::lock_guard<std::mutex> locker(mutex);
+            results.push_back({job.id, match});
+        }
+
+        uint64_t one = 1;
+        if (write(event_fd, &one, sizeof(one)) < 0)
+        {
+            // Can only be a full counter, which means the plugin thread is notified already.
+        }
+    }
+}
+
+/**
+ * @brief CryptWorkers::submit queues the verification. The completion is called on the plugin thread, from handle_results().
+ */
+void CryptWorkers::submit(const std::string &phrase, const std::string &crypted, std::function<void(bool match)> &&completion)
+{
+    if (!running())
+        throw std::runtime_error("Crypt workers are not running.");
+
+    const uint64_t id = next_id++;
+    completions[id] = std::move(completion);
+
+    {
+        std::lock_guard<std::mutex> locker(mutex);
+        jobs.push_back({id, phrase, crypted});
+    }
+
+    jobs_available.notify_one();
+}
+
+void CryptWorkers::handle_results()
+{
+    uint64_t eventfd_value = 0;
+    if (read(event_fd, &eventfd_value, sizeof(eventfd_value)) < 0)
+        return;
+
+    results_being_handled.clear();
+
+    {
+        std::lock_guard<std::mutex> locker(mutex);
+        results_being_handled.swap(results);
+    }
+
+    for (const Result &r : results_being_handled)
+    {
+        auto pos = completions.find(r.id);
+
+        if (pos == completions.end())
+            continue;
+
+        std::function<void(bool match)> completion = std::move(pos->second);
+        completions.erase(pos);
+
+        try
+        {
+            completion(r.match);
+        }
+        catch (std::exception &ex)
+        {
+            flashmq_logf(LOG_ERR, "Error completing password verification: %s", ex.what());
+        }
+    }
+}
+
+size_t CryptWorkers::get_pending_count() const
+{
+    return completions.size();
+}
@@ -0,0 +1,71 @@
+#ifndef CRYPTWORKERS_H
+#define CRYPTWORKERS_H
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <unordered_map>
+#include <cstdint>
+
+namespace dbus_flashmq
+{
+
+/**
+ * @brief The CryptWorkers class verifies password hashes on worker threads. bcrypt is slow on purpose, and done on the plugin thread,
+ * it holds up all MQTT and dbus traffic, which shows when all clients log in again at once.
+ *
+ * The workers only run crypt; the completion handlers are called on the plugin thread, from handle_results(), when the eventfd is
+ * readable. Nothing else of the plugin is touched by the workers.
+ */
+class CryptWorkers
+{
+    struct Job
+    {
+        uint64_t id = 0;
+        std::string phrase;
+        std::string crypted;
+    };
+
+    struct Result
+    {
+        uint64_t id = 0;
+        bool match = false;
+    };
+
+    std::vector<std::thread> threads;
+    std::mutex mutex;
+    std::condition_variable jobs_available;
+    std::deque<Job> jobs;
+    std::vector<Result> results;
+    bool stopping = false;
+    int event_fd = -1;
+
+    // Only used on the plugin thread.
+    uint64_t next_id = 1;
+    std::unordered_map<uint64_t, std::function<void(bool match)>> completions;
+    std::vector<Result> results_being_handled;
+
+    void work();
+
+public:
+    CryptWorkers() = default;
+    CryptWorkers(const CryptWorkers &other) = delete;
+    ~CryptWorkers();
+    CryptWorkers &operator=(const CryptWorkers &other) = delete;
+
+    void start(size_t thread_count);
+    void stop();
+    bool running() const;
+    int get_fd() const;
+    void submit(const std::string &phrase, const std::string &crypted, std::function<void(bool match)> &&completion);
+    void handle_results();
+    size_t get_pending_count() const;
+};
+
+}
+
+#endif // CRYPTWORKERS_H
@@ -167,7 +167,15 @@ void dbus_flashmq::dbus_pending_call_notify(DBusPendingCall *pending, void *data
     }
 
     const DBusMessageGuard msg = dbus_pending_call_steal_reply(pending);
-    const dbus_uint32_t reply_to = dbus_message_get_reply_serial(msg.d);
+    dbus_handle_reply(state, msg.d);
+}
+
+/**
+ * @brief dbus_handle_reply gives a method return or error to the handler of the call it's the reply to.
+ */
+void dbus_flashmq::dbus_handle_reply(State *state, DBusMessage *msg) noexcept
+{
+    const dbus_uint32_t reply_to = dbus_message_get_reply_serial(msg);
 
     if (reply_to == 0)
     {
@@ -175,7 +183,7 @@ void dbus_flashmq::dbus_pending_call_notify(DBusPendingCall *pending, void *data
         return;
     }
 
-    const int msg_type = dbus_message_get_type(msg.d);
+    const int msg_type = dbus_message_get_type(msg);
 
     if (!(msg_type == DBUS_MESSAGE_TYPE_METHOD_RETURN || msg_type == DBUS_MESSAGE_TYPE_ERROR))
     {
@@ -183,15 +191,16 @@ void dbus_flashmq::dbus_pending_call_notify(DBusPendingCall *pending, void *data
         return;
     }
 
-    auto fpos = state->async_handlers.find(reply_to);
+    AsyncHandler f = state->async_handlers.take(reply_to);
 
-    if (fpos != state->async_handlers.end())
+    if (f)
     {
         try
         {
-            auto f = fpos->second;
-            state->async_handlers.erase(fpos);
-            f(msg.d);
+            if (state->trace_recorder)
+                state->trace_recorder->record_dbus_message(TraceEventType::DbusReply, msg);
+
+            f(msg);
         }
         catch (std::exception &ex)
         {
@@ -204,22 +213,27 @@ DBusHandlerResult dbus_flashmq::dbus_handle_message(DBusConnection *connection,
 {
     (void) connection;
 
+    // Views, not copies, because this is done for every signal.
     const char *_signal_name = dbus_message_get_member(message);
-    const std::string signal_name(_signal_name ? _signal_name : "");
+    const std::string_view signal_name(_signal_name ? _signal_name : "");
+
+    State *state = static_cast<State*>(user_data);
 
     try
     {
-        State *state = static_cast<State*>(user_data);
+        if (state->trace_recorder)
+            state->trace_recorder->record_dbus_message(TraceEventType::DbusMessage, message);
+
         int msg_type = dbus_message_get_type(message);
 
         const char *_sender = dbus_message_get_sender(message);
-        std::string sender(_sender ? _sender : "");
+        const std::string_view raw_sender(_sender ? _sender : "");
 
         if (msg_type == DBUS_MESSAGE_TYPE_SIGNAL)
         {
             state->attempt_to_process_delayed_changes();
 
-            if (strcmp(signal_name.c_str(), "NameAcquired") == 0)
+            if (signal_name == "NameAcquired")
             {
                 const char *_name = nullptr;
                 DBusErrorGuard err;
@@ -228,11 +242,14 @@ DBusHandlerResult dbus_flashmq::dbus_handle_message(DBusConnection *connection,
 
                 std::string name(_name);
 
-                flashmq_logf(LOG_DEBUG, "Signal: '%s' by '%s'. Name: '%s'", signal_name.c_str(), sender.c_str(), name.c_str());
+                state->stats.other_signals++;
+                flashmq_logf(LOG_DEBUG, "Signal: '%s' by '%s'. Name: '%s'", signal_name.data(), raw_sender.data(), name.c_str());
                 return DBusHandlerResult::DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
             }
-            else if (strcmp(signal_name.c_str(), "NameOwnerChanged") == 0)
+            else if (signal_name == "NameOwnerChanged")
             {
+                state->stats.name_owner_changed_signals++;
+
                 const char *_name = nullptr;
                 const char *_oldowner = nullptr;
                 const char *_newowner = nullptr;
@@ -264,46 +281,55 @@ DBusHandlerResult dbus_flashmq::dbus_handle_message(DBusConnection *connection,
                 return DBusHandlerResult::DBUS_HANDLER_RESULT_HANDLED;
             }
 
-            state->get_named_owner(sender);
-            //flashmq_logf(LOG_DEBUG, "Received signal: '%s' by '%s'", signal_name.c_str(), sender.c_str());
+            // Unique names like ':1.66' fit in the small string buffer, so this doesn't allocate.
+            const std::string unique_sender(raw_sender);
+            const std::string &sender = state->get_named_owner(unique_sender);
+            //flashmq_logf(LOG_DEBUG, "Received signal: '%s' by '%s'", signal_name.data(), sender.c_str());
 
             if (sender.starts_with("com.victronenergy."))
             {
                 // The preferred signal, containing multiple items. The format is used by both ItemsChanged and the method call GetItems.
-                if (strcmp(signal_name.c_str(), "ItemsChanged") == 0)
+                if (signal_name == "ItemsChanged")
                 {
-                    std::unordered_map<std::string, Item> changed_items = get_from_dict_with_dict_with_text_and_value(message);
-                    state->add_dbus_to_mqtt_mapping(sender, changed_items, true);
+                    state->stats.items_changed_signals++;
+                    state->signal_read_at = state->dbus_data_read_at;
+                    state->apply_items_changed(sender, message);
+                    state->signal_read_at.reset();
 
                     return DBusHandlerResult::DBUS_HANDLER_RESULT_HANDLED;
                 }
 
                 // Will contain the update for only one item.
-                if (strcmp(signal_name.c_str(), "PropertiesChanged") == 0)
+                if (signal_name == "PropertiesChanged")
                 {
-                    std::unordered_map<std::string, Item> changed_items = get_from_properties_changed(message);
-                    state->add_dbus_to_mqtt_mapping(sender, changed_items, true);
+                    state->stats.properties_changed_signals++;
+                    state->signal_read_at = state->dbus_data_read_at;
+                    state->apply_properties_changed(sender, message);
+                    state->signal_read_at.reset();
 
                     return DBusHandlerResult::DBUS_HANDLER_RESULT_HANDLED;
                 }
             }
 
+            state->stats.other_signals++;
+
             const char *_interface = dbus_message_get_interface(message);
-            const std::string interface(_interface ? _interface : "");
+            const std::string_view interface(_interface ? _interface : "");
 
-            if (strcmp(interface.c_str(), "com.victronenergy.TokenUsers") == 0 && strcmp(signal_name.c_str(), "UserRemoved") == 0)
+            if (interface == "com.victronenergy.TokenUsers" && signal_name == "UserRemoved")
             {
                 std::string token_name = get_string_from_reply(message);
                 state->disconnect_all_connections_of_user(token_name);
                 return DBusHandlerResult::DBUS_HANDLER_RESULT_HANDLED;
             }
 
-            flashmq_logf(LOG_INFO, "Unhandled signal: '%s' by '%s'", signal_name.c_str(), sender.c_str());
+            flashmq_logf(LOG_INFO, "Unhandled signal: '%s' by '%s'", signal_name.data(), sender.c_str());
         }
     }
     catch (std::exception &ex)
     {
-        flashmq_logf(LOG_ERR, "On signal '%s' in dbus_handle_message: %s", signal_name.c_str(), ex.what());
+        state->signal_read_at.reset();
+        flashmq_logf(LOG_ERR, "On signal '%s' in dbus_handle_message: %s", signal_name.data(), ex.what());
         return DBusHandlerResult::DBUS_HANDLER_RESULT_HANDLED;
     }
 
@@ -10,6 +10,8 @@
 namespace dbus_flashmq
 {
 
+struct State;
+
 void dbus_dispatch_status_function(DBusConnection *connection, DBusDispatchStatus new_status, void *data);
 
 dbus_bool_t dbus_add_watch_function(DBusWatch *watch, void *data);
@@ -23,6 +25,7 @@ void dbus_toggle_timeout_function(DBusTimeout *timeout, void *data);
 void dbus_timeout_do_handle(DBusTimeout *timeout);
 
 void dbus_pending_call_notify(DBusPendingCall *pending, void *data) noexcept;
+void dbus_handle_reply(State *state, DBusMessage *msg) noexcept;
 
 }
 
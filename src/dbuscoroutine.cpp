@@ -0,0 +1,192 @@
+#include "dbuscoroutine.h"
+
+#include <vector>
+#include <new>
+
+#include "state.h"
+#include "utils.h"
+#include "vendor/flashmq_plugin.h"
+
+using namespace dbus_flashmq;
+
+namespace
+{
+
+constexpr size_t frame_size_class = 256;
+constexpr size_t frame_size_classes = 16; // Frames bigger than 4 kB are not pooled.
+constexpr size_t frame_pool_max_free = 64; // Per size class.
+
+std::array<std::vector<void*>, frame_size_classes> &get_free_frames()
+{
+    static std::array<std::vector<void*>, frame_size_classes> free_frames;
+    return free_frames;
+}
+
+size_t get_size_class(size_t size)
+{
+    return (size + frame_size_class - 1) / frame_size_class - 1;
+}
+
+}
+
+void *FramePool::allocate(size_t size)
+{
+    const size_t size_class = get_size_class(size);
+
+    if (size_class >= frame_size_classes)
+        return ::operator new(size);
+
+    std::vector<void*> &free_list = get_free_frames()[size_class];
+
+    if (!free_list.empty())
+    {
+        void *p = free_list.back();
+        free_list.pop_back();
+        return p;
+    }
+
+    return ::operator new((size_class + 1) * frame_size_class);
+}
+
+void FramePool::deallocate(void *p, size_t size) noexcept
+{
+    const size_t size_class = get_size_class(size);
+
+    if (size_class < frame_size_classes)
+    {
+        std::vector<void*> &free_list = get_free_frames()[size_class];
+
+        if (free_list.size() < frame_pool_max_free)
+        {
+            try
+            {
+                free_list.push_back(p);
+                return;
+            }
+            catch (std::bad_alloc&)
+            {
+
+            }
+        }
+    }
+
+    ::operator delete(p);
+}
+
+void DbusTask::promise_type::unhandled_exception() noexcept
+{
+    try
+    {
+        throw;
+    }
+    catch (std::exception &ex)
+    {
+        flashmq_logf(LOG_ERR, ex.what());
+    }
+    catch (...)
+    {
+        flashmq_logf(LOG_ERR, "Unknown exception in dbus coroutine.");
+    }
+}
+
+void *DbusTask::promise_type::operator new(size_t size)
+{
+    return FramePool::allocate(size);
+}
+
+void DbusTask::promise_type::operator delete(void *p, size_t size) noexcept
+{
+    FramePool::deallocate(p, size);
+}
+
+DbusReply::DbusReply(DBusMessage *msg) :
+    msg(msg ? dbus_message_ref(msg) : nullptr)
+{
+
+}
+
+DbusReply::DbusReply(DbusReply &&other) noexcept :
+    msg(other.msg)
+{
+    other.msg = nullptr;
+}
+
+DbusReply::~DbusReply()
+{
+    if (msg)
+        dbus_message_unref(msg);
+}
+
+DbusReply &DbusReply::operator=(DbusReply &&other) noexcept
+{
+    if (this != &other)
+    {
+        if (msg)
+            dbus_message_unref(msg);
+
+        msg = other.msg;
+        other.msg = nullptr;
+    }
+
+    return *this;
+}
+
+DBusMessage *DbusReply::get() const
+{
+    return msg;
+}
+
+bool DbusReply::is_error() const
+{
+    return !msg || dbus_message_get_type(msg) == DBUS_MESSAGE_TYPE_ERROR;
+}
+
+std::string DbusReply::get_error_name() const
+{
+    if (!msg)
+        return "(no reply)";
+
+    return dbus_message_get_error_name_safe(msg);
+}
+
+DbusCallSpec::DbusCallSpec(const std::string &service, const std::string &path, const char *interface, const char *method,
+                           std::span<const VeVariant> args, bool wrap_arguments_in_variant) :
+    service(&service),
+    path(&path),
+    interface(interface),
+    method(method),
+    args(args),
+    wrap_arguments_in_variant(wrap_arguments_in_variant)
+{
+
+}
+
+dbus_uint32_t dbus_flashmq::dbus_call_with_handler(State *state, const DbusCallSpec &spec, AsyncHandler &&handler)
+{
+    return state->call_method(*spec.service, *spec.path, spec.interface, spec.method, std::move(handler), spec.args, spec.wrap_arguments_in_variant);
+}
+
+void dbus_flashmq::dbus_cancel_call(State *state, dbus_uint32_t serial)
+{
+    state->async_handlers.take(serial);
+}
+
+DbusCallAwaiter::DbusCallAwaiter(State *state, const DbusCallSpec &spec) :
+    DbusCallsAwaiter<1>(state, {spec})
+{
+
+}
+
+DbusReply DbusCallAwaiter::await_resume()
+{
+    return std::move(DbusCallsAwaiter<1>::await_resume()[0]);
+}
+
+/**
+ * @brief dbus_call is to be co_awaited directly, like 'DbusReply reply = co_await dbus_call(this, service, "/", ...);'.
+ */
+DbusCallAwaiter dbus_flashmq::dbus_call(State *state, const std::string &service, const std::string &path, const char *interface, const char *method,
+                                        std::span<const VeVariant> args, bool wrap_arguments_in_variant)
+{
+    return DbusCallAwaiter(state, DbusCallSpec(service, path, interface, method, args, wrap_arguments_in_variant));
+}
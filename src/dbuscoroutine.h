@@ -0,0 +1,181 @@
+#ifndef DBUSCOROUTINE_H
+#define DBUSCOROUTINE_H
+
+#include <coroutine>
+#include <array>
+#include <span>
+#include <string>
+#include <cstddef>
+#include <dbus-1.0/dbus/dbus.h>
+
+#include "vevariant.h"
+#include "asynchandlers.h"
+
+namespace dbus_flashmq
+{
+
+struct State;
+
+/**
+ * @brief The FramePool class recycles coroutine frames, so that a flow like a service scan doesn't cost a heap allocation each time.
+ *
+ * Frames are rounded up to size classes, and freed frames are kept on a free list per class. Everything runs on the one plugin thread,
+ * so there's no locking.
+ */
+class FramePool
+{
+public:
+    static void *allocate(size_t size);
+    static void deallocate(void *p, size_t size) noexcept;
+};
+
+/**
+ * @brief The DbusTask struct is the return type of coroutines that do dbus calls. They start right away, and clean up after themselves
+ * when done; nobody awaits them.
+ *
+ * Exceptions escaping the coroutine are logged, like exceptions in normal reply handlers. A coroutine that is still waiting for a reply
+ * when the plugin is unloaded is never resumed; its frame is simply abandoned.
+ */
+struct DbusTask
+{
+    struct promise_type
+    {
+        DbusTask get_return_object() noexcept { return {}; }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() noexcept {}
+        void unhandled_exception() noexcept;
+
+        static void *operator new(size_t size);
+        static void operator delete(void *p, size_t size) noexcept;
+    };
+};
+
+/**
+ * @brief The DbusReply class owns a reference to a method return or error.
+ */
+class DbusReply
+{
+    DBusMessage *msg = nullptr;
+
+public:
+    DbusReply() = default;
+    explicit DbusReply(DBusMessage *msg);
+    DbusReply(const DbusReply &other) = delete;
+    DbusReply(DbusReply &&other) noexcept;
+    ~DbusReply();
+    DbusReply &operator=(const DbusReply &other) = delete;
+    DbusReply &operator=(DbusReply &&other) noexcept;
+
+    DBusMessage *get() const;
+    bool is_error() const;
+    std::string get_error_name() const;
+};
+
+/**
+ * @brief The DbusCallSpec struct describes a method call for the awaitables. It only holds pointers, so it's only to be used in the
+ * co_await expression itself, where the temporaries live until the coroutine is resumed.
+ */
+struct DbusCallSpec
+{
+    const std::string *service = nullptr;
+    const std::string *path = nullptr;
+    const char *interface = nullptr;
+    const char *method = nullptr;
+    std::span<const VeVariant> args;
+    bool wrap_arguments_in_variant = false;
+
+    DbusCallSpec() = default;
+    DbusCallSpec(const std::string &service, const std::string &path, const char *interface, const char *method,
+                 std::span<const VeVariant> args = {}, bool wrap_arguments_in_variant=false);
+};
+
+dbus_uint32_t dbus_call_with_handler(State *state, const DbusCallSpec &spec, AsyncHandler &&handler);
+void dbus_cancel_call(State *state, dbus_uint32_t serial);
+
+/**
+ * @brief The DbusCallsAwaiter class awaits the replies to one or more method calls, made at the same time.
+ *
+ * Timeouts and lost replies come back as error replies, so the coroutine is always resumed.
+ */
+template<size_t N>
+class DbusCallsAwaiter
+{
+    State *state = nullptr;
+    std::array<DbusCallSpec, N> specs;
+    std::array<DbusReply, N> replies;
+    size_t pending = 0;
+    std::coroutine_handle<> handle;
+
+    void on_reply(size_t i, DBusMessage *msg)
+    {
+        replies[i] = DbusReply(msg);
+
+        if (--pending == 0)
+            handle.resume();
+    }
+
+public:
+    DbusCallsAwaiter(State *state, std::array<DbusCallSpec, N> &&specs) :
+        state(state),
+        specs(std::move(specs))
+    {
+
+    }
+
+    bool await_ready() const noexcept
+    {
+        return false;
+    }
+
+    void await_suspend(std::coroutine_handle<> h)
+    {
+        handle = h;
+        std::array<dbus_uint32_t, N> serials {};
+
+        try
+        {
+            for (size_t i = 0; i < N; i++)
+            {
+                serials[i] = dbus_call_with_handler(state, specs[i], [this, i](DBusMessage *msg) { on_reply(i, msg); });
+                pending++;
+            }
+        }
+        catch (...)
+        {
+            // The calls that did go out must not resume us anymore, because the exception is resumed into the coroutine right away.
+            for (size_t i = 0; i < pending; i++)
+            {
+                dbus_cancel_call(state, serials[i]);
+            }
+
+            throw;
+        }
+    }
+
+    std::array<DbusReply, N> await_resume()
+    {
+        return std::move(replies);
+    }
+};
+
+class DbusCallAwaiter : public DbusCallsAwaiter<1>
+{
+public:
+    DbusCallAwaiter(State *state, const DbusCallSpec &spec);
+
+    DbusReply await_resume();
+};
+
+DbusCallAwaiter dbus_call(State *state, const std::string &service, const std::string &path, const char *interface, const char *method,
+                          std::span<const VeVariant> args = {}, bool wrap_arguments_in_variant=false);
+
+template<typename... Specs>
+DbusCallsAwaiter<sizeof...(Specs)> when_all(State *state, Specs&&... specs)
+{
+    return DbusCallsAwaiter<sizeof...(Specs)>(state, {std::forward<Specs>(specs)...});
+}
+
+}
+
+#endif // DBUSCOROUTINE_H
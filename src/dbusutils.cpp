@@ -1,7 +1,6 @@
 #include "dbusutils.h"
 #include "vendor/flashmq_plugin.h"
 #include "exceptions.h"
-#include "dbusmessageitersignature.h"
 
 using namespace dbus_flashmq;
 
@@ -105,15 +104,13 @@ std::unordered_map<std::string, Item> dbus_flashmq::get_from_dict_with_dict_with
     std::unordered_map<std::string, Item> result;
 
     int result_n = 0;
+    if (!dbus_message_has_signature(msg, "a{sa{sv}}"))
+        throw std::runtime_error("Return from GetItems() is not the correct signature");
+
     DBusMessageIter iter;
     int current_type = 0;
     dbus_message_iter_init(msg, &iter);
 
-    DBusMessageIterSignature signature(&iter);
-
-    if (signature.signature != "a{sa{sv}}")
-        throw std::runtime_error("Return from GetItems() is not the correct signature");
-
     while ((current_type = dbus_message_iter_get_arg_type (&iter)) != DBUS_TYPE_INVALID)
     {
         if (current_type != DBUS_TYPE_ARRAY)
@@ -186,15 +183,13 @@ std::unordered_map<std::string, Item> dbus_flashmq::get_from_get_value_on_root(D
     std::unordered_map<std::string, Item> result;
 
     int result_n = 0;
+    if (!dbus_message_has_signature(msg, "v"))
+        throw std::runtime_error("Return from GetValue() is not the correct signature");
+
     DBusMessageIter iter;
     int current_type = 0;
     dbus_message_iter_init(msg, &iter);
 
-    DBusMessageIterSignature signature(&iter);
-
-    if (signature.signature != "v")
-        throw std::runtime_error("Return from GetValue() is not the correct signature");
-
     while ((current_type = dbus_message_iter_get_arg_type (&iter)) != DBUS_TYPE_INVALID)
     {
         if (current_type != DBUS_TYPE_VARIANT)
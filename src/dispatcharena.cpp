@@ -0,0 +1,84 @@
+#include "dispatcharena.h"
+
+#include <cstring>
+#include <bit>
+#include <algorithm>
+#include <stdexcept>
+#include <cstdint>
+
+using namespace dbus_flashmq;
+
+DispatchArena::DispatchArena(size_t initial_capacity, size_t max_capacity) :
+    buffer(std::make_unique<std::byte[]>(initial_capacity)),
+    capacity(initial_capacity),
+    max_capacity(std::max(initial_capacity, max_capacity))
+{
+
+}
+
+/**
+ * @brief DispatchArena::allocate returns memory that stays valid until the next reset().
+ * @param alignment must be a power of two.
+ */
+void *DispatchArena::allocate(size_t size, size_t alignment)
+{
+    if (!std::has_single_bit(alignment))
+        throw std::invalid_argument("Arena alignment must be a power of two.");
+
+    const uintptr_t base = reinterpret_cast<uintptr_t>(buffer.get());
+    const uintptr_t aligned = (base + used + alignment - 1) & ~(static_cast<uintptr_t>(alignment) - 1);
+    const size_t offset = aligned - base;
+
+    if (offset + size <= capacity)
+    {
+        used = offset + size;
+        return buffer.get() + offset;
+    }
+
+    const size_t block_size = size + alignment;
+    std::unique_ptr<std::byte[]> &block = overflow_blocks.emplace_back(std::make_unique<std::byte[]>(block_size));
+    overflow_size += block_size;
+    overflow_count++;
+
+    const uintptr_t block_base = reinterpret_cast<uintptr_t>(block.get());
+    const uintptr_t block_aligned = (block_base + alignment - 1) & ~(static_cast<uintptr_t>(alignment) - 1);
+    return block.get() + (block_aligned - block_base);
+}
+
+/**
+ * @brief DispatchArena::copy_string copies s into the arena, null terminated, for dbus.
+ */
+char *DispatchArena::copy_string(const char *s, size_t len)
+{
+    char *data = static_cast<char*>(allocate(len + 1, 1));
+    std::memcpy(data, s, len);
+    data[len] = 0;
+    return data;
+}
+
+/**
+ * @brief DispatchArena::reset frees everything allocated since the last reset, and grows the arena if it didn't fit.
+ */
+void DispatchArena::reset()
+{
+    if (overflow_size > 0 && capacity < max_capacity)
+    {
+        const size_t new_capacity = std::min(std::bit_ceil(capacity + overflow_size), max_capacity);
+        buffer = std::make_unique<std::byte[]>(new_capacity);
+        capacity = new_capacity;
+    }
+
+    overflow_blocks.clear();
+    overflow_size = 0;
+    used = 0;
+}
+
+size_t DispatchArena::get_capacity() const
+{
+    return capacity;
+}
+
+size_t DispatchArena::get_overflow_count() const
+{
+    return overflow_count;
+}
@@ -0,0 +1,45 @@
+#ifndef DISPATCHARENA_H
+#define DISPATCHARENA_H
+
+#include <cstddef>
+#include <memory>
+#include <vector>
+
+namespace dbus_flashmq
+{
+
+/**
+ * @brief The DispatchArena class is a bump allocator for temporaries of dbus message handling, like decoded values that are only
+ * compared against the item store. It's reset after each batch of dispatched messages, which frees everything at once.
+ *
+ * What doesn't fit goes into separate blocks, and on the next reset, the arena grows to hold that too, up to a maximum. So, in the
+ * steady state, handling a message doesn't allocate at all.
+ *
+ * Nothing allocated from it may be kept beyond the dispatch batch; whatever is stored must be copied out.
+ */
+class DispatchArena
+{
+    std::unique_ptr<std::byte[]> buffer;
+    size_t capacity = 0;
+    size_t used = 0;
+    size_t max_capacity = 0;
+    std::vector<std::unique_ptr<std::byte[]>> overflow_blocks;
+    size_t overflow_size = 0;
+    size_t overflow_count = 0;
+
+public:
+    DispatchArena(size_t initial_capacity, size_t max_capacity);
+    DispatchArena(const DispatchArena &other) = delete;
+    DispatchArena &operator=(const DispatchArena &other) = delete;
+
+    void *allocate(size_t size, size_t alignment=alignof(std::max_align_t));
+    char *copy_string(const char *s, size_t len);
+    void reset();
+
+    size_t get_capacity() const;
+    size_t get_overflow_count() const;
+};
+
+}
+
+#endif // DISPATCHARENA_H
@@ -0,0 +1,345 @@
+#include <sys/epoll.h>
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <vector>
+
+#include "vendor/flashmq_plugin.h"
+#include "testerglobals.h"
+#include "utils.h"
+#include "state.h"
+#include "dbusutils.h"
+#include "dbusmessageguard.h"
+#include "dbusmessageiteropencontainerguard.h"
+
+/*
+ * Benchmarks of the hot paths. They don't need a dbus daemon or network, and use the same stand-ins for the FlashMQ functions as the
+ * tests, with publishes only counted.
+ *
+ * Each benchmark is calibrated to take about 50 ms per run, and run 7 times. The median is the number to compare between builds; the
+ * minimum is there to see how noisy the machine is.
+ */
+
+using namespace dbus_flashmq;
+
+namespace
+{
+
+constexpr int bench_runs = 7;
+constexpr std::chrono::milliseconds bench_run_target(50);
+const std::string bench_vrm_id("c0619ab4a585");
+
+// Results are added to this, so the compiler can't optimize the work away.
+volatile uint64_t bench_sink = 0;
+
+/**
+ * @brief run_bench runs f, which does ops_per_call operations, often enough to get stable numbers, and prints the nanoseconds per operation.
+ */
+void run_bench(const std::string &name, size_t ops_per_call, const std::function<void()> &f)
+{
+    using clock = std::chrono::steady_clock;
+
+    f();
+
+    size_t calls = 1;
+    while (true)
+    {
+        const auto start = clock::now();
+        for (size_t i = 0; i < calls; i++)
+            f();
+        const auto duration = clock::now() - start;
+
+        if (duration >= bench_run_target / 4 || calls >= (1ULL << 30))
+        {
+            const double per_call = std::chrono::duration<double>(duration).count() / static_cast<double>(calls);
+            calls = std::max<size_t>(1, static_cast<size_t>(std::chrono::duration<double>(bench_run_target).count() / per_call));
+            break;
+        }
+
+        calls *= 2;
+    }
+
+    std::vector<double> ns_per_op;
+
+    for (int run = 0; run < bench_runs; run++)
+    {
+        const auto start = clock::now();
+        for (size_t i = 0; i < calls; i++)
+            f();
+        const auto duration = clock::now() - start;
+
+        const double ns = std::chrono::duration<double, std::nano>(duration).count();
+        ns_per_op.push_back(ns / static_cast<double>(calls * ops_per_call));
+    }
+
+    std::sort(ns_per_op.begin(), ns_per_op.end());
+
+    printf("%-48s %12zu ops %12.1f ns/op (median) %12.1f ns/op (min)\n", name.c_str(), calls * ops_per_call,
+           ns_per_op.at(ns_per_op.size() / 2), ns_per_op.front());
+}
+
+VeVariant make_value(size_t i)
+{
+    switch (i % 4)
+    {
+    case 0:
+        return VeVariant(nlohmann::json(static_cast<double>(i) * 0.1));
+    case 1:
+        return VeVariant(nlohmann::json(static_cast<int32_t>(i)));
+    case 2:
+        return VeVariant("Text value " + std::to_string(i));
+    default:
+        return VeVariant(nlohmann::json::array({static_cast<int32_t>(i), 2, 3}));
+    }
+}
+
+/**
+ * @brief add_services fills the item store up to item_count, with solarcharger like services of 100 items each.
+ */
+void add_services(State *state, size_t item_count)
+{
+    const size_t items_per_service = 100;
+
+    for (size_t s = state->dbus_service_items.size(); s < item_count / items_per_service; s++)
+    {
+        const std::string service = "com.victronenergy.solarcharger.bench_" + std::to_string(s);
+        std::unordered_map<std::string, Item> items;
+
+        ValueMinMax instance;
+        instance.value = VeVariant(nlohmann::json(static_cast<int32_t>(s)));
+        items.emplace("/DeviceInstance", Item::from_path_and_value("/DeviceInstance", std::move(instance)));
+
+        for (size_t i = 1; i < items_per_service; i++)
+        {
+            const std::string path = "/History/Daily/" + std::to_string(i) + "/Yield";
+            ValueMinMax value;
+            value.value = make_value(i);
+            items.emplace(path, Item::from_path_and_value(path, std::move(value)));
+        }
+
+        state->add_dbus_to_mqtt_mapping(service, items, false);
+    }
+}
+
+DBusMessage *make_items_changed_signal(size_t item_count)
+{
+    DBusMessage *msg = dbus_message_new_signal("/", "com.victronenergy.BusItem", "ItemsChanged");
+
+    DBusMessageIter iter;
+    dbus_message_iter_init_append(msg, &iter);
+    DBusMessageIterOpenContainerGuard array_iter(&iter, DBUS_TYPE_ARRAY, "{sa{sv}}");
+
+    for (size_t i = 0; i < item_count; i++)
+    {
+        const std::string path = "/History/Daily/" + std::to_string(i) + "/Yield";
+        const VeVariant value = make_value(i);
+        const VeVariant text(value.as_text());
+
+        DBusMessageIterOpenContainerGuard item_iter(array_iter.get_array_iter(), DBUS_TYPE_DICT_ENTRY, nullptr);
+        const char *key = path.c_str();
+        dbus_message_iter_append_basic(item_iter.get_array_iter(), DBUS_TYPE_STRING, &key);
+
+        DBusMessageIterOpenContainerGuard props_iter(item_iter.get_array_iter(), DBUS_TYPE_ARRAY, "{sv}");
+
+        for (const auto &[name, v] : {std::pair<const char*, const VeVariant*>("Value", &value), std::pair<const char*, const VeVariant*>("Text", &text)})
+        {
+            DBusMessageIterOpenContainerGuard prop_iter(props_iter.get_array_iter(), DBUS_TYPE_DICT_ENTRY, nullptr);
+            dbus_message_iter_append_basic(prop_iter.get_array_iter(), DBUS_TYPE_STRING, &name);
+            DBusMessageIterOpenContainerGuard variant_iter(prop_iter.get_array_iter(), DBUS_TYPE_VARIANT, v->get_dbus_type_as_string_recursive().c_str());
+            v->append_args_to_dbus_message(variant_iter.get_array_iter());
+        }
+    }
+
+    return msg;
+}
+
+DBusMessage *make_variant_signal(const VeVariant &value)
+{
+    DBusMessage *msg = dbus_message_new_signal("/Bench", "com.victronenergy.BusItem", "Bench");
+
+    DBusMessageIter iter;
+    dbus_message_iter_init_append(msg, &iter);
+    DBusMessageIterOpenContainerGuard variant_iter(&iter, DBUS_TYPE_VARIANT, value.get_dbus_type_as_string_recursive().c_str());
+    value.append_args_to_dbus_message(variant_iter.get_array_iter());
+
+    return msg;
+}
+
+void item_as_json_bench()
+{
+    for (size_t kind = 0; kind < 4; kind++)
+    {
+        ValueMinMax a;
+        a.value = make_value(kind);
+        ValueMinMax b;
+        b.value = make_value(kind + 4);
+
+        Item item = Item::from_path_and_value("/Bench", ValueMinMax(a));
+        size_t n = 0;
+
+        // Alternating values, so the rendered JSON is never the cached one.
+        run_bench("Item::as_json " + std::string(a.value.get_dbus_type_as_string_recursive()), 1, [&]() {
+            item.set_value(n++ % 2 ? a : b);
+            bench_sink = bench_sink + item.as_json().size();
+        });
+    }
+}
+
+void vevariant_decode_bench()
+{
+    const std::vector<std::pair<std::string, VeVariant>> values {
+        {"double", make_value(0)},
+        {"int", make_value(1)},
+        {"string", make_value(2)},
+        {"array", make_value(3)},
+    };
+
+    for (const auto &[name, value] : values)
+    {
+        DBusMessageGuard msg = make_variant_signal(value);
+
+        run_bench("VeVariant(DBusMessageIter*) " + name, 1, [&]() {
+            DBusMessageIter iter;
+            dbus_message_iter_init(msg.d, &iter);
+            VeVariant v(&iter);
+            bench_sink = bench_sink + static_cast<uint64_t>(v.get_dbus_type());
+        });
+    }
+}
+
+void items_changed_decode_bench()
+{
+    for (size_t item_count : {1UL, 10UL, 100UL})
+    {
+        DBusMessageGuard msg = make_items_changed_signal(item_count);
+
+        run_bench("get_from_dict_with_dict_with_text_and_value " + std::to_string(item_count), item_count, [&]() {
+            std::unordered_map<std::string, Item> items = get_from_dict_with_dict_with_text_and_value(msg.d);
+            bench_sink = bench_sink + items.size();
+        });
+    }
+}
+
+void find_item_bench(State *state)
+{
+    add_services(state, 10000);
+
+    std::vector<std::string> topics;
+    for (size_t s = 0; s < 100; s += 7)
+    {
+        for (size_t i = 1; i < 100; i += 13)
+        {
+            topics.push_back("W/" + bench_vrm_id + "/solarcharger/" + std::to_string(s) + "/History/Daily/" + std::to_string(i) + "/Yield");
+        }
+    }
+
+    size_t n = 0;
+    run_bench("State::find_item_by_mqtt_path (10k items)", 1, [&]() {
+        const Item &item = state->find_item_by_mqtt_path(topics[n++ % topics.size()]);
+        bench_sink = bench_sink + item.get_path().size();
+    });
+}
+
+void acl_check_bench(State *state)
+{
+    state->client_profiles.set("ev1", ClientProfile("token/evcharger/HQ2401ABCDE", false, false));
+
+    struct AclCase
+    {
+        AclAccess access;
+        std::string clientid;
+        std::string username;
+        std::string topic;
+        std::vector<std::string> subtopics;
+    };
+
+    // Roughly the mix of a busy system: mostly our own publishes, and delivering them to subscribers on LAN and VRM.
+    const std::string n_topic = "N/" + bench_vrm_id + "/solarcharger/3/History/Daily/14/Yield";
+    std::vector<AclCase> cases {
+        {AclAccess::write, "", "", n_topic, {}},
+        {AclAccess::write, "", "", n_topic, {}},
+        {AclAccess::write, "", "", n_topic, {}},
+        {AclAccess::read, "gui", "", n_topic, {}},
+        {AclAccess::read, "GXdbus-c0619ab4a585", "GXdbus", n_topic, {}},
+        {AclAccess::write, "ev1", "token/evcharger/HQ2401ABCDE", "I/local/out/evcharger/HQ2401ABCDE/vregset/gx2evcs", {}},
+        {AclAccess::write, "ha", "", "homeassistant/sensor/battery/state", {}},
+        {AclAccess::read, "gui", "", "W/" + bench_vrm_id + "/settings/0/Settings/Gui/Password", {}},
+    };
+
+    for (AclCase &c : cases)
+    {
+        c.subtopics = splitToVector(c.topic, '/');
+    }
+
+    size_t n = 0;
+    run_bench("flashmq_plugin_acl_check (topic mix)", 1, [&]() {
+        const AclCase &c = cases[n++ % cases.size()];
+        const AuthResult r = flashmq_plugin_acl_check(state, c.access, c.clientid, c.username, c.topic, c.subtopics, "", "", 0, false, {}, {}, nullptr);
+        bench_sink = bench_sink + static_cast<uint64_t>(r);
+    });
+}
+
+void publish_all_bench(State *state)
+{
+    TesterGlobals *globals = TesterGlobals::getInstance();
+
+    // All in one go, so it's the publishing that's measured, not the event loop.
+    state->keepalive_coalesce_window = std::chrono::milliseconds(0);
+    state->full_publish_slice_items = std::numeric_limits<size_t>::max();
+    state->full_publish_slice_duration = std::chrono::hours(1);
+
+    for (size_t item_count : {10000UL, 50000UL})
+    {
+        add_services(state, item_count);
+        globals->publish_count = 0;
+
+        run_bench("State::publish_all (" + std::to_string(item_count / 1000) + "k items)", item_count, [&]() {
+            state->publish_all(std::optional<std::string>());
+        });
+
+        if (state->full_publish_job || globals->publish_count < item_count)
+            throw std::runtime_error("Full publish didn't complete in one go.");
+    }
+}
+
+}
+
+int main(int argc, char **argv)
+{
+    (void)argc; (void)argv;
+
+    TesterGlobals *globals = TesterGlobals::getInstance();
+    globals->epoll_fd = epoll_create(1024);
+    globals->count_publishes_only = true;
+    globals->quiet = true;
+
+    std::unordered_map<std::string, std::string> plugin_opts;
+    flashmq_plugin_main_init(plugin_opts);
+
+    // There can only be one, and without flashmq_plugin_init(), it doesn't connect to dbus.
+    void *data = nullptr;
+    flashmq_plugin_allocate_thread_memory(&data, plugin_opts);
+    State *state = static_cast<State*>(data);
+    state->unique_vrm_id = bench_vrm_id;
+
+    try
+    {
+        item_as_json_bench();
+        vevariant_decode_bench();
+        items_changed_decode_bench();
+        find_item_bench(state);
+        acl_check_bench(state);
+        publish_all_bench(state);
+    }
+    catch (std::exception &ex)
+    {
+        fprintf(stderr, "Benchmark failed: %s\n", ex.what());
+        return 1;
+    }
+
+    flashmq_plugin_deallocate_thread_memory(data, plugin_opts);
+
+    return 0;
+}
@@ -0,0 +1,536 @@
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <poll.h>
+#include <unistd.h>
+#include <signal.h>
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <numeric>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "vendor/flashmq_plugin.h"
+#include "testerglobals.h"
+#include "utils.h"
+#include "state.h"
+#include "syntheticservice.h"
+
+/*
+ * Load harness: it starts a private dbus-daemon, with synthetic com.victronenergy services in a child process, and runs the plugin
+ * against it in the same event loop as the tests. Publishes are only counted.
+ *
+ * After the initial scan and a keep-alive, the services send changes at the configured rate for the configured time, and it reports
+ * how many items per second the plugin ingested and published, the CPU time it used and its peak RSS. When the plugin can't keep up,
+ * the ingested items fall behind the sent ones.
+ */
+
+using namespace dbus_flashmq;
+
+namespace
+{
+
+const std::string load_vrm_id("c0619ab4a585");
+
+struct LoadOptions
+{
+    size_t services = 20;
+    size_t items_per_service = 200;
+    double changes_per_second = 2000.0;
+    size_t items_per_signal = 10;
+    bool properties_changed = false;
+    double seconds = 10.0;
+    std::string trace_path;
+};
+
+volatile sig_atomic_t services_stop = 0;
+
+void print_usage(const char *name)
+{
+    fprintf(stderr,
+            "Usage: %s [--services N] [--items-per-service N] [--changes-per-second N] [--items-per-signal N] [--properties-changed] [--seconds N] [--trace FILE]\n"
+            "\n"
+            "  --services            Number of synthetic services (default 20).\n"
+            "  --items-per-service   Items per service (default 200).\n"
+            "  --changes-per-second  Changed items per second, over all services (default 2000).\n"
+            "  --items-per-signal    Changed items per ItemsChanged signal (default 10).\n"
+            "  --properties-changed  Send one PropertiesChanged per changed item instead of ItemsChanged.\n"
+            "  --seconds             Duration of the measurement (default 10).\n"
+            "  --trace               Record a trace of the run to FILE, for flashmq-dbus-plugin-replay.\n",
+            name);
+}
+
+LoadOptions parse_args(int argc, char **argv)
+{
+    LoadOptions o;
+
+    for (int i = 1; i < argc; i++)
+    {
+        const std::string arg(argv[i]);
+
+        if (arg == "--properties-changed")
+        {
+            o.properties_changed = true;
+            continue;
+        }
+
+        if (i + 1 >= argc)
+            throw std::runtime_error("Option '" + arg + "' needs a value, or is unknown.");
+
+        const std::string value(argv[++i]);
+
+        if (arg == "--services")
+            o.services = value_to_int_ranged<size_t>(value, 1, 10000);
+        else if (arg == "--items-per-service")
+            o.items_per_service = value_to_int_ranged<size_t>(value, 1, 100000);
+        else if (arg == "--changes-per-second")
+            o.changes_per_second = static_cast<double>(value_to_int_ranged<uint32_t>(value, 0, 10000000));
+        else if (arg == "--items-per-signal")
+            o.items_per_signal = value_to_int_ranged<size_t>(value, 1, 100000);
+        else if (arg == "--seconds")
+            o.seconds = static_cast<double>(value_to_int_ranged<uint32_t>(value, 1, 86400));
+        else if (arg == "--trace")
+            o.trace_path = value;
+        else
+            throw std::runtime_error("Unknown option '" + arg + "'.");
+    }
+
+    return o;
+}
+
+void write_all(int fd, const void *buf, size_t len)
+{
+    const char *p = static_cast<const char*>(buf);
+
+    while (len > 0)
+    {
+        const ssize_t n = write(fd, p, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            throw std::runtime_error(std::string("Write to pipe failed: ") + strerror(errno));
+        p += n;
+        len -= static_cast<size_t>(n);
+    }
+}
+
+bool read_all(int fd, void *buf, size_t len)
+{
+    char *p = static_cast<char*>(buf);
+
+    while (len > 0)
+    {
+        const ssize_t n = read(fd, p, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        p += n;
+        len -= static_cast<size_t>(n);
+    }
+
+    return true;
+}
+
+/**
+ * @brief start_dbus_daemon starts a dbus-daemon listening in dir, and returns its pid and address.
+ */
+std::pair<pid_t, std::string> start_dbus_daemon(const std::filesystem::path &dir)
+{
+    const std::filesystem::path config_path = dir / "bus.conf";
+
+    {
+        std::ofstream config(config_path);
+        config << "<!DOCTYPE busconfig PUBLIC \"-//freedesktop//DTD D-Bus Bus Configuration 1.0//EN\"\n"
+               << " \"http://www.freedesktop.org/standards/dbus/1.0/busconfig.dtd\">\n"
+               << "<busconfig>\n"
+               << "  <type>system</type>\n"
+               << "  <listen>unix:dir=" << dir.string() << "</listen>\n"
+               << "  <auth>EXTERNAL</auth>\n"
+               << "  <policy context=\"default\">\n"
+               << "    <allow send_destination=\"*\" eavesdrop=\"true\"/>\n"
+               << "    <allow eavesdrop=\"true\"/>\n"
+               << "    <allow own=\"*\"/>\n"
+               << "    <allow user=\"*\"/>\n"
+               << "  </policy>\n"
+               << "</busconfig>\n";
+
+        if (!config)
+            throw std::runtime_error("Can't write " + config_path.string());
+    }
+
+    int address_pipe[2];
+    if (pipe(address_pipe) < 0)
+        throw std::runtime_error(std::string("pipe: ") + strerror(errno));
+
+    const pid_t pid = fork();
+    if (pid < 0)
+        throw std::runtime_error(std::string("fork: ") + strerror(errno));
+
+    if (pid == 0)
+    {
+        close(address_pipe[0]);
+        const std::string config_arg = "--config-file=" + config_path.string();
+        const std::string address_arg = "--print-address=" + std::to_string(address_pipe[1]);
+        execlp("dbus-daemon", "dbus-daemon", config_arg.c_str(), "--nofork", "--nopidfile", address_arg.c_str(), nullptr);
+        fprintf(stderr, "Can't start dbus-daemon: %s\n", strerror(errno));
+        _exit(1);
+    }
+
+    close(address_pipe[1]);
+
+    std::string address;
+    char c = 0;
+    while (read_all(address_pipe[0], &c, 1) && c != '\n')
+    {
+        address.push_back(c);
+    }
+
+    close(address_pipe[0]);
+
+    if (address.empty())
+        throw std::runtime_error("dbus-daemon didn't give an address.");
+
+    return {pid, address};
+}
+
+/**
+ * @brief run_services is the child process that runs the synthetic services. It writes a byte to ready_fd when all are on the bus, starts
+ * sending changes when it reads a byte from go_fd, and on SIGTERM, it writes the number of changed items it sent to ready_fd.
+ */
+[[noreturn]] void run_services(const LoadOptions &o, int ready_fd, int go_fd)
+{
+    signal(SIGTERM, [](int) { services_stop = 1; });
+
+    const char *service_types[] = {"battery", "solarcharger", "pvinverter", "tank", "temperature", "grid"};
+    std::vector<std::unique_ptr<SyntheticService>> services;
+
+    try
+    {
+        for (size_t i = 0; i < o.services; i++)
+        {
+            const std::string name = std::string("com.victronenergy.") + service_types[i % std::size(service_types)] + ".load_" + std::to_string(i);
+            auto &service = services.emplace_back(std::make_unique<SyntheticService>(name, static_cast<uint32_t>(100 + i), o.items_per_service));
+            service->connect();
+        }
+
+        const char ready = 'r';
+        write_all(ready_fd, &ready, 1);
+
+        std::vector<struct pollfd> fds;
+        for (auto &service : services)
+        {
+            fds.push_back({service->get_fd(), POLLIN, 0});
+        }
+        fds.push_back({go_fd, POLLIN, 0});
+
+        const size_t items_per_signal = o.properties_changed ? 1 : o.items_per_signal;
+        const double signals_per_second = o.changes_per_second / static_cast<double>(items_per_signal);
+        std::optional<std::chrono::time_point<std::chrono::steady_clock>> started_at;
+        uint64_t signals_sent = 0;
+        uint64_t items_sent = 0;
+        size_t next_service = 0;
+
+        while (!services_stop)
+        {
+            int timeout_ms = 10;
+
+            if (started_at && signals_per_second > 0)
+            {
+                const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - started_at.value();
+                const uint64_t signals_due = static_cast<uint64_t>(elapsed.count() * signals_per_second);
+
+                // Don't let a backlog grow without bounds when the bus can't keep up; the rate just isn't reached then.
+                const uint64_t burst = std::max<uint64_t>(1, static_cast<uint64_t>(signals_per_second / 100.0));
+                for (uint64_t i = 0; signals_sent < signals_due && i < burst; i++)
+                {
+                    items_sent += services.at(next_service)->emit_changes(items_per_signal, o.properties_changed);
+                    next_service = (next_service + 1) % services.size();
+                    signals_sent++;
+                }
+
+                const double next_signal_at = static_cast<double>(signals_sent + 1) / signals_per_second;
+                timeout_ms = std::clamp<int>(static_cast<int>((next_signal_at - elapsed.count()) * 1000.0), 0, 10);
+            }
+
+            for (auto &service : services)
+            {
+                service->process();
+            }
+
+            if (poll(fds.data(), fds.size(), timeout_ms) > 0 && (fds.back().revents & POLLIN) && !started_at)
+            {
+                char go = 0;
+                read_all(go_fd, &go, 1);
+                started_at = std::chrono::steady_clock::now();
+                fds.pop_back();
+            }
+        }
+
+        write_all(ready_fd, &items_sent, sizeof(items_sent));
+    }
+    catch (std::exception &ex)
+    {
+        fprintf(stderr, "Synthetic services failed: %s\n", ex.what());
+        _exit(1);
+    }
+
+    services.clear();
+    _exit(0);
+}
+
+void send_keepalive(void *data, const std::string &payload)
+{
+    const std::string topic = "R/" + load_vrm_id + "/keepalive";
+    const std::vector<std::string> subtopics = splitToVector(topic, '/');
+    flashmq_plugin_acl_check(data, AclAccess::write, "load", "", topic, subtopics, "", payload, 0, false, {}, {}, nullptr);
+}
+
+double get_cpu_seconds()
+{
+    struct rusage usage;
+    memset(&usage, 0, sizeof(usage));
+    getrusage(RUSAGE_SELF, &usage);
+
+    auto to_seconds = [](const struct timeval &tv) { return static_cast<double>(tv.tv_sec) + static_cast<double>(tv.tv_usec) / 1000000.0; };
+    return to_seconds(usage.ru_utime) + to_seconds(usage.ru_stime);
+}
+
+long get_peak_rss_kb()
+{
+    struct rusage usage;
+    memset(&usage, 0, sizeof(usage));
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+}
+
+void stop_child(pid_t pid)
+{
+    if (pid <= 0)
+        return;
+
+    kill(pid, SIGTERM);
+    waitpid(pid, nullptr, 0);
+}
+
+int run_load(const LoadOptions &o, const std::filesystem::path &dir)
+{
+    TesterGlobals *globals = TesterGlobals::getInstance();
+    globals->epoll_fd = epoll_create(1024);
+    globals->count_publishes_only = true;
+    globals->quiet = true;
+
+    const auto [daemon_pid, address] = start_dbus_daemon(dir);
+    setenv("DBUS_SYSTEM_BUS_ADDRESS", address.c_str(), 1);
+
+    int ready_pipe[2];
+    int go_pipe[2];
+    if (pipe(ready_pipe) < 0 || pipe(go_pipe) < 0)
+    {
+        stop_child(daemon_pid);
+        throw std::runtime_error(std::string("pipe: ") + strerror(errno));
+    }
+
+    const pid_t services_pid = fork();
+    if (services_pid == 0)
+    {
+        close(ready_pipe[0]);
+        close(go_pipe[1]);
+        run_services(o, ready_pipe[1], go_pipe[0]);
+    }
+
+    close(ready_pipe[1]);
+    close(go_pipe[0]);
+
+    char ready = 0;
+    if (services_pid < 0 || !read_all(ready_pipe[0], &ready, 1))
+    {
+        stop_child(services_pid);
+        stop_child(daemon_pid);
+        throw std::runtime_error("The synthetic services didn't start.");
+    }
+
+    {
+        std::ofstream unique_id(dir / "unique-id");
+        unique_id << load_vrm_id << "\n";
+    }
+
+    std::unordered_map<std::string, std::string> plugin_opts;
+    plugin_opts["skip_broker_registration"] = "true";
+    plugin_opts["unique_id_file"] = (dir / "unique-id").string();
+    plugin_opts["stats_interval_seconds"] = "0";
+    plugin_opts["keepalive_coalesce_milliseconds"] = "0";
+    if (!o.trace_path.empty())
+        plugin_opts["trace_file"] = o.trace_path;
+
+    flashmq_plugin_main_init(plugin_opts);
+
+    void *data = nullptr;
+    flashmq_plugin_allocate_thread_memory(&data, plugin_opts);
+    State *state = static_cast<State*>(data);
+
+    const auto init_started_at = std::chrono::steady_clock::now();
+    flashmq_plugin_init(data, plugin_opts, false);
+
+    while (!state->scan_scheduler.get_initial_scan_duration())
+    {
+        globals->run_event_loop(data, std::chrono::milliseconds(100));
+
+        if (std::chrono::steady_clock::now() - init_started_at > std::chrono::seconds(120))
+        {
+            stop_child(services_pid);
+            stop_child(daemon_pid);
+            throw std::runtime_error("The initial scan didn't complete within 120 seconds.");
+        }
+    }
+
+    const size_t item_count = std::accumulate(state->dbus_service_items.begin(), state->dbus_service_items.end(), size_t(0),
+                                              [](size_t n, const auto &p) { return n + p.second.size(); });
+    printf("Initial scan of %zu services with %zu items took %ld ms.\n", state->dbus_service_items.size(), item_count,
+           static_cast<long>(state->scan_scheduler.get_initial_scan_duration().value().count()));
+
+    // Publishing needs a keep-alive, which also does a full publish. That's measured separately, before the changes start.
+    const uint64_t full_publish_count_before = globals->publish_count;
+    const auto full_publish_started_at = std::chrono::steady_clock::now();
+    send_keepalive(data, "");
+    while (state->full_publish_queued || state->full_publish_job)
+    {
+        globals->run_event_loop(data, std::chrono::milliseconds(10));
+    }
+    const std::chrono::duration<double, std::milli> full_publish_duration = std::chrono::steady_clock::now() - full_publish_started_at;
+    printf("Full publish of %lu topics took %.1f ms.\n", static_cast<unsigned long>(globals->publish_count - full_publish_count_before),
+           full_publish_duration.count());
+
+    const PluginStats stats_before = state->stats;
+    const uint64_t publish_count_before = globals->publish_count;
+    const uint64_t publish_bytes_before = globals->publish_bytes;
+    state->signal_to_publish_latency.reset();
+    const double cpu_before = get_cpu_seconds();
+    const auto started_at = std::chrono::steady_clock::now();
+
+    const char go = 'g';
+    write_all(go_pipe[1], &go, 1);
+
+    const auto end = started_at + std::chrono::milliseconds(static_cast<int64_t>(o.seconds * 1000.0));
+    auto last_keepalive = started_at;
+    while (std::chrono::steady_clock::now() < end)
+    {
+        globals->run_event_loop(data, std::chrono::milliseconds(100));
+
+        if (std::chrono::steady_clock::now() - last_keepalive > std::chrono::seconds(30))
+        {
+            send_keepalive(data, R"({ "keepalive-options" : [ "suppress-republish" ] })");
+            last_keepalive = std::chrono::steady_clock::now();
+        }
+    }
+
+    const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - started_at;
+    const double cpu_used = get_cpu_seconds() - cpu_before;
+    const PluginStats &stats_after = state->stats;
+
+    kill(services_pid, SIGTERM);
+    uint64_t items_sent = 0;
+    const bool got_items_sent = read_all(ready_pipe[0], &items_sent, sizeof(items_sent));
+    waitpid(services_pid, nullptr, 0);
+    close(ready_pipe[0]);
+    close(go_pipe[1]);
+
+    const double secs = elapsed.count();
+    const uint64_t signals = (stats_after.items_changed_signals - stats_before.items_changed_signals) +
+                             (stats_after.properties_changed_signals - stats_before.properties_changed_signals);
+    const uint64_t items_ingested = stats_after.items_ingested - stats_before.items_ingested;
+    const uint64_t publishes = globals->publish_count - publish_count_before;
+    const uint64_t publish_bytes = globals->publish_bytes - publish_bytes_before;
+
+    printf("\n");
+    printf("%-28s %.1f s\n", "Measured", secs);
+    printf("%-28s %.0f /s (%lu)\n", "Signals", static_cast<double>(signals) / secs, static_cast<unsigned long>(signals));
+    printf("%-28s %.0f /s (%lu)\n", "Items ingested", static_cast<double>(items_ingested) / secs, static_cast<unsigned long>(items_ingested));
+    printf("%-28s %.0f /s (%lu)\n", "Publishes", static_cast<double>(publishes) / secs, static_cast<unsigned long>(publishes));
+    printf("%-28s %.0f kB/s\n", "Publish payload", static_cast<double>(publish_bytes) / secs / 1000.0);
+    printf("%-28s %.3f s (%.1f%% of one core)\n", "CPU time", cpu_used, cpu_used / secs * 100.0);
+    if (items_ingested > 0)
+        printf("%-28s %.2f us\n", "CPU per ingested item", cpu_used * 1000000.0 / static_cast<double>(items_ingested));
+    printf("%-28s %ld kB\n", "Peak RSS", get_peak_rss_kb());
+    printf("%-28s %s\n", "Signal to publish latency", state->signal_to_publish_latency.to_string().c_str());
+    printf("%-28s %lu\n", "Dispatch yields", static_cast<unsigned long>(stats_after.dispatch_yields - stats_before.dispatch_yields));
+
+    if (got_items_sent)
+    {
+        printf("%-28s %lu sent, %lu ingested", "Changed items", static_cast<unsigned long>(items_sent), static_cast<unsigned long>(items_ingested));
+        if (items_sent > 0)
+            printf(" (%.1f%%)", static_cast<double>(items_ingested) / static_cast<double>(items_sent) * 100.0);
+        printf("\n");
+    }
+
+    flashmq_plugin_deinit(data, plugin_opts, false);
+    flashmq_plugin_deallocate_thread_memory(data, plugin_opts);
+    flashmq_plugin_main_deinit(plugin_opts);
+
+    stop_child(daemon_pid);
+
+    return 0;
+}
+
+}
+
+int main(int argc, char **argv)
+{
+    if (argc > 1 && (std::string(argv[1]) == "--help" || std::string(argv[1]) == "-h"))
+    {
+        print_usage(argv[0]);
+        return 0;
+    }
+
+    LoadOptions o;
+
+    try
+    {
+        o = parse_args(argc, argv);
+    }
+    catch (std::exception &ex)
+    {
+        fprintf(stderr, "%s\n\n", ex.what());
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    // Child processes and a dead bus should give errors, not kill us.
+    signal(SIGPIPE, SIG_IGN);
+
+    char dir_template[] = "/tmp/flashmq-dbus-plugin-load.XXXXXX";
+    if (!mkdtemp(dir_template))
+    {
+        fprintf(stderr, "mkdtemp: %s\n", strerror(errno));
+        return 1;
+    }
+
+    const std::filesystem::path dir(dir_template);
+    int result = 1;
+
+    try
+    {
+        printf("%zu services, %zu items each, %.0f changes/s in %s, for %.0f s.\n", o.services, o.items_per_service, o.changes_per_second,
+               o.properties_changed ? "PropertiesChanged" : ("ItemsChanged of " + std::to_string(o.items_per_signal) + " items").c_str(), o.seconds);
+        fflush(stdout);
+
+        result = run_load(o, dir);
+    }
+    catch (std::exception &ex)
+    {
+        fprintf(stderr, "Load test failed: %s\n", ex.what());
+    }
+
+    std::error_code ec;
+    std::filesystem::remove_all(dir, ec);
+
+    return result;
+}
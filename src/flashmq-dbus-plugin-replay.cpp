@@ -0,0 +1,465 @@
+#include <sys/epoll.h>
+#include <unistd.h>
+#include <chrono>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <filesystem>
+#include <fstream>
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "vendor/flashmq_plugin.h"
+#include "testerglobals.h"
+#include "utils.h"
+#include "state.h"
+#include "trace.h"
+#include "dbus_functions.h"
+#include "dbusmessageguard.h"
+#include "dbuserrorguard.h"
+#include "vevariant.h"
+
+/*
+ * Trace replayer: it feeds a trace recorded with the 'trace_file' plugin option into the plugin, without a dbus connection, in the same
+ * event loop as the tests. Publishes are only counted, and checksummed.
+ *
+ * The method calls the plugin makes are matched to the ones in the trace on destination, path, interface and member, in order, so
+ * the recorded replies can be given to the right handlers. Calls that can't be matched are reported, as divergences.
+ *
+ * With the same trace, plugin options and code, the checksum of the output is the same on every replay, so it can be used to see if
+ * an optimization changed what the plugin does. At the original speed, timers fire like they did; at maximum speed, time is ignored.
+ */
+
+using namespace dbus_flashmq;
+
+namespace
+{
+
+struct ReplayOptions
+{
+    std::string trace_path;
+    bool max_speed = false;
+    std::optional<uint64_t> expected_checksum;
+    std::map<std::string, std::string> plugin_opts;
+};
+
+void print_usage(const char *name)
+{
+    fprintf(stderr,
+            "Usage: %s <trace> [--max-speed] [--expect-checksum HEX] [--plugin-opt name=value]...\n"
+            "\n"
+            "  --max-speed        Replay as fast as possible, instead of at the recorded pace.\n"
+            "  --expect-checksum  Exit with 2 when the checksum of the output is not this.\n"
+            "  --plugin-opt       Override a plugin option of the recording. Can be given more than once.\n",
+            name);
+}
+
+ReplayOptions parse_args(int argc, char **argv)
+{
+    ReplayOptions o;
+
+    for (int i = 1; i < argc; i++)
+    {
+        const std::string arg(argv[i]);
+
+        if (arg == "--max-speed")
+        {
+            o.max_speed = true;
+            continue;
+        }
+
+        if (!arg.starts_with("--"))
+        {
+            if (!o.trace_path.empty())
+                throw std::runtime_error("Only one trace can be replayed.");
+
+            o.trace_path = arg;
+            continue;
+        }
+
+        if (i + 1 >= argc)
+            throw std::runtime_error("Option '" + arg + "' needs a value, or is unknown.");
+
+        const std::string value(argv[++i]);
+
+        if (arg == "--expect-checksum")
+        {
+            size_t end = 0;
+            o.expected_checksum = std::stoull(value, &end, 16);
+            if (end != value.size())
+                throw std::runtime_error("'" + value + "' is not a hexadecimal checksum.");
+        }
+        else if (arg == "--plugin-opt")
+        {
+            const size_t eq = value.find('=');
+            if (eq == std::string::npos || eq == 0)
+                throw std::runtime_error("Plugin option '" + value + "' is not of the form name=value.");
+            o.plugin_opts[value.substr(0, eq)] = value.substr(eq + 1);
+        }
+        else
+            throw std::runtime_error("Unknown option '" + arg + "'.");
+    }
+
+    if (o.trace_path.empty())
+        throw std::runtime_error("No trace given.");
+
+    return o;
+}
+
+DBusMessage *demarshal(const std::string &data)
+{
+    DBusErrorGuard err;
+    DBusMessage *msg = dbus_message_demarshal(data.data(), static_cast<int>(data.size()), err.get());
+    err.throw_error();
+
+    if (!msg)
+        throw std::runtime_error("Can't demarshal dbus message from trace.");
+
+    return msg;
+}
+
+/**
+ * @brief The Replayer class gives the events of a trace to the plugin, and the recorded replies to the method calls it makes.
+ *
+ * Recorded and replayed calls are matched per call key in order of appearance, because the order between calls to different
+ * services can differ a bit, while the serials always do.
+ */
+class Replayer
+{
+    State *state;
+    TesterGlobals *globals;
+
+    std::unordered_map<std::string, std::deque<dbus_uint32_t>> replayed_calls_not_in_trace_yet;
+    std::unordered_map<std::string, std::deque<dbus_uint32_t>> recorded_calls_not_made_yet;
+    std::unordered_map<dbus_uint32_t, dbus_uint32_t> recorded_to_replayed_serial;
+    std::unordered_map<dbus_uint32_t, std::string> replies_waiting_for_call;
+
+    void match(dbus_uint32_t recorded_serial, dbus_uint32_t replayed_serial)
+    {
+        matched_calls++;
+
+        auto pos = replies_waiting_for_call.find(recorded_serial);
+        if (pos != replies_waiting_for_call.end())
+        {
+            // We're inside the call_method() of the plugin here, and it may not expect its handler to run yet.
+            std::string reply = std::move(pos->second);
+            replies_waiting_for_call.erase(pos);
+            flashmq_add_task([this, reply, replayed_serial]() {
+                deliver_reply(reply, replayed_serial);
+            }, 0);
+            return;
+        }
+
+        recorded_to_replayed_serial[recorded_serial] = replayed_serial;
+    }
+
+    void deliver_reply(const std::string &reply, dbus_uint32_t replayed_serial)
+    {
+        DBusMessageGuard msg(demarshal(reply));
+        dbus_message_set_reply_serial(msg.d, replayed_serial);
+        dbus_handle_reply(state, msg.d);
+        replies_delivered++;
+    }
+
+public:
+    uint64_t events = 0;
+    uint64_t calls_made = 0;
+    uint64_t matched_calls = 0;
+    uint64_t replies_delivered = 0;
+
+    Replayer(State *state, TesterGlobals *globals) :
+        state(state),
+        globals(globals)
+    {
+
+    }
+
+    /**
+     * @brief on_method_call is the method call sink of the state: the calls the plugin makes end up here instead of on the bus.
+     */
+    void on_method_call(DBusMessage *msg)
+    {
+        calls_made++;
+
+        auto safe = [](const char *s) { return s ? s : ""; };
+
+        TraceEvent call;
+        call.destination = safe(dbus_message_get_destination(msg));
+        call.path = safe(dbus_message_get_path(msg));
+        call.interface = safe(dbus_message_get_interface(msg));
+        call.member = safe(dbus_message_get_member(msg));
+        const std::string key = call.get_call_key();
+
+        // What the plugin writes to the bus is output too.
+        globals->add_to_checksum(key);
+        DBusMessageIter iter;
+        dbus_message_iter_init(msg, &iter);
+        while (dbus_message_iter_get_arg_type(&iter) != DBUS_TYPE_INVALID)
+        {
+            globals->add_to_checksum(VeVariant(&iter).as_text());
+            dbus_message_iter_next(&iter);
+        }
+
+        const dbus_uint32_t serial = dbus_message_get_serial(msg);
+        std::deque<dbus_uint32_t> &recorded = recorded_calls_not_made_yet[key];
+
+        if (recorded.empty())
+        {
+            replayed_calls_not_in_trace_yet[key].push_back(serial);
+            return;
+        }
+
+        const dbus_uint32_t recorded_serial = recorded.front();
+        recorded.pop_front();
+        match(recorded_serial, serial);
+    }
+
+    void apply(const TraceEvent &event)
+    {
+        events++;
+
+        switch (event.type)
+        {
+        case TraceEventType::DbusMessage:
+        {
+            DBusMessageGuard msg(demarshal(event.message));
+            state->dbus_data_read_at = std::chrono::steady_clock::now();
+            dbus_handle_message(nullptr, msg.d, state);
+            state->dispatch_arena.reset();
+            state->dbus_data_read_at.reset();
+            break;
+        }
+        case TraceEventType::DbusCall:
+        {
+            std::deque<dbus_uint32_t> &replayed = replayed_calls_not_in_trace_yet[event.get_call_key()];
+
+            if (replayed.empty())
+            {
+                recorded_calls_not_made_yet[event.get_call_key()].push_back(event.serial);
+                break;
+            }
+
+            const dbus_uint32_t replayed_serial = replayed.front();
+            replayed.pop_front();
+            match(event.serial, replayed_serial);
+            break;
+        }
+        case TraceEventType::DbusReply:
+        {
+            DBusMessageGuard msg(demarshal(event.message));
+            const dbus_uint32_t recorded_serial = dbus_message_get_reply_serial(msg.d);
+
+            auto pos = recorded_to_replayed_serial.find(recorded_serial);
+            if (pos == recorded_to_replayed_serial.end())
+            {
+                replies_waiting_for_call[recorded_serial] = event.message;
+                break;
+            }
+
+            const dbus_uint32_t replayed_serial = pos->second;
+            recorded_to_replayed_serial.erase(pos);
+            dbus_message_set_reply_serial(msg.d, replayed_serial);
+            dbus_handle_reply(state, msg.d);
+            replies_delivered++;
+            break;
+        }
+        case TraceEventType::AclCheck:
+        {
+            const std::vector<std::string> subtopics = splitToVector(event.topic, '/');
+            const AuthResult result = flashmq_plugin_acl_check(state, static_cast<AclAccess>(event.access), event.clientid, event.username,
+                                                               event.topic, subtopics, "", event.payload, 0, event.retain, {}, {}, nullptr);
+            globals->add_to_checksum(std::to_string(static_cast<int>(result)));
+            break;
+        }
+        case TraceEventType::LoginCheck:
+            state->client_logging_in(event.clientid, event.username);
+            break;
+        case TraceEventType::LoginSucceeded:
+            state->client_logged_in(event.username, event.clientid, {}, event.privileged, event.lan);
+            break;
+        case TraceEventType::ClientDisconnected:
+            flashmq_plugin_client_disconnected(state, event.clientid);
+            break;
+        case TraceEventType::Subscribe:
+        {
+            std::string topic = event.topic;
+            uint8_t qos = 0;
+            flashmq_plugin_alter_subscription(state, event.clientid, topic, splitToVector(topic, '/'), qos, nullptr);
+            break;
+        }
+        case TraceEventType::Unsubscribe:
+            flashmq_plugin_on_unsubscribe(state, {}, event.clientid, "", event.topic, splitToVector(event.topic, '/'), "", nullptr);
+            break;
+        }
+    }
+
+    static size_t count(const std::unordered_map<std::string, std::deque<dbus_uint32_t>> &calls)
+    {
+        size_t n = 0;
+        for (const auto &p : calls)
+        {
+            n += p.second.size();
+        }
+        return n;
+    }
+
+    size_t get_calls_not_in_trace() const
+    {
+        return count(replayed_calls_not_in_trace_yet);
+    }
+
+    size_t get_calls_not_made() const
+    {
+        return count(recorded_calls_not_made_yet);
+    }
+
+    size_t get_undelivered_replies() const
+    {
+        return replies_waiting_for_call.size();
+    }
+};
+
+int run_replay(const ReplayOptions &o, const std::filesystem::path &dir)
+{
+    TraceReader reader(o.trace_path);
+
+    {
+        std::ofstream unique_id(dir / "unique-id");
+        unique_id << reader.get_vrm_id() << "\n";
+    }
+
+    TesterGlobals *globals = TesterGlobals::getInstance();
+    globals->epoll_fd = epoll_create(1024);
+    globals->count_publishes_only = true;
+    globals->quiet = true;
+    globals->checksum_output = true;
+
+    // The options of the recording, minus what would touch files of the recording machine.
+    std::unordered_map<std::string, std::string> plugin_opts(reader.get_plugin_opts().begin(), reader.get_plugin_opts().end());
+    plugin_opts.erase("trace_file");
+    plugin_opts.erase("snapshot_file");
+    plugin_opts["unique_id_file"] = (dir / "unique-id").string();
+    plugin_opts["stats_interval_seconds"] = "0";
+    if (o.max_speed)
+        plugin_opts["keepalive_coalesce_milliseconds"] = "0";
+    for (const auto &[name, value] : o.plugin_opts)
+    {
+        plugin_opts[name] = value;
+    }
+
+    flashmq_plugin_main_init(plugin_opts);
+
+    void *data = nullptr;
+    flashmq_plugin_allocate_thread_memory(&data, plugin_opts);
+    State *state = static_cast<State*>(data);
+
+    Replayer replayer(state, globals);
+    state->method_call_sink = [&replayer](DBusMessage *msg) { replayer.on_method_call(msg); };
+
+    flashmq_plugin_init(data, plugin_opts, false);
+
+    const auto started_at = std::chrono::steady_clock::now();
+
+    while (std::optional<TraceEvent> event = reader.next())
+    {
+        if (!o.max_speed)
+        {
+            const auto due = started_at + event->time;
+            auto now = std::chrono::steady_clock::now();
+            while (now < due)
+            {
+                globals->run_event_loop(data, std::chrono::ceil<std::chrono::milliseconds>(due - now));
+                now = std::chrono::steady_clock::now();
+            }
+        }
+
+        globals->run_due_tasks();
+        replayer.apply(event.value());
+    }
+
+    globals->run_due_tasks();
+
+    const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - started_at;
+    const double secs = elapsed.count();
+
+    // The recording ends with the calls of the deinit, so they should be matched too.
+    flashmq_plugin_deinit(data, plugin_opts, false);
+    globals->run_due_tasks();
+
+    const uint64_t checksum = globals->output_checksum;
+
+    printf("%-28s %lu in %.3f s (%.0f /s)\n", "Events", static_cast<unsigned long>(replayer.events), secs,
+           secs > 0 ? static_cast<double>(replayer.events) / secs : 0.0);
+    printf("%-28s %lu\n", "Publishes", static_cast<unsigned long>(globals->publish_count));
+    printf("%-28s %lu made, %lu matched\n", "Method calls", static_cast<unsigned long>(replayer.calls_made),
+           static_cast<unsigned long>(replayer.matched_calls));
+    printf("%-28s %lu\n", "Replies delivered", static_cast<unsigned long>(replayer.replies_delivered));
+    printf("%-28s %zu only replayed, %zu only recorded, %zu replies undelivered\n", "Divergence", replayer.get_calls_not_in_trace(),
+           replayer.get_calls_not_made(), replayer.get_undelivered_replies());
+    printf("%-28s %016" PRIx64 "\n", "Checksum", checksum);
+
+    state->method_call_sink = nullptr;
+    flashmq_plugin_deallocate_thread_memory(data, plugin_opts);
+    flashmq_plugin_main_deinit(plugin_opts);
+
+    if (o.expected_checksum && o.expected_checksum.value() != checksum)
+    {
+        fprintf(stderr, "Checksum mismatch: expected %016" PRIx64 ".\n", o.expected_checksum.value());
+        return 2;
+    }
+
+    return 0;
+}
+
+}
+
+int main(int argc, char **argv)
+{
+    if (argc > 1 && (std::string(argv[1]) == "--help" || std::string(argv[1]) == "-h"))
+    {
+        print_usage(argv[0]);
+        return 0;
+    }
+
+    ReplayOptions o;
+
+    try
+    {
+        o = parse_args(argc, argv);
+    }
+    catch (std::exception &ex)
+    {
+        fprintf(stderr, "%s\n\n", ex.what());
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    char dir_template[] = "/tmp/flashmq-dbus-plugin-replay.XXXXXX";
+    if (!mkdtemp(dir_template))
+    {
+        fprintf(stderr, "mkdtemp: %s\n", strerror(errno));
+        return 1;
+    }
+
+    const std::filesystem::path dir(dir_template);
+    int result = 1;
+
+    try
+    {
+        result = run_replay(o, dir);
+    }
+    catch (std::exception &ex)
+    {
+        fprintf(stderr, "Replay failed: %s\n", ex.what());
+    }
+
+    std::error_code ec;
+    std::filesystem::remove_all(dir, ec);
+
+    return result;
+}
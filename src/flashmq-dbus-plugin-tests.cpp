@@ -1,5 +1,12 @@
 #include <sys/epoll.h>
+#include <poll.h>
 #include <cstring>
+#include <unistd.h>
+#include <thread>
+#include <fstream>
+#include <filesystem>
+#include <algorithm>
+#include <map>
 
 #include "flashmq-dbus-plugin-tests.h"
 #include "vendor/flashmq_plugin.h"
@@ -7,8 +14,30 @@
 #include "utils.h"
 #include "state.h"
 #include "guicustomizations.h"
-
-#define MAX_EVENTS 25
+#include "jsonwriter.h"
+#include "exceptions.h"
+#include "dbusmessageguard.h"
+#include "dbuserrorguard.h"
+#include "dbusmessageiteropencontainerguard.h"
+#include "scanscheduler.h"
+#include "snapshot.h"
+#include "asynchandlers.h"
+#include "smallfunction.h"
+#include "dbuscoroutine.h"
+#include "dispatcharena.h"
+#include "topicclassifier.h"
+#include "clientprofile.h"
+#include "credentialscache.h"
+#include "cryptworkers.h"
+#include "pluginstats.h"
+#include "latencyhistogram.h"
+#include "trace.h"
+#include "topicindex.h"
+#include "itempathtrie.h"
+#include "publishratelimiter.h"
+#include "subscriptiontracker.h"
+#include "dbusutils.h"
+#include "dbus_functions.h"
 
 void tests_init_once()
 {
@@ -18,6 +47,28 @@ void tests_init_once()
 
 using namespace dbus_flashmq;
 
+/**
+ * A directory of this run, so runs don't trip over each other's files.
+ */
+const std::string &get_test_dir()
+{
+    static const std::string dir = []() {
+        char templ[] = "/tmp/flashmq-dbus-plugin-tests-XXXXXX";
+
+        if (mkdtemp(templ) == nullptr)
+            throw std::runtime_error(std::string("mkdtemp: ") + strerror(errno));
+
+        return std::string(templ);
+    }();
+
+    return dir;
+}
+
+std::string test_file_path(const std::string &name)
+{
+    return get_test_dir() + "/" + name;
+}
+
 AuthResult dbus_flashmq::acl_check_helper(
     void *thread_data, const AclAccess access, const std::string &clientid, const std::string &username,
     const std::string &topic, const std::string &payload)
@@ -108,78 +159,2001 @@ int read_only_vrm_mode_tests(void *data)
 }
 
 
-int pre_event_loop_test(void *data)
+int json_writer_tests()
 {
-    FMQ_COMPARE(true, true);
+    const std::vector<std::string> inputs {
+        R"(0)", R"(-2147483649)", R"(4294967296)", R"(13.0)", R"(-0.0)", R"(1e15)", R"(0.1)", R"(1.7976931348623157e308)",
+        R"(true)", R"(null)", R"([])", R"([1,2,3])", R"([[1.5],[]])", R"("")", R"("/opt/victronenergy/dbus-systemcalc-py")",
+        R"("quote \" backslash \\ tab \t nl \n cr \r ff \f bs \b ctrl \u0001\u001f del \u007f")",
+        R"("ÄÖÜ € 𝄞 multi-byte, with enough characters to pass a couple of 8 byte blocks")",
+    };
 
-    integration_permission_tests(data);
-    read_only_vrm_mode_tests(data);
+    for (const std::string &input : inputs)
+    {
+        const VeVariant v(nlohmann::json::parse(input));
+
+        std::string written;
+        JsonWriter writer(written);
+        v.write_json(writer);
+
+        FMQ_COMPARE(written, v.as_json_value().dump());
+    }
+
+    std::string written;
+    JsonWriter writer(written);
+    VeVariant("pincode").write_json(writer, true);
+    FMQ_COMPARE(written, std::string(R"("******")"));
+
+    bool thrown = false;
+    try
+    {
+        writer.write_string("invalid \xC0\xAF");
+    }
+    catch (ValueError&)
+    {
+        thrown = true;
+    }
+    FMQ_COMPARE(thrown, true);
 
     return 0;
 }
 
-int main(int argc, char **argv)
+int properties_changed_decoding_tests()
 {
-    (void) argc; (void)argv;
+    DBusMessageGuard msg = dbus_message_new_signal("/Dc/0/Voltage", "com.victronenergy.BusItem", "PropertiesChanged");
 
-    tests_init_once();
+    {
+        const std::vector<std::pair<std::string, VeVariant>> entries {
+            {"Value", VeVariant(nlohmann::json(13.5))}, {"Text", VeVariant("13.5 V")}, {"Min", VeVariant(nlohmann::json(0.0))}, {"Max", VeVariant(nlohmann::json(100.0))},
+            {"Default", VeVariant("")}
+        };
+
+        DBusMessageIter iter;
+        dbus_message_iter_init_append(msg.d, &iter);
+        DBusMessageIterOpenContainerGuard array_iter(&iter, DBUS_TYPE_ARRAY, "{sv}");
+
+        for (const auto &e : entries)
+        {
+            DBusMessageIterOpenContainerGuard dict_iter(array_iter.get_array_iter(), DBUS_TYPE_DICT_ENTRY, nullptr);
+            const char *key = e.first.c_str();
+            dbus_message_iter_append_basic(dict_iter.get_array_iter(), DBUS_TYPE_STRING, &key);
+            DBusMessageIterOpenContainerGuard variant_iter(dict_iter.get_array_iter(), DBUS_TYPE_VARIANT, e.second.get_dbus_type_as_string_recursive().c_str());
+            e.second.append_args_to_dbus_message(variant_iter.get_array_iter());
+        }
+    }
+
+    Item item = Item::from_properties_changed(msg.d);
+
+    FMQ_COMPARE(item.get_path(), std::string("/Dc/0/Voltage"));
+    FMQ_COMPARE(item.get_value().value.as_text(), VeVariant(nlohmann::json(13.5)).as_text());
+    FMQ_COMPARE(item.get_value().min.as_text(), VeVariant(nlohmann::json(0.0)).as_text());
+    FMQ_COMPARE(item.get_value().max.as_text(), VeVariant(nlohmann::json(100.0)).as_text());
+
+    return 0;
+}
+
+int dispatch_arena_tests()
+{
+    DispatchArena arena(64, 1024);
+
+    arena.allocate(40);
+    void *overflowed = arena.allocate(40);
+    FMQ_COMPARE(arena.get_overflow_count(), static_cast<size_t>(1));
+    FMQ_COMPARE(reinterpret_cast<uintptr_t>(overflowed) % alignof(std::max_align_t), static_cast<uintptr_t>(0));
+
+    arena.reset();
+    FMQ_COMPARE(arena.get_capacity(), static_cast<size_t>(128));
+
+    // A long string decoded into the arena must survive as a copy, after the arena is reset and reused.
+    const std::string long_string = "A string too long to be stored inline";
+    DBusMessageGuard msg = dbus_message_new_signal("/ProductName", "com.victronenergy.BusItem", "PropertiesChanged");
 
-    if (!crypt_match("hallo", "$2a$08$LBfjL0PfMBbjWxCzLBfjLurkA7K0tuDn44rNUXDBvatSgSqHvwaHS"))
     {
-        throw std::runtime_error("crypt test failed.");
+        DBusMessageIter iter;
+        dbus_message_iter_init_append(msg.d, &iter);
+        DBusMessageIterOpenContainerGuard array_iter(&iter, DBUS_TYPE_ARRAY, "{sv}");
+        DBusMessageIterOpenContainerGuard dict_iter(array_iter.get_array_iter(), DBUS_TYPE_DICT_ENTRY, nullptr);
+        const char *key = "Value";
+        dbus_message_iter_append_basic(dict_iter.get_array_iter(), DBUS_TYPE_STRING, &key);
+        DBusMessageIterOpenContainerGuard variant_iter(dict_iter.get_array_iter(), DBUS_TYPE_VARIANT, "s");
+        VeVariant(long_string).append_args_to_dbus_message(variant_iter.get_array_iter());
     }
 
-    std::unordered_map<std::string, std::string> pluginOpts;
+    ValueMinMax stored;
 
-    TesterGlobals *globals = TesterGlobals::getInstance();
-    globals->epoll_fd = epoll_create(1024);
+    {
+        DBusMessageIter iter;
+        dbus_message_iter_init(msg.d, &iter);
+        const ValueMinMax decoded = ValueMinMax::from_dict(&iter, &arena);
+        FMQ_COMPARE(std::string(decoded.value.get_string_view()), long_string);
+        stored = decoded;
+    }
 
-    void *data = nullptr;;
+    arena.reset();
+    std::memset(arena.allocate(arena.get_capacity()), 'x', arena.get_capacity());
+    FMQ_COMPARE(std::string(stored.value.get_string_view()), long_string);
+    FMQ_COMPARE(arena.get_overflow_count(), static_cast<size_t>(1));
 
-    flashmq_plugin_main_init(pluginOpts);
-    flashmq_plugin_allocate_thread_memory(&data, pluginOpts);
+    return 0;
+}
 
-    flashmq_plugin_init(data, pluginOpts, false);
+int topic_classifier_tests()
+{
+    auto classify = [](const std::string &topic) {
+        return classify_topic(topic, splitToVector(topic, '/'), "c0619ab4a585");
+    };
 
-    pre_event_loop_test(data);
+    const TopicClass w = classify("W/c0619ab4a585/settings/0/Settings/Services/MqttPASSWORDThing");
+    FMQ_COMPARE(w.action == TopicAction::W, true);
+    FMQ_COMPARE(w.for_us, true);
+    FMQ_COMPARE(w.sensitive, true);
 
-    struct epoll_event events[MAX_EVENTS];
-    memset(&events, 0, sizeof (struct epoll_event)*MAX_EVENTS);
+    const TopicClass api = classify("W/c0619ab4a585/platform/0/Security/Api");
+    FMQ_COMPARE(api.platform_security_api, true);
+    FMQ_COMPARE(api.sensitive, true);
 
-    GuiCustomizations g;
-    g.scan();
+    const TopicClass n = classify("N/other/system/0/Serial");
+    FMQ_COMPARE(n.action == TopicAction::N, true);
+    FMQ_COMPARE(n.for_us, false);
+    FMQ_COMPARE(n.sensitive, false);
+
+    const TopicClass i = classify("I/local/in/evcharger/HQ2401ABCDE/vregset");
+    FMQ_COMPARE(i.action == TopicAction::I, true);
+    FMQ_COMPARE(i.local, true);
+    FMQ_COMPARE(i.direction_in, true);
+
+    FMQ_COMPARE(classify("Iets/c0619ab4a585").action == TopicAction::Other, true);
+
+    const ClientProfile token_profile("token/evcharger/HQ2401ABCDE", false, false);
+    FMQ_COMPARE(token_profile.token, true);
+    FMQ_COMPARE(token_profile.token_role, std::string("evcharger"));
+    FMQ_COMPARE(token_profile.token_unique_id, std::string("HQ2401ABCDE"));
+
+    const ClientProfile bridge_profile("GXdbus", false, false);
+    FMQ_COMPARE(bridge_profile.bridge, true);
+    FMQ_COMPARE(bridge_profile.privileged, true);
+    FMQ_COMPARE(bridge_profile.token, false);
 
-    while (true)
+    ClientProfiles profiles;
+    profiles.set("client", ClientProfile("token/evcharger/HQ2401ABCDE", false, true));
+    FMQ_COMPARE(profiles.find("client", "token/evcharger/HQ2401ABCDE") != nullptr, true);
+    FMQ_COMPARE(profiles.find("client", "token/evcharger/QQ2401ABCDE") == nullptr, true);
+
+    return 0;
+}
+
+int scan_scheduler_tests()
+{
+    ScanScheduler scheduler;
+    scheduler.set_max_in_flight(2);
+    scheduler.set_priority_service_types("settings, system");
+
+    scheduler.enqueue("com.victronenergy.solarcharger.ttyO1");
+    scheduler.enqueue("com.victronenergy.system");
+    scheduler.enqueue("com.victronenergy.battery.ttyO2");
+    scheduler.enqueue("com.victronenergy.settings");
+    scheduler.enqueue("com.victronenergy.system");
+    scheduler.start_initial_scan();
+
+    FMQ_COMPARE(scheduler.get_queued_count(), static_cast<size_t>(4));
+    FMQ_COMPARE(scheduler.next().value_or(""), std::string("com.victronenergy.settings"));
+    FMQ_COMPARE(scheduler.next().value_or(""), std::string("com.victronenergy.system"));
+    FMQ_COMPARE(scheduler.next().has_value(), false);
+
+    scheduler.cancel("com.victronenergy.solarcharger.ttyO1");
+    scheduler.finished();
+    FMQ_COMPARE(scheduler.complete_initial_scan_if_done(), false);
+    FMQ_COMPARE(scheduler.next().value_or(""), std::string("com.victronenergy.battery.ttyO2"));
+    scheduler.finished();
+    FMQ_COMPARE(scheduler.complete_initial_scan_if_done(), false);
+    scheduler.finished();
+    FMQ_COMPARE(scheduler.complete_initial_scan_if_done(), true);
+    FMQ_COMPARE(scheduler.complete_initial_scan_if_done(), false);
+    FMQ_COMPARE(scheduler.get_initial_scan_duration().has_value(), true);
+
+    return 0;
+}
+
+int snapshot_tests()
+{
+    std::unordered_map<std::string, std::unordered_map<std::string, Item>> items;
+    std::unordered_map<std::string, ServiceIdentifier> instances;
+
+    const std::string service("com.victronenergy.solarcharger.ttyO1");
+    instances[service] = ServiceIdentifier(279);
+
+    const std::vector<std::pair<std::string, std::string>> values {
+        {"/Dc/0/Voltage", "13.5"}, {"/ProductName", R"("SmartSolar Charger MPPT 150/35, long enough to not be inline")"},
+        {"/Yield/Power", "null"}, {"/Pv/V", "[1,2,3]"}, {"/DeviceInstance", "279"}
+    };
+
+    for (const auto &p : values)
     {
-        const uint32_t next_task_delay = globals->delayedTasks.getTimeTillNext();
-        const uint32_t epoll_wait_time = std::min<uint32_t>(next_task_delay, 100);
+        ValueMinMax v;
+        v.value = VeVariant(nlohmann::json::parse(p.second));
+        Item item = Item::from_path_and_value(p.first, std::move(v));
+        item.set_mapping_details("c0619ab4a585", service, instances[service]);
+        items[service][p.first] = item;
+    }
 
-        const int num_fds = epoll_wait(globals->epoll_fd, events, MAX_EVENTS, static_cast<int>(epoll_wait_time));
+    const std::string path = test_file_path("snapshot.bin");
+    write_snapshot_file(path, serialize_snapshot("c0619ab4a585", items, instances));
 
-        if (epoll_wait_time == 0)
-        {
-            globals->delayedTasks.performAll();
-        }
+    FMQ_COMPARE(read_snapshot_file(path, "someotherid").empty(), true);
+
+    const std::vector<SnapshotService> services = read_snapshot_file(path, "c0619ab4a585");
+    unlink(path.c_str());
+
+    FMQ_COMPARE(services.size(), static_cast<size_t>(1));
+    FMQ_COMPARE(services.at(0).service, service);
+    FMQ_COMPARE(services.at(0).instance.getValue(), std::string("279"));
+    FMQ_COMPARE(services.at(0).items.size(), values.size());
+
+    for (const SnapshotItem &si : services.at(0).items)
+    {
+        Item &org = items[service][si.path];
+        FMQ_COMPARE(si.json, org.as_json());
+        FMQ_COMPARE(si.value.value == org.get_value().value, true);
+        FMQ_COMPARE(si.value.value.get_type() == org.get_value().value.get_type(), true);
+    }
+
+    return 0;
+}
+
+/**
+ * Traces end up in field reports, so passwords must not be in them: not in the payloads of writes, and not in the values of items.
+ */
+int trace_redaction_tests(void *data)
+{
+    State *state = static_cast<State*>(data);
+    const std::string path = test_file_path("trace-redaction.bin");
+
+    {
+        state->trace_recorder = std::make_unique<TraceRecorder>(path, state->unique_vrm_id, std::unordered_map<std::string, std::string>());
 
-        if (num_fds < 0)
+        const std::string secret_topic = "W/" + state->unique_vrm_id + "/settings/0/Settings/Services/AccessPointPassword";
+        acl_check_helper(data, AclAccess::write, "client1", "user1", secret_topic, R"({"value": "hunter22"})");
+
+        const std::string normal_topic = "W/" + state->unique_vrm_id + "/settings/0/Settings/Gui/Brightness";
+        acl_check_helper(data, AclAccess::write, "client1", "user1", normal_topic, R"({"value": 5})");
+
+        state->trace_recorder.reset();
+
+        TraceReader reader(path);
+        int acl_checks = 0;
+
+        while (std::optional<TraceEvent> event = reader.next())
         {
-            if (errno == EINTR)
+            if (event->type != TraceEventType::AclCheck)
                 continue;
+
+            acl_checks++;
+            const bool secret = event->topic.find("AccessPointPassword") != std::string::npos;
+            FMQ_COMPARE(event->payload, std::string(secret ? "" : R"({"value": 5})"));
         }
 
-        for (int i = 0; i < num_fds; i++)
+        FMQ_COMPARE(acl_checks, 2);
+    }
+
+    {
+        TraceRecorder recorder(path, "c0619ab4a585", {});
+
+        DBusMessageGuard signal(dbus_message_new_signal("/", "com.victronenergy.BusItem", "ItemsChanged"));
+        dbus_message_set_serial(signal.d, 1);
+        dbus_message_set_sender(signal.d, ":1.42");
+
+        DBusMessageIter iter;
+        dbus_message_iter_init_append(signal.d, &iter);
+
         {
-            int cur_fd = events[i].data.fd;
+            DBusMessageIterOpenContainerGuard items(&iter, DBUS_TYPE_ARRAY, "{sa{sv}}");
+
+            const std::vector<std::pair<const char*, const char*>> values {
+                {"/Settings/Services/AccessPointPassword", "hunter22"}, {"/Settings/Gui/Language", "nl"}
+            };
 
-            auto pos = globals->watchedFds.find(cur_fd);
-            if (pos != globals->watchedFds.end())
+            for (const auto &[item_path, item_value] : values)
             {
-                std::weak_ptr<void> &p = pos->second;
-                flashmq_plugin_poll_event_received(data, cur_fd, events[i].events, p);
+                DBusMessageIterOpenContainerGuard entry(items.get_array_iter(), DBUS_TYPE_DICT_ENTRY, nullptr);
+                dbus_message_iter_append_basic(entry.get_array_iter(), DBUS_TYPE_STRING, &item_path);
+                DBusMessageIterOpenContainerGuard props(entry.get_array_iter(), DBUS_TYPE_ARRAY, "{sv}");
+
+                for (const char *key : {"Value", "Text"})
+                {
+                    DBusMessageIterOpenContainerGuard prop(props.get_array_iter(), DBUS_TYPE_DICT_ENTRY, nullptr);
+                    dbus_message_iter_append_basic(prop.get_array_iter(), DBUS_TYPE_STRING, &key);
+                    DBusMessageIterOpenContainerGuard variant(prop.get_array_iter(), DBUS_TYPE_VARIANT, "s");
+                    dbus_message_iter_append_basic(variant.get_array_iter(), DBUS_TYPE_STRING, &item_value);
+                }
             }
         }
+
+        // Only the fact of the call is recorded, but its reply has the secret.
+        DBusMessageGuard call(dbus_message_new_method_call("com.victronenergy.settings", "/Settings/Ble/Service/Pincode", "com.victronenergy.BusItem", "GetValue"));
+        dbus_message_set_serial(call.d, 7);
+        recorder.record_dbus_call(call.d);
+
+        DBusMessageGuard reply(dbus_message_new(DBUS_MESSAGE_TYPE_METHOD_RETURN));
+        dbus_message_set_reply_serial(reply.d, 7);
+        dbus_message_set_serial(reply.d, 2);
+        const char *pincode = "123456";
+        dbus_message_append_args(reply.d, DBUS_TYPE_STRING, &pincode, DBUS_TYPE_INVALID);
+
+        recorder.record_dbus_message(TraceEventType::DbusMessage, signal.d);
+        recorder.record_dbus_message(TraceEventType::DbusReply, reply.d);
+    }
+
+    std::string recorded;
+    {
+        std::ifstream f(path, std::ios::binary);
+        recorded.assign(std::istreambuf_iterator<char>(f), std::istreambuf_iterator<char>());
+    }
+
+    FMQ_COMPARE(recorded.find("hunter22") == std::string::npos, true);
+    FMQ_COMPARE(recorded.find("123456") == std::string::npos, true);
+
+    TraceReader reader(path);
+    unlink(path.c_str());
+
+    std::optional<TraceEvent> event = reader.next(); // The call.
+    event = reader.next();
+
+    // What isn't a secret is recorded as is, so it still replays the same.
+    FMQ_COMPARE(event.has_value() && event->type == TraceEventType::DbusMessage, true);
+    DBusErrorGuard err;
+    DBusMessageGuard signal(dbus_message_demarshal(event->message.data(), static_cast<int>(event->message.size()), err.get()));
+    FMQ_COMPARE(signal.d != nullptr, true);
+    FMQ_COMPARE(std::string(dbus_message_get_sender(signal.d)), std::string(":1.42"));
+
+    const std::unordered_map<std::string, Item> items = get_from_dict_with_dict_with_text_and_value(signal.d);
+    FMQ_COMPARE(items.size(), static_cast<size_t>(2));
+    FMQ_COMPARE(items.at("/Settings/Gui/Language").get_value().value.as_text(), std::string("nl"));
+    FMQ_COMPARE(items.at("/Settings/Services/AccessPointPassword").get_value().value.as_text(), std::string(""));
+
+    std::optional<TraceEvent> reply_event = reader.next();
+    FMQ_COMPARE(reply_event.has_value() && reply_event->type == TraceEventType::DbusReply, true);
+    DBusMessageGuard reply(dbus_message_demarshal(reply_event->message.data(), static_cast<int>(reply_event->message.size()), err.get()));
+    FMQ_COMPARE(reply.d != nullptr, true);
+    FMQ_COMPARE(dbus_message_get_reply_serial(reply.d), 7u);
+
+    return 0;
+}
+
+int trace_tests(void *data)
+{
+    const std::string path = test_file_path("trace.bin");
+
+    {
+        TraceRecorder recorder(path, "c0619ab4a585", {{"skip_broker_registration", "true"}});
+
+        DBusMessageGuard signal(dbus_message_new_signal("/Dc/0/Voltage", "com.victronenergy.BusItem", "PropertiesChanged"));
+        dbus_message_set_serial(signal.d, 1); // Messages from the bus always have one; unsent ones don't demarshal without.
+        recorder.record_dbus_message(TraceEventType::DbusMessage, signal.d);
+
+        TraceEvent acl;
+        acl.type = TraceEventType::AclCheck;
+        acl.access = static_cast<uint8_t>(AclAccess::write);
+        acl.clientid = "client1";
+        acl.username = "user1";
+        acl.topic = "W/c0619ab4a585/settings/0/Settings/Gui/Brightness";
+        acl.payload = R"({"value": 5})";
+        acl.retain = true;
+        recorder.record(acl);
+
+        FMQ_COMPARE(recorder.get_event_count(), static_cast<uint64_t>(2));
+    }
+
+    TraceReader reader(path);
+    unlink(path.c_str());
+
+    FMQ_COMPARE(reader.get_vrm_id(), std::string("c0619ab4a585"));
+    FMQ_COMPARE(reader.get_plugin_opts().at("skip_broker_registration"), std::string("true"));
+
+    std::optional<TraceEvent> signal_event = reader.next();
+    FMQ_COMPARE(signal_event.has_value(), true);
+    FMQ_COMPARE(signal_event->type == TraceEventType::DbusMessage, true);
+
+    DBusErrorGuard err;
+    DBusMessageGuard signal(dbus_message_demarshal(signal_event->message.data(), static_cast<int>(signal_event->message.size()), err.get()));
+    FMQ_COMPARE(signal.d != nullptr, true);
+    FMQ_COMPARE(std::string(dbus_message_get_path(signal.d)), std::string("/Dc/0/Voltage"));
+    FMQ_COMPARE(std::string(dbus_message_get_member(signal.d)), std::string("PropertiesChanged"));
+
+    std::optional<TraceEvent> acl_event = reader.next();
+    FMQ_COMPARE(acl_event.has_value(), true);
+    FMQ_COMPARE(acl_event->type == TraceEventType::AclCheck, true);
+    FMQ_COMPARE(acl_event->access, static_cast<uint8_t>(AclAccess::write));
+    FMQ_COMPARE(acl_event->clientid, std::string("client1"));
+    FMQ_COMPARE(acl_event->username, std::string("user1"));
+    FMQ_COMPARE(acl_event->topic, std::string("W/c0619ab4a585/settings/0/Settings/Gui/Brightness"));
+    FMQ_COMPARE(acl_event->payload, std::string(R"({"value": 5})"));
+    FMQ_COMPARE(acl_event->retain, true);
+    FMQ_COMPARE(acl_event->time >= signal_event->time, true);
+
+    FMQ_COMPARE(reader.next().has_value(), false);
+
+    trace_redaction_tests(data);
+
+    return 0;
+}
+
+int credentials_cache_tests()
+{
+    const std::filesystem::path dir = std::filesystem::temp_directory_path() / "flashmq-dbus-plugin-tests-credentials";
+    std::filesystem::remove_all(dir);
+    std::filesystem::create_directories(dir);
+
+    const std::string tokens_path = dir / "tokens.json";
+    const std::string vnc_password_path = dir / "vncpassword.txt";
+
+    auto write_file = [](const std::string &path, const std::string &contents) {
+        std::ofstream f(path, std::ios::trunc);
+        f << contents;
+    };
+
+    CredentialsCache cache(tokens_path, vnc_password_path);
+    cache.start_watching();
+    FMQ_COMPARE(cache.get_fd() >= 0, true);
+
+    FMQ_COMPARE(cache.get_token_password_hash("token/evcharger/one") == nullptr, true);
+    FMQ_COMPARE(cache.get_vnc_password_crypt().has_value(), false);
+
+    write_file(tokens_path, R"([{"token_name": "token/evcharger/one", "password_hash": "hash1"}])");
+    write_file(vnc_password_path, "");
+
+    const std::string *hash = cache.get_token_password_hash("token/evcharger/one");
+    FMQ_COMPARE(hash != nullptr, true);
+    FMQ_COMPARE(*hash, std::string("hash1"));
+    FMQ_COMPARE(cache.get_vnc_password_crypt().value_or("none"), std::string(""));
+
+    // Nothing changed, so nothing is read again.
+    const size_t load_count = cache.get_load_count();
+    cache.get_token_password_hash("token/evcharger/one");
+    cache.get_vnc_password_crypt();
+    FMQ_COMPARE(cache.get_load_count(), load_count);
+
+    write_file(tokens_path, R"([{"token_name": "token/evcharger/two", "password_hash": "hash2"}])");
+    write_file(vnc_password_path, "crypted\n");
+
+    FMQ_COMPARE(cache.get_token_password_hash("token/evcharger/one") == nullptr, true);
+    FMQ_COMPARE(*cache.get_token_password_hash("token/evcharger/two"), std::string("hash2"));
+    FMQ_COMPARE(cache.get_vnc_password_crypt().value_or("none"), std::string("crypted"));
+
+    std::filesystem::remove_all(dir);
+
+    return 0;
+}
+
+int crypt_workers_tests()
+{
+    const std::string crypted("$2a$08$LBfjL0PfMBbjWxCzLBfjLurkA7K0tuDn44rNUXDBvatSgSqHvwaHS");
+
+    CryptWorkers workers;
+    workers.start(2);
+    FMQ_COMPARE(workers.running(), true);
+
+    std::vector<std::pair<std::string, bool>> results;
+
+    for (const std::string password : {"hallo", "wrong"})
+    {
+        workers.submit(password, crypted, [&results, password](bool match) {
+            results.emplace_back(password, match);
+        });
+    }
+
+    FMQ_COMPARE(workers.get_pending_count(), static_cast<size_t>(2));
+
+    const auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+    while (workers.get_pending_count() > 0 && std::chrono::steady_clock::now() < deadline)
+    {
+        pollfd p {workers.get_fd(), POLLIN, 0};
+        if (poll(&p, 1, 100) > 0)
+            workers.handle_results();
+    }
+
+    std::sort(results.begin(), results.end());
+    FMQ_COMPARE(results, (std::vector<std::pair<std::string, bool>>({{"hallo", true}, {"wrong", false}})));
+
+    workers.stop();
+    FMQ_COMPARE(workers.running(), false);
+    FMQ_COMPARE(workers.get_fd(), -1);
+
+    return 0;
+}
+
+int async_handlers_tests()
+{
+    AsyncHandlers handlers;
+    std::vector<dbus_uint32_t> called;
+    std::string lost_error;
+
+    // 1 and 65 share a slot in the initial ring, so this forces it to grow.
+    for (dbus_uint32_t serial : {1u, 2u, 65u, 1000u})
+    {
+        auto handler = [&called, &lost_error, serial](DBusMessage *msg) {
+            called.push_back(serial);
+
+            if (msg)
+                lost_error = dbus_message_get_error_name_safe(msg);
+        };
+
+        handlers.add(serial, handler, std::chrono::milliseconds(0), "GetValue", "test");
+    }
+
+    FMQ_COMPARE(handlers.get_in_flight_count(), static_cast<size_t>(4));
+    FMQ_COMPARE(static_cast<bool>(handlers.take(3)), false);
+
+    for (dbus_uint32_t serial : {65u, 1u, 1000u})
+    {
+        AsyncHandler f = handlers.take(serial);
+        FMQ_COMPARE(static_cast<bool>(f), true);
+        f(nullptr);
+    }
+
+    FMQ_COMPARE(called, std::vector<dbus_uint32_t>({65u, 1u, 1000u}));
+    FMQ_COMPARE(static_cast<bool>(handlers.take(1)), false);
+    FMQ_COMPARE(handlers.get_oldest_age().has_value(), true);
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(2));
+    FMQ_COMPARE(handlers.expire_lost(std::chrono::milliseconds(0)), static_cast<size_t>(1));
+    FMQ_COMPARE(handlers.get_in_flight_count(), static_cast<size_t>(0));
+    FMQ_COMPARE(handlers.get_lost_count(), static_cast<size_t>(1));
+
+    // Lost calls are answered with an error, so that coroutines waiting on them still get resumed.
+    FMQ_COMPARE(called.back(), 2u);
+    FMQ_COMPARE(lost_error, std::string(DBUS_ERROR_NO_REPLY));
+
+    void *frame = FramePool::allocate(300);
+    FramePool::deallocate(frame, 300);
+    void *reused_frame = FramePool::allocate(400);
+    FMQ_COMPARE(reused_frame == frame, true);
+    FramePool::deallocate(reused_frame, 400);
+
+    return 0;
+}
+
+int small_function_tests()
+{
+    std::shared_ptr<int> token = std::make_shared<int>(1);
+    std::weak_ptr<int> watch = token;
+
+    SmallFunction<int(int), 32> f = [token](int x) { return x + *token; };
+    token.reset();
+    FMQ_COMPARE(watch.use_count(), 1L);
+    FMQ_COMPARE(f(1), 2);
+
+    // Moving moves the callable, not a copy of it.
+    SmallFunction<int(int), 32> g = std::move(f);
+    FMQ_COMPARE(static_cast<bool>(f), false);
+    FMQ_COMPARE(static_cast<bool>(g), true);
+    FMQ_COMPARE(watch.use_count(), 1L);
+    FMQ_COMPARE(g(2), 3);
+
+    bool thrown = false;
+    try
+    {
+        f(1);
+    }
+    catch (std::bad_function_call&)
+    {
+        thrown = true;
+    }
+    FMQ_COMPARE(thrown, true);
+
+    // Assigning over one destroys what it held.
+    SmallFunction<int(int), 32> h = [](int x) { return x * 2; };
+    g = std::move(h);
+    FMQ_COMPARE(watch.expired(), true);
+    FMQ_COMPARE(g(2), 4);
+    FMQ_COMPARE(static_cast<bool>(h), false);
+
+    {
+        std::shared_ptr<int> token2 = std::make_shared<int>(2);
+        watch = token2;
+        SmallFunction<int(int), 32> i = [token2](int x) { return x + *token2; };
+        token2.reset();
+        FMQ_COMPARE(watch.expired(), false);
+    }
+
+    FMQ_COMPARE(watch.expired(), true);
+
+    token = std::make_shared<int>(3);
+    watch = token;
+    g = [token](int x) { return x + *token; };
+    token.reset();
+    g.reset();
+    FMQ_COMPARE(watch.expired(), true);
+    FMQ_COMPARE(static_cast<bool>(g), false);
+
+    return 0;
+}
+
+namespace
+{
+
+/**
+ * Gets the address of the frame of the coroutine that awaits it, without suspending.
+ */
+struct FrameAddressAwaiter
+{
+    void *address = nullptr;
+
+    bool await_ready() const noexcept { return false; }
+    bool await_suspend(std::coroutine_handle<> h) noexcept { address = h.address(); return false; }
+    void *await_resume() const noexcept { return address; }
+};
+
+struct CoroutineTestResult
+{
+    int resumed = 0;
+    std::vector<std::string> errors;
+    std::string exception;
+    void *frame = nullptr;
+};
+
+DbusTask when_all_test_coroutine(State *state, CoroutineTestResult &result, std::string second_path)
+{
+    result.frame = co_await FrameAddressAwaiter();
+
+    const std::string service("com.victronenergy.coroutine_test");
+    const std::string path("/Dc/0/Voltage");
+
+    try
+    {
+        std::array<DbusReply, 2> replies = co_await when_all(state, DbusCallSpec(service, path, "com.victronenergy.BusItem", "GetValue"),
+                                                             DbusCallSpec(service, second_path, "com.victronenergy.BusItem", "GetValue"));
+        result.resumed++;
+
+        for (const DbusReply &reply : replies)
+        {
+            result.errors.push_back(reply.is_error() ? reply.get_error_name() : "");
+        }
+    }
+    catch (std::exception &ex)
+    {
+        result.exception = ex.what();
+    }
+}
+
+}
+
+/**
+ * Coroutines against the method call sink, so we decide when, and how, calls are answered.
+ */
+int dbus_coroutine_tests(void *data)
+{
+    State *state = static_cast<State*>(data);
+
+    std::vector<DBusMessage*> calls;
+    const dbus_uint32_t sink_serial_org = state->method_call_sink_serial;
+    const std::chrono::milliseconds call_timeout_org = state->dbus_call_timeout;
+
+    // Far from the serials of the real connection, which share the async handlers.
+    state->method_call_sink_serial = 1000000;
+    state->method_call_sink = [&calls](DBusMessage *msg) { calls.push_back(dbus_message_ref(msg)); };
+
+    auto reply_to = [state](DBusMessage *call) {
+        DBusMessageGuard reply(dbus_message_new_method_return(call));
+        dbus_handle_reply(state, reply.d);
+        dbus_message_unref(call);
+    };
+
+    const size_t in_flight_before = state->async_handlers.get_in_flight_count();
+
+    // Resumed once, after the last reply, whatever the order.
+    {
+        CoroutineTestResult result;
+        when_all_test_coroutine(state, result, "/Dc/0/Current");
+        FMQ_COMPARE(calls.size(), static_cast<size_t>(2));
+        FMQ_COMPARE(result.resumed, 0);
+
+        reply_to(calls.at(1));
+        FMQ_COMPARE(result.resumed, 0);
+        reply_to(calls.at(0));
+        FMQ_COMPARE(result.resumed, 1);
+        FMQ_COMPARE(result.errors, std::vector<std::string>({"", ""}));
+        FMQ_COMPARE(state->async_handlers.get_in_flight_count(), in_flight_before);
+        calls.clear();
+
+        // The frame of a finished coroutine is reused by the next.
+        CoroutineTestResult result2;
+        when_all_test_coroutine(state, result2, "/Dc/0/Current");
+        FMQ_COMPARE(result2.frame == result.frame, true);
+
+        reply_to(calls.at(0));
+        reply_to(calls.at(1));
+        FMQ_COMPARE(result2.resumed, 1);
+        calls.clear();
+    }
+
+    // Replies that never come are given up on, and the coroutine still resumes, with NoReply.
+    {
+        state->dbus_call_timeout = std::chrono::milliseconds(0);
+        CoroutineTestResult result;
+        when_all_test_coroutine(state, result, "/Dc/0/Current");
+        state->dbus_call_timeout = call_timeout_org;
+
+        reply_to(calls.at(0));
+        FMQ_COMPARE(result.resumed, 0);
+
+        std::this_thread::sleep_for(std::chrono::milliseconds(2));
+        FMQ_COMPARE(state->async_handlers.expire_lost(std::chrono::milliseconds(0)), static_cast<size_t>(1));
+        FMQ_COMPARE(result.resumed, 1);
+        FMQ_COMPARE(result.errors, std::vector<std::string>({"", DBUS_ERROR_NO_REPLY}));
+        dbus_message_unref(calls.at(1));
+        calls.clear();
     }
 
+    // When making one of the calls throws, the ones that did go out are cancelled, so their replies don't resume us a second time.
+    {
+        CoroutineTestResult result;
+        when_all_test_coroutine(state, result, "not a valid path");
+        FMQ_COMPARE(calls.size(), static_cast<size_t>(1));
+        FMQ_COMPARE(result.exception.empty(), false);
+        FMQ_COMPARE(result.resumed, 0);
+        FMQ_COMPARE(state->async_handlers.get_in_flight_count(), in_flight_before);
+
+        reply_to(calls.at(0));
+        FMQ_COMPARE(result.resumed, 0);
+        calls.clear();
+    }
+
+    state->method_call_sink = nullptr;
+    state->method_call_sink_serial = sink_serial_org;
+
+    return 0;
+}
+
+int plugin_stats_tests(void *data)
+{
+    PluginStats previous;
+    PluginStats now;
+    now.items_changed_signals = 20;
+    now.item_publishes = 3;
+    now.dispatch_yields = 4;
+
+    const nlohmann::json j = now.counters_to_json(previous, std::chrono::seconds(2));
+    FMQ_COMPARE(j["signals"]["ItemsChanged"].get<uint64_t>(), 20u);
+    FMQ_COMPARE(j["signals_per_second"]["ItemsChanged"].get<double>(), 10.0);
+    FMQ_COMPARE(j["publishes_per_second"].get<double>(), 1.5);
+    FMQ_COMPARE(j["dispatch_yields_per_second"].get<double>(), 2.0);
+
+    LatencyHistogram histogram;
+    FMQ_COMPARE(histogram.get_percentile(50.0), 0u);
+
+    for (int i = 1; i <= 1000; i++)
+    {
+        histogram.record(std::chrono::microseconds(i));
+    }
+
+    histogram.record(std::chrono::microseconds(100000));
+
+    FMQ_COMPARE(histogram.get_count(), 1001u);
+    FMQ_COMPARE(histogram.get_max(), 100000u);
+
+    // Within the precision of the buckets.
+    const uint64_t p50 = histogram.get_percentile(50.0);
+    FMQ_COMPARE(p50 >= 500 && p50 <= 532, true);
+    const uint64_t p99 = histogram.get_percentile(99.0);
+    FMQ_COMPARE(p99 >= 990 && p99 <= 1023, true);
+    FMQ_COMPARE(histogram.get_percentile(100.0), 100000u);
+
+    histogram.reset();
+    FMQ_COMPARE(histogram.get_count(), 0u);
+
+    State *state = static_cast<State*>(data);
+    const nlohmann::json state_stats = state->get_stats_json();
+    FMQ_COMPARE(state_stats["services"].get<size_t>(), state->dbus_service_items.size());
+    FMQ_COMPARE(state_stats["keepalive_tokens"].get<int>(), state->keepAliveTokens);
+    FMQ_COMPARE(state_stats["latency_microseconds"].contains("signal_to_publish"), true);
+
+    return 0;
+}
+
+namespace
+{
+
+std::unique_ptr<Item> make_test_item(const std::string &service, int instance, const std::string &path, const std::string &json)
+{
+    ValueMinMax v;
+    v.value = VeVariant(nlohmann::json::parse(json));
+    auto item = std::make_unique<Item>(Item::from_path_and_value(path, std::move(v)));
+    item->set_mapping_details("c0619ab4a585", service, ServiceIdentifier(instance));
+    return item;
+}
+
+}
+
+int topic_index_tests()
+{
+    TopicIndex index;
+    const std::string suffix("solarcharger/258/Dc/0/Voltage");
+
+    std::unique_ptr<Item> voltage = make_test_item("com.victronenergy.solarcharger.ttyO1", 258, "/Dc/0/Voltage", "13.5");
+    std::unique_ptr<Item> current = make_test_item("com.victronenergy.solarcharger.ttyO1", 258, "/Dc/0/Current", "2.5");
+
+    index.add(*voltage);
+    index.add(*current);
+    FMQ_COMPARE(index.size(), static_cast<size_t>(2));
+    FMQ_COMPARE(index.find(suffix) == voltage.get(), true);
+    FMQ_COMPARE(index.find("solarcharger/258/Dc/0/Current") == current.get(), true);
+    FMQ_COMPARE(index.find("solarcharger/258/Dc/0") == nullptr, true);
+
+    index.remove(*current);
+    FMQ_COMPARE(index.size(), static_cast<size_t>(1));
+    FMQ_COMPARE(index.find("solarcharger/258/Dc/0/Current") == nullptr, true);
+
+    // A device that re-enumerated on another tty, while the old name is still there.
+    std::unique_ptr<Item> voltage_other_tty = make_test_item("com.victronenergy.solarcharger.ttyO2", 258, "/Dc/0/Voltage", "13.6");
+    index.add(*voltage_other_tty);
+    FMQ_COMPARE(index.size(), static_cast<size_t>(1));
+    FMQ_COMPARE(index.find(suffix) == voltage_other_tty.get(), true);
+
+    // The old one goes away, like remove_dbus_service() does: out of the index, and then freed. The key must not point into it.
+    index.remove(*voltage);
+    voltage.reset();
+    FMQ_COMPARE(index.size(), static_cast<size_t>(1));
+    const std::string lookup(suffix);
+    FMQ_COMPARE(index.find(lookup) == voltage_other_tty.get(), true);
+    FMQ_COMPARE(index.find(lookup)->get_service_name(), std::string("com.victronenergy.solarcharger.ttyO2"));
+
+    index.remove(*voltage_other_tty);
+    FMQ_COMPARE(index.size(), static_cast<size_t>(0));
+    FMQ_COMPARE(index.find(lookup) == nullptr, true);
+
+    return 0;
+}
+
+int item_path_trie_tests()
+{
+    ItemPathTrie trie;
+    const std::string service("com.victronenergy.solarcharger.ttyO1");
+
+    std::unique_ptr<Item> voltage = make_test_item(service, 279, "/Dc/0/Voltage", "13.5");
+    std::unique_ptr<Item> current = make_test_item(service, 279, "/Dc/0/Current", "2.5");
+    std::unique_ptr<Item> yield = make_test_item(service, 279, "/Yield/Power", "100");
+    std::unique_ptr<Item> dc = make_test_item(service, 279, "/Dc", "1");
+
+    std::vector<std::string> paths;
+    auto collect = [&paths](Item &item) { paths.push_back(item.get_path()); };
+
+    FMQ_COMPARE(trie.for_each_below("/", collect), static_cast<size_t>(0));
+
+    trie.add(*voltage);
+    trie.add(*current);
+    trie.add(*yield);
+
+    FMQ_COMPARE(trie.for_each_below("/Dc/0", collect), static_cast<size_t>(2));
+    FMQ_COMPARE(paths, std::vector<std::string>({"/Dc/0/Current", "/Dc/0/Voltage"}));
+
+    paths.clear();
+    FMQ_COMPARE(trie.for_each_below("/", collect), static_cast<size_t>(3));
+    FMQ_COMPARE(trie.for_each_below("", collect), static_cast<size_t>(3));
+    FMQ_COMPARE(trie.for_each_below("/Dc/0/Voltage", collect), static_cast<size_t>(1));
+    FMQ_COMPARE(trie.for_each_below("Dc//0/", collect), static_cast<size_t>(2));
+    FMQ_COMPARE(trie.for_each_below("/Dc/1", collect), static_cast<size_t>(0));
+    FMQ_COMPARE(trie.for_each_below("/Dc/0/Voltage/Extra", collect), static_cast<size_t>(0));
+    FMQ_COMPARE(trie.for_each_below("/Dc/0/Volt", collect), static_cast<size_t>(0));
+
+    // An item on an inner node reports itself too, before the items below it.
+    trie.add(*dc);
+    paths.clear();
+    FMQ_COMPARE(trie.for_each_below("/Dc", collect), static_cast<size_t>(3));
+    FMQ_COMPARE(paths.at(0), std::string("/Dc"));
+
+    // Adding an item with the same path replaces the one that was there.
+    std::unique_ptr<Item> new_voltage = make_test_item(service, 279, "/Dc/0/Voltage", "12.0");
+    trie.add(*new_voltage);
+    std::vector<const Item*> found;
+    FMQ_COMPARE(trie.for_each_below("/Dc/0/Voltage", [&found](Item &item) { found.push_back(&item); }), static_cast<size_t>(1));
+    FMQ_COMPARE(found.at(0) == new_voltage.get(), true);
+    FMQ_COMPARE(trie.for_each_below("/", collect), static_cast<size_t>(4));
+
+    return 0;
+}
+
+int vevariant_tests()
+{
+    // Fourteen characters still fit inline, fifteen go on the heap.
+    for (const std::string &str : {std::string("fourteen chars"), std::string("fifteen chars.."), std::string()})
+    {
+        const VeVariant org(str);
+        FMQ_COMPARE(org.get_type() == VeVariantType::String, true);
+        FMQ_COMPARE(org.get_string_view(), std::string_view(str));
+
+        VeVariant copy(org);
+        FMQ_COMPARE(copy == org, true);
+        FMQ_COMPARE(copy.hash(), org.hash());
+        FMQ_COMPARE(copy.hash(), std::hash<std::string_view>()(str));
+
+        // Not sharing the string.
+        FMQ_COMPARE(copy.get_string_view().data() != org.get_string_view().data() || str.empty(), true);
+
+        VeVariant moved(std::move(copy));
+        FMQ_COMPARE(moved == org, true);
+        FMQ_COMPARE(moved.get_string_view(), std::string_view(str));
+
+        // Assigning over every kind of string, and over a number.
+        for (const VeVariant &other : {VeVariant("short"), VeVariant("a string of more than fifteen chars"), VeVariant(nlohmann::json(3))})
+        {
+            VeVariant assigned(other);
+            assigned = org;
+            FMQ_COMPARE(assigned == org, true);
+            FMQ_COMPARE(assigned.hash(), org.hash());
+
+            VeVariant move_assigned(other);
+            VeVariant tmp(org);
+            move_assigned = std::move(tmp);
+            FMQ_COMPARE(move_assigned == org, true);
+            FMQ_COMPARE(move_assigned.get_string_view(), std::string_view(str));
+        }
+
+        // Same prefix, one char longer or different at the end.
+        FMQ_COMPARE(VeVariant(str + "x") == org, false);
+
+        if (!str.empty())
+        {
+            std::string changed(str);
+            changed.back() = '!';
+            FMQ_COMPARE(VeVariant(changed) == org, false);
+        }
+    }
+
+    FMQ_COMPARE(VeVariant("13") == VeVariant(nlohmann::json(13)), false);
+
+    {
+        const VeVariant arr(nlohmann::json::parse(R"(["fourteen chars", "fifteen chars..", "x"])"));
+        FMQ_COMPARE(arr.get_type() == VeVariantType::Array, true);
+
+        VeVariant copy(arr);
+        FMQ_COMPARE(copy == arr, true);
+        FMQ_COMPARE(copy.hash(), arr.hash());
+        FMQ_COMPARE(copy.get_contained_type_as_string(), std::string("s"));
+
+        VeVariant moved(std::move(copy));
+        FMQ_COMPARE(moved == arr, true);
+        FMQ_COMPARE(moved.as_json_value(), nlohmann::json::parse(R"(["fourteen chars", "fifteen chars..", "x"])"));
+
+        FMQ_COMPARE(VeVariant(nlohmann::json::parse(R"(["fourteen chars", "fifteen chars..", "y"])")) == arr, false);
+        FMQ_COMPARE(VeVariant(nlohmann::json::parse(R"(["fourteen chars", "fifteen chars.."])")) == arr, false);
+
+        const VeVariant ints(nlohmann::json::parse("[1, 2, 3]"));
+        VeVariant ints_assigned(arr);
+        ints_assigned = ints;
+        FMQ_COMPARE(ints_assigned == ints, true);
+        FMQ_COMPARE(ints_assigned.hash(), ints.hash());
+    }
+
+    {
+        // Dicts only come from dbus.
+        DBusMessageGuard msg = dbus_message_new_signal("/", "com.victronenergy.BusItem", "ItemsChanged");
+
+        {
+            DBusMessageIter iter;
+            dbus_message_iter_init_append(msg.d, &iter);
+            DBusMessageIterOpenContainerGuard array_iter(&iter, DBUS_TYPE_ARRAY, "{sv}");
+
+            const std::vector<std::pair<std::string, VeVariant>> entries {
+                {"fourteen chars", VeVariant("fifteen chars..")}, {"fifteen chars..", VeVariant(nlohmann::json(3))}
+            };
+
+            for (const auto &e : entries)
+            {
+                DBusMessageIterOpenContainerGuard dict_iter(array_iter.get_array_iter(), DBUS_TYPE_DICT_ENTRY, nullptr);
+                const char *key = e.first.c_str();
+                dbus_message_iter_append_basic(dict_iter.get_array_iter(), DBUS_TYPE_STRING, &key);
+                DBusMessageIterOpenContainerGuard variant_iter(dict_iter.get_array_iter(), DBUS_TYPE_VARIANT, e.second.get_dbus_type_as_string_recursive().c_str());
+                e.second.append_args_to_dbus_message(variant_iter.get_array_iter());
+            }
+        }
+
+        DBusMessageIter iter;
+        dbus_message_iter_init(msg.d, &iter);
+        const VeVariant dict(&iter);
+        FMQ_COMPARE(dict.get_type() == VeVariantType::Dict, true);
+
+        VeVariant copy(dict);
+        FMQ_COMPARE(copy == dict, true);
+        FMQ_COMPARE(copy.get_dict_val(VeVariant("fourteen chars")) == VeVariant("fifteen chars.."), true);
+
+        VeVariant moved(std::move(copy));
+        FMQ_COMPARE(moved == dict, true);
+        FMQ_COMPARE(moved.get_dict_val(VeVariant("fifteen chars..")).as_int<int>(), 3);
+
+        VeVariant changed(dict);
+        changed[VeVariant("fifteen chars..")] = VeVariant(nlohmann::json(4));
+        FMQ_COMPARE(changed == dict, false);
+
+        VeVariant added(dict);
+        added[VeVariant("x")] = VeVariant(nlohmann::json(3));
+        FMQ_COMPARE(added == dict, false);
+
+        // Dicts can't be keys themselves, so they have no hash.
+        bool hash_threw = false;
+        try
+        {
+            dict.hash();
+        }
+        catch (ValueError &ex)
+        {
+            hash_threw = true;
+        }
+        FMQ_COMPARE(hash_threw, true);
+    }
+
+    return 0;
+}
+
+int item_set_value_tests()
+{
+    std::unique_ptr<Item> item = make_test_item("com.victronenergy.solarcharger.ttyO1", 258, "/Dc/0/Current", "14.5");
+
+    auto vmm = [](std::optional<std::string> value, std::optional<std::string> min = {}, std::optional<std::string> max = {}) {
+        ValueMinMax result;
+        if (value)
+            result.value = VeVariant(nlohmann::json::parse(value.value()));
+        if (min)
+            result.min = VeVariant(nlohmann::json::parse(min.value()));
+        if (max)
+            result.max = VeVariant(nlohmann::json::parse(max.value()));
+        return result;
+    };
+
+    FMQ_COMPARE(item->as_json(), std::string(R"({"value":14.5})"));
+
+    FMQ_COMPARE(item->set_value(vmm("14.5")), false);
+    FMQ_COMPARE(item->set_value(ValueMinMax()), false);
+
+    FMQ_COMPARE(item->set_value(vmm("15.5")), true);
+    FMQ_COMPARE(item->as_json(), std::string(R"({"value":15.5})"));
+
+    // A signal with only a max doesn't clear the value, but is a change.
+    FMQ_COMPARE(item->set_value(vmm({}, {}, "100")), true);
+    FMQ_COMPARE(item->as_json(), std::string(R"({"max":100,"value":15.5})"));
+    FMQ_COMPARE(item->set_value(vmm({}, {}, "100")), false);
+
+    FMQ_COMPARE(item->set_value(vmm({}, "0")), true);
+    FMQ_COMPARE(item->as_json(), std::string(R"({"max":100,"min":0,"value":15.5})"));
+
+    // Leaving out what's there already is not a change, and neither is repeating it.
+    FMQ_COMPARE(item->set_value(vmm("15.5")), false);
+    FMQ_COMPARE(item->set_value(vmm("15.5", "0", "100")), false);
+    FMQ_COMPARE(item->set_value(vmm(std::nullopt, "0", "100")), false);
+
+    // Any one of them changing is.
+    FMQ_COMPARE(item->set_value(vmm("15.5", "0", "150")), true);
+    FMQ_COMPARE(item->set_value(vmm("15.5", "-10", "150")), true);
+    FMQ_COMPARE(item->as_json(), std::string(R"({"max":150,"min":-10,"value":15.5})"));
+
+    // The same number as another type is a change, because it's rendered differently.
+    FMQ_COMPARE(item->set_value(vmm("16")), true);
+    FMQ_COMPARE(item->set_value(vmm("16.0")), true);
+    FMQ_COMPARE(item->as_json(), std::string(R"({"max":150,"min":-10,"value":16.0})"));
+
+    FMQ_COMPARE(item->set_value(vmm(R"("fourteen chars")")), true);
+    FMQ_COMPARE(item->set_value(vmm(R"("fourteen chars")")), false);
+    FMQ_COMPARE(item->set_value(vmm(R"("fifteen chars..")")), true);
+    FMQ_COMPARE(item->set_value(vmm(R"("fifteen chars..")")), false);
+
+    // All empty arrays are null on MQTT, so going from one to the other isn't a change.
+    FMQ_COMPARE(item->set_value(vmm("null")), true);
+    FMQ_COMPARE(item->set_value(vmm("[]")), false);
+    FMQ_COMPARE(item->as_json(), std::string(R"({"max":150,"min":-10,"value":null})"));
+
+    return 0;
+}
+
+namespace
+{
+
+ValueMinMax make_test_value(const std::string &json)
+{
+    ValueMinMax v;
+    v.value = VeVariant(nlohmann::json::parse(json));
+    return v;
+}
+
+/**
+ * Like the items from GetItems, for State::add_dbus_to_mqtt_mapping().
+ */
+std::unordered_map<std::string, Item> make_test_items(const std::vector<std::pair<std::string, std::string>> &paths_and_json)
+{
+    std::unordered_map<std::string, Item> items;
+
+    for (const auto &p : paths_and_json)
+    {
+        items.emplace(p.first, Item::from_path_and_value(p.first, make_test_value(p.second)));
+    }
+
+    return items;
+}
+
+}
+
+int publish_rate_limiter_tests()
+{
+    {
+        const PublishRateLimiter limiter(" solarcharger/+/Dc/0/Current = 500 , +/+/Ac/#=1000,,solarcharger/+/Ac/Power=10");
+        FMQ_COMPARE(limiter.empty(), false);
+        FMQ_COMPARE(limiter.get_interval("solarcharger/258/Dc/0/Current").count(), 500);
+        FMQ_COMPARE(limiter.get_interval("solarcharger/258/Dc/0/Voltage").count(), 0);
+        FMQ_COMPARE(limiter.get_interval("solarcharger/258/Dc/0/Current/Extra").count(), 0);
+        FMQ_COMPARE(limiter.get_interval("vebus/276/Ac/Out/L1/P").count(), 1000);
+
+        // The first match wins.
+        FMQ_COMPARE(limiter.get_interval("solarcharger/258/Ac/Power").count(), 1000);
+    }
+
+    FMQ_COMPARE(PublishRateLimiter("").empty(), true);
+    FMQ_COMPARE(PublishRateLimiter(" , ").empty(), true);
+    FMQ_COMPARE(PublishRateLimiter().get_interval("solarcharger/258/Dc/0/Current").count(), 0);
+
+    for (const std::string spec : {"solarcharger/+/Dc", "solarcharger/+/Dc=", "solarcharger/+/Dc=0", "solarcharger/+/Dc=3600001",
+                                   "solarcharger/+/Dc=fast", "solarcharger/#/Dc=100", "solarcharger/2+/Dc=100", "solarcharger//Dc=100",
+                                   "a=b=100", "solarcharger/+/Dc=100,oops"})
+    {
+        bool threw = false;
+        try
+        {
+            PublishRateLimiter limiter(spec);
+        }
+        catch (ValueError &ex)
+        {
+            threw = true;
+        }
+        FMQ_COMPARE(threw, true);
+    }
+
+    return 0;
+}
+
+/**
+ * A rate limited item is published when it changes, and changes within the interval after that are published once, when the interval
+ * expires, with the latest value.
+ */
+int publish_rate_limit_state_tests(void *data)
+{
+    State *state = static_cast<State*>(data);
+    TesterGlobals *globals = TesterGlobals::getInstance();
+
+    const bool alive_org = state->alive;
+    state->alive = true;
+    state->publish_rate_limiter = PublishRateLimiter("solarcharger/+/Dc/0/Current=100");
+
+    const std::string service("com.victronenergy.solarcharger.rate_limit_test");
+    const std::string topic_prefix = "N/" + state->unique_vrm_id + "/solarcharger/901";
+
+    std::unordered_map<std::string, Item> items = make_test_items({{"/DeviceInstance", "901"}, {"/Dc/0/Current", "1.5"}, {"/Dc/0/Voltage", "12.5"}});
+
+    globals->record_publishes = true;
+    globals->recorded_publishes.clear();
+
+    state->add_dbus_to_mqtt_mapping(service, items, false);
+    FMQ_COMPARE(globals->recorded_publishes.size(), static_cast<size_t>(3));
+
+    // Like ItemsChanged does.
+    auto apply_change = [state, &service](const std::string &path, const std::string &json) {
+        std::unordered_map<std::string, Item> changed_items = make_test_items({{path, json}});
+        state->add_dbus_to_mqtt_mapping(service, changed_items, true);
+    };
+
+    globals->recorded_publishes.clear();
+    apply_change("/Dc/0/Current", "2.5");
+    apply_change("/Dc/0/Voltage", "12.6");
+    apply_change("/Dc/0/Current", "3.5");
+
+    // Only the one that's not limited.
+    FMQ_COMPARE(globals->recorded_publishes.size(), static_cast<size_t>(1));
+    FMQ_COMPARE(globals->recorded_publishes.at(0).first, topic_prefix + "/Dc/0/Voltage");
+    FMQ_COMPARE(state->pending_publishes.size(), static_cast<size_t>(1));
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(150));
+    globals->recorded_publishes.clear();
+    globals->run_due_tasks();
+
+    FMQ_COMPARE(globals->recorded_publishes.size(), static_cast<size_t>(1));
+    FMQ_COMPARE(globals->recorded_publishes.at(0).first, topic_prefix + "/Dc/0/Current");
+    FMQ_COMPARE(globals->recorded_publishes.at(0).second, std::string(R"({"value":3.5})"));
+    FMQ_COMPARE(state->pending_publishes.empty(), true);
+
+    // Unchanged values don't make it pending again.
+    globals->recorded_publishes.clear();
+    apply_change("/Dc/0/Current", "3.5");
+    FMQ_COMPARE(state->pending_publishes.empty(), true);
+    std::this_thread::sleep_for(std::chrono::milliseconds(150));
+    globals->run_due_tasks();
+    FMQ_COMPARE(globals->recorded_publishes.empty(), true);
+
+    // After the interval, a change is published right away.
+    apply_change("/Dc/0/Current", "4.5");
+    FMQ_COMPARE(globals->recorded_publishes.size(), static_cast<size_t>(1));
+    FMQ_COMPARE(globals->recorded_publishes.at(0).second, std::string(R"({"value":4.5})"));
+
+    // Only what actually goes out counts for the rate limit, so a blocked entry doesn't delay anything.
+    {
+        std::unique_ptr<Item> tunnel = make_test_item("com.victronenergy.vebus.ttyO1", 276, "/Interfaces/Mk2/Tunnel", "1");
+        tunnel->set_min_publish_interval(std::chrono::milliseconds(100));
+        FMQ_COMPARE(tunnel->publish(), static_cast<size_t>(0));
+        FMQ_COMPARE(tunnel->get_publish_delay(std::chrono::steady_clock::now()).count(), 0);
+
+        std::unique_ptr<Item> current = make_test_item("com.victronenergy.solarcharger.ttyO1", 258, "/Dc/0/Current", "1.5");
+        current->set_min_publish_interval(std::chrono::milliseconds(100));
+        FMQ_COMPARE(current->publish() > 0, true);
+        FMQ_COMPARE(current->get_publish_delay(std::chrono::steady_clock::now()).count() > 0, true);
+    }
+
+    state->remove_dbus_service(service);
+    globals->record_publishes = false;
+    globals->recorded_publishes.clear();
+    state->publish_rate_limiter = PublishRateLimiter();
+    state->alive = alive_org;
+
+    return 0;
+}
+
+namespace
+{
+
+/**
+ * The echos of the full_publish_completed messages among the recorded publishes, with "-" for the ones without.
+ */
+std::vector<std::string> get_recorded_full_publish_echos()
+{
+    std::vector<std::string> result;
+
+    for (const auto &p : TesterGlobals::getInstance()->recorded_publishes)
+    {
+        if (!p.first.ends_with("/full_publish_completed"))
+            continue;
+
+        const nlohmann::json j = nlohmann::json::parse(p.second);
+        result.push_back(j.contains("full-publish-completed-echo") ? j["full-publish-completed-echo"].get<std::string>() : "-");
+    }
+
+    return result;
+}
+
+std::string make_keepalive_payload(const std::string &echo)
+{
+    nlohmann::json j;
+    j["keepalive-options"] = nlohmann::json::array({{{"full-publish-completed-echo", echo}}});
+    return j.dump();
+}
+
+}
+
+/**
+ * Keepalives within the coalesce window, or during a full publish, share one full publish, and each one still gets its echo, once.
+ */
+int keepalive_coalescing_tests(void *data)
+{
+    State *state = static_cast<State*>(data);
+    TesterGlobals *globals = TesterGlobals::getInstance();
+
+    const bool alive_org = state->alive;
+    const int tokens_org = state->keepAliveTokens;
+    const size_t slice_items_org = state->full_publish_slice_items;
+    const std::chrono::milliseconds window_org = state->keepalive_coalesce_window;
+
+    state->keepAliveTokens = 10;
+    state->full_publish_slice_items = 2;
+    state->keepalive_coalesce_window = std::chrono::milliseconds(20);
+
+    const std::string service("com.victronenergy.solarcharger.keepalive_test");
+    const std::string topic_prefix = "N/" + state->unique_vrm_id + "/solarcharger/902/";
+
+    std::unordered_map<std::string, Item> items = make_test_items({{"/DeviceInstance", "902"}, {"/Dc/0/Current", "1.5"}, {"/Dc/0/Voltage", "12.5"}});
+    state->add_dbus_to_mqtt_mapping(service, items, false);
+
+    auto count_item_publishes = [&globals, &topic_prefix]() {
+        return std::count_if(globals->recorded_publishes.begin(), globals->recorded_publishes.end(), [&topic_prefix](const auto &p) {
+            return p.first.starts_with(topic_prefix);
+        });
+    };
+
+    globals->record_publishes = true;
+    globals->recorded_publishes.clear();
+
+
+    // A burst of keepalives costs one token, and nothing is published until the window expires.
+    state->handle_keepalive(make_keepalive_payload("a"));
+    state->handle_keepalive(make_keepalive_payload("b"));
+    state->handle_keepalive("");
+    state->handle_keepalive(make_keepalive_payload("c"));
+    state->handle_keepalive(R"({"keepalive-options": ["suppress-republish"]})");
+
+    FMQ_COMPARE(state->keepAliveTokens, 9);
+    FMQ_COMPARE(get_recorded_full_publish_echos().empty(), true);
+    FMQ_COMPARE(count_item_publishes(), 0);
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(30));
+    globals->run_due_tasks();
+
+    FMQ_COMPARE(get_recorded_full_publish_echos(), std::vector<std::string>({"a", "b", "-", "c"}));
+    FMQ_COMPARE(count_item_publishes(), 3);
+    FMQ_COMPARE(state->full_publish_job.has_value(), false);
+
+    // Keepalives during a full publish queue one next one, which they all share.
+    globals->recorded_publishes.clear();
+    state->handle_keepalive(make_keepalive_payload("d"));
+    state->start_queued_full_publish();
+    FMQ_COMPARE(state->full_publish_job.has_value(), true);
+
+    state->handle_keepalive(make_keepalive_payload("e"));
+    state->handle_keepalive(make_keepalive_payload("f"));
+    FMQ_COMPARE(state->keepAliveTokens, 7);
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(30));
+    globals->run_due_tasks();
+
+    FMQ_COMPARE(get_recorded_full_publish_echos(), std::vector<std::string>({"d", "e", "f"}));
+    FMQ_COMPARE(count_item_publishes(), 6);
+    FMQ_COMPARE(state->full_publish_job.has_value(), false);
+    FMQ_COMPARE(state->full_publish_queued, false);
+
+    state->remove_dbus_service(service);
+    globals->record_publishes = false;
+    globals->recorded_publishes.clear();
+    state->keepalive_coalesce_window = window_org;
+    state->full_publish_slice_items = slice_items_org;
+    state->keepAliveTokens = tokens_org;
+    state->alive = alive_org;
+
+    return 0;
+}
+
+int subscription_tracker_tests()
+{
+    SubscriptionTracker tracker;
+    std::unique_ptr<Item> voltage = make_test_item("com.victronenergy.solarcharger.ttyO1", 258, "/Dc/0/Voltage", "13.5");
+    std::unique_ptr<Item> current = make_test_item("com.victronenergy.solarcharger.ttyO1", 258, "/Dc/0/Current", "2.5");
+    std::unique_ptr<Item> brightness = make_test_item("com.victronenergy.settings", 0, "/Settings/Gui/Brightness", "5");
+    const std::string voltage_filter("N/+/solarcharger/+/Dc/0/Voltage");
+
+    // The match is cached in the item, for the generation of the filters. That starts at 1.
+    bool matched = true;
+    FMQ_COMPARE(tracker.has_subscriber(*voltage), false);
+    FMQ_COMPARE(voltage->get_subscriber_match(1, matched), true);
+    FMQ_COMPARE(matched, false);
+
+    // Filters that can't match notifications are not tracked, and don't invalidate anything.
+    tracker.subscribe("client1", "R/#");
+    tracker.subscribe("client1", "W/+/solarcharger/#");
+    FMQ_COMPARE(tracker.filter_count(), static_cast<size_t>(0));
+    FMQ_COMPARE(voltage->get_subscriber_match(1, matched), true);
+
+    tracker.subscribe("client1", voltage_filter);
+    FMQ_COMPARE(voltage->get_subscriber_match(1, matched), true);
+    FMQ_COMPARE(voltage->get_subscriber_match(2, matched), false);
+    FMQ_COMPARE(tracker.has_subscriber(*voltage), true);
+    FMQ_COMPARE(tracker.has_subscriber(*current), false);
+    FMQ_COMPARE(tracker.has_subscriber(*brightness), false);
+
+    // The same filter, by another client, and through a shared subscription, is counted, and doesn't invalidate the matches.
+    tracker.subscribe("client2", "$share/group/" + voltage_filter);
+    tracker.subscribe("client2", voltage_filter);
+    FMQ_COMPARE(tracker.filter_count(), static_cast<size_t>(1));
+    FMQ_COMPARE(voltage->get_subscriber_match(2, matched), true);
+    FMQ_COMPARE(matched, true);
+
+    tracker.subscribe("client2", "N/+/settings/#");
+    FMQ_COMPARE(tracker.filter_count(), static_cast<size_t>(2));
+    FMQ_COMPARE(voltage->get_subscriber_match(2, matched), true);
+    FMQ_COMPARE(voltage->get_subscriber_match(3, matched), false);
+    FMQ_COMPARE(tracker.has_subscriber(*brightness), true);
+    FMQ_COMPARE(tracker.has_subscriber(*voltage), true);
+
+    // Until the last one unsubscribes.
+    tracker.unsubscribe("client1", voltage_filter);
+    FMQ_COMPARE(tracker.has_subscriber(*voltage), true);
+    FMQ_COMPARE(voltage->get_subscriber_match(3, matched), true);
+    tracker.unsubscribe("client2", voltage_filter);
+    FMQ_COMPARE(tracker.filter_count(), static_cast<size_t>(1));
+    FMQ_COMPARE(tracker.has_subscriber(*voltage), false);
+    FMQ_COMPARE(tracker.has_subscriber(*brightness), true);
+
+    // Unsubscribing what's not subscribed changes nothing.
+    tracker.unsubscribe("client1", "N/+/settings/#");
+    tracker.unsubscribe("client3", "N/+/settings/#");
+    FMQ_COMPARE(voltage->get_subscriber_match(4, matched), true);
+    FMQ_COMPARE(tracker.has_subscriber(*brightness), true);
+
+    tracker.subscribe("client3", "#");
+    FMQ_COMPARE(tracker.has_subscriber(*current), true);
+    FMQ_COMPARE(tracker.has_subscriber(*voltage), true);
+
+    // The filters of disconnected clients stay for a while, for persistent sessions.
+    tracker.client_disconnected("client3");
+    tracker.purge_disconnected_clients(std::chrono::seconds(60));
+    FMQ_COMPARE(tracker.has_subscriber(*current), true);
+
+    tracker.client_connected("client3");
+    tracker.purge_disconnected_clients(std::chrono::seconds(0));
+    FMQ_COMPARE(tracker.has_subscriber(*current), true);
+
+    tracker.client_disconnected("client3");
+    tracker.purge_disconnected_clients(std::chrono::seconds(0));
+    FMQ_COMPARE(tracker.has_subscriber(*current), false);
+    FMQ_COMPARE(tracker.has_subscriber(*brightness), true);
+    FMQ_COMPARE(tracker.filter_count(), static_cast<size_t>(1));
+
+    tracker.unsubscribe("client2", "N/+/settings/#");
+    FMQ_COMPARE(tracker.filter_count(), static_cast<size_t>(0));
+    FMQ_COMPARE(tracker.has_subscriber(*brightness), false);
+
+    // A client we know no filters of may have a session restored from before a restart, so it gets everything until it subscribes.
+    tracker.client_connected("client4");
+    FMQ_COMPARE(tracker.has_subscriber(*brightness), true);
+    tracker.subscribe("client4", voltage_filter);
+    FMQ_COMPARE(tracker.has_subscriber(*brightness), false);
+    FMQ_COMPARE(tracker.has_subscriber(*voltage), true);
+
+    // Subscribing to something that can't match notifications also tells us what it wants.
+    tracker.client_connected("client5");
+    FMQ_COMPARE(tracker.has_subscriber(*brightness), true);
+    tracker.subscribe("client5", "W/+/settings/#");
+    FMQ_COMPARE(tracker.has_subscriber(*brightness), false);
+
+    tracker.client_connected("client6");
+    FMQ_COMPARE(tracker.has_subscriber(*current), true);
+    tracker.client_disconnected("client6");
+    FMQ_COMPARE(tracker.has_subscriber(*current), false);
+
+    return 0;
+}
+
+/**
+ * With subscription aware publishing, changes are only published when someone is subscribed, or VRM shows interest.
+ */
+int subscription_aware_publishing_state_tests(void *data)
+{
+    State *state = static_cast<State*>(data);
+    TesterGlobals *globals = TesterGlobals::getInstance();
+
+    const bool alive_org = state->alive;
+    const bool subscription_aware_publishing_org = state->subscription_aware_publishing;
+    const auto vrm_interest_org = state->vrmBridgeInterestTime;
+
+    // Without the logins of other tests, which count as clients that want everything.
+    SubscriptionTracker tracker_org = std::move(state->subscription_tracker);
+    state->subscription_tracker = SubscriptionTracker();
+
+    state->alive = true;
+    state->subscription_aware_publishing = true;
+    state->vrmBridgeInterestTime = std::chrono::steady_clock::now() - std::chrono::seconds(VRM_INTEREST_TIMEOUT_SECONDS + 10);
+    state->update_vrm_bridge_interest();
+
+    const std::string service("com.victronenergy.solarcharger.subscription_test");
+    const std::string clientid("subscription_test_client");
+    const std::string voltage_topic = "N/" + state->unique_vrm_id + "/solarcharger/903/Dc/0/Voltage";
+
+    auto apply_change = [state, &service](const std::string &path, const std::string &json) {
+        std::unordered_map<std::string, Item> changed_items = make_test_items({{path, json}});
+        state->add_dbus_to_mqtt_mapping(service, changed_items, true);
+    };
+
+    globals->record_publishes = true;
+    globals->recorded_publishes.clear();
+
+    std::unordered_map<std::string, Item> items = make_test_items({{"/DeviceInstance", "903"}, {"/Dc/0/Current", "1.5"}, {"/Dc/0/Voltage", "12.5"}});
+    state->add_dbus_to_mqtt_mapping(service, items, false);
+    FMQ_COMPARE(globals->recorded_publishes.empty(), true);
+
+    state->subscription_tracker.subscribe(clientid, "N/+/solarcharger/+/Dc/0/Voltage");
+
+    apply_change("/Dc/0/Current", "2.5");
+    apply_change("/Dc/0/Voltage", "12.6");
+    FMQ_COMPARE(globals->recorded_publishes.size(), static_cast<size_t>(1));
+    FMQ_COMPARE(globals->recorded_publishes.at(0).first, voltage_topic);
+
+    state->subscription_tracker.unsubscribe(clientid, "N/+/solarcharger/+/Dc/0/Voltage");
+    globals->recorded_publishes.clear();
+    apply_change("/Dc/0/Voltage", "12.7");
+    FMQ_COMPARE(globals->recorded_publishes.empty(), true);
+
+    // A session restored from before a restart doesn't subscribe again, so a client we know no filters of gets everything, until it subscribes.
+    {
+        const std::string restored_clientid("subscription_test_restored_client");
+        state->client_logged_in("subscription_test_user", restored_clientid, std::weak_ptr<Client>(), false, false);
+        apply_change("/Dc/0/Voltage", "12.8");
+        FMQ_COMPARE(globals->recorded_publishes.size(), static_cast<size_t>(1));
+
+        std::string filter("N/+/settings/#");
+        uint8_t qos = 0;
+        flashmq_plugin_alter_subscription(state, restored_clientid, filter, splitToVector(filter, '/'), qos, nullptr);
+        globals->recorded_publishes.clear();
+        apply_change("/Dc/0/Voltage", "12.7");
+        FMQ_COMPARE(globals->recorded_publishes.empty(), true);
+
+        flashmq_plugin_client_disconnected(state, restored_clientid);
+    }
+
+    // The subscriptions of the bridge to VRM aren't seen, so with VRM interest, everything is wanted.
+    state->mark_vrm_bridge_interest();
+    apply_change("/Dc/0/Current", "3.5");
+    apply_change("/Dc/0/Voltage", "12.9");
+    FMQ_COMPARE(globals->recorded_publishes.size(), static_cast<size_t>(2));
+
+    state->remove_dbus_service(service);
+    globals->record_publishes = false;
+    globals->recorded_publishes.clear();
+    state->vrmBridgeInterestTime = vrm_interest_org;
+    state->update_vrm_bridge_interest();
+    state->subscription_aware_publishing = subscription_aware_publishing_org;
+    state->subscription_tracker = std::move(tracker_org);
+    state->alive = alive_org;
+
+    return 0;
+}
+
+/**
+ * ItemsChanged is applied to the store in place, but should have the same outcome as the GetItems way: decoding into a map of items
+ * and adding those.
+ */
+int items_changed_tests(void *data)
+{
+    State *state = static_cast<State*>(data);
+    TesterGlobals *globals = TesterGlobals::getInstance();
+
+    const bool alive_org = state->alive;
+    state->alive = true;
+
+    typedef std::vector<std::pair<std::string, VeVariant>> Properties;
+    const std::vector<std::pair<std::string, Properties>> entries {
+        {"/Dc/0/Voltage", {{"Value", VeVariant(nlohmann::json(12.6))}, {"Text", VeVariant("12.6V")}}},
+        {"/Dc/0/Current", {{"Value", VeVariant(nlohmann::json(1.5))}, {"Text", VeVariant("1.5A")}}},
+        {"Yield/Power", {{"Value", VeVariant(nlohmann::json(100))}, {"Text", VeVariant("100W")}}},
+        {"/ProductName", {{"Value", VeVariant("SmartSolar Charger MPPT 150/35, long enough to not be inline")}, {"Text", VeVariant("")}}},
+        {"/Dc/0/Temperature", {{"Value", VeVariant(nlohmann::json(nullptr))}, {"Text", VeVariant("")}}},
+        {"/Load/I", {{"Value", VeVariant(nlohmann::json(3))}, {"Text", VeVariant("3A")}, {"Min", VeVariant(nlohmann::json(0))}, {"Max", VeVariant(nlohmann::json(20))}}},
+        {"/Pv/V", {{"Value", VeVariant(nlohmann::json::parse("[35.5, 36.5]"))}, {"Text", VeVariant("")}}}
+    };
+
+    DBusMessageGuard msg = dbus_message_new_signal("/", "com.victronenergy.BusItem", "ItemsChanged");
+
+    {
+        DBusMessageIter iter;
+        dbus_message_iter_init_append(msg.d, &iter);
+        DBusMessageIterOpenContainerGuard array_iter(&iter, DBUS_TYPE_ARRAY, "{sa{sv}}");
+
+        for (const auto &entry : entries)
+        {
+            DBusMessageIterOpenContainerGuard item_iter(array_iter.get_array_iter(), DBUS_TYPE_DICT_ENTRY, nullptr);
+            const char *path = entry.first.c_str();
+            dbus_message_iter_append_basic(item_iter.get_array_iter(), DBUS_TYPE_STRING, &path);
+
+            DBusMessageIterOpenContainerGuard props_iter(item_iter.get_array_iter(), DBUS_TYPE_ARRAY, "{sv}");
+
+            for (const auto &prop : entry.second)
+            {
+                DBusMessageIterOpenContainerGuard prop_iter(props_iter.get_array_iter(), DBUS_TYPE_DICT_ENTRY, nullptr);
+                const char *name = prop.first.c_str();
+                dbus_message_iter_append_basic(prop_iter.get_array_iter(), DBUS_TYPE_STRING, &name);
+                DBusMessageIterOpenContainerGuard variant_iter(prop_iter.get_array_iter(), DBUS_TYPE_VARIANT, prop.second.get_dbus_type_as_string_recursive().c_str());
+                prop.second.append_args_to_dbus_message(variant_iter.get_array_iter());
+            }
+        }
+    }
+
+    // Unsent messages have no serial, and they can't be read back without one.
+    dbus_message_set_serial(msg.d, 1);
+
+    const std::string in_place_service("com.victronenergy.solarcharger.in_place_test");
+    const std::string map_service("com.victronenergy.solarcharger.map_test");
+    const std::string in_place_prefix = "N/" + state->unique_vrm_id + "/solarcharger/905";
+    const std::string map_prefix = "N/" + state->unique_vrm_id + "/solarcharger/906";
+
+    for (const auto &p : {std::make_pair(in_place_service, "905"), std::make_pair(map_service, "906")})
+    {
+        std::unordered_map<std::string, Item> items = make_test_items(
+            {{"/DeviceInstance", p.second}, {"/Dc/0/Voltage", "12.5"}, {"/Dc/0/Current", "1.5"}, {"/Load/I", "2"}});
+        state->add_dbus_to_mqtt_mapping(p.first, items, false);
+    }
+
+    globals->record_publishes = true;
+    globals->recorded_publishes.clear();
+
+    state->apply_items_changed(in_place_service, msg.d);
+    state->dispatch_arena.reset();
+
+    {
+        std::unordered_map<std::string, Item> changed_items = get_from_dict_with_dict_with_text_and_value(msg.d);
+        state->add_dbus_to_mqtt_mapping(map_service, changed_items, true);
+    }
+
+    // The same publishes, on the topics of each.
+    std::map<std::string, std::string> in_place_publishes;
+    std::map<std::string, std::string> map_publishes;
+
+    for (const auto &p : globals->recorded_publishes)
+    {
+        if (p.first.starts_with(in_place_prefix))
+            in_place_publishes[p.first.substr(in_place_prefix.size())] = p.second;
+        else if (p.first.starts_with(map_prefix))
+            map_publishes[p.first.substr(map_prefix.size())] = p.second;
+    }
+
+    FMQ_COMPARE(in_place_publishes.size(), static_cast<size_t>(6));
+    FMQ_COMPARE(in_place_publishes.count("/Dc/0/Current"), static_cast<size_t>(0));
+    FMQ_COMPARE(in_place_publishes.at("/Yield/Power"), std::string(R"({"value":100})"));
+    FMQ_COMPARE(in_place_publishes.at("/Load/I"), std::string(R"({"max":20,"min":0,"value":3})"));
+    FMQ_COMPARE(in_place_publishes, map_publishes);
+
+    // And the same store.
+    const std::unordered_map<std::string, Item> &in_place_items = state->dbus_service_items.at(in_place_service);
+    const std::unordered_map<std::string, Item> &map_items = state->dbus_service_items.at(map_service);
+
+    FMQ_COMPARE(in_place_items.size(), static_cast<size_t>(8));
+    FMQ_COMPARE(in_place_items.size(), map_items.size());
+
+    for (const auto &p : in_place_items)
+    {
+        // Which is different on purpose.
+        if (p.first == "/DeviceInstance")
+            continue;
+
+        const Item &a = p.second;
+        const Item &b = map_items.at(p.first);
+
+        FMQ_COMPARE(a.get_path(), b.get_path());
+        FMQ_COMPARE(a.get_value().value == b.get_value().value, true);
+        FMQ_COMPARE(a.get_value().value.get_type() == b.get_value().value.get_type(), true);
+        FMQ_COMPARE(a.get_value().min == b.get_value().min, true);
+        FMQ_COMPARE(a.get_value().max == b.get_value().max, true);
+        FMQ_COMPARE(a.get_mqtt_topic().substr(in_place_prefix.size()), b.get_mqtt_topic().substr(map_prefix.size()));
+        FMQ_COMPARE(state->find_item_by_mqtt_path(a.get_mqtt_topic()).get_service_name(), in_place_service);
+    }
+
+    // Nothing points into the dispatch arena.
+    FMQ_COMPARE(in_place_items.at("/ProductName").get_value().value.get_string_view(),
+                std::string_view("SmartSolar Charger MPPT 150/35, long enough to not be inline"));
+
+    state->remove_dbus_service(in_place_service);
+    state->remove_dbus_service(map_service);
+    globals->record_publishes = false;
+    globals->recorded_publishes.clear();
+    state->alive = alive_org;
+
+    return 0;
+}
+
+/**
+ * The snapshot is only made when something changed, in slices of whole services, and written on a thread of its own.
+ */
+int snapshot_job_state_tests(void *data)
+{
+    State *state = static_cast<State*>(data);
+
+    const bool alive_org = state->alive;
+    state->alive = true;
+    const std::string path = test_file_path("snapshot-job.bin");
+    state->snapshot_path = path;
+    state->snapshot_slice_items = 2;
+
+    const std::string service1("com.victronenergy.solarcharger.snapshot_job_test1");
+    const std::string service2("com.victronenergy.solarcharger.snapshot_job_test2");
+
+    std::unordered_map<std::string, Item> items1 = make_test_items({{"/DeviceInstance", "911"}, {"/Dc/0/Current", "1.5"}, {"/Dc/0/Voltage", "12.5"}});
+    std::unordered_map<std::string, Item> items2 = make_test_items({{"/DeviceInstance", "912"}, {"/Dc/0/Current", "2.5"}, {"/Dc/0/Voltage", "13.5"}});
+
+    state->snapshot_dirty = false;
+    state->add_dbus_to_mqtt_mapping(service1, items1, false);
+    FMQ_COMPARE(state->snapshot_dirty, true);
+    state->add_dbus_to_mqtt_mapping(service2, items2, false);
+
+    state->start_snapshot_job();
+    FMQ_COMPARE(state->snapshot_dirty, false);
+    FMQ_COMPARE(state->snapshot_job.has_value(), true);
+    FMQ_COMPARE(state->snapshot_job_task_id > 0, true);
+
+    TesterGlobals::getInstance()->run_due_tasks();
+    FMQ_COMPARE(state->snapshot_job.has_value(), false);
+    FMQ_COMPARE(state->snapshot_job_task_id, static_cast<uint32_t>(0));
+    state->wait_for_snapshot_writer();
+
+    {
+        const std::vector<SnapshotService> services = read_snapshot_file(path, state->unique_vrm_id);
+        int found = 0;
+
+        for (const SnapshotService &s : services)
+        {
+            if (s.service == service1 || s.service == service2)
+            {
+                found++;
+                FMQ_COMPARE(s.items.size(), static_cast<size_t>(3));
+            }
+        }
+
+        FMQ_COMPARE(found, 2);
+    }
+
+    // Only changes make it dirty.
+    {
+        std::unordered_map<std::string, Item> changed_items = make_test_items({{"/Dc/0/Current", "1.5"}});
+        state->add_dbus_to_mqtt_mapping(service1, changed_items, true);
+        FMQ_COMPARE(state->snapshot_dirty, false);
+
+        changed_items = make_test_items({{"/Dc/0/Current", "1.6"}});
+        state->add_dbus_to_mqtt_mapping(service1, changed_items, true);
+        FMQ_COMPARE(state->snapshot_dirty, true);
+    }
+
+    state->snapshot_dirty = false;
+    state->remove_dbus_service(service1);
+    FMQ_COMPARE(state->snapshot_dirty, true);
+    state->remove_dbus_service(service2);
+
+    unlink(path.c_str());
+    state->snapshot_path.clear();
+    state->snapshot_slice_items = SNAPSHOT_SLICE_ITEMS;
+    state->alive = alive_org;
+
+    return 0;
+}
+
+/**
+ * Restored services are there right away, and are replaced by the scans when they turn out to be different, or removed when they don't
+ * turn up at all.
+ */
+int snapshot_state_tests(void *data)
+{
+    State *state = static_cast<State*>(data);
+    TesterGlobals *globals = TesterGlobals::getInstance();
+
+    const bool alive_org = state->alive;
+    state->alive = true;
+    ScanScheduler scan_scheduler_org = std::move(state->scan_scheduler);
+    state->scan_scheduler = ScanScheduler();
+
+    const std::string kept("com.victronenergy.solarcharger.snapshot_test_kept");
+    const std::string other_instance("com.victronenergy.solarcharger.snapshot_test_other_instance");
+    const std::string path_gone("com.victronenergy.solarcharger.snapshot_test_path_gone");
+    const std::string stale("com.victronenergy.solarcharger.snapshot_test_stale");
+    const std::string forgotten("com.victronenergy.solarcharger.snapshot_test_forgotten");
+
+    const std::vector<std::pair<std::string, int>> services {{kept, 921}, {other_instance, 922}, {path_gone, 923}, {stale, 924}, {forgotten, 925}};
+
+    auto make_scanned_items = [](int instance) {
+        return make_test_items({{"/DeviceInstance", std::to_string(instance)}, {"/Dc/0/Current", "1.5"}, {"/Dc/0/Voltage", "12.5"}});
+    };
+
+    const std::string path = test_file_path("snapshot-state.bin");
+
+    {
+        std::unordered_map<std::string, std::unordered_map<std::string, Item>> items;
+        std::unordered_map<std::string, ServiceIdentifier> instances;
+
+        for (const auto &p : services)
+        {
+            instances[p.first] = ServiceIdentifier(p.second);
+
+            for (auto &p2 : make_scanned_items(p.second))
+            {
+                p2.second.set_mapping_details(state->unique_vrm_id, p.first, instances[p.first]);
+                items[p.first][p2.first] = p2.second;
+            }
+        }
+
+        write_snapshot_file(path, serialize_snapshot(state->unique_vrm_id, items, instances));
+    }
+
+    globals->record_publishes = true;
+    globals->recorded_publishes.clear();
+
+    state->snapshot_path = path;
+    state->load_snapshot();
+    unlink(path.c_str());
+
+    // Nothing is published until a client asks, or the scans come in.
+    FMQ_COMPARE(globals->recorded_publishes.empty(), true);
+
+    for (const auto &p : services)
+    {
+        FMQ_COMPARE(state->dbus_service_items.contains(p.first), true);
+        FMQ_COMPARE(state->dbus_service_items.at(p.first).size(), static_cast<size_t>(3));
+        FMQ_COMPARE(state->unverified_snapshot_services.contains(p.first), true);
+    }
+
+    const std::string kept_topic = "solarcharger/921/Dc/0/Voltage";
+    FMQ_COMPARE(state->topic_index.find(kept_topic) != nullptr, true);
+    FMQ_COMPARE(state->topic_index.find(kept_topic)->as_json(), std::string(R"({"value":12.5})"));
+
+    // What failed to load is undone as a whole.
+    state->forget_snapshot_service(forgotten);
+    state->unverified_snapshot_services.erase(forgotten);
+    FMQ_COMPARE(state->dbus_service_items.contains(forgotten), false);
+    FMQ_COMPARE(state->service_names_to_instance.contains(forgotten), false);
+    FMQ_COMPARE(state->dbus_service_path_tries.contains(forgotten), false);
+    FMQ_COMPARE(state->topic_index.find("solarcharger/925/Dc/0/Voltage") == nullptr, true);
+
+    state->reconcile_snapshot_service(kept, make_scanned_items(921));
+    FMQ_COMPARE(state->dbus_service_items.contains(kept), true);
+    FMQ_COMPARE(state->unverified_snapshot_services.contains(kept), false);
+    FMQ_COMPARE(globals->recorded_publishes.empty(), true);
+
+    state->reconcile_snapshot_service(other_instance, make_scanned_items(932));
+    FMQ_COMPARE(state->dbus_service_items.contains(other_instance), false);
+    FMQ_COMPARE(state->unverified_snapshot_services.contains(other_instance), false);
+
+    std::unordered_map<std::string, Item> items_without_current = make_scanned_items(923);
+    items_without_current.erase("/Dc/0/Current");
+    state->reconcile_snapshot_service(path_gone, items_without_current);
+    FMQ_COMPARE(state->dbus_service_items.contains(path_gone), false);
+
+    // The replaced ones had their values cleared.
+    FMQ_COMPARE(globals->recorded_publishes.size(), static_cast<size_t>(6));
+    FMQ_COMPARE(globals->recorded_publishes.at(0).second, std::string(""));
+
+    // What's not scanned by the end of the initial scan, isn't there anymore.
+    FMQ_COMPARE(state->dbus_service_items.contains(stale), true);
+    state->scan_scheduler.start_initial_scan();
+    state->check_initial_scan_completed();
+    FMQ_COMPARE(state->dbus_service_items.contains(stale), false);
+    FMQ_COMPARE(state->unverified_snapshot_services.empty(), true);
+    FMQ_COMPARE(state->dbus_service_items.contains(kept), true);
+
+    state->remove_dbus_service(kept);
+    state->snapshot_path.clear();
+    state->scan_scheduler = std::move(scan_scheduler_org);
+    globals->record_publishes = false;
+    globals->recorded_publishes.clear();
+    state->alive = alive_org;
+
+    return 0;
+}
+
+/**
+ * A burst of messages is dispatched over several wake-ups of the dispatch eventfd, so it doesn't keep the MQTT clients waiting.
+ */
+int dispatch_budget_tests(void *data)
+{
+    State *state = static_cast<State*>(data);
+
+    DBusErrorGuard err;
+    DBusConnection *sender = dbus_bus_get_private(DBusBusType::DBUS_BUS_SYSTEM, err.get());
+    err.throw_error();
+
+    // Whatever is still there from the start-up, so only our signals are left.
+    auto read_and_dispatch_all = [state]() {
+        for (int i = 0; i < 10; i++)
+        {
+            dbus_connection_read_write(state->con, 10);
+        }
+
+        while (dbus_connection_dispatch(state->con) == DBUS_DISPATCH_DATA_REMAINS)
+        {
+
+        }
+    };
+
+    uint64_t eventfd_value = 0;
+    if (state->dispatch_pending && read(state->dispatch_event_fd, &eventfd_value, sizeof(uint64_t)) > 0)
+        state->dispatch_pending = false;
+    read_and_dispatch_all();
+
+    const size_t budget_messages_org = state->dispatch_budget_messages;
+    const std::chrono::microseconds budget_duration_org = state->dispatch_budget_duration;
+    state->dispatch_budget_messages = 2;
+    state->dispatch_budget_duration = std::chrono::seconds(1);
+
+    for (int i = 0; i < 5; i++)
+    {
+        DBusMessageGuard signal(dbus_message_new_signal("/DispatchBudgetTest", "com.victronenergy.BusItem", "DispatchBudgetTest"));
+        dbus_connection_send(sender, signal.d, nullptr);
+    }
+
+    dbus_connection_flush(sender);
+
+    for (int i = 0; i < 10; i++)
+    {
+        dbus_connection_read_write(state->con, 10);
+    }
+
+    // While a dispatch is pending, the eventfd isn't written again.
+    state->setDispatchable();
+    state->setDispatchable();
+    FMQ_COMPARE(state->dispatch_pending, true);
+    eventfd_value = 0;
+    FMQ_COMPARE(read(state->dispatch_event_fd, &eventfd_value, sizeof(uint64_t)), static_cast<ssize_t>(sizeof(uint64_t)));
+    FMQ_COMPARE(eventfd_value, static_cast<uint64_t>(1));
+    const uint64_t one = 1;
+    FMQ_COMPARE(write(state->dispatch_event_fd, &one, sizeof(uint64_t)), static_cast<ssize_t>(sizeof(uint64_t)));
+
+    const uint64_t signals_before = state->stats.other_signals;
+    const uint64_t yields_before = state->stats.dispatch_yields;
+
+    flashmq_plugin_poll_event_received(state, state->dispatch_event_fd, EPOLLIN, std::weak_ptr<void>());
+    FMQ_COMPARE(state->stats.other_signals - signals_before, static_cast<uint64_t>(2));
+    FMQ_COMPARE(state->stats.dispatch_yields - yields_before, static_cast<uint64_t>(1));
+    FMQ_COMPARE(state->dispatch_pending, true);
+
+    flashmq_plugin_poll_event_received(state, state->dispatch_event_fd, EPOLLIN, std::weak_ptr<void>());
+    FMQ_COMPARE(state->stats.other_signals - signals_before, static_cast<uint64_t>(4));
+    FMQ_COMPARE(state->stats.dispatch_yields - yields_before, static_cast<uint64_t>(2));
+
+    // The rest fits in the budget.
+    flashmq_plugin_poll_event_received(state, state->dispatch_event_fd, EPOLLIN, std::weak_ptr<void>());
+    FMQ_COMPARE(state->stats.other_signals - signals_before, static_cast<uint64_t>(5));
+    FMQ_COMPARE(state->stats.dispatch_yields - yields_before, static_cast<uint64_t>(2));
+    FMQ_COMPARE(state->dispatch_pending, false);
+
+    state->dispatch_budget_messages = budget_messages_org;
+    state->dispatch_budget_duration = budget_duration_org;
+
+    dbus_connection_close(sender);
+    dbus_connection_unref(sender);
+
+    return 0;
+}
+
+int pre_event_loop_test(void *data)
+{
+    FMQ_COMPARE(true, true);
+
+    integration_permission_tests(data);
+    read_only_vrm_mode_tests(data);
+    json_writer_tests();
+    properties_changed_decoding_tests();
+    dispatch_arena_tests();
+    topic_classifier_tests();
+    scan_scheduler_tests();
+    snapshot_tests();
+    trace_tests(data);
+    credentials_cache_tests();
+    plugin_stats_tests(data);
+    crypt_workers_tests();
+    async_handlers_tests();
+    small_function_tests();
+    dbus_coroutine_tests(data);
+    topic_index_tests();
+    item_path_trie_tests();
+    vevariant_tests();
+    item_set_value_tests();
+    publish_rate_limiter_tests();
+    publish_rate_limit_state_tests(data);
+    keepalive_coalescing_tests(data);
+    subscription_tracker_tests();
+    subscription_aware_publishing_state_tests(data);
+    items_changed_tests(data);
+    snapshot_job_state_tests(data);
+    snapshot_state_tests(data);
+    dispatch_budget_tests(data);
+
+    std::filesystem::remove_all(get_test_dir());
+
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    (void) argc; (void)argv;
+
+    tests_init_once();
+
+    if (!crypt_match("hallo", "$2a$08$LBfjL0PfMBbjWxCzLBfjLurkA7K0tuDn44rNUXDBvatSgSqHvwaHS"))
+    {
+        throw std::runtime_error("crypt test failed.");
+    }
+
+    std::unordered_map<std::string, std::string> pluginOpts;
+
+    TesterGlobals *globals = TesterGlobals::getInstance();
+    globals->epoll_fd = epoll_create(1024);
+
+    void *data = nullptr;;
+
+    flashmq_plugin_main_init(pluginOpts);
+    flashmq_plugin_allocate_thread_memory(&data, pluginOpts);
+
+    flashmq_plugin_init(data, pluginOpts, false);
+
+    pre_event_loop_test(data);
+
+    GuiCustomizations g;
+    g.scan();
+
+    globals->run_event_loop(data);
+
     flashmq_plugin_deinit(data, pluginOpts, false);
 
     flashmq_plugin_deallocate_thread_memory(data, pluginOpts);
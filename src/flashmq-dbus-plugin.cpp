@@ -14,8 +14,6 @@
 
 // https://dbus.freedesktop.org/doc/api/html/index.html
 
-#define DBUS_MQTT_INTEGRATIONS_USERNAME "dbus-mqtt-integrations"
-
 using namespace dbus_flashmq;
 
 int flashmq_plugin_version()
@@ -47,6 +45,11 @@ void flashmq_plugin_main_init(std::unordered_map<std::string, std::string> &plug
     dbus_threads_init_default();
 }
 
+void flashmq_plugin_main_deinit(std::unordered_map<std::string, std::string> &plugin_opts)
+{
+    (void) plugin_opts;
+}
+
 void flashmq_plugin_init(void *thread_data, std::unordered_map<std::string, std::string> &plugin_opts, bool reloading)
 {
     State *state = static_cast<State*>(thread_data);
@@ -54,7 +57,21 @@ void flashmq_plugin_init(void *thread_data, std::unordered_map<std::string, std:
     if (reloading)
         return;
 
-    state->get_unique_id();
+    std::string unique_id_file = UNIQUE_ID_FILE_PATH;
+    auto unique_id_file_pos = plugin_opts.find("unique_id_file");
+    if (unique_id_file_pos != plugin_opts.end())
+    {
+        unique_id_file = unique_id_file_pos->second;
+    }
+
+    state->get_unique_id(unique_id_file);
+
+    auto trace_file_pos = plugin_opts.find("trace_file");
+    if (trace_file_pos != plugin_opts.end())
+    {
+        flashmq_logf(LOG_NOTICE, "Recording trace to '%s'.", trace_file_pos->second.c_str());
+        state->trace_recorder = std::make_unique<TraceRecorder>(trace_file_pos->second, state->unique_vrm_id, plugin_opts);
+    }
 
     // Venus never skips it, but the Docker development env does.
     auto skip_broker_reg_pos = plugin_opts.find("skip_broker_registration");
@@ -63,6 +80,98 @@ void flashmq_plugin_init(void *thread_data, std::unordered_map<std::string, std:
         state->do_online_registration = false;
     }
 
+    auto publish_rate_limits_pos = plugin_opts.find("publish_rate_limits");
+    if (publish_rate_limits_pos != plugin_opts.end())
+    {
+        state->publish_rate_limiter = PublishRateLimiter(publish_rate_limits_pos->second);
+    }
+
+    auto full_publish_slice_items_pos = plugin_opts.find("full_publish_slice_items");
+    if (full_publish_slice_items_pos != plugin_opts.end())
+    {
+        state->full_publish_slice_items = value_to_int_ranged<size_t>(full_publish_slice_items_pos->second, 1);
+    }
+
+    auto full_publish_slice_us_pos = plugin_opts.find("full_publish_slice_microseconds");
+    if (full_publish_slice_us_pos != plugin_opts.end())
+    {
+        const uint32_t us = value_to_int_ranged<uint32_t>(full_publish_slice_us_pos->second, 1);
+        state->full_publish_slice_duration = std::chrono::microseconds(us);
+    }
+
+    auto keepalive_coalesce_pos = plugin_opts.find("keepalive_coalesce_milliseconds");
+    if (keepalive_coalesce_pos != plugin_opts.end())
+    {
+        const uint32_t ms = value_to_int_ranged<uint32_t>(keepalive_coalesce_pos->second, 0, 10000);
+        state->keepalive_coalesce_window = std::chrono::milliseconds(ms);
+    }
+
+    auto dispatch_budget_messages_pos = plugin_opts.find("dispatch_budget_messages");
+    if (dispatch_budget_messages_pos != plugin_opts.end())
+    {
+        state->dispatch_budget_messages = value_to_int_ranged<size_t>(dispatch_budget_messages_pos->second, 1);
+    }
+
+    auto dispatch_budget_us_pos = plugin_opts.find("dispatch_budget_microseconds");
+    if (dispatch_budget_us_pos != plugin_opts.end())
+    {
+        const uint32_t us = value_to_int_ranged<uint32_t>(dispatch_budget_us_pos->second, 1);
+        state->dispatch_budget_duration = std::chrono::microseconds(us);
+    }
+
+    auto subscription_aware_pos = plugin_opts.find("subscription_aware_publishing");
+    if (subscription_aware_pos != plugin_opts.end() && subscription_aware_pos->second == "true")
+    {
+        state->subscription_aware_publishing = true;
+    }
+
+    auto scan_max_in_flight_pos = plugin_opts.find("scan_max_in_flight");
+    if (scan_max_in_flight_pos != plugin_opts.end())
+    {
+        state->scan_scheduler.set_max_in_flight(value_to_int_ranged<size_t>(scan_max_in_flight_pos->second, 1, 1000));
+    }
+
+    auto scan_priority_pos = plugin_opts.find("scan_priority_service_types");
+    if (scan_priority_pos != plugin_opts.end())
+    {
+        state->scan_scheduler.set_priority_service_types(scan_priority_pos->second);
+    }
+
+    auto snapshot_file_pos = plugin_opts.find("snapshot_file");
+    if (snapshot_file_pos != plugin_opts.end())
+    {
+        state->snapshot_path = snapshot_file_pos->second;
+    }
+
+    auto snapshot_interval_pos = plugin_opts.find("snapshot_interval_seconds");
+    if (snapshot_interval_pos != plugin_opts.end())
+    {
+        state->snapshot_interval = std::chrono::seconds(value_to_int_ranged<uint32_t>(snapshot_interval_pos->second, 10, 86400));
+    }
+
+    state->load_snapshot();
+
+    auto stats_interval_pos = plugin_opts.find("stats_interval_seconds");
+    if (stats_interval_pos != plugin_opts.end())
+    {
+        state->stats_interval = std::chrono::seconds(value_to_int_ranged<uint32_t>(stats_interval_pos->second, 0, 3600));
+    }
+
+    auto dbus_call_timeout_pos = plugin_opts.find("dbus_call_timeout_milliseconds");
+    if (dbus_call_timeout_pos != plugin_opts.end())
+    {
+        state->dbus_call_timeout = std::chrono::milliseconds(value_to_int_ranged<uint32_t>(dbus_call_timeout_pos->second, 100, 600000));
+    }
+
+    size_t crypt_worker_threads = CRYPT_WORKER_THREADS;
+    auto crypt_worker_threads_pos = plugin_opts.find("crypt_worker_threads");
+    if (crypt_worker_threads_pos != plugin_opts.end())
+    {
+        crypt_worker_threads = value_to_int_ranged<size_t>(crypt_worker_threads_pos->second, 0, 8);
+    }
+
+    state->start_crypt_workers(crypt_worker_threads);
+
     state->initiate_broker_registration(0);
 
     state->open();
@@ -75,6 +184,8 @@ void flashmq_plugin_init(void *thread_data, std::unordered_map<std::string, std:
 
     state->start_one_second_timer();
     state->start_one_minute_timer();
+    state->start_snapshot_timer();
+    state->start_stats_timer();
 }
 
 void flashmq_plugin_deinit(void *thread_data, std::unordered_map<std::string, std::string> &plugin_opts, bool reloading)
@@ -90,6 +201,8 @@ void flashmq_plugin_deinit(void *thread_data, std::unordered_map<std::string, st
 
     State *state = static_cast<State*>(thread_data);
 
+    state->write_snapshot();
+
     /*
      *  These are async calls and because we don't have an event loop anymore at this point, it may be that the
      *  call is never sent, when dbus buffers are full for instance. It's a rare occurance though, and not
@@ -97,6 +210,12 @@ void flashmq_plugin_deinit(void *thread_data, std::unordered_map<std::string, st
      */
     state->write_bridge_connection_state(BRIDGE_DBUS, std::optional<bool>(), BRIDGE_DEACTIVATED_STRING);
     state->write_bridge_connection_state(BRIDGE_RPC, std::optional<bool>(), BRIDGE_DEACTIVATED_STRING);
+
+    if (state->trace_recorder)
+    {
+        flashmq_logf(LOG_NOTICE, "Recorded %lu trace events.", static_cast<unsigned long>(state->trace_recorder->get_event_count()));
+        state->trace_recorder.reset();
+    }
 }
 
 AuthResult auth_success_or_delayed_fail(
@@ -105,9 +224,7 @@ AuthResult auth_success_or_delayed_fail(
 {
     if (result == AuthResult::success)
     {
-        if (lan)
-            state->lan_clients.try_emplace(clientid, ClientData{username, clientid, client});
-        state->register_user_and_clientid(username, clientid);
+        state->client_logged_in(username, clientid, client, state->privileged_network_clients.contains(client), lan);
         return AuthResult::success;
     }
 
@@ -120,128 +237,120 @@ AuthResult auth_success_or_delayed_fail(
     return AuthResult::async;
 }
 
-AuthResult do_vnc_auth(const std::string &password)
+/**
+ * @brief check_password matches the password against the hash on a crypt worker, and finishes the login asynchronously. Without
+ * workers, it's done right away.
+ * @param on_result is called with whether the password matched, and decides the login result, like auth_success_or_delayed_fail().
+ */
+AuthResult check_password(State *state, const std::weak_ptr<Client> &client, const std::string &password, const std::string &crypted,
+                          std::function<AuthResult(bool match)> &&on_result)
 {
-    const static std::string vnc_password_file_path = "/data/conf/vncpassword.txt";
+    if (!state->crypt_workers.running())
+        return on_result(crypt_match(password, crypted));
+
+    auto completion = [client, on_result = std::move(on_result)](bool match) {
+        // There's nobody to tell anymore, and nothing to register for a client that's gone.
+        if (client.expired())
+            return;
+
+        const AuthResult result = on_result(match);
+
+        // A deny is already scheduled with a delay.
+        if (result != AuthResult::async)
+            flashmq_continue_async_authentication(client, result, "", "");
+    };
+
+    state->crypt_workers.submit(password, crypted, std::move(completion));
+    return AuthResult::async;
+}
+
+AuthResult do_vnc_auth(State *state, const std::weak_ptr<Client> &client, const std::string &username, const std::string &clientid,
+                       const std::string &password)
+{
+    std::optional<std::string> vnc_password_crypt;
 
     try
     {
-        if (!std::filesystem::exists(vnc_password_file_path))
-            return AuthResult::login_denied;
-
-        if (std::filesystem::file_size(vnc_password_file_path) == 0)
-            return AuthResult::success;
+        vnc_password_crypt = state->credentials_cache.get_vnc_password_crypt();
+    }
+    catch (std::exception &ex)
+    {
+        flashmq_logf(LOG_ERR, "Error in do_vnc_auth using '%s': %s", VNC_PASSWORD_FILE_PATH, ex.what());
+    }
 
-        std::fstream vnc_password_file(vnc_password_file_path, std::ios::in);
+    /*
+     * We only count unseen attempts. When some integration uses a wrong/changed password and keeps trying, we
+     * should not trip the rate limiter.
+     *
+     * The token is taken before the verification, otherwise a burst of logins would all pass the rate-limit check
+     * while their verification is still pending on the crypt workers. It's given back when the password is right.
+     */
+    const bool unseen_password = state->passwordHistory.count(password) == 0;
+    if (unseen_password)
+        state->decrement_login_tokens();
 
-        if (!vnc_password_file)
+    auto on_result = [state, client, username, clientid, password, unseen_password](bool match) {
+        if (match)
         {
-            std::string error_str(strerror(errno));
-            throw std::runtime_error(error_str);
-        }
+            if (unseen_password)
+                state->refund_login_token();
 
-        std::string vnc_password_crypt;
+            // The VNC password is the security profile password, so it's privileged.
+            state->privileged_network_clients.insert(client);
+            state->security_profile_password_clients.try_emplace(clientid, ClientData{username, clientid, client});
 
-        if (!getline(vnc_password_file, vnc_password_crypt))
-        {
-            std::string error_str(strerror(errno));
-            throw std::runtime_error(error_str);
+            return auth_success_or_delayed_fail(state, client, username, clientid, AuthResult::success, true);
         }
 
-        trim(vnc_password_crypt);
+        if (unseen_password && state->passwordHistory.size() < LOGIN_TOKENS_LONG_TERM) // protect memory use
+            state->passwordHistory.insert(password);
 
-        // The file is normally 0 bytes, but disabling it again makes it 1 byte, with a newline. This is also approved.
-        if (vnc_password_crypt.empty())
-            return AuthResult::success;
+        return auth_success_or_delayed_fail(state, client, username, clientid, AuthResult::login_denied, true);
+    };
 
-        if (crypt_match(password, vnc_password_crypt))
-            return AuthResult::success;
-    }
-    catch (std::exception &ex)
-    {
-        flashmq_logf(LOG_ERR, "Error in do_vnc_auth using '%s': %s", vnc_password_file_path.c_str(), ex.what());
-    }
+    if (!vnc_password_crypt)
+        return on_result(false);
 
-    return AuthResult::login_denied;
+    if (vnc_password_crypt.value().empty())
+        return on_result(true);
+
+    return check_password(state, client, password, vnc_password_crypt.value(), std::move(on_result));
 }
 
 /**
- * These are tokens set for pairing, like:
- *
- *   curl --insecure --user "remoteconsole:securityprofilepassword" -X POST \
- *     -d "role=evcharger&device_id=mydevice123" 'https://venus.local/auth/generate-token/'
- *
- * Answer: {"token_name":"token/evcharger/mydevice123","password":"hfNWPw7UmCKg4CiSZ1CKnnkjlBbArStO"}
- *
- * Example tokens file:
- *
- * [
- *    {
- *       "password_hash": "$2y$10$SIQlG707GEsg2J6ek.FH/Od9DEr8NeBC/1xdNmdz3So7ilwKbOUw6",
- *       "token_name": "token/evcharger/mydevice123"
- *    }
- * ]
- *
+ * These are tokens set for pairing. See CredentialsCache::load_tokens() for the format.
  */
-std::optional<AuthResult> do_token_auth(const std::string &username, const std::string &password)
+std::optional<AuthResult> do_token_auth(State *state, const std::weak_ptr<Client> &client, const std::string &username,
+                                        const std::string &clientid, const std::string &password)
 {
+    std::string password_hash;
+
     try
     {
-        const static std::string token_users_file = "/data/conf/tokens.json";
+        const std::string *cached_hash = state->credentials_cache.get_token_password_hash(username);
 
-        if (!std::filesystem::exists(token_users_file))
+        if (!cached_hash)
             return {};
 
-        std::ifstream infile(token_users_file);
-
-        if (!infile.is_open())
-        {
-            throw std::runtime_error("Error opening " + token_users_file);
-        }
-
-        std::stringstream buffer;
-        buffer << infile.rdbuf();
-        std::string json_text = buffer.str();
-
-        const nlohmann::json j = nlohmann::json::parse(json_text);
-
-        if (!j.is_array())
-            throw std::runtime_error("The file '" + token_users_file + "' is not valid json (array)");
-
-        for (auto &row : j)
-        {
-            const std::string &token_name = row.at("token_name");
-            const std::string &password_hash = row.at("password_hash");
-
-            if (username == token_name)
-            {
-                const bool match = crypt_match(password, password_hash);
-                return match ? AuthResult::success : AuthResult::acl_denied;
-            }
-        }
-
-        return {};
+        password_hash = *cached_hash;
     }
     catch (std::exception &ex)
     {
         flashmq_logf(LOG_ERR, "Error in do_token_auth: %s", ex.what());
+        return {};
     }
 
-    return {};
+    auto on_result = [state, client, username, clientid](bool match) {
+        const AuthResult r = match ? AuthResult::success : AuthResult::acl_denied;
+        return auth_success_or_delayed_fail(state, client, username, clientid, r, true);
+    };
+
+    return check_password(state, client, password, password_hash, std::move(on_result));
 }
 
-AuthResult flashmq_plugin_login_check(
-    void *thread_data, const std::string &clientid, const std::string &username, const std::string &password,
-    const std::vector<std::pair<std::string, std::string>> *userProperties, const std::weak_ptr<Client> &client)
+AuthResult do_login_check(State *state, const std::string &clientid, const std::string &username, const std::string &password,
+                          const std::weak_ptr<Client> &client, const bool localhost_login)
 {
-    (void)userProperties;
-
-    if (!thread_data)
-        return AuthResult::error;
-
-    State *state = static_cast<State*>(thread_data);
-    const bool localhost_login = state->localhost_client(client);
-
     /*
      * The local_username of the bridge does not go through flashmq_plugin_login_check(), so seeing this username
      * is always an imposter.
@@ -267,10 +376,10 @@ AuthResult flashmq_plugin_login_check(
     }
 
     // Tokens are not subject to rate-limiting. We control their entropy, and rate-limiting is not necessary.
-    const std::optional<AuthResult> token_auth_result = do_token_auth(username, password);
+    const std::optional<AuthResult> token_auth_result = do_token_auth(state, client, username, clientid, password);
     if (token_auth_result)
     {
-        return auth_success_or_delayed_fail(state, client, username, clientid, token_auth_result.value(), true);
+        return token_auth_result.value();
     }
 
     /*
@@ -298,28 +407,24 @@ AuthResult flashmq_plugin_login_check(
         return auth_success_or_delayed_fail(state, client, username, clientid, AuthResult::login_denied, true);
     }
 
-    if (do_vnc_auth(password) == AuthResult::success)
-    {
-        // The VNC password is the security profile password, so it's privileged.
-        state->privileged_network_clients.insert(client);
-        state->security_profile_password_clients.try_emplace(clientid, ClientData{username, clientid, client});
+    return do_vnc_auth(state, client, username, clientid, password);
+}
 
-        return auth_success_or_delayed_fail(state, client, username, clientid, AuthResult::success, true);
-    }
+AuthResult flashmq_plugin_login_check(
+    void *thread_data, const std::string &clientid, const std::string &username, const std::string &password,
+    const std::vector<std::pair<std::string, std::string>> *userProperties, const std::weak_ptr<Client> &client)
+{
+    (void)userProperties;
 
-    /*
-     * We only count unseen attempts. When some integration uses a wrong/changed password and keeps trying, we
-     * should not trip the rate limiter.
-     */
-    if (state->passwordHistory.count(password) == 0)
-    {
-        state->decrement_login_tokens();
+    if (!thread_data)
+        return AuthResult::error;
 
-        if (state->passwordHistory.size() < LOGIN_TOKENS_LONG_TERM) // protect memory use
-            state->passwordHistory.insert(password);
-    }
+    State *state = static_cast<State*>(thread_data);
+    const bool localhost_login = state->localhost_client(client);
 
-    return auth_success_or_delayed_fail(state, client, username, clientid, AuthResult::login_denied, true);
+    state->client_logging_in(clientid, username);
+
+    return do_login_check(state, clientid, username, password, client, localhost_login);
 }
 
 void flashmq_plugin_client_disconnected(void *thread_data, const std::string &clientid)
@@ -328,8 +433,75 @@ void flashmq_plugin_client_disconnected(void *thread_data, const std::string &cl
         return;
 
     State *state = static_cast<State*>(thread_data);
+
+    if (state->trace_recorder)
+    {
+        TraceEvent event;
+        event.type = TraceEventType::ClientDisconnected;
+        event.clientid = clientid;
+        state->trace_recorder->record(event);
+    }
+
+    state->client_profiles.remove(clientid);
     state->security_profile_password_clients.erase(clientid);
     state->lan_clients.erase(clientid);
+    state->subscription_tracker.client_disconnected(clientid);
+}
+
+bool flashmq_plugin_alter_subscription(void *thread_data, const std::string &clientid, std::string &topic, const std::vector<std::string> &subtopics,
+                                       uint8_t &qos, const std::vector<std::pair<std::string, std::string>> *userProperties)
+{
+    (void)subtopics;
+    (void)qos;
+    (void)userProperties;
+
+    if (!thread_data)
+        return false;
+
+    State *state = static_cast<State*>(thread_data);
+
+    if (state->trace_recorder)
+    {
+        TraceEvent event;
+        event.type = TraceEventType::Subscribe;
+        event.clientid = clientid;
+        event.topic = topic;
+        state->trace_recorder->record(event);
+    }
+
+    // We don't alter anything; this is the only hook that sees subscriptions before they're made.
+    if (state->subscription_aware_publishing)
+        state->subscription_tracker.subscribe(clientid, topic);
+
+    return false;
+}
+
+void flashmq_plugin_on_unsubscribe(void *thread_data, const std::weak_ptr<Session> &session, const std::string &clientid,
+                                   const std::string &username, const std::string &topic, const std::vector<std::string> &subtopics,
+                                   const std::string &shareName, const std::vector<std::pair<std::string, std::string>> *userProperties)
+{
+    (void)session;
+    (void)username;
+    (void)subtopics;
+    (void)shareName;
+    (void)userProperties;
+
+    if (!thread_data)
+        return;
+
+    State *state = static_cast<State*>(thread_data);
+
+    if (state->trace_recorder)
+    {
+        TraceEvent event;
+        event.type = TraceEventType::Unsubscribe;
+        event.clientid = clientid;
+        event.topic = topic;
+        state->trace_recorder->record(event);
+    }
+
+    if (state->subscription_aware_publishing)
+        state->subscription_tracker.unsubscribe(clientid, topic);
 }
 
 bool flashmq_plugin_alter_publish(void *thread_data, const std::string &clientid, std::string &topic, const std::vector<std::string> &subtopics,
@@ -378,7 +550,7 @@ void handle_venus_actions(
          * to consider any AclAccess::write activity as interest.
          */
         if (username_is_bridge(username))
-            state->vrmBridgeInterestTime = std::chrono::steady_clock::now();
+            state->mark_vrm_bridge_interest();
 
         // There's also 'P' for mqtt-rpc, but we should ignore that, and not report it.
         if (action == "W")
@@ -397,7 +569,7 @@ void handle_venus_actions(
 
             if (path != "keepalive")
             {
-                state->handle_read(topic, subtopics);
+                state->handle_read(topic, subtopics, payload_str);
             }
         }
     }
@@ -471,7 +643,7 @@ void handle_venus_actions(
  *
  * Username example from the connecting client: token/evcharger/HQ2501ABCDE
  */
-AuthResult handle_paired_integration_client_auth(const AclAccess access, const std::string &username, const std::vector<std::string> &subtopics)
+AuthResult handle_paired_integration_client_auth(const AclAccess access, const ClientProfile &profile, const std::vector<std::string> &subtopics)
 {
     if (access == AclAccess::subscribe)
         return AuthResult::success;
@@ -481,7 +653,7 @@ AuthResult handle_paired_integration_client_auth(const AclAccess access, const s
 
     const std::string &direction = subtopics.at(2);
 
-    if (username == DBUS_MQTT_INTEGRATIONS_USERNAME)
+    if (profile.integrations_user)
     {
         if ((access == AclAccess::write && direction == "out") || (access == AclAccess::read && direction == "in" ))
             return AuthResult::success;
@@ -495,23 +667,16 @@ AuthResult handle_paired_integration_client_auth(const AclAccess access, const s
     if (access == AclAccess::read && direction == "in")
         return AuthResult::acl_denied;
 
-    if (username.rfind("token/", 0) != 0)
-        return AuthResult::acl_denied;
-
-    const std::vector<std::string> user_fields = splitToVector(username, '/');
-
-    if (user_fields.size() != 3)
+    if (!profile.token)
         return AuthResult::acl_denied;
 
-    const std::string &unique_id_from_user = user_fields.at(2);
     const std::string &unique_id_from_topic = subtopics.at(4);
-    const std::string &role_from_user = user_fields.at(1);
     const std::string &role_from_topic = subtopics.at(3);
 
-    if (unique_id_from_user.empty() || unique_id_from_topic.empty())
+    if (profile.token_unique_id.empty() || unique_id_from_topic.empty())
         return AuthResult::acl_denied;
 
-    if (unique_id_from_user == unique_id_from_topic && role_from_user == role_from_topic)
+    if (profile.token_unique_id == unique_id_from_topic && profile.token_role == role_from_topic)
         return AuthResult::success;
 
     return AuthResult::acl_denied;
@@ -519,6 +684,9 @@ AuthResult handle_paired_integration_client_auth(const AclAccess access, const s
 
 /**
  * @brief using ACL hook as 'on_message' handler.
+ *
+ * This is called for every message delivered to every subscriber, so what we need to know about the topic is classified once, and
+ * what we need to know about the client comes from its profile.
  */
 AuthResult flashmq_plugin_acl_check(void *thread_data, const AclAccess access, const std::string &clientid, const std::string &username,
                                     const std::string &topic, const std::vector<std::string> &subtopics, const std::string &shareName,
@@ -535,13 +703,25 @@ AuthResult flashmq_plugin_acl_check(void *thread_data, const AclAccess access, c
     try
     {
         State *state = static_cast<State*>(thread_data);
+        const TopicClass topic_class = classify_topic(topic, subtopics, state->unique_vrm_id);
+
+        if (state->trace_recorder)
+        {
+            TraceEvent event;
+            event.type = TraceEventType::AclCheck;
+            event.access = static_cast<uint8_t>(access);
+            event.clientid = clientid;
+            event.username = username;
+            event.topic = topic;
+            if (!topic_class.sensitive)
+                event.payload = payload;
+            event.retain = retain;
+            state->trace_recorder->record(event);
+        }
 
         if (subtopics.size() < 2)
             return AuthResult::success;
 
-        const std::string &action = subtopics.at(0);
-        const std::string &system_id = subtopics.at(1);
-
         /*
          * Can be like:
          *
@@ -553,26 +733,23 @@ AuthResult flashmq_plugin_acl_check(void *thread_data, const AclAccess access, c
          *
          * Allowing localhost still allows diagnostic use with a local client.
          *
-         * Obtaining whether a client is localhost takes a bit of work, so we only do it conditionally, even though
-         * to the eye, it may make more sense to do it earlier.
+         * Whether a client is localhost is in the client profile, which takes a bit of work to make for clients that
+         * don't have one yet, so we only get it conditionally, even though to the eye, it may make more sense to do it earlier.
          */
-        if (action == "I")
+        if (topic_class.action == TopicAction::I)
         {
+            const ClientProfile &profile = state->get_client_profile(clientid, username);
+
             /*
              * This block will always return an answer. Unlike the rest of I; see below.
              */
-            if (system_id == "local")
+            if (topic_class.local)
             {
-                AuthResult preliminary_result = handle_paired_integration_client_auth(access, username, subtopics);
+                AuthResult preliminary_result = handle_paired_integration_client_auth(access, profile, subtopics);
 
-                if (preliminary_result == AuthResult::acl_denied)
+                if (preliminary_result == AuthResult::acl_denied && profile.localhost)
                 {
-                    const IsPrivilegedUser priv = state->is_privileged_user(clientid, username);
-
-                    if (state->localhost_client(priv.client))
-                    {
-                        preliminary_result = AuthResult::success;
-                    }
+                    preliminary_result = AuthResult::success;
                 }
 
                 return preliminary_result;
@@ -582,29 +759,30 @@ AuthResult flashmq_plugin_acl_check(void *thread_data, const AclAccess access, c
              * This block only has the chance to deny, not allow. The reason is that the rest of this function will
              * perform the proper checks, like VRM read-only mode, or receiving messages for another portal ID.
              */
-            if (!(username == DBUS_MQTT_INTEGRATIONS_USERNAME || username_is_bridge(username)))
+            if (!(profile.integrations_user || profile.bridge) && !profile.localhost)
             {
-                const IsPrivilegedUser priv = state->is_privileged_user(clientid, username);
-
-                if (!state->localhost_client(priv.client))
-                {
-                    return AuthResult::acl_denied;
-                }
+                return AuthResult::acl_denied;
             }
         }
 
         if (access == AclAccess::write)
         {
-            if (action == "W" && subtopics.size() >= 3 && subtopics.at(2) == "platform" && topic.find("/Security/Api") != std::string::npos)
+            const std::string &action = subtopics.at(0);
+            const std::string &system_id = subtopics.at(1);
+
+            if (topic_class.platform_security_api)
             {
-                if (!state->is_privileged_user(clientid, username))
+                if (!state->get_client_profile(clientid, username).privileged)
                 {
                     flashmq_logf(LOG_WARNING, "Attempt to invoke platform security API by non-privileged user.");
                     return AuthResult::acl_denied;
                 }
             }
 
-            if ((action == "W" || action == "R" || action == "P" || action == "I") && system_id != state->unique_vrm_id)
+            const bool request_action = topic_class.action == TopicAction::W || topic_class.action == TopicAction::R ||
+                                        topic_class.action == TopicAction::P || topic_class.action == TopicAction::I;
+
+            if (request_action && !topic_class.for_us)
             {
                 flashmq_logf(LOG_ERR, "We received a '%s' request for '%s', but that's not us (but %s)",
                              action.c_str(), system_id.c_str(), state->unique_vrm_id.c_str());
@@ -614,7 +792,7 @@ AuthResult flashmq_plugin_acl_check(void *thread_data, const AclAccess access, c
                  * subscribers. But for P and I, we are ensuring nobody gets those to avoid other Venus services
                  * mistakingly acting on them.
                  */
-                if (action == "W" || action == "R")
+                if (topic_class.action == TopicAction::W || topic_class.action == TopicAction::R)
                     return AuthResult::success;
                 else
                     return AuthResult::acl_denied;
@@ -624,9 +802,10 @@ AuthResult flashmq_plugin_acl_check(void *thread_data, const AclAccess access, c
              * We also block P/<portalid>/in for safety; that is currently also covered by not having an RPC bridge
              * connection in read-only mode, but that may not be a separate connection in the future anymore.
              */
-            if (action == "W" || ((action == "P" || action == "I") && subtopics.size() >= 3 && subtopics.at(2) == "in"))
+            if (topic_class.action == TopicAction::W ||
+                ((topic_class.action == TopicAction::P || topic_class.action == TopicAction::I) && topic_class.direction_in))
             {
-                if (username_is_bridge(username) && state->vrm_portal_mode != VrmPortalMode::Full)
+                if (state->vrm_portal_mode != VrmPortalMode::Full && state->get_client_profile(clientid, username).bridge)
                     return AuthResult::acl_denied;
             }
 
@@ -634,7 +813,7 @@ AuthResult flashmq_plugin_acl_check(void *thread_data, const AclAccess access, c
              * Only allow ourselves to write N messages. This avoids people's own integrations from publishing
              * values they are not supposed to, which can be old, wrong, etc.
              */
-            if (action == "N" && !(clientid.empty() && username.empty()) && state->unique_vrm_id == system_id)
+            if (topic_class.action == TopicAction::N && !(clientid.empty() && username.empty()) && topic_class.for_us)
             {
                 if (!state->warningAboutNTopicsLogged)
                 {
@@ -653,41 +832,27 @@ AuthResult flashmq_plugin_acl_check(void *thread_data, const AclAccess access, c
         }
         else if (access == AclAccess::read)
         {
-            const char action_char = action.length() == 1 ? action[0] : 0;
-
             /*
              * Just means other MQTT clients can't see it. Doesn't affect ourselves or dbus communications.
              *
              * Denying all W reads is not really possible anymore. Our own apps don't use those, but custom
              * integrations might.
              */
-            if (action_char == 'W')
-            {
-                if (subtopics.size() >= 3 && subtopics.at(2) == "platform" && topic.find("/Security/Api") != std::string::npos)
-                    return AuthResult::acl_denied;
-
-                if (subtopics.size() >= 7 && subtopics.at(2) == "settings" && subtopics.at(6) == "AccessPointPassword")
-                    return AuthResult::acl_denied;
-
-                std::string lower_topic = topic;
-                str_make_lower(lower_topic);
-
-                if (lower_topic.find("password") != std::string::npos)
-                    return AuthResult::acl_denied;
-            }
+            if (topic_class.sensitive)
+                return AuthResult::acl_denied;
 
             /*
              * The if-statements below stop traffic over the bridge if there is no VRM interest. However, we only
              * limit our own N (notifications), to avoid accidentally denying other things.
              */
-            if (action_char != 'N')
+            if (topic_class.action != TopicAction::N)
                 return AuthResult::success;
 
             // We still allow normal cross-client behavior when it's all on LAN.
-            if (!username_is_bridge(username))
+            if (!state->get_client_profile(clientid, username).bridge)
                 return AuthResult::success;
 
-            if (std::chrono::steady_clock::now() > state->vrmBridgeInterestTime + std::chrono::seconds(VRM_INTEREST_TIMEOUT_SECONDS))
+            if (!state->has_vrm_bridge_interest())
                 return AuthResult::acl_denied;
 
             return AuthResult::success;
@@ -707,26 +872,70 @@ void flashmq_plugin_poll_event_received(void *thread_data, int fd, uint32_t even
 
     State *state = static_cast<State*>(thread_data);
 
+    if (fd == state->credentials_cache.get_fd())
+    {
+        state->credentials_cache.handle_events();
+        return;
+    }
+
+    if (fd == state->crypt_workers.get_fd())
+    {
+        state->crypt_workers.handle_results();
+        return;
+    }
+
     if (fd == state->dispatch_event_fd)
     {
         uint64_t eventfd_value = 0;
         if (read(fd, &eventfd_value, sizeof(uint64_t)) > 0)
         {
+            /*
+             * A burst, like a service appearing with thousands of items, would otherwise keep us here until it's all dispatched, while
+             * the MQTT clients of this thread wait. So we stop after a budget of messages or time, and continue on the next wake-up.
+             *
+             * The dispatch status function may be called in between, but dispatch_pending is still set, so it doesn't write the eventfd.
+             */
+            const auto budget_end = std::chrono::steady_clock::now() + state->dispatch_budget_duration;
+            size_t dispatched = 0;
+            bool yielded = false;
+
             DBusDispatchStatus dispatch_status = DBusDispatchStatus::DBUS_DISPATCH_DATA_REMAINS;
             while((dispatch_status = dbus_connection_get_dispatch_status(state->con)) == DBUS_DISPATCH_DATA_REMAINS)
             {
+                if (dispatched >= state->dispatch_budget_messages || std::chrono::steady_clock::now() >= budget_end)
+                {
+                    yielded = true;
+                    break;
+                }
+
                 dbus_connection_dispatch(state->con);
+                dispatched++;
+            }
+
+            // Whatever the handlers decoded into it is no longer referenced.
+            state->dispatch_arena.reset();
+
+            // What's left was read at the same time, so it keeps that as the start of its latency.
+            if (!yielded)
+                state->dbus_data_read_at.reset();
+
+            state->dispatch_pending = false;
+
+            if (yielded)
+            {
+                state->stats.dispatch_yields++;
+                state->setDispatchable();
             }
 
             // This will make us spin, but it's a method that doesn't allocate memory.
             if (dispatch_status == DBusDispatchStatus::DBUS_DISPATCH_NEED_MEMORY)
             {
-                uint64_t one = 1;
-                write(state->dispatch_event_fd, &one, sizeof(uint64_t));
+                state->setDispatchable();
             }
         }
         else
         {
+            state->dispatch_pending = false;
             const char *err = strerror(errno);
             flashmq_logf(LOG_ERR, err);
         }
@@ -739,6 +948,10 @@ void flashmq_plugin_poll_event_received(void *thread_data, int fd, uint32_t even
     if (!w || w->empty())
         return;
 
+    // The start of the signal to publish latency. Messages are read here, and dispatched on the next wake-up of the dispatch eventfd.
+    if (!state->dbus_data_read_at && (events & EPOLLIN))
+        state->dbus_data_read_at = std::chrono::steady_clock::now();
+
     // Since the process is supervised, just exit if there are major problems like running
     // out of memory.
 
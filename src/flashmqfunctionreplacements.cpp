@@ -46,7 +46,8 @@ std::string getLogLevelString(int level)
  */
 void flashmq_logf(int level, const char *str, ...)
 {
-    (void)level;
+    if (TesterGlobals::getInstance()->quiet && level != LOG_WARNING && level != LOG_ERR)
+        return;
 
     time_t time = std::time(nullptr);
     struct tm tm = *std::localtime(&time);
@@ -104,6 +105,26 @@ void flashmq_publish_message(const std::string &topic, const uint8_t qos, const
     (void)payload; (void)qos; (void)retain; (void)correlationData; (void)responseTopic;
     (void)contentType; (void)userProperties;
 
+    TesterGlobals *globals = TesterGlobals::getInstance();
+
+    // The heartbeat and stats have the time in them, so they would make every replay different.
+    if (globals->checksum_output && !topic.ends_with("/heartbeat") && !topic.ends_with("/dbus-flashmq/stats"))
+    {
+        globals->add_to_checksum(topic);
+        globals->add_to_checksum(payload);
+        globals->add_to_checksum(retain ? "r" : "");
+    }
+
+    if (globals->record_publishes)
+        globals->recorded_publishes.emplace_back(topic, payload);
+
+    if (globals->count_publishes_only)
+    {
+        globals->publish_count++;
+        globals->publish_bytes += topic.size() + payload.size();
+        return;
+    }
+
     std::cout << "DUMMY: " << topic << ": " << payload << std::endl;
 }
 
@@ -0,0 +1,17 @@
+#include "fullpublishjob.h"
+
+#include <algorithm>
+
+using namespace dbus_flashmq;
+
+bool FullPublishJob::done() const
+{
+    return next >= items.size();
+}
+
+void FullPublishJob::forget_service(const std::string &service)
+{
+    // The items that were already published don't matter anymore.
+    const auto first_pending = items.begin() + static_cast<std::ptrdiff_t>(std::min(next, items.size()));
+    items.erase(std::remove_if(first_pending, items.end(), [&service](const Item *item) { return item->get_service_name() == service; }), items.end());
+}
@@ -0,0 +1,33 @@
+#ifndef FULLPUBLISHJOB_H
+#define FULLPUBLISHJOB_H
+
+#include <vector>
+#include <string>
+#include <optional>
+
+#include "types.h"
+
+namespace dbus_flashmq
+{
+
+/**
+ * @brief The FullPublishJob struct is a publish of all items, done in slices, so that a big system doesn't stall the event loop.
+ *
+ * It holds pointers into the item store, taken when the job starts, so the owner must call forget_service() before the items of a
+ * service are erased. Items added during the job are not in it, but those are published as new values anyway.
+ */
+struct FullPublishJob
+{
+    std::vector<Item*> items;
+    size_t next = 0;
+
+    // One 'full_publish_completed' is published per echo when the job is done.
+    std::vector<std::optional<std::string>> payload_echos;
+
+    bool done() const;
+    void forget_service(const std::string &service);
+};
+
+}
+
+#endif // FULLPUBLISHJOB_H
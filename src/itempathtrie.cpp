@@ -0,0 +1,95 @@
+#include "itempathtrie.h"
+
+#include <vector>
+
+using namespace dbus_flashmq;
+
+/**
+ * @brief Splits a dbus path like '/Dc/0/Voltage' into views of its components, ignoring empty ones.
+ */
+static std::vector<std::string_view> split_path(std::string_view path)
+{
+    std::vector<std::string_view> result;
+
+    size_t start = 0;
+    while (start < path.size())
+    {
+        size_t end = path.find('/', start);
+
+        if (end == std::string_view::npos)
+            end = path.size();
+
+        if (end > start)
+            result.push_back(path.substr(start, end - start));
+
+        start = end + 1;
+    }
+
+    return result;
+}
+
+const ItemPathTrie::Node *ItemPathTrie::find_node(std::string_view path) const
+{
+    const Node *cur = &root;
+
+    for (std::string_view component : split_path(path))
+    {
+        auto pos = cur->children.find(component);
+
+        if (pos == cur->children.end())
+            return nullptr;
+
+        cur = pos->second.get();
+    }
+
+    return cur;
+}
+
+void ItemPathTrie::for_each_item(const Node &node, const std::function<void (Item &)> &f)
+{
+    if (node.item)
+        f(*node.item);
+
+    for (auto &p : node.children)
+    {
+        for_each_item(*p.second, f);
+    }
+}
+
+void ItemPathTrie::add(Item &item)
+{
+    Node *cur = &root;
+
+    for (std::string_view component : split_path(item.get_path()))
+    {
+        auto pos = cur->children.find(component);
+
+        if (pos == cur->children.end())
+            pos = cur->children.emplace(std::string(component), std::make_unique<Node>()).first;
+
+        cur = pos->second.get();
+    }
+
+    cur->item = &item;
+}
+
+/**
+ * @brief ItemPathTrie::for_each_below calls f for the item at path, if any, and everything below it.
+ * @return the number of items found.
+ */
+size_t ItemPathTrie::for_each_below(std::string_view path, const std::function<void (Item &)> &f) const
+{
+    const Node *node = find_node(path);
+
+    if (!node)
+        return 0;
+
+    size_t count = 0;
+
+    for_each_item(*node, [&count, &f](Item &item) {
+        count++;
+        f(item);
+    });
+
+    return count;
+}
@@ -0,0 +1,42 @@
+#ifndef ITEMPATHTRIE_H
+#define ITEMPATHTRIE_H
+
+#include <map>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <functional>
+
+#include "types.h"
+
+namespace dbus_flashmq
+{
+
+/**
+ * @brief The ItemPathTrie class is a tree over the dbus paths of the items of one service, keyed per path component.
+ *
+ * It's used to answer reads on sub-trees, like 'R/<portalid>/solarcharger/279/Dc', from the items we already have, instead of
+ * asking the service to serialize the sub-tree with GetValue. Like the TopicIndex, it points into the item store. Items only leave
+ * the store with their whole service, so there's no removing single items; the owner erases the trie of the service instead.
+ */
+class ItemPathTrie
+{
+    struct Node
+    {
+        std::map<std::string, std::unique_ptr<Node>, std::less<>> children;
+        Item *item = nullptr;
+    };
+
+    Node root;
+
+    const Node *find_node(std::string_view path) const;
+    static void for_each_item(const Node &node, const std::function<void(Item &item)> &f);
+
+public:
+    void add(Item &item);
+    size_t for_each_below(std::string_view path, const std::function<void(Item &item)> &f) const;
+};
+
+}
+
+#endif // ITEMPATHTRIE_H
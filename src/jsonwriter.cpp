@@ -0,0 +1,215 @@
+#include "jsonwriter.h"
+
+#include <cstring>
+#include <cmath>
+
+#include "vendor/json.hpp"
+#include "exceptions.h"
+
+using namespace dbus_flashmq;
+
+namespace
+{
+
+constexpr uint64_t swar_ones = 0x0101010101010101ULL;
+constexpr uint64_t swar_highs = 0x8080808080808080ULL;
+
+/**
+ * @brief has_byte_needing_attention tests 8 bytes at once for anything that can't be copied verbatim into a JSON string.
+ *
+ * That is a control character, quote, backslash or any non-ASCII byte (which needs UTF-8 validation). This is plain 64 bit integer
+ * arithmetic, so it works the same on the ARM and x86 targets, without intrinsics. It can report false positives for bytes after
+ * the first hit, but never false negatives, which is all we need to know whether the block can be skipped.
+ */
+inline bool has_byte_needing_attention(uint64_t w)
+{
+    const uint64_t below_space = (w - swar_ones * 0x20) & ~w;
+    const uint64_t quote = w ^ (swar_ones * '"');
+    const uint64_t backslash = w ^ (swar_ones * '\\');
+    const uint64_t has_quote = (quote - swar_ones) & ~quote;
+    const uint64_t has_backslash = (backslash - swar_ones) & ~backslash;
+    return ((below_space | has_quote | has_backslash | w) & swar_highs) != 0;
+}
+
+inline bool is_plain_byte(unsigned char c)
+{
+    return c >= 0x20 && c < 0x80 && c != '"' && c != '\\';
+}
+
+inline bool is_continuation(unsigned char c)
+{
+    return (c & 0xC0) == 0x80;
+}
+
+}
+
+JsonWriter::JsonWriter(std::string &out) :
+    out(out)
+{
+
+}
+
+void JsonWriter::write_null()
+{
+    out.append("null");
+}
+
+void JsonWriter::write_bool(bool b)
+{
+    out.append(b ? "true" : "false");
+}
+
+void JsonWriter::write_double(double d)
+{
+    if (!std::isfinite(d))
+    {
+        write_null();
+        return;
+    }
+
+    // Not std::to_chars, because nlohmann formats differently (like '13.0' instead of '13' and '1000000000000000.0' instead of '1e+15'),
+    // and we want to keep publishing exactly what we did before.
+    char buf[64];
+    const char *end = nlohmann::detail::to_chars(buf, buf + sizeof(buf), d);
+    out.append(buf, static_cast<size_t>(end - buf));
+}
+
+/**
+ * @brief JsonWriter::get_utf8_sequence_length validates the multi-byte UTF-8 sequence at pos, with the same rules as nlohmann (no overlong
+ * forms, no surrogates, nothing above U+10FFFF).
+ */
+size_t JsonWriter::get_utf8_sequence_length(std::string_view s, size_t pos)
+{
+    const unsigned char c = static_cast<unsigned char>(s[pos]);
+    const size_t left = s.size() - pos;
+
+    auto at = [&](size_t i) { return static_cast<unsigned char>(s[pos + i]); };
+
+    size_t len = 0;
+    unsigned char second_min = 0x80;
+    unsigned char second_max = 0xBF;
+
+    if (c >= 0xC2 && c <= 0xDF)
+        len = 2;
+    else if (c >= 0xE0 && c <= 0xEF)
+    {
+        len = 3;
+        if (c == 0xE0)
+            second_min = 0xA0;
+        else if (c == 0xED)
+            second_max = 0x9F;
+    }
+    else if (c >= 0xF0 && c <= 0xF4)
+    {
+        len = 4;
+        if (c == 0xF0)
+            second_min = 0x90;
+        else if (c == 0xF4)
+            second_max = 0x8F;
+    }
+
+    bool valid = len > 0 && left >= len && at(1) >= second_min && at(1) <= second_max;
+
+    for (size_t i = 2; valid && i < len; i++)
+    {
+        valid = is_continuation(at(i));
+    }
+
+    if (!valid)
+        throw ValueError("Invalid UTF-8 in string at byte index " + std::to_string(pos));
+
+    return len;
+}
+
+void JsonWriter::write_string(std::string_view s)
+{
+    static const char *hex = "0123456789abcdef";
+
+    out.reserve(out.size() + s.size() + 2);
+    out.push_back('"');
+
+    const size_t n = s.size();
+    size_t run_start = 0;
+    size_t i = 0;
+
+    while (i < n)
+    {
+        while (i + sizeof(uint64_t) <= n)
+        {
+            uint64_t w;
+            std::memcpy(&w, s.data() + i, sizeof(w));
+
+            if (has_byte_needing_attention(w))
+                break;
+
+            i += sizeof(w);
+        }
+
+        if (i >= n)
+            break;
+
+        const unsigned char c = static_cast<unsigned char>(s[i]);
+
+        if (is_plain_byte(c))
+        {
+            i++;
+            continue;
+        }
+
+        // Valid multi-byte sequences are copied verbatim as part of the current run.
+        if (c >= 0x80)
+        {
+            i += get_utf8_sequence_length(s, i);
+            continue;
+        }
+
+        out.append(s.data() + run_start, i - run_start);
+
+        switch (c)
+        {
+        case '"':
+            out.append("\\\"");
+            break;
+        case '\\':
+            out.append("\\\\");
+            break;
+        case '\b':
+            out.append("\\b");
+            break;
+        case '\f':
+            out.append("\\f");
+            break;
+        case '\n':
+            out.append("\\n");
+            break;
+        case '\r':
+            out.append("\\r");
+            break;
+        case '\t':
+            out.append("\\t");
+            break;
+        default:
+        {
+            const char escaped[] = {'\\', 'u', '0', '0', hex[c >> 4], hex[c & 0x0F]};
+            out.append(escaped, sizeof(escaped));
+            break;
+        }
+        }
+
+        i++;
+        run_start = i;
+    }
+
+    out.append(s.data() + run_start, n - run_start);
+    out.push_back('"');
+}
+
+void JsonWriter::write_raw(char c)
+{
+    out.push_back(c);
+}
+
+void JsonWriter::write_raw(std::string_view s)
+{
+    out.append(s);
+}
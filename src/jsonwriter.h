@@ -0,0 +1,48 @@
+#ifndef JSONWRITER_H
+#define JSONWRITER_H
+
+#include <string>
+#include <string_view>
+#include <charconv>
+#include <concepts>
+#include <cstdint>
+
+namespace dbus_flashmq
+{
+
+/**
+ * @brief The JsonWriter class appends JSON tokens straight to a string, without building a document first.
+ *
+ * The output is byte-identical to what nlohmann::json's dump() produces for the same values: no whitespace, doubles formatted
+ * with nlohmann's own to_chars, non-finite doubles as null, and strings escaped the same way, throwing ValueError on invalid UTF-8.
+ *
+ * The caller owns the buffer, so that it can be reused, and its capacity with it.
+ */
+class JsonWriter
+{
+    std::string &out;
+
+    static size_t get_utf8_sequence_length(std::string_view s, size_t pos);
+
+public:
+    JsonWriter(std::string &out);
+
+    void write_null();
+    void write_bool(bool b);
+    void write_double(double d);
+    void write_string(std::string_view s);
+    void write_raw(char c);
+    void write_raw(std::string_view s);
+
+    template<std::integral T>
+    void write_int(T i)
+    {
+        char buf[24];
+        const std::to_chars_result r = std::to_chars(buf, buf + sizeof(buf), i);
+        out.append(buf, static_cast<size_t>(r.ptr - buf));
+    }
+};
+
+}
+
+#endif // JSONWRITER_H
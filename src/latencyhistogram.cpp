@@ -0,0 +1,110 @@
+#include "latencyhistogram.h"
+
+#include <bit>
+#include <algorithm>
+#include <cmath>
+#include <sstream>
+
+using namespace dbus_flashmq;
+
+/**
+ * @brief LatencyHistogram::get_index gives values below 16 a bucket each. Above that, the bucket is the position of the highest bit,
+ * plus the 4 bits below it.
+ */
+size_t LatencyHistogram::get_index(uint64_t value)
+{
+    value = std::min(value, max_value);
+
+    if (value < sub_bucket_count)
+        return static_cast<size_t>(value);
+
+    const unsigned highest_bit = static_cast<unsigned>(std::bit_width(value)) - 1;
+    const unsigned shift = highest_bit - sub_bucket_bits;
+    return static_cast<size_t>((shift + 1) * sub_bucket_count + ((value >> shift) - sub_bucket_count));
+}
+
+uint64_t LatencyHistogram::get_highest_equivalent_value(size_t index)
+{
+    if (index < sub_bucket_count)
+        return index;
+
+    const uint64_t shift = index / sub_bucket_count - 1;
+    const uint64_t sub_bucket = index % sub_bucket_count + sub_bucket_count;
+    return ((sub_bucket + 1) << shift) - 1;
+}
+
+void LatencyHistogram::record(std::chrono::microseconds latency)
+{
+    const uint64_t value = latency.count() > 0 ? static_cast<uint64_t>(latency.count()) : 0;
+
+    counts[get_index(value)]++;
+    total_count++;
+    max_recorded = std::max(max_recorded, std::min(value, max_value));
+}
+
+void LatencyHistogram::record_since(std::chrono::time_point<std::chrono::steady_clock> start)
+{
+    record(std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start));
+}
+
+uint64_t LatencyHistogram::get_count() const
+{
+    return total_count;
+}
+
+uint64_t LatencyHistogram::get_max() const
+{
+    return max_recorded;
+}
+
+/**
+ * @brief LatencyHistogram::get_percentile
+ * @param percentile like 99.9.
+ * @return The highest value of the bucket the percentile falls in, but never more than the highest latency seen. 0 when empty.
+ */
+uint64_t LatencyHistogram::get_percentile(double percentile) const
+{
+    if (total_count == 0)
+        return 0;
+
+    percentile = std::clamp(percentile, 0.0, 100.0);
+    const uint64_t rank = std::max<uint64_t>(1, static_cast<uint64_t>(std::ceil(percentile / 100.0 * static_cast<double>(total_count))));
+
+    uint64_t seen = 0;
+    for (size_t i = 0; i < bucket_count; i++)
+    {
+        seen += counts[i];
+
+        if (seen >= rank)
+            return std::min(get_highest_equivalent_value(i), max_recorded);
+    }
+
+    return max_recorded;
+}
+
+void LatencyHistogram::reset()
+{
+    counts.fill(0);
+    total_count = 0;
+    max_recorded = 0;
+}
+
+nlohmann::json LatencyHistogram::to_json() const
+{
+    return {
+        {"count", total_count},
+        {"p50", get_percentile(50.0)},
+        {"p90", get_percentile(90.0)},
+        {"p99", get_percentile(99.0)},
+        {"p99.9", get_percentile(99.9)},
+        {"max", max_recorded}
+    };
+}
+
+std::string LatencyHistogram::to_string() const
+{
+    std::ostringstream s;
+    s << "count=" << total_count << " p50=" << get_percentile(50.0) << "us p90=" << get_percentile(90.0) << "us p99=" << get_percentile(99.0)
+      << "us p99.9=" << get_percentile(99.9) << "us max=" << max_recorded << "us";
+    return s.str();
+}
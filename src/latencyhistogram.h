@@ -0,0 +1,48 @@
+#ifndef LATENCYHISTOGRAM_H
+#define LATENCYHISTOGRAM_H
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+#include "vendor/json.hpp"
+
+namespace dbus_flashmq
+{
+
+/**
+ * @brief The LatencyHistogram class counts latencies in microseconds, in log-linear buckets, like HDR histograms: each power of two is
+ * split into 16 linear buckets, so the error of a percentile is at most about 6%, with a fixed size of a couple of kB and an O(1) record().
+ *
+ * Latencies above about 71 minutes are counted as that.
+ */
+class LatencyHistogram
+{
+    static constexpr unsigned sub_bucket_bits = 4;
+    static constexpr uint64_t sub_bucket_count = 1 << sub_bucket_bits;
+    static constexpr unsigned max_value_bits = 32;
+    static constexpr uint64_t max_value = (1ULL << max_value_bits) - 1;
+    static constexpr size_t bucket_count = (max_value_bits - sub_bucket_bits + 1) * sub_bucket_count;
+
+    std::array<uint64_t, bucket_count> counts {};
+    uint64_t total_count = 0;
+    uint64_t max_recorded = 0;
+
+    static size_t get_index(uint64_t value);
+    static uint64_t get_highest_equivalent_value(size_t index);
+
+public:
+    void record(std::chrono::microseconds latency);
+    void record_since(std::chrono::time_point<std::chrono::steady_clock> start);
+    uint64_t get_count() const;
+    uint64_t get_max() const;
+    uint64_t get_percentile(double percentile) const;
+    void reset();
+    nlohmann::json to_json() const;
+    std::string to_string() const;
+};
+
+}
+
+#endif // LATENCYHISTOGRAM_H
@@ -0,0 +1,48 @@
+#include "pluginstats.h"
+
+using namespace dbus_flashmq;
+
+namespace
+{
+
+double per_second(uint64_t now, uint64_t previous, std::chrono::duration<double> elapsed)
+{
+    if (elapsed.count() <= 0.0 || now < previous)
+        return 0.0;
+
+    return static_cast<double>(now - previous) / elapsed.count();
+}
+
+}
+
+nlohmann::json PluginStats::counters_to_json(const PluginStats &previous, std::chrono::duration<double> elapsed) const
+{
+    nlohmann::json j;
+
+    j["signals"] = {
+        {"ItemsChanged", items_changed_signals},
+        {"PropertiesChanged", properties_changed_signals},
+        {"NameOwnerChanged", name_owner_changed_signals},
+        {"other", other_signals}
+    };
+
+    j["signals_per_second"] = {
+        {"ItemsChanged", per_second(items_changed_signals, previous.items_changed_signals, elapsed)},
+        {"PropertiesChanged", per_second(properties_changed_signals, previous.properties_changed_signals, elapsed)},
+        {"NameOwnerChanged", per_second(name_owner_changed_signals, previous.name_owner_changed_signals, elapsed)},
+        {"other", per_second(other_signals, previous.other_signals, elapsed)}
+    };
+
+    j["items_ingested"] = items_ingested;
+    j["items_ingested_per_second"] = per_second(items_ingested, previous.items_ingested, elapsed);
+    j["publishes"] = item_publishes;
+    j["publishes_per_second"] = per_second(item_publishes, previous.item_publishes, elapsed);
+    j["publish_bytes"] = item_publish_bytes;
+    j["publish_bytes_per_second"] = per_second(item_publish_bytes, previous.item_publish_bytes, elapsed);
+    j["full_publishes"] = full_publishes;
+    j["full_publishes_coalesced"] = full_publishes_coalesced;
+    j["dispatch_yields"] = dispatch_yields;
+    j["dispatch_yields_per_second"] = per_second(dispatch_yields, previous.dispatch_yields, elapsed);
+
+    return j;
+}
@@ -0,0 +1,36 @@
+#ifndef PLUGINSTATS_H
+#define PLUGINSTATS_H
+
+#include <cstdint>
+#include <chrono>
+
+#include "vendor/json.hpp"
+
+namespace dbus_flashmq
+{
+
+/**
+ * @brief The PluginStats struct holds the counters published on N/<portalid>/dbus-flashmq/stats. They're plain members, bumped on the
+ * hot paths of the one plugin thread, and kept together on their own cache line(s).
+ *
+ * The counters only go up. Rates are the difference with the counters of the previous periodic publish.
+ */
+struct alignas(64) PluginStats
+{
+    uint64_t items_changed_signals = 0;
+    uint64_t properties_changed_signals = 0;
+    uint64_t name_owner_changed_signals = 0;
+    uint64_t other_signals = 0;
+    uint64_t items_ingested = 0;
+    uint64_t item_publishes = 0;
+    uint64_t item_publish_bytes = 0;
+    uint64_t full_publishes = 0;
+    uint64_t full_publishes_coalesced = 0;
+    uint64_t dispatch_yields = 0; // Wake-ups that ran out of dispatch budget with D-Bus messages left.
+
+    nlohmann::json counters_to_json(const PluginStats &previous, std::chrono::duration<double> elapsed) const;
+};
+
+}
+
+#endif // PLUGINSTATS_H
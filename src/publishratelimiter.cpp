@@ -0,0 +1,72 @@
+#include "publishratelimiter.h"
+
+#include "utils.h"
+#include "exceptions.h"
+
+using namespace dbus_flashmq;
+
+PublishRateLimiter::PublishRateLimiter(const std::string &spec)
+{
+    for (std::string entry : splitToVector(spec, ',', std::numeric_limits<size_t>::max(), false))
+    {
+        trim(entry);
+
+        if (entry.empty())
+            continue;
+
+        const std::vector<std::string> parts = splitToVector(entry, '=');
+
+        if (parts.size() != 2)
+            throw ValueError("Publish rate limit '" + entry + "' is not of the form 'pattern=milliseconds'.");
+
+        std::string pattern = parts.at(0);
+        std::string interval = parts.at(1);
+        trim(pattern);
+        trim(interval);
+
+        Rule rule;
+        rule.filter = splitToVector(pattern, '/');
+
+        for (size_t i = 0; i < rule.filter.size(); i++)
+        {
+            const std::string &part = rule.filter.at(i);
+
+            if (part.empty() || (part.find_first_of("+#") != std::string::npos && part.length() > 1))
+                throw ValueError("Invalid publish rate limit pattern: " + pattern);
+
+            if (part == "#" && i + 1 != rule.filter.size())
+                throw ValueError("'#' can only be at the end of publish rate limit pattern: " + pattern);
+        }
+
+        try
+        {
+            rule.interval = std::chrono::milliseconds(value_to_int_ranged<uint32_t>(interval, 1, 3600000));
+        }
+        catch (std::exception &ex)
+        {
+            throw ValueError("Invalid interval in publish rate limit '" + entry + "': " + ex.what());
+        }
+
+        rules.push_back(std::move(rule));
+    }
+}
+
+/**
+ * @brief PublishRateLimiter::get_interval gives the minimum time between publishes for a topic, or 0 when there is no limit.
+ * @param topic_suffix is the topic after 'N/<portalid>/'.
+ */
+std::chrono::milliseconds PublishRateLimiter::get_interval(std::string_view topic_suffix) const
+{
+    for (const Rule &rule : rules)
+    {
+        if (mqtt_filter_matches(rule.filter, topic_suffix))
+            return rule.interval;
+    }
+
+    return std::chrono::milliseconds(0);
+}
+
+bool PublishRateLimiter::empty() const
+{
+    return rules.empty();
+}
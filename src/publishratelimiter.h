@@ -0,0 +1,40 @@
+#ifndef PUBLISHRATELIMITER_H
+#define PUBLISHRATELIMITER_H
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <chrono>
+
+namespace dbus_flashmq
+{
+
+/**
+ * @brief The PublishRateLimiter class holds the minimum publish intervals per topic pattern, as configured with the plugin option
+ * 'publish_rate_limits'.
+ *
+ * The option is a comma separated list of 'pattern=milliseconds', where the patterns are MQTT filters on the topic after 'N/<portalid>/',
+ * like 'solarcharger/+/Dc/0/Current=500,+/+/Ac/#=1000'. The first matching pattern wins. The lookup is only done once per item, when
+ * it's added to the store, so matching speed is not a concern.
+ */
+class PublishRateLimiter
+{
+    struct Rule
+    {
+        std::vector<std::string> filter;
+        std::chrono::milliseconds interval;
+    };
+
+    std::vector<Rule> rules;
+
+public:
+    PublishRateLimiter() = default;
+    PublishRateLimiter(const std::string &spec);
+
+    std::chrono::milliseconds get_interval(std::string_view topic_suffix) const;
+    bool empty() const;
+};
+
+}
+
+#endif // PUBLISHRATELIMITER_H
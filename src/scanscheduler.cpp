@@ -0,0 +1,152 @@
+#include "scanscheduler.h"
+
+#include <algorithm>
+
+#include "utils.h"
+#include "exceptions.h"
+
+using namespace dbus_flashmq;
+
+ScanScheduler::ScanScheduler()
+{
+    queues.resize(1);
+}
+
+void ScanScheduler::set_max_in_flight(size_t max_in_flight)
+{
+    if (max_in_flight == 0)
+        throw ValueError("The maximum number of scans in flight can't be 0.");
+
+    this->max_in_flight = max_in_flight;
+}
+
+/**
+ * @brief ScanScheduler::set_priority_service_types
+ * @param spec is a comma separated list of service types, like 'settings,system'. Earlier ones are scanned first.
+ */
+void ScanScheduler::set_priority_service_types(const std::string &spec)
+{
+    if (!queued.empty())
+        throw std::runtime_error("Can't change scan priorities with scans queued.");
+
+    priority_service_types.clear();
+
+    for (std::string service_type : splitToVector(spec, ',', std::numeric_limits<size_t>::max(), false))
+    {
+        trim(service_type);
+
+        if (service_type.empty())
+            continue;
+
+        if (service_type.find_first_of("./") != std::string::npos)
+            throw ValueError("Invalid service type for scan priority: " + service_type);
+
+        priority_service_types.push_back(service_type);
+    }
+
+    queues.clear();
+    queues.resize(priority_service_types.size() + 1);
+}
+
+size_t ScanScheduler::get_queue_index(const std::string &service) const
+{
+    if (!service.starts_with("com.victronenergy."))
+        return priority_service_types.size();
+
+    const std::string service_type = get_service_type(service);
+    auto pos = std::find(priority_service_types.begin(), priority_service_types.end(), service_type);
+    return static_cast<size_t>(pos - priority_service_types.begin());
+}
+
+/**
+ * @brief ScanScheduler::start_initial_scan marks the start of the scan of all services. It's complete when all the services enqueued
+ * until then are done.
+ */
+void ScanScheduler::start_initial_scan()
+{
+    initial_scan_running = true;
+    initial_scan_started_at = std::chrono::steady_clock::now();
+    initial_scan_duration.reset();
+}
+
+void ScanScheduler::enqueue(const std::string &service)
+{
+    if (!queued.insert(service).second)
+        return;
+
+    queues.at(get_queue_index(service)).push_back(service);
+}
+
+/**
+ * @brief ScanScheduler::cancel drops a queued scan, for when a service disappears before we got to it. Scans in flight just finish (or fail).
+ */
+void ScanScheduler::cancel(const std::string &service)
+{
+    if (queued.erase(service) == 0)
+        return;
+
+    std::deque<std::string> &q = queues.at(get_queue_index(service));
+    std::erase(q, service);
+}
+
+/**
+ * @brief ScanScheduler::next gives the next service to scan, if there is one and there's room for it. The caller must call finished()
+ * when the scan is done, successfully or not.
+ */
+std::optional<std::string> ScanScheduler::next()
+{
+    if (in_flight >= max_in_flight)
+        return {};
+
+    for (std::deque<std::string> &q : queues)
+    {
+        if (q.empty())
+            continue;
+
+        std::string service = std::move(q.front());
+        q.pop_front();
+        queued.erase(service);
+        in_flight++;
+        return service;
+    }
+
+    return {};
+}
+
+/**
+ * @brief ScanScheduler::finished frees the slot of a scan.
+ */
+void ScanScheduler::finished()
+{
+    if (in_flight > 0)
+        in_flight--;
+}
+
+/**
+ * @brief ScanScheduler::complete_initial_scan_if_done
+ * @return true only once: when the initial scan has just been found to be done.
+ */
+bool ScanScheduler::complete_initial_scan_if_done()
+{
+    if (!initial_scan_running || in_flight > 0 || !queued.empty())
+        return false;
+
+    initial_scan_running = false;
+    initial_scan_duration = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - initial_scan_started_at);
+    return true;
+}
+
+size_t ScanScheduler::get_queued_count() const
+{
+    return queued.size();
+}
+
+size_t ScanScheduler::get_in_flight_count() const
+{
+    return in_flight;
+}
+
+std::optional<std::chrono::milliseconds> ScanScheduler::get_initial_scan_duration() const
+{
+    return initial_scan_duration;
+}
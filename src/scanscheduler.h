@@ -0,0 +1,56 @@
+#ifndef SCANSCHEDULER_H
+#define SCANSCHEDULER_H
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <unordered_set>
+#include <optional>
+#include <chrono>
+
+namespace dbus_flashmq
+{
+
+/**
+ * @brief The ScanScheduler class decides which services are scanned (GetNameOwner, then GetItems) when, so that we don't flood the bus
+ * at boot by scanning all services at once.
+ *
+ * At most 'max_in_flight' services are being scanned at any time. Because a slot is held for the whole scan of a service, the GetNameOwner
+ * of one service and the GetItems of another are naturally pipelined. Services of the priority types, like 'settings', are scanned
+ * first, in the order they are configured in; the others in the order they appeared.
+ *
+ * It also keeps track of the initial scan, of the services from ListNames, to report how long it took to get a complete state.
+ */
+class ScanScheduler
+{
+    std::vector<std::string> priority_service_types;
+    std::vector<std::deque<std::string>> queues; // One per priority type, plus one for the rest.
+    std::unordered_set<std::string> queued;
+    size_t max_in_flight = 1;
+    size_t in_flight = 0;
+
+    bool initial_scan_running = false;
+    std::chrono::time_point<std::chrono::steady_clock> initial_scan_started_at;
+    std::optional<std::chrono::milliseconds> initial_scan_duration;
+
+    size_t get_queue_index(const std::string &service) const;
+
+public:
+    ScanScheduler();
+
+    void set_max_in_flight(size_t max_in_flight);
+    void set_priority_service_types(const std::string &spec);
+    void start_initial_scan();
+    void enqueue(const std::string &service);
+    void cancel(const std::string &service);
+    std::optional<std::string> next();
+    void finished();
+    bool complete_initial_scan_if_done();
+    size_t get_queued_count() const;
+    size_t get_in_flight_count() const;
+    std::optional<std::chrono::milliseconds> get_initial_scan_duration() const;
+};
+
+}
+
+#endif // SCANSCHEDULER_H
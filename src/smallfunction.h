@@ -0,0 +1,129 @@
+#ifndef SMALLFUNCTION_H
+#define SMALLFUNCTION_H
+
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <functional>
+
+namespace dbus_flashmq
+{
+
+template<typename Signature, size_t Capacity>
+class SmallFunction;
+
+/**
+ * @brief The SmallFunction class is like a move-only std::function, but always stores the callable inline, so creating one never allocates.
+ *
+ * Callables that don't fit are a compile error, not a silent heap allocation. That means captures should be small: pointers and PODs
+ * are fine; a std::string is (at 32 bytes), but it may allocate by itself.
+ */
+template<typename R, typename... Args, size_t Capacity>
+class SmallFunction<R(Args...), Capacity>
+{
+    alignas(std::max_align_t) std::byte storage[Capacity];
+
+    R (*invoker)(void *f, Args... args) = nullptr;
+
+    // Moves the callable from src to dst when dst is given, and destroys the callable in src.
+    void (*manager)(void *dst, void *src) noexcept = nullptr;
+
+    template<typename F>
+    static R invoke(void *f, Args... args)
+    {
+        return (*static_cast<F*>(f))(std::forward<Args>(args)...);
+    }
+
+    template<typename F>
+    static void manage(void *dst, void *src) noexcept
+    {
+        F *f = static_cast<F*>(src);
+
+        if (dst)
+            new (dst) F(std::move(*f));
+
+        f->~F();
+    }
+
+    void move_from(SmallFunction &other) noexcept
+    {
+        if (!other.manager)
+            return;
+
+        other.manager(storage, other.storage);
+        invoker = other.invoker;
+        manager = other.manager;
+        other.invoker = nullptr;
+        other.manager = nullptr;
+    }
+
+public:
+    SmallFunction() = default;
+
+    template<typename F>
+    requires (!std::is_same_v<std::decay_t<F>, SmallFunction> && std::is_invocable_r_v<R, std::decay_t<F>&, Args...>)
+    SmallFunction(F &&f)
+    {
+        using Fn = std::decay_t<F>;
+
+        static_assert(sizeof(Fn) <= Capacity, "Callable too big for SmallFunction. Capture less, or pointers.");
+        static_assert(alignof(Fn) <= alignof(std::max_align_t), "Callable is over-aligned for SmallFunction.");
+        static_assert(std::is_nothrow_move_constructible_v<Fn>, "SmallFunction needs nothrow movable callables.");
+
+        new (storage) Fn(std::forward<F>(f));
+        invoker = &invoke<Fn>;
+        manager = &manage<Fn>;
+    }
+
+    SmallFunction(const SmallFunction &other) = delete;
+
+    SmallFunction(SmallFunction &&other) noexcept
+    {
+        move_from(other);
+    }
+
+    ~SmallFunction()
+    {
+        reset();
+    }
+
+    SmallFunction &operator=(const SmallFunction &other) = delete;
+
+    SmallFunction &operator=(SmallFunction &&other) noexcept
+    {
+        if (this != &other)
+        {
+            reset();
+            move_from(other);
+        }
+
+        return *this;
+    }
+
+    void reset() noexcept
+    {
+        if (manager)
+            manager(nullptr, storage);
+
+        invoker = nullptr;
+        manager = nullptr;
+    }
+
+    R operator()(Args... args)
+    {
+        if (!invoker)
+            throw std::bad_function_call();
+
+        return invoker(storage, std::forward<Args>(args)...);
+    }
+
+    explicit operator bool() const
+    {
+        return invoker != nullptr;
+    }
+};
+
+}
+
+#endif // SMALLFUNCTION_H
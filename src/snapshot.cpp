@@ -0,0 +1,352 @@
+#include "snapshot.h"
+
+#include <cstring>
+#include <memory>
+#include <functional>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "exceptions.h"
+#include "vendor/flashmq_plugin.h"
+
+using namespace dbus_flashmq;
+
+namespace
+{
+
+constexpr std::string_view snapshot_magic{"DBFMQSNP"};
+constexpr uint32_t snapshot_version = 1;
+
+/**
+ * @brief The FileDescriptorGuard class closes the fd when going out of scope.
+ */
+struct FileDescriptorGuard
+{
+    int fd = -1;
+
+    FileDescriptorGuard(int fd) : fd(fd) {}
+    FileDescriptorGuard(const FileDescriptorGuard&) = delete;
+
+    ~FileDescriptorGuard()
+    {
+        if (fd >= 0)
+            close(fd);
+    }
+};
+
+void write_value_min_max(SnapshotWriter &writer, const ValueMinMax &v)
+{
+    v.value.write_snapshot(writer);
+    v.min.write_snapshot(writer);
+    v.max.write_snapshot(writer);
+}
+
+ValueMinMax read_value_min_max(SnapshotReader &reader)
+{
+    ValueMinMax v;
+    v.value = VeVariant::from_snapshot(reader);
+    v.min = VeVariant::from_snapshot(reader);
+    v.max = VeVariant::from_snapshot(reader);
+    return v;
+}
+
+}
+
+SnapshotWriter::SnapshotWriter(std::string &out) :
+    out(out)
+{
+
+}
+
+void SnapshotWriter::write_u8(uint8_t v)
+{
+    out.push_back(static_cast<char>(v));
+}
+
+void SnapshotWriter::write_u32(uint32_t v)
+{
+    out.append(reinterpret_cast<const char*>(&v), sizeof(v));
+}
+
+void SnapshotWriter::write_u64(uint64_t v)
+{
+    out.append(reinterpret_cast<const char*>(&v), sizeof(v));
+}
+
+void SnapshotWriter::write_string(std::string_view s)
+{
+    if (s.size() > std::numeric_limits<uint32_t>::max())
+        throw ValueError("String too long for snapshot.");
+
+    write_u32(static_cast<uint32_t>(s.size()));
+    out.append(s);
+}
+
+SnapshotReader::SnapshotReader(std::string_view in) :
+    in(in)
+{
+
+}
+
+const char *SnapshotReader::take(size_t n)
+{
+    if (n > in.size())
+        throw ValueError("Snapshot is truncated.");
+
+    const char *p = in.data();
+    in.remove_prefix(n);
+    return p;
+}
+
+uint8_t SnapshotReader::read_u8()
+{
+    return static_cast<uint8_t>(*take(1));
+}
+
+uint32_t SnapshotReader::read_u32()
+{
+    uint32_t v;
+    std::memcpy(&v, take(sizeof(v)), sizeof(v));
+    return v;
+}
+
+uint64_t SnapshotReader::read_u64()
+{
+    uint64_t v;
+    std::memcpy(&v, take(sizeof(v)), sizeof(v));
+    return v;
+}
+
+std::string_view SnapshotReader::read_string()
+{
+    const uint32_t len = read_u32();
+    const char *p = take(len);
+    return std::string_view(p, len);
+}
+
+bool SnapshotReader::at_end() const
+{
+    return in.empty();
+}
+
+SnapshotSerializer::SnapshotSerializer(const std::string &vrm_id, std::vector<std::string> &&services) :
+    writer(data),
+    services(std::move(services))
+{
+    data.append(snapshot_magic);
+    writer.write_u32(snapshot_version);
+    writer.write_string(vrm_id);
+
+    // Services can disappear while we're at it, so the count is filled in at the end.
+    service_count_offset = data.size();
+    writer.write_u32(0);
+}
+
+bool SnapshotSerializer::done() const
+{
+    return next >= services.size();
+}
+
+/**
+ * @brief SnapshotSerializer::add_next_service writes the next service with all its items, unless it's gone or we don't know its instance.
+ * @return the number of items written.
+ */
+size_t SnapshotSerializer::add_next_service(std::unordered_map<std::string, std::unordered_map<std::string, Item>> &dbus_service_items,
+                                            const std::unordered_map<std::string, ServiceIdentifier> &service_names_to_instance)
+{
+    const std::string &service = services.at(next++);
+
+    auto pos_items = dbus_service_items.find(service);
+    auto pos_instance = service_names_to_instance.find(service);
+
+    if (pos_items == dbus_service_items.end() || pos_instance == service_names_to_instance.end())
+        return 0;
+
+    writer.write_string(service);
+    writer.write_string(pos_instance->second.getValue());
+    writer.write_u32(static_cast<uint32_t>(pos_items->second.size()));
+
+    for (auto &p : pos_items->second)
+    {
+        Item &item = p.second;
+
+        writer.write_string(item.get_path());
+        write_value_min_max(writer, item.get_value());
+
+        try
+        {
+            writer.write_string(item.as_json());
+        }
+        catch (std::exception&)
+        {
+            // The item is unpublishable anyway; it will be rendered (and fail) again after loading.
+            writer.write_string("");
+        }
+    }
+
+    service_count++;
+    return pos_items->second.size();
+}
+
+std::string SnapshotSerializer::finish()
+{
+    std::memcpy(data.data() + service_count_offset, &service_count, sizeof(service_count));
+    return std::move(data);
+}
+
+/**
+ * @brief serialize_snapshot writes all items, with their rendered JSON, of all services of which we know the instance, in one go.
+ */
+std::string dbus_flashmq::serialize_snapshot(const std::string &vrm_id, std::unordered_map<std::string, std::unordered_map<std::string, Item>> &dbus_service_items,
+                                             const std::unordered_map<std::string, ServiceIdentifier> &service_names_to_instance)
+{
+    std::vector<std::string> services;
+    services.reserve(dbus_service_items.size());
+
+    for (const auto &p : dbus_service_items)
+    {
+        services.push_back(p.first);
+    }
+
+    SnapshotSerializer serializer(vrm_id, std::move(services));
+
+    while (!serializer.done())
+    {
+        serializer.add_next_service(dbus_service_items, service_names_to_instance);
+    }
+
+    return serializer.finish();
+}
+
+/**
+ * @brief write_snapshot_file writes and syncs a temporary file first, and renames it over the old one, so there's never a half written
+ * snapshot, also not after a power cut.
+ */
+void dbus_flashmq::write_snapshot_file(const std::string &path, const std::string &data)
+{
+    const std::string tmp_path = path + ".tmp";
+
+    {
+        FileDescriptorGuard fd(open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600));
+
+        if (fd.fd < 0)
+            throw std::runtime_error("Can't open '" + tmp_path + "' for writing: " + strerror(errno));
+
+        const char *p = data.data();
+        size_t left = data.size();
+
+        while (left > 0)
+        {
+            const ssize_t n = write(fd.fd, p, left);
+
+            if (n < 0)
+            {
+                if (errno == EINTR)
+                    continue;
+
+                const std::string err = strerror(errno);
+                unlink(tmp_path.c_str());
+                throw std::runtime_error("Error writing '" + tmp_path + "': " + err);
+            }
+
+            p += n;
+            left -= static_cast<size_t>(n);
+        }
+
+        // Otherwise, after a power cut, the rename may have made it to disk and the data not, leaving an empty or truncated file.
+        if (fsync(fd.fd) < 0)
+        {
+            const std::string err = strerror(errno);
+            unlink(tmp_path.c_str());
+            throw std::runtime_error("Error syncing '" + tmp_path + "': " + err);
+        }
+    }
+
+    if (rename(tmp_path.c_str(), path.c_str()) < 0)
+    {
+        const std::string err = strerror(errno);
+        unlink(tmp_path.c_str());
+        throw std::runtime_error("Can't rename '" + tmp_path + "' to '" + path + "': " + err);
+    }
+}
+
+/**
+ * @brief read_snapshot_file maps the snapshot into memory and decodes it.
+ * @return the services in the snapshot, or nothing when the file doesn't exist or is for another VRM id.
+ */
+std::vector<SnapshotService> dbus_flashmq::read_snapshot_file(const std::string &path, const std::string &vrm_id)
+{
+    std::vector<SnapshotService> result;
+
+    FileDescriptorGuard fd(open(path.c_str(), O_RDONLY | O_CLOEXEC));
+
+    if (fd.fd < 0)
+    {
+        if (errno == ENOENT)
+            return result;
+
+        throw std::runtime_error("Can't open snapshot '" + path + "': " + strerror(errno));
+    }
+
+    struct stat st;
+    if (fstat(fd.fd, &st) < 0)
+        throw std::runtime_error("Can't stat snapshot '" + path + "': " + strerror(errno));
+
+    const size_t size = static_cast<size_t>(st.st_size);
+
+    if (size < snapshot_magic.size())
+        throw ValueError("Snapshot '" + path + "' is too small.");
+
+    void *mapped = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd.fd, 0);
+
+    if (mapped == MAP_FAILED)
+        throw std::runtime_error("Can't map snapshot '" + path + "': " + strerror(errno));
+
+    std::unique_ptr<void, std::function<void(void*)>> unmapper(mapped, [size](void *p) { munmap(p, size); });
+
+    const std::string_view data(static_cast<const char*>(mapped), size);
+
+    if (!data.starts_with(snapshot_magic))
+        throw ValueError("Snapshot '" + path + "' is not a snapshot.");
+
+    SnapshotReader reader(data.substr(snapshot_magic.size()));
+
+    const uint32_t version = reader.read_u32();
+    if (version != snapshot_version)
+    {
+        flashmq_logf(LOG_NOTICE, "Ignoring snapshot '%s' of version %u.", path.c_str(), version);
+        return result;
+    }
+
+    if (reader.read_string() != vrm_id)
+    {
+        flashmq_logf(LOG_NOTICE, "Ignoring snapshot '%s' of another VRM id.", path.c_str());
+        return result;
+    }
+
+    const uint32_t service_count = reader.read_u32();
+
+    for (uint32_t i = 0; i < service_count; i++)
+    {
+        SnapshotService &service = result.emplace_back();
+        service.service = reader.read_string();
+        service.instance = ServiceIdentifier(std::string(reader.read_string()));
+
+        const uint32_t item_count = reader.read_u32();
+
+        for (uint32_t j = 0; j < item_count; j++)
+        {
+            SnapshotItem &item = service.items.emplace_back();
+            item.path = reader.read_string();
+            item.value = read_value_min_max(reader);
+            item.json = reader.read_string();
+        }
+    }
+
+    if (!reader.at_end())
+        throw ValueError("Snapshot '" + path + "' has trailing data.");
+
+    return result;
+}
@@ -0,0 +1,99 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <unordered_map>
+#include <cstdint>
+
+#include "types.h"
+#include "serviceidentifier.h"
+
+namespace dbus_flashmq
+{
+
+/**
+ * @brief The SnapshotWriter class appends fixed width native endian fields to a buffer. The snapshot is only ever read back on the same
+ * machine, so we don't bother with byte order.
+ */
+class SnapshotWriter
+{
+    std::string &out;
+
+public:
+    SnapshotWriter(std::string &out);
+
+    void write_u8(uint8_t v);
+    void write_u32(uint32_t v);
+    void write_u64(uint64_t v);
+    void write_string(std::string_view s);
+};
+
+/**
+ * @brief The SnapshotReader class reads what SnapshotWriter wrote, from a (memory mapped) buffer, throwing ValueError when it runs out.
+ */
+class SnapshotReader
+{
+    std::string_view in;
+
+    const char *take(size_t n);
+
+public:
+    SnapshotReader(std::string_view in);
+
+    uint8_t read_u8();
+    uint32_t read_u32();
+    uint64_t read_u64();
+    std::string_view read_string();
+    bool at_end() const;
+};
+
+struct SnapshotItem
+{
+    std::string path;
+    ValueMinMax value;
+    std::string json;
+};
+
+struct SnapshotService
+{
+    std::string service;
+    ServiceIdentifier instance;
+    std::vector<SnapshotItem> items;
+};
+
+/**
+ * @brief The SnapshotSerializer class builds a snapshot one service at a time, so that it can be done in slices, between which the item
+ * store can change.
+ *
+ * It only holds on to service names, and looks each one up when it gets to it. Services that are gone by then are left out.
+ */
+class SnapshotSerializer
+{
+    std::string data;
+    SnapshotWriter writer;
+    std::vector<std::string> services;
+    size_t next = 0;
+    uint32_t service_count = 0;
+    size_t service_count_offset = 0;
+
+public:
+    SnapshotSerializer(const std::string &vrm_id, std::vector<std::string> &&services);
+    SnapshotSerializer(const SnapshotSerializer &other) = delete;
+    SnapshotSerializer &operator=(const SnapshotSerializer &other) = delete;
+
+    bool done() const;
+    size_t add_next_service(std::unordered_map<std::string, std::unordered_map<std::string, Item>> &dbus_service_items,
+                            const std::unordered_map<std::string, ServiceIdentifier> &service_names_to_instance);
+    std::string finish();
+};
+
+std::string serialize_snapshot(const std::string &vrm_id, std::unordered_map<std::string, std::unordered_map<std::string, Item>> &dbus_service_items,
+                               const std::unordered_map<std::string, ServiceIdentifier> &service_names_to_instance);
+void write_snapshot_file(const std::string &path, const std::string &data);
+std::vector<SnapshotService> read_snapshot_file(const std::string &path, const std::string &vrm_id);
+
+}
+
+#endif // SNAPSHOT_H
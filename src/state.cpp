@@ -7,6 +7,8 @@
 #include <fstream>
 #include <sstream>
 #include <cassert>
+#include <utility>
+#include <array>
 #include <sys/types.h>
 
 #include "dbus_functions.h"
@@ -21,9 +23,68 @@
 #include "dbuspendingmessagecallguard.h"
 #include "exceptions.h"
 #include "guicustomizations.h"
+#include "snapshot.h"
 
 using namespace dbus_flashmq;
 
+namespace
+{
+
+/**
+ * @brief The ScanCompletion class gives the slot of a scan back to the scan scheduler when the scan coroutine is done, also when it throws.
+ */
+class ScanCompletion
+{
+    State *state = nullptr;
+
+public:
+    ScanCompletion(State *state) :
+        state(state)
+    {
+
+    }
+
+    ScanCompletion(const ScanCompletion &other) = delete;
+
+    ~ScanCompletion()
+    {
+        state->scan_finished();
+    }
+};
+
+/**
+ * @brief The HandlerPath class holds a dbus path in a reply handler. Paths that fit, which is nearly all of them, don't allocate.
+ */
+class HandlerPath
+{
+    std::array<char, 32> inline_path;
+    uint8_t inline_size = 0;
+    std::unique_ptr<std::string> long_path;
+
+public:
+    HandlerPath(const std::string &path)
+    {
+        if (path.size() >= inline_path.size())
+        {
+            long_path = std::make_unique<std::string>(path);
+            return;
+        }
+
+        std::copy(path.begin(), path.end(), inline_path.begin());
+        inline_size = static_cast<uint8_t>(path.size());
+    }
+
+    std::string_view get() const
+    {
+        if (long_path)
+            return *long_path;
+
+        return std::string_view(inline_path.data(), inline_size);
+    }
+};
+
+}
+
 std::atomic_int State::instance_counter = 0;
 
 Watch::~Watch()
@@ -45,23 +106,30 @@ State::State()
     local_nets.emplace_back("127.0.0.0/8");
     local_nets.emplace_back("::1/128");
 
+    scan_scheduler.set_max_in_flight(SCAN_MAX_IN_FLIGHT);
+    scan_scheduler.set_priority_service_types(SCAN_PRIORITY_SERVICE_TYPES);
+
     bridge_connection_states[BRIDGE_DBUS].msg = "pending";
     bridge_connection_states[BRIDGE_RPC].msg = "pending";
 
     dispatch_event_fd = eventfd(0, EFD_NONBLOCK);
     flashmq_poll_add_fd(dispatch_event_fd, EPOLLIN, std::weak_ptr<void>());
+
+    credentials_cache.start_watching();
+    if (credentials_cache.get_fd() >= 0)
+        flashmq_poll_add_fd(credentials_cache.get_fd(), EPOLLIN, std::weak_ptr<void>());
 }
 
 State::~State()
 {
-
+    wait_for_snapshot_writer();
 }
 
-void State::get_unique_id()
+void State::get_unique_id(const std::string &path)
 {
     std::fstream file;
 
-    file.open("/data/venus/unique-id", std::ios::in);
+    file.open(path, std::ios::in);
     getline(file, this->unique_vrm_id);
     trim(this->unique_vrm_id);
 
@@ -126,34 +194,346 @@ void State::add_dbus_to_mqtt_mapping(const std::string &service, std::unordered_
  */
 void State::add_dbus_to_mqtt_mapping(const std::string &service, ServiceIdentifier instance, Item &item, bool force_publish)
 {
+    stats.items_ingested++;
     item.set_mapping_details(unique_vrm_id, service, instance);
-    Item &fully_mapped_item = dbus_service_items[service][item.get_path()];
-    fully_mapped_item = item;
+    auto emplace_result = dbus_service_items[service].try_emplace(item.get_path());
+    Item &fully_mapped_item = emplace_result.first->second;
+    bool changed = true;
+
+    if (emplace_result.second)
+    {
+        fully_mapped_item = item;
+        fully_mapped_item.set_min_publish_interval(publish_rate_limiter.get_interval(fully_mapped_item.get_mqtt_topic_suffix()));
+        topic_index.add(fully_mapped_item);
+        dbus_service_path_tries[service].add(fully_mapped_item);
+        snapshot_dirty = true;
+    }
+    else
+    {
+        // Services send ItemsChanged with values that didn't change. Keeping the item as is keeps its rendered JSON too.
+        changed = count_value_change(fully_mapped_item.set_value(item.get_value()));
+    }
+
+    handle_item_update(fully_mapped_item, changed, force_publish);
+}
+
+/**
+ * @brief State::apply_items_changed applies an ItemsChanged signal straight to the item store.
+ *
+ * This is the hot path, so unlike GetItems replies, it doesn't build an intermediate map of items first. Values of known items are
+ * decoded and compared in place. Only new items are constructed, and when the service isn't fully known yet, we fall back to queueing.
+ */
+void State::apply_items_changed(const std::string &service, DBusMessage *msg)
+{
+    auto pos_service = dbus_service_items.find(service);
+    auto pos_instance = service_names_to_instance.find(service);
+
+    if (pos_service == dbus_service_items.end() || pos_instance == service_names_to_instance.end())
+    {
+        std::unordered_map<std::string, Item> changed_items = get_from_dict_with_dict_with_text_and_value(msg);
+        add_dbus_to_mqtt_mapping(service, changed_items, true);
+        return;
+    }
+
+    if (!dbus_message_has_signature(msg, "a{sa{sv}}"))
+        throw std::runtime_error("ItemsChanged is not the correct signature");
+
+    std::unordered_map<std::string, Item> &items = pos_service->second;
+    const ServiceIdentifier instance = pos_instance->second;
+
+    DBusMessageIter iter;
+    dbus_message_iter_init(msg, &iter);
+
+    DBusMessageIter array_iter;
+    dbus_message_iter_recurse(&iter, &array_iter);
+
+    std::string &path = dbus_path_buffer;
+
+    while (dbus_message_iter_get_arg_type(&array_iter) == DBUS_TYPE_DICT_ENTRY)
+    {
+        try
+        {
+            DBusMessageIter dict_iter;
+            dbus_message_iter_recurse(&array_iter, &dict_iter);
+
+            DBusBasicValue key;
+            dbus_message_iter_get_basic(&dict_iter, &key);
+
+            path.clear();
+            if (key.str[0] != '/')
+                path.push_back('/');
+            path.append(key.str);
+
+            dbus_message_iter_next(&dict_iter);
 
-    if (fully_mapped_item.is_vrm_portal_mode())
+            const ValueMinMax value = ValueMinMax::from_dict(&dict_iter, &dispatch_arena);
+            apply_item_change(service, instance, items, path, value);
+        }
+        catch (std::exception &er)
+        {
+            flashmq_logf(LOG_ERR, "Skipping item creation because: %s", er.what());
+        }
+
+        dbus_message_iter_next(&array_iter);
+    }
+
+    attempt_to_process_delayed_changes();
+}
+
+/**
+ * @brief State::apply_properties_changed applies a PropertiesChanged signal straight to the item store, like apply_items_changed().
+ */
+void State::apply_properties_changed(const std::string &service, DBusMessage *msg)
+{
+    auto pos_service = dbus_service_items.find(service);
+    auto pos_instance = service_names_to_instance.find(service);
+
+    if (pos_service == dbus_service_items.end() || pos_instance == service_names_to_instance.end())
+    {
+        std::unordered_map<std::string, Item> changed_items = get_from_properties_changed(msg);
+        add_dbus_to_mqtt_mapping(service, changed_items, true);
+        return;
+    }
+
+    if (!dbus_message_has_signature(msg, "a{sv}"))
+        throw ValueError("PropertiesChanged is not the correct signature.");
+
+    DBusMessageIter iter;
+    dbus_message_iter_init(msg, &iter);
+
+    dbus_path_buffer.assign(dbus_message_get_path(msg));
+
+    const ValueMinMax value = ValueMinMax::from_dict(&iter, &dispatch_arena);
+
+    if (!value.value && !value.min && !value.max)
+        throw ValueError("PropertiesChanged for '" + dbus_path_buffer + "' has no Value, Min or Max.");
+
+    apply_item_change(service, pos_instance->second, pos_service->second, dbus_path_buffer, value);
+    attempt_to_process_delayed_changes();
+}
+
+/**
+ * @brief State::apply_item_change updates or adds one item of a signal. The value may be in the dispatch arena, so it's copied to store it.
+ */
+void State::apply_item_change(const std::string &service, ServiceIdentifier instance, std::unordered_map<std::string, Item> &items,
+                              const std::string &path, const ValueMinMax &value)
+{
+    auto pos_item = items.find(path);
+    if (pos_item != items.end())
+    {
+        stats.items_ingested++;
+        Item &item = pos_item->second;
+        const bool changed = count_value_change(item.set_value(value));
+        handle_item_update(item, changed, false);
+        return;
+    }
+
+    Item item = Item::from_path_and_value(path, ValueMinMax(value));
+    add_dbus_to_mqtt_mapping(service, instance, item, false);
+}
+
+/**
+ * @brief State::handle_item_update does what needs doing after an item in the store got a new value: side effects of special items,
+ * and publishing it.
+ */
+void State::handle_item_update(Item &item, bool changed, bool force_publish)
+{
+    if (item.is_vrm_portal_mode())
     {
-        this->vrm_portal_mode = parseVrmPortalMode(fully_mapped_item.get_value().value.as_int<int>());
+        this->vrm_portal_mode = parseVrmPortalMode(item.get_value().value.as_int<int>());
         this->write_all_bridge_connection_states_debounced();
     }
 
-    if (fully_mapped_item.is_mqtt_local())
+    if (item.is_mqtt_local())
     {
-        this->mqtt_local_mode = parseMqttLocal(fully_mapped_item.get_value().value.as_int<int>());
+        this->mqtt_local_mode = parseMqttLocal(item.get_value().value.as_int<int>());
         this->disconnect_all_applicable_lan_clients(this->mqtt_local_mode);
     }
 
-    if (this->alive || fully_mapped_item.should_be_retained() || force_publish)
-        fully_mapped_item.publish();
+    if (force_publish)
+        publish_item(item);
+    else if (changed && (this->alive || item.should_be_retained()))
+        publish_changed_item(item);
+}
+
+bool State::count_value_change(bool changed)
+{
+    if (changed)
+    {
+        this->changed_values_count++;
+        this->snapshot_dirty = true;
+    }
+    else
+        this->unchanged_values_count++;
+
+    return changed;
+}
+
+void State::publish_item(Item &item, bool null_payload)
+{
+    const size_t bytes = item.publish(null_payload);
+
+    if (bytes > 0)
+    {
+        stats.item_publishes++;
+        stats.item_publish_bytes += bytes;
+
+        if (signal_read_at)
+            signal_to_publish_latency.record_since(signal_read_at.value());
+    }
+}
+
+/**
+ * @brief State::publish_changed_item publishes an item because its value changed, unless that's too soon for its rate limit. In that
+ * case it's published when the interval expires, with whatever the value is by then.
+ */
+void State::publish_changed_item(Item &item)
+{
+    if (!is_wanted(item))
+        return;
+
+    const std::chrono::milliseconds delay = item.get_publish_delay(std::chrono::steady_clock::now());
+
+    if (delay.count() == 0)
+    {
+        publish_item(item);
+        return;
+    }
+
+    if (!item.is_publish_pending())
+    {
+        item.set_publish_pending(true);
+        pending_publishes.push_back(&item);
+    }
+
+    schedule_pending_publishes(delay);
+}
+
+bool State::has_vrm_bridge_interest() const
+{
+    return vrm_bridge_interest;
+}
+
+void State::mark_vrm_bridge_interest()
+{
+    this->vrmBridgeInterestTime = std::chrono::steady_clock::now();
+    this->vrm_bridge_interest = true;
+}
+
+void State::update_vrm_bridge_interest()
+{
+    this->vrm_bridge_interest = std::chrono::steady_clock::now() <= this->vrmBridgeInterestTime + std::chrono::seconds(VRM_INTEREST_TIMEOUT_SECONDS);
+}
+
+/**
+ * @brief State::is_wanted says whether publishing an item is useful. Without subscription aware publishing, that's always. With it,
+ * only when a local client has a matching subscription, or when VRM shows interest, because the subscriptions of the bridge to
+ * VRM don't go through the plugin.
+ */
+bool State::is_wanted(Item &item) const
+{
+    if (!this->subscription_aware_publishing)
+        return true;
+
+    if (item.should_be_retained() || has_vrm_bridge_interest())
+        return true;
+
+    return subscription_tracker.has_subscriber(item);
+}
+
+void State::schedule_pending_publishes(std::chrono::milliseconds delay)
+{
+    const auto due_at = std::chrono::steady_clock::now() + delay;
+
+    if (pending_publishes_task_id)
+    {
+        if (pending_publishes_due_at <= due_at)
+            return;
+
+        flashmq_remove_task(pending_publishes_task_id);
+    }
+
+    auto f = std::bind(&State::publish_pending_publishes, this);
+    this->pending_publishes_task_id = flashmq_add_task(f, static_cast<uint32_t>(delay.count()));
+    this->pending_publishes_due_at = due_at;
+}
+
+void State::publish_pending_publishes()
+{
+    this->pending_publishes_task_id = 0;
+
+    const auto now = std::chrono::steady_clock::now();
+    std::chrono::milliseconds next_delay = std::chrono::milliseconds::max();
+    std::vector<Item*> still_pending;
+
+    for (Item *item : pending_publishes)
+    {
+        // Another publish, like a full publish on keepalive, may have taken care of it already.
+        if (!item->is_publish_pending())
+            continue;
+
+        const std::chrono::milliseconds delay = item->get_publish_delay(now);
+
+        if (delay.count() > 0)
+        {
+            next_delay = std::min(next_delay, delay);
+            still_pending.push_back(item);
+            continue;
+        }
+
+        if (this->alive || item->should_be_retained())
+            publish_item(*item);
+        else
+            item->set_publish_pending(false);
+    }
+
+    pending_publishes = std::move(still_pending);
+
+    if (!pending_publishes.empty())
+        schedule_pending_publishes(next_delay);
 }
 
 /**
  * @brief State::find_item_by_mqtt_path get item by value based on topic.
  * @param topic
+ *
+ * The normal case is served from the topic index, without allocations. When that misses, we take the long way, to be able to
+ * report whether the service exists, which handle_read() uses to request sub-trees.
  */
-const Item &State::find_item_by_mqtt_path(const std::string &topic) const
+const Item &State::find_item_by_mqtt_path(std::string_view topic) const
 {
     // Example topic: N/48e7da87942f/solarcharger/258/Link
 
+    const size_t vrm_id_start = topic.find('/');
+
+    if (vrm_id_start != std::string_view::npos)
+    {
+        const size_t suffix_start = topic.find('/', vrm_id_start + 1);
+
+        if (suffix_start != std::string_view::npos)
+        {
+            const std::string_view vrm_id = topic.substr(vrm_id_start + 1, suffix_start - vrm_id_start - 1);
+
+            if (vrm_id != this->unique_vrm_id)
+                throw std::runtime_error("Second subpath should match local VRM id. It doesn't.");
+
+            const Item *item = topic_index.find(topic.substr(suffix_start + 1));
+
+            if (item)
+                return *item;
+        }
+    }
+
+    return find_item_by_mqtt_path_slow(std::string(topic));
+}
+
+Item &State::find_item_by_mqtt_path(std::string_view topic)
+{
+    return const_cast<Item&>(std::as_const(*this).find_item_by_mqtt_path(topic));
+}
+
+const Item &State::find_item_by_mqtt_path_slow(const std::string &topic) const
+{
     std::vector<std::string> parts = splitToVector(topic, '/', 4);
 
     const std::string &vrm_id = parts.at(1);
@@ -243,15 +623,18 @@ void State::attempt_to_process_delayed_changes()
                      i.item.get_service_name().c_str(), i.item.get_path().c_str(), i.item.get_value().value.as_text().c_str());
 
         Item &item = find_matching_active_item(i.item);
-        item.set_value(i.item.get_value());
+        const bool changed = count_value_change(item.set_value(i.item.get_value()));
 
-        if (this->alive)
-            item.publish();
+        if (changed && this->alive)
+            publish_changed_item(item);
     }
 }
 
 void State::open()
 {
+    if (method_call_sink)
+        return;
+
     DBusErrorGuard err;
     con = dbus_bus_get(DBusBusType::DBUS_BUS_SYSTEM, err.get());
     err.throw_error();
@@ -268,15 +651,21 @@ void State::open()
     this->setDispatchable();
 }
 
-dbus_uint32_t State::call_method(const std::string &service, const std::string &path, const std::string &interface, const std::string &method,
-                                 const std::vector<VeVariant> &args, bool wrap_arguments_in_variant)
+/**
+ * @brief State::call_method calls a dbus method asynchronously.
+ * @param handler is called with the reply, or with an error (like 'org.freedesktop.DBus.Error.NoReply' on timeout).
+ * @param timeout defaults to the configured dbus call timeout.
+ */
+dbus_uint32_t State::call_method(const std::string &service, const std::string &path, const char *interface, const char *method,
+                                 AsyncHandler &&handler, std::span<const VeVariant> args, bool wrap_arguments_in_variant,
+                                 std::optional<std::chrono::milliseconds> timeout)
 {
     if (!dbus_validate_path(path.c_str(), nullptr))
     {
         throw std::runtime_error("Path '" + path + "' is not valid for method call.");
     }
 
-    DBusMessageGuard msg = dbus_message_new_method_call(service.c_str(), path.c_str(), interface.c_str(), method.c_str());
+    DBusMessageGuard msg = dbus_message_new_method_call(service.c_str(), path.c_str(), interface, method);
 
     if (!msg.d)
     {
@@ -299,8 +688,23 @@ dbus_uint32_t State::call_method(const std::string &service, const std::string &
 
     }
 
+    const std::chrono::milliseconds call_timeout = timeout.value_or(this->dbus_call_timeout);
+
+    if (method_call_sink)
+    {
+        const dbus_uint32_t serial = ++method_call_sink_serial;
+        dbus_message_set_serial(msg.d, serial);
+
+        if (trace_recorder)
+            trace_recorder->record_dbus_call(msg.d);
+
+        async_handlers.add(serial, std::move(handler), call_timeout, method, service);
+        method_call_sink(msg.d);
+        return serial;
+    }
+
     DBusPendingMessageCallGuard pendingCall;
-    dbus_bool_t send_reply_result = dbus_connection_send_with_reply(con, msg.d, &pendingCall.d, -1);
+    dbus_bool_t send_reply_result = dbus_connection_send_with_reply(con, msg.d, &pendingCall.d, static_cast<int>(call_timeout.count()));
 
     if (!pendingCall.d || !send_reply_result)
         throw std::runtime_error("Tried method call but failed: DBusPendingCall is null or result was false.");
@@ -311,11 +715,18 @@ dbus_uint32_t State::call_method(const std::string &service, const std::string &
     }
 
     dbus_uint32_t serial = dbus_message_get_serial(msg.d);
+
+    if (trace_recorder)
+        trace_recorder->record_dbus_call(msg.d);
+
+    async_handlers.add(serial, std::move(handler), call_timeout, method, service);
     return serial;
 }
 
 void State::write_to_dbus(const std::string &topic, const std::string &payload)
 {
+    const auto written_at = std::chrono::steady_clock::now();
+
     flashmq_logf(LOG_DEBUG, "[Write] Writing '%s' to '%s'", payload.c_str(), topic.c_str());
 
     const nlohmann::json j = nlohmann::json::parse(payload);
@@ -332,25 +743,25 @@ void State::write_to_dbus(const std::string &topic, const std::string &payload)
 
     flashmq_logf(LOG_DEBUG, "[Write] Determined dbus type of '%s' as '%s'", json_value.dump().c_str(), new_value.get_dbus_type_as_string_recursive().c_str());
 
-    std::vector<VeVariant> args;
-    args.push_back(new_value);
-    dbus_uint32_t serial = call_method(item.get_service_name(), item.get_path(), "com.victronenergy.BusItem", "SetValue", args, true);
+    // Holding on to the item, instead of a copy of the topic. If its service wasn't removed in the meantime, it's still there.
+    const auto *removals = get_service_removals(item.get_service_name());
+    auto set_value_handler = [state = this, item = &item, removals, removals_at_call = removals->second, written_at](DBusMessage *msg) {
+        state->write_to_reply_latency.record_since(written_at);
 
-    auto set_value_handler = [](const std::string &topic, DBusMessage *msg) {
+        const char *topic = removals->second == removals_at_call ? item->get_mqtt_topic().data() : "(removed item)";
         const int msg_type = dbus_message_get_type(msg);
 
         if (msg_type == DBUS_MESSAGE_TYPE_ERROR)
         {
             std::string error = dbus_message_get_error_name_safe(msg);
-            flashmq_logf(LOG_ERR, "Error on 'SetValue' on %s: %s", topic.c_str(), error.c_str());
+            flashmq_logf(LOG_ERR, "Error on 'SetValue' on %s: %s", topic, error.c_str());
             return;
         }
 
-        flashmq_logf(LOG_DEBUG, "SetValue on '%s' successful.", topic.c_str());
+        flashmq_logf(LOG_DEBUG, "SetValue on '%s' successful.", topic);
     };
 
-    auto handler = std::bind(set_value_handler, topic, std::placeholders::_1);
-    this->async_handlers[serial] = handler;
+    call_method(item.get_service_name(), item.get_path(), "com.victronenergy.BusItem", "SetValue", set_value_handler, {&new_value, 1}, true);
 }
 
 ServiceIdentifier State::store_and_get_instance_from_service(const std::string &service, const std::unordered_map<std::string, Item> &items, bool instance_must_be_known)
@@ -398,8 +809,9 @@ void State::handle_keepalive(const std::string &payload)
     // Cheating: I don't actually need to parse the json.
     bool suppress_publish_of_all = payload.find("suppress-republish") != std::string::npos;
 
-    // Rate limit keep-alives that cause republish. It's been seen in the field some installations get hundreds at once.
-    if (!suppress_publish_of_all && this->keepAliveTokens-- > 0)
+    // Rate limit keep-alives that cause republish. It's been seen in the field some installations get hundreds at once. Joining a
+    // full publish that is already queued doesn't cost anything, so that one doesn't take a token.
+    if (!suppress_publish_of_all && (this->full_publish_queued || this->keepAliveTokens-- > 0))
     {
         std::optional<std::string> payload_echo;
 
@@ -467,19 +879,117 @@ void State::heartbeat()
     heartbeat_task_id = flashmq_add_task(f, 3000);
 }
 
+/**
+ * @brief State::publish_all queues a publish of all items, which is done in slices, yielding to the event loop in between.
+ *
+ * When several clients send a keepalive at the same time, they all share one full publish: requests within the coalesce window
+ * join the queued publish, and get their echo when it's done. Requests that arrive while a full publish is in progress, join the
+ * one after it, because items of the current one may already have been published before the request was made.
+ */
 void State::publish_all(const std::optional<std::string> &payload_echo)
 {
+    full_publish_queued_echos.push_back(payload_echo);
+
+    if (full_publish_queued)
+    {
+        stats.full_publishes_coalesced++;
+        return;
+    }
+
+    full_publish_queued = true;
+
+    // It will be started when the current one completes.
+    if (full_publish_job)
+        return;
+
+    if (keepalive_coalesce_window.count() == 0)
+    {
+        start_queued_full_publish();
+        return;
+    }
+
+    auto f = std::bind(&State::start_queued_full_publish, this);
+    this->full_publish_coalesce_task_id = flashmq_add_task(f, static_cast<uint32_t>(keepalive_coalesce_window.count()));
+}
+
+void State::start_queued_full_publish()
+{
+    this->full_publish_coalesce_task_id = 0;
+
+    if (!full_publish_queued || full_publish_job)
+        return;
+
+    full_publish_queued = false;
+    start_full_publish(std::move(full_publish_queued_echos));
+    full_publish_queued_echos.clear();
+    continue_full_publish();
+}
+
+void State::start_full_publish(std::vector<std::optional<std::string>> &&payload_echos)
+{
+    stats.full_publishes++;
+
+    FullPublishJob &job = full_publish_job.emplace();
+    job.payload_echos = std::move(payload_echos);
+
     for (auto &p : dbus_service_items)
     {
         for (auto &p2 : p.second)
         {
-            Item &i = p2.second;
-            i.publish();
+            job.items.push_back(&p2.second);
         }
     }
+}
+
+void State::continue_full_publish()
+{
+    this->full_publish_task_id = 0;
+
+    if (!full_publish_job)
+        return;
+
+    FullPublishJob &job = full_publish_job.value();
+
+    const auto slice_start = std::chrono::steady_clock::now();
+    size_t count = 0;
+
+    while (!job.done())
+    {
+        Item *item = job.items.at(job.next++);
+
+        if (is_wanted(*item))
+            publish_item(*item);
+
+        // Looking at the clock every couple of items is enough.
+        if (++count >= full_publish_slice_items || (count % 16 == 0 && std::chrono::steady_clock::now() - slice_start >= full_publish_slice_duration))
+            break;
+    }
+
+    if (!job.done())
+    {
+        auto f = std::bind(&State::continue_full_publish, this);
+        this->full_publish_task_id = flashmq_add_task(f, 0);
+        return;
+    }
 
     guiCustomizations.publish_customizations(this->unique_vrm_id, nullptr, nullptr);
 
+    for (const std::optional<std::string> &payload_echo : job.payload_echos)
+    {
+        publish_full_publish_completed(payload_echo);
+    }
+
+    full_publish_job.reset();
+
+    if (full_publish_queued)
+    {
+        auto f = std::bind(&State::start_queued_full_publish, this);
+        this->full_publish_coalesce_task_id = flashmq_add_task(f, 0);
+    }
+}
+
+void State::publish_full_publish_completed(const std::optional<std::string> &payload_echo)
+{
     std::ostringstream done_topic;
     done_topic << "N/" << unique_vrm_id << "/full_publish_completed";
 
@@ -511,16 +1021,18 @@ void State::set_new_id_to_owner(const std::string &owner, const std::string &nam
 /**
  * @brief State::get_named_owner
  * @param sender Like 1:31
- * @return
+ * @return The well-known name, or sender itself when there is none. Not a copy, so signal handling doesn't allocate for it.
  */
-void State::get_named_owner(std::string &sender) const
+const std::string &State::get_named_owner(const std::string &sender) const
 {
     if (!sender.starts_with("com.victronenergy"))
     {
         auto pos = service_id_to_names.find(sender);
         if (pos != service_id_to_names.end())
-            sender = pos->second;
+            return pos->second;
     }
+
+    return sender;
 }
 
 /**
@@ -536,12 +1048,41 @@ void State::remove_id_to_owner(const std::string &owner)
 /**
  * @brief State::handle_read
  * @param topic like 'R/48e7da87942f/system/0/Ac/Grid/L2/Power'
+ * @param payload is normally empty, but can be '{ "fresh": true }' to have sub-tree reads bypass the cache.
  *
  * Read a fresh value and make sure item is added. This is because a path may not always send
  * PropertiesChanged (eg /vebus/Hub4/L1/AcPowerSetpoint) but can nevertheless be read.
+ *
+ * Reads on sub-trees, like 'R/48e7da87942f/solarcharger/279/Dc', are answered with the items we have, because a GetValue on a
+ * sub-tree makes the service serialize all of it. We only go to dbus when we have nothing under that path, or when asked to.
  */
-void State::handle_read(const std::string &topic, const std::vector<std::string> &subtopics)
+void State::handle_read(const std::string &topic, const std::vector<std::string> &subtopics, const std::string &payload)
 {
+    if (subtopics.at(2) == std::string_view("dbus-flashmq") && subtopics.size() == 4 && subtopics.at(3) == "stats")
+    {
+        publish_stats(false);
+
+        try
+        {
+            // A read with {"log": true} also puts the latencies in the log.
+            if (!payload.empty())
+            {
+                const nlohmann::json j = nlohmann::json::parse(payload);
+
+                if (j.is_object() && j.value("log", false))
+                    log_latencies();
+            }
+        }
+        catch (nlohmann::json::exception &ex)
+        {
+            flashmq_logf(LOG_DEBUG, "Failure parsing stats read options: %s", ex.what());
+        }
+
+        return;
+    }
+
+    const auto read_at = std::chrono::steady_clock::now();
+
     if (subtopics.at(2) == std::string_view("GuiCustomizations"))
     {
         this->guiCustomizations.publish_customizations(this->unique_vrm_id, &topic, &subtopics);
@@ -550,16 +1091,23 @@ void State::handle_read(const std::string &topic, const std::vector<std::string>
 
     try
     {
-        const Item &item = find_item_by_mqtt_path(topic);
-        dbus_uint32_t serial = call_method(item.get_service_name(), item.get_path(), "com.victronenergy.BusItem", "GetValue");
+        Item &item = find_item_by_mqtt_path(topic);
+
+        // Not copying the item; if its service wasn't removed in the meantime, it's still in the store when the reply comes in.
+        const auto *removals = get_service_removals(item.get_service_name());
+        auto get_value_handler = [state = this, item = &item, removals, removals_at_call = removals->second, read_at](DBusMessage *msg) {
+            if (removals->second != removals_at_call)
+            {
+                flashmq_logf(LOG_DEBUG, "Discarding 'GetValue' reply, because '%s' was removed in the meantime.", removals->first.c_str());
+                return;
+            }
 
-        auto get_value_handler = [](State *state, const Item &item, DBusMessage *msg) {
             const int msg_type = dbus_message_get_type(msg);
 
             if (msg_type == DBUS_MESSAGE_TYPE_ERROR)
             {
                 std::string error = dbus_message_get_error_name_safe(msg);
-                flashmq_logf(LOG_ERR, "Error on 'GetValue' from %s: %s", item.get_path().c_str(), error.c_str());
+                flashmq_logf(LOG_ERR, "Error on 'GetValue' from %s: %s", item->get_path().c_str(), error.c_str());
                 return;
             }
 
@@ -570,20 +1118,62 @@ void State::handle_read(const std::string &topic, const std::vector<std::string>
             ValueMinMax val;
             val.value = std::move(answer);
 
-            Item &real_item = state->find_matching_active_item(item);
-            real_item.set_value(val);
-            real_item.publish();
+            item->set_value(val);
+            state->publish_item(*item);
+            state->read_to_publish_latency.record_since(read_at);
         };
 
-        auto handler = std::bind(get_value_handler, this, item, std::placeholders::_1);
-        this->async_handlers[serial] = handler;
+        call_method(item.get_service_name(), item.get_path(), "com.victronenergy.BusItem", "GetValue", get_value_handler);
     }
     catch (ItemNotFound &info)
     {
-        get_value(info.service, info.dbus_like_path, true);
+        bool fresh = false;
+
+        try
+        {
+            if (!payload.empty())
+            {
+                const nlohmann::json j = nlohmann::json::parse(payload);
+
+                if (j.is_object())
+                    fresh = j.value("fresh", false);
+            }
+        }
+        catch (nlohmann::json::exception &ex)
+        {
+            flashmq_logf(LOG_DEBUG, "Failure parsing read options: %s", ex.what());
+        }
+
+        if (!fresh && publish_sub_tree_from_cache(info.service, info.dbus_like_path) > 0)
+        {
+            read_to_publish_latency.record_since(read_at);
+            return;
+        }
+
+        get_value(info.service, info.dbus_like_path, true, read_at);
     }
 }
 
+/**
+ * @brief State::publish_sub_tree_from_cache publishes the items we know of, on and below a path of a service.
+ * @param service like 'com.victronenergy.solarcharger.ttyO2'.
+ * @param path like '/Dc'.
+ * @return the number of items published.
+ */
+size_t State::publish_sub_tree_from_cache(const std::string &service, const std::string &path)
+{
+    auto pos = dbus_service_path_tries.find(service);
+
+    if (pos == dbus_service_path_tries.end())
+        return 0;
+
+    const ItemPathTrie &trie = pos->second;
+
+    return trie.for_each_below(path, [this](Item &item) {
+        publish_item(item);
+    });
+}
+
 /**
  * @brief State::initiate_broker_registration calls a dbus method to have Venus Platform call mosquitto_bridge_registrator.py. Contrary to
  * the previous dbus-mqtt, we are not root anymore, so we can't do it directly.
@@ -600,32 +1190,30 @@ void State::initiate_broker_registration(uint32_t delay)
         return;
     }
 
-    auto register_at_vrm_handler = [](State *state, DBusMessage *msg) {
-        state->register_pending_id = 0;
-
-        const int msg_type = dbus_message_get_type(msg);
+    auto f = [state = this]() {
+        state->register_at_vrm();
+    };
 
-        if (msg_type == DBUS_MESSAGE_TYPE_ERROR)
-        {
-            std::string error = dbus_message_get_error_name_safe(msg);
-            flashmq_logf(LOG_ERR, "Error on SetValue on /Mqtt/RegisterOnVrm: %s", error.c_str());
-            return;
-        }
+    register_pending_id = flashmq_add_task(f, delay);
+}
 
-        flashmq_logf(LOG_NOTICE, "SetValue on /Mqtt/RegisterOnVrm seemingly successful.");
-    };
+DbusTask State::register_at_vrm()
+{
+    flashmq_logf(LOG_NOTICE, "Initiating bridge registration.");
 
-    auto register_f = [register_at_vrm_handler](State *state) {
-        flashmq_logf(LOG_NOTICE, "Initiating bridge registration.");
+    const VeVariant arg("1");
+    const DbusReply reply = co_await dbus_call(this, "com.victronenergy.platform", "/Mqtt/RegisterOnVrm", "com.victronenergy.platform", "SetValue",
+                                               {&arg, 1}, true);
 
-        dbus_uint32_t serial = state->call_method("com.victronenergy.platform", "/Mqtt/RegisterOnVrm", "com.victronenergy.platform", "SetValue", {{"1"}}, true);
+    register_pending_id = 0;
 
-        auto handler_f = std::bind(register_at_vrm_handler, state, std::placeholders::_1);
-        state->async_handlers[serial] = handler_f;
-    };
+    if (reply.is_error())
+    {
+        flashmq_logf(LOG_ERR, "Error on SetValue on /Mqtt/RegisterOnVrm: %s", reply.get_error_name().c_str());
+        co_return;
+    }
 
-    auto f = std::bind(register_f, this);
-    register_pending_id = flashmq_add_task(f, delay);
+    flashmq_logf(LOG_NOTICE, "SetValue on /Mqtt/RegisterOnVrm seemingly successful.");
 }
 
 void State::per_second_action()
@@ -634,6 +1222,8 @@ void State::per_second_action()
     start_one_second_timer();
 
     this->keepAliveTokens = KEEPALIVE_TOKENS;
+    update_vrm_bridge_interest();
+
     this->loginTokensShortTerm = std::min<int>(LOGIN_TOKENS_SHORT_TERM, this->loginTokensShortTerm + 1);
 
     if (this->longTermLoginTokensResetAt + std::chrono::hours(24) < std::chrono::steady_clock::now())
@@ -644,6 +1234,10 @@ void State::per_second_action()
         this->longTermLoginTokensResetAt = std::chrono::steady_clock::now();
         this->passwordHistory.clear();
     }
+
+    // So a trace is complete up to the last second, when we're killed.
+    if (trace_recorder)
+        trace_recorder->flush();
 }
 
 void State::start_one_second_timer()
@@ -661,6 +1255,26 @@ void State::per_minute_action()
     start_one_minute_timer();
 
     purge_old_usernames_to_clientids();
+    subscription_tracker.purge_disconnected_clients(std::chrono::seconds(DISCONNECTED_SUBSCRIPTIONS_EXPIRY_SECONDS));
+
+    if (this->unchanged_values_count > 0)
+    {
+        flashmq_logf(LOG_INFO, "Value updates in the last minute: %zu changed, %zu unchanged and not published.",
+                     this->changed_values_count, this->unchanged_values_count);
+    }
+
+    this->changed_values_count = 0;
+    this->unchanged_values_count = 0;
+
+    const size_t lost = async_handlers.expire_lost(std::chrono::milliseconds(DBUS_CALL_LOST_GRACE_MILLISECONDS));
+    const std::optional<std::chrono::milliseconds> oldest = async_handlers.get_oldest_age();
+
+    if (lost > 0 || (oldest && oldest.value() > dbus_call_timeout))
+    {
+        flashmq_logf(LOG_WARNING, "Dbus calls in flight: %zu, the oldest pending for %ld ms. Calls that never completed: %zu in total.",
+                     async_handlers.get_in_flight_count(), static_cast<long>(oldest.value_or(std::chrono::milliseconds(0)).count()),
+                     async_handlers.get_lost_count());
+    }
 }
 
 void State::start_one_minute_timer()
@@ -677,50 +1291,28 @@ bool State::match_local_net(const sockaddr *addr) const
     return std::any_of(local_nets.begin(), local_nets.end(), [addr](const Network &net){ return net.match(addr);});
 }
 
-void State::write_bridge_connection_state(const std::string &bridge, const std::optional<bool> connected, const std::string &msg)
+DbusTask State::write_bridge_connection_state(std::string bridge, const std::optional<bool> connected, std::string msg)
 {
-    auto answer_handler = [](const std::string &path, DBusMessage *msg) {
-        const int msg_type = dbus_message_get_type(msg);
-
-        if (msg_type == DBUS_MESSAGE_TYPE_ERROR)
-        {
-            std::string error = dbus_message_get_error_name_safe(msg);
-            flashmq_logf(LOG_ERR, "Error on SetValue on '%s': %s", path.c_str(), error.c_str());
-            return;
-        }
-    };
-
     const std::string bool_val_for_log = connected.has_value() ? std::to_string(connected.value()) : "null";
     flashmq_logf(LOG_NOTICE, "Setting bridge connection status of %s to %s (%s).",
                  bridge.c_str(), bool_val_for_log.c_str(), msg.c_str());
 
-    {
-        VeVariant bool_variant(connected);
-
-        const std::string path = "/Mqtt/Bridges/" + bridge + "/Connected";
-        const dbus_uint32_t serial = call_method(
-                    "com.victronenergy.platform",
-                    path,
-                    "com.victronenergy.platform",
-                    "SetValue", {bool_variant}, true);
+    const std::string platform("com.victronenergy.platform");
+    const std::string connected_path = "/Mqtt/Bridges/" + bridge + "/Connected";
+    const std::string status_path = "/Mqtt/Bridges/" + bridge + "/ConnectionStatus";
+    const VeVariant bool_variant(connected);
+    const VeVariant msg_variant(msg);
 
-        auto handler = std::bind(answer_handler, path, std::placeholders::_1);
-        this->async_handlers[serial] = handler;
-    }
+    const auto [connected_reply, status_reply] = co_await when_all(
+        this,
+        DbusCallSpec(platform, connected_path, "com.victronenergy.platform", "SetValue", {&bool_variant, 1}, true),
+        DbusCallSpec(platform, status_path, "com.victronenergy.platform", "SetValue", {&msg_variant, 1}, true));
 
-    {
-        VeVariant msg_variant(msg);
+    if (connected_reply.is_error())
+        flashmq_logf(LOG_ERR, "Error on SetValue on '%s': %s", connected_path.c_str(), connected_reply.get_error_name().c_str());
 
-        const std::string path = "/Mqtt/Bridges/" + bridge + "/ConnectionStatus";
-        const dbus_uint32_t serial = call_method(
-                    "com.victronenergy.platform",
-                    path,
-                    "com.victronenergy.platform",
-                    "SetValue", {msg_variant}, true);
-
-        auto handler = std::bind(answer_handler, path, std::placeholders::_1);
-        this->async_handlers[serial] = handler;
-    }
+    if (status_reply.is_error())
+        flashmq_logf(LOG_ERR, "Error on SetValue on '%s': %s", status_path.c_str(), status_reply.get_error_name().c_str());
 }
 
 void State::write_all_bridge_connection_states_debounced()
@@ -789,6 +1381,23 @@ void State::decrement_login_tokens()
         loginTokensLongTerm--;
 }
 
+/**
+ * @brief State::refund_login_token gives back a token taken by decrement_login_tokens(), for a password that turned out to be right.
+ */
+void State::refund_login_token()
+{
+    loginTokensShortTerm = std::min(loginTokensShortTerm + 1, LOGIN_TOKENS_SHORT_TERM);
+    loginTokensLongTerm = std::min(loginTokensLongTerm + 1, LOGIN_TOKENS_LONG_TERM);
+}
+
+void State::start_crypt_workers(size_t thread_count)
+{
+    crypt_workers.start(thread_count);
+
+    if (crypt_workers.get_fd() >= 0)
+        flashmq_poll_add_fd(crypt_workers.get_fd(), EPOLLIN, std::weak_ptr<void>());
+}
+
 void State::scan_all_dbus_services()
 {
     auto list_names_handler = [](State *state, DBusMessage *msg) {
@@ -799,93 +1408,496 @@ void State::scan_all_dbus_services()
             if (!service.starts_with("com.victronenergy"))
                 continue;
 
-            state->scan_dbus_service(service);
+            state->scan_scheduler.enqueue(service);
         }
+
+        state->scan_scheduler.start_initial_scan();
+        state->start_queued_scans();
+
+        // In case there was nothing to scan.
+        state->check_initial_scan_completed();
     };
 
-    dbus_uint32_t serial = call_method("org.freedesktop.DBus", "/org/freedesktop/DBus", "org.freedesktop.DBus", "ListNames");
-    auto bla = std::bind(list_names_handler, this, std::placeholders::_1);
-    async_handlers[serial] = bla;
+    auto handler = std::bind(list_names_handler, this, std::placeholders::_1);
+    call_method("org.freedesktop.DBus", "/org/freedesktop/DBus", "org.freedesktop.DBus", "ListNames", handler);
 }
 
-void State::get_value(const std::string &service, const std::string &path, bool force_publish)
+void State::get_value(const std::string &service, const std::string &path, bool force_publish,
+                      std::optional<std::chrono::time_point<std::chrono::steady_clock>> read_at)
 {
-    auto get_value_handler = [](State *state, const std::string &service, const std::string &path_prefix, bool force_publish, DBusMessage *msg) {
+    // The service name comes from its entry in service_removals, so that's not copied either.
+    auto get_value_handler = [state = this, service = &get_service_removals(service)->first, path_prefix = HandlerPath(path), force_publish, read_at](DBusMessage *msg) {
         const int msg_type = dbus_message_get_type(msg);
 
         if (msg_type == DBUS_MESSAGE_TYPE_ERROR)
         {
             std::string error = dbus_message_get_error_name_safe(msg);
-            flashmq_logf(LOG_ERR, "Error on 'GetValue' from %s: %s", service.c_str(), error.c_str());
+            flashmq_logf(LOG_ERR, "Error on 'GetValue' from %s: %s", service->c_str(), error.c_str());
             return;
         }
 
-        std::unordered_map<std::string, Item> items = get_from_get_value_on_root(msg, path_prefix);
-        state->add_dbus_to_mqtt_mapping(service, items, false, force_publish);
+        std::unordered_map<std::string, Item> items = get_from_get_value_on_root(msg, std::string(path_prefix.get()));
+        state->add_dbus_to_mqtt_mapping(*service, items, false, force_publish);
+
+        if (read_at)
+            state->read_to_publish_latency.record_since(read_at.value());
     };
 
-    dbus_uint32_t serial = this->call_method(service, path, "com.victronenergy.BusItem", "GetValue");
-    auto handler = std::bind(get_value_handler, this, service, path, force_publish, std::placeholders::_1);
-    this->async_handlers[serial] = handler;
+    this->call_method(service, path, "com.victronenergy.BusItem", "GetValue", std::move(get_value_handler));
 }
 
+/**
+ * @brief State::scan_dbus_service queues a scan of the service, to be done when the scan scheduler has room for it.
+ */
 void State::scan_dbus_service(const std::string &service)
 {
-    auto get_items_handler = [](State *state, const std::string &service, DBusMessage *msg) {
-        const int msg_type = dbus_message_get_type(msg);
+    scan_scheduler.enqueue(service);
+    start_queued_scans();
+}
 
-        if (msg_type == DBUS_MESSAGE_TYPE_ERROR)
+void State::start_queued_scans()
+{
+    std::optional<std::string> service;
+    while ((service = scan_scheduler.next()))
+    {
+        try
         {
-            std::string error = dbus_message_get_error_name_safe(msg);
+            scan_service(service.value());
+        }
+        catch (std::exception &ex)
+        {
+            flashmq_logf(LOG_ERR, "Error starting scan of '%s': %s", service.value().c_str(), ex.what());
+            scan_finished();
+        }
+    }
+}
 
-            if (error == "org.freedesktop.DBus.Error.UnknownMethod")
-            {
-                /*
-                 * The current preferred way of getting values is GetItems, which uses async IO in Python. But, but not
-                 * all services support that. So, if we error here with (org.freedesktop.DBus.Error.UnknownObject
-                 * or) org.freedesktop.DBus.Error.UnknownMethod, we have to use the traditional GetValue on /.
-                 */
+void State::scan_finished()
+{
+    scan_scheduler.finished();
+    start_queued_scans();
+    check_initial_scan_completed();
+}
 
-                // TODO: and if this fails, introspect it? For now, we decided to not do this. QWACS is the only thing so far that seems to need it.
+void State::check_initial_scan_completed()
+{
+    if (scan_scheduler.complete_initial_scan_if_done())
+    {
+        const std::chrono::milliseconds duration = scan_scheduler.get_initial_scan_duration().value_or(std::chrono::milliseconds(0));
+        flashmq_logf(LOG_NOTICE, "Initial scan of dbus services completed in %ld ms.", static_cast<long>(duration.count()));
 
-                state->get_value(service, "/");
-                return;
+        // What's left didn't turn out to have an owner or valid items (anymore).
+        const std::unordered_set<std::string> stale = std::move(unverified_snapshot_services);
+        unverified_snapshot_services.clear();
+
+        for (const std::string &service : stale)
+        {
+            flashmq_logf(LOG_INFO, "Removing service '%s' from the snapshot, because it's not on the dbus (anymore).", service.c_str());
+            remove_dbus_service(service);
+        }
+    }
+}
+
+/**
+ * @brief State::load_snapshot fills the item store with what was saved before a restart, so there is something to publish right away.
+ *
+ * The restored services are marked unverified, and the scans replace or correct them. The side effects of items, like the VRM portal mode,
+ * are not applied; that waits for the live values.
+ */
+void State::load_snapshot()
+{
+    if (snapshot_path.empty())
+        return;
+
+    std::vector<SnapshotService> services;
+
+    try
+    {
+        services = read_snapshot_file(snapshot_path, unique_vrm_id);
+    }
+    catch (std::exception &ex)
+    {
+        flashmq_logf(LOG_ERR, "Error loading snapshot '%s': %s", snapshot_path.c_str(), ex.what());
+        return;
+    }
+
+    size_t item_count = 0;
+    size_t service_count = 0;
+
+    for (SnapshotService &s : services)
+    {
+        if (dbus_service_items.contains(s.service))
+            continue;
+
+        size_t service_item_count = 0;
+
+        try
+        {
+            this->service_names_to_instance[s.service] = s.instance;
+            this->service_type_and_instance_to_full_service[ShortServiceName(s.service, s.instance)] = s.service;
+
+            std::unordered_map<std::string, Item> &items = dbus_service_items[s.service];
+            ItemPathTrie &trie = dbus_service_path_tries[s.service];
+
+            for (SnapshotItem &si : s.items)
+            {
+                Item item = Item::from_path_and_value(si.path, std::move(si.value));
+                item.set_mapping_details(unique_vrm_id, s.service, s.instance);
+
+                auto emplace_result = items.try_emplace(item.get_path());
+                if (!emplace_result.second)
+                    continue;
+
+                Item &stored_item = emplace_result.first->second;
+                stored_item = item;
+                stored_item.restore_json_cache(si.json);
+                stored_item.set_min_publish_interval(publish_rate_limiter.get_interval(stored_item.get_mqtt_topic_suffix()));
+                topic_index.add(stored_item);
+                trie.add(stored_item);
+                service_item_count++;
             }
 
-            flashmq_logf(LOG_ERR, "Error on 'GetItems' from %s: %s", service.c_str(), error.c_str());
-            return;
+            unverified_snapshot_services.insert(s.service);
+            item_count += service_item_count;
+            service_count++;
         }
+        catch (std::exception &ex)
+        {
+            flashmq_logf(LOG_ERR, "Error loading service '%s' from snapshot '%s', skipping it: %s", s.service.c_str(), snapshot_path.c_str(), ex.what());
+            forget_snapshot_service(s.service);
+        }
+    }
 
-        std::unordered_map<std::string, Item> items = get_from_dict_with_dict_with_text_and_value(msg);
-        state->add_dbus_to_mqtt_mapping(service, items, false);
-    };
+    flashmq_logf(LOG_NOTICE, "Loaded %zu items of %zu services from snapshot '%s'.", item_count, service_count, snapshot_path.c_str());
+}
 
-    auto get_name_owner_handler = [get_items_handler](State *state, const std::string &service, DBusMessage *msg) {
-        const int msg_type = dbus_message_get_type(msg);
-        if (msg_type == DBUS_MESSAGE_TYPE_ERROR)
+/**
+ * @brief State::forget_snapshot_service undoes the partial load of a service from the snapshot. Nothing has been published of it yet.
+ */
+void State::forget_snapshot_service(const std::string &service)
+{
+    service_removals[service]++;
+
+    auto pos = dbus_service_items.find(service);
+    if (pos != dbus_service_items.end())
+    {
+        for (const auto &p : pos->second)
         {
-            std::string error = dbus_message_get_error_name_safe(msg);
-            flashmq_logf(LOG_ERR, error.c_str());
-            return;
+            topic_index.remove(p.second);
+        }
+    }
+
+    dbus_service_path_tries.erase(service);
+    dbus_service_items.erase(service);
+    service_names_to_instance.erase(service);
+    std::erase_if(service_type_and_instance_to_full_service, [&service](const auto &p) { return p.second == service; });
+}
+
+/**
+ * @brief State::write_snapshot writes the snapshot in one go, and waits for it. That's for at deinit, when there's no event loop anymore.
+ */
+void State::write_snapshot()
+{
+    if (snapshot_path.empty())
+        return;
+
+    if (snapshot_job_task_id)
+    {
+        flashmq_remove_task(snapshot_job_task_id);
+        snapshot_job_task_id = 0;
+    }
+
+    snapshot_job.reset();
+    wait_for_snapshot_writer();
+
+    try
+    {
+        const std::string data = serialize_snapshot(unique_vrm_id, dbus_service_items, service_names_to_instance);
+        write_snapshot_file(snapshot_path, data);
+        snapshot_dirty = false;
+    }
+    catch (std::exception &ex)
+    {
+        flashmq_logf(LOG_ERR, "Error writing snapshot '%s': %s", snapshot_path.c_str(), ex.what());
+    }
+}
+
+/**
+ * @brief State::start_snapshot_job starts building a snapshot in slices, like the full publish, so that a big system doesn't stall the
+ * event loop. When it's done, the file is written and synced on a thread of its own.
+ */
+void State::start_snapshot_job()
+{
+    // Changes during the job may or may not make it in, so they make for another one.
+    snapshot_dirty = false;
+
+    std::vector<std::string> services;
+    services.reserve(dbus_service_items.size());
+
+    for (const auto &p : dbus_service_items)
+    {
+        services.push_back(p.first);
+    }
+
+    snapshot_job.emplace(unique_vrm_id, std::move(services));
+    continue_snapshot_job();
+}
+
+void State::continue_snapshot_job()
+{
+    this->snapshot_job_task_id = 0;
+
+    if (!snapshot_job)
+        return;
+
+    SnapshotSerializer &job = snapshot_job.value();
+    size_t count = 0;
+
+    // Services are done whole, because between slices, their items may be added to or removed.
+    while (!job.done() && count < snapshot_slice_items)
+    {
+        count += job.add_next_service(dbus_service_items, service_names_to_instance);
+    }
+
+    if (!job.done())
+    {
+        auto f = std::bind(&State::continue_snapshot_job, this);
+        this->snapshot_job_task_id = flashmq_add_task(f, 0);
+        return;
+    }
+
+    std::string data = job.finish();
+    snapshot_job.reset();
+
+    // Normally, the previous one is long done.
+    wait_for_snapshot_writer();
+
+    auto write = [path = snapshot_path, data = std::move(data)]() {
+        try
+        {
+            write_snapshot_file(path, data);
+        }
+        catch (std::exception &ex)
+        {
+            flashmq_logf(LOG_ERR, "Error writing snapshot '%s': %s", path.c_str(), ex.what());
         }
+    };
+
+    snapshot_writer = std::thread(std::move(write));
+}
+
+void State::wait_for_snapshot_writer()
+{
+    if (snapshot_writer.joinable())
+        snapshot_writer.join();
+}
+
+void State::start_snapshot_timer()
+{
+    if (snapshot_path.empty() || snapshot_task_id)
+        return;
+
+    auto f = [this]() {
+        this->snapshot_task_id = 0;
+        start_snapshot_timer();
+
+        if (this->snapshot_dirty && !this->snapshot_job)
+            start_snapshot_job();
+    };
+
+    const uint32_t interval = static_cast<uint32_t>(std::chrono::duration_cast<std::chrono::milliseconds>(snapshot_interval).count());
+    this->snapshot_task_id = flashmq_add_task(f, interval);
+}
+
+void State::start_stats_timer()
+{
+    if (stats_interval.count() == 0 || stats_task_id)
+        return;
 
-        const std::string name_owner = get_string_from_reply(msg);
-        state->service_id_to_names[name_owner] = service;
+    auto f = [this]() {
+        this->stats_task_id = 0;
+        start_stats_timer();
 
-        dbus_uint32_t serial = state->call_method(service, "/", "com.victronenergy.BusItem", "GetItems");
-        auto handler = std::bind(get_items_handler, state, service, std::placeholders::_1);
-        state->async_handlers[serial] = handler;
+        // Like the values, only when somebody is looking.
+        if (this->alive)
+            publish_stats(true);
     };
 
+    const uint32_t interval = static_cast<uint32_t>(std::chrono::duration_cast<std::chrono::milliseconds>(stats_interval).count());
+    this->stats_task_id = flashmq_add_task(f, interval);
+}
+
+nlohmann::json State::get_stats_json() const
+{
+    const auto now = std::chrono::steady_clock::now();
+    nlohmann::json j = stats.counters_to_json(stats_at_last_publish, now - stats_last_published_at);
+
+    size_t item_count = 0;
+    for (const auto &p : dbus_service_items)
+    {
+        item_count += p.second.size();
+    }
+
+    j["services"] = dbus_service_items.size();
+    j["items"] = item_count;
+    j["async_handlers"] = async_handlers.get_in_flight_count();
+    j["async_handlers_lost"] = async_handlers.get_lost_count();
+    j["delayed_changed_values"] = delayed_changed_values.size();
+    j["pending_publishes"] = pending_publishes.size();
+    j["keepalive_tokens"] = keepAliveTokens;
+    j["login_tokens_short_term"] = loginTokensShortTerm;
+    j["login_tokens_long_term"] = loginTokensLongTerm;
+    j["dispatch_arena_capacity"] = dispatch_arena.get_capacity();
+    j["dispatch_arena_overflows"] = dispatch_arena.get_overflow_count();
+    j["client_profiles"] = client_profiles.size();
+    j["credentials_loads"] = credentials_cache.get_load_count();
+    j["crypt_verifications_pending"] = crypt_workers.get_pending_count();
+
+    const std::optional<std::chrono::milliseconds> scan_duration = scan_scheduler.get_initial_scan_duration();
+    if (scan_duration)
+        j["initial_scan_milliseconds"] = scan_duration.value().count();
+    else
+        j["initial_scan_milliseconds"] = nullptr;
+
+    j["latency_microseconds"] = {
+        {"signal_to_publish", signal_to_publish_latency.to_json()},
+        {"write_to_reply", write_to_reply_latency.to_json()},
+        {"read_to_publish", read_to_publish_latency.to_json()}
+    };
+
+    return j;
+}
+
+void State::log_latencies() const
+{
+    flashmq_logf(LOG_NOTICE, "Latency of signal to publish: %s", signal_to_publish_latency.to_string().c_str());
+    flashmq_logf(LOG_NOTICE, "Latency of write to SetValue reply: %s", write_to_reply_latency.to_string().c_str());
+    flashmq_logf(LOG_NOTICE, "Latency of read to publish: %s", read_to_publish_latency.to_string().c_str());
+}
+
+/**
+ * @brief State::publish_stats publishes N/<portalid>/dbus-flashmq/stats.
+ * @param periodic Only the periodic publishes start a new period for the rates and latencies. A read shows them since the last periodic one.
+ */
+void State::publish_stats(bool periodic)
+{
+    nlohmann::json j { {"value", get_stats_json()} };
+
+    if (periodic)
+    {
+        stats_at_last_publish = stats;
+        stats_last_published_at = std::chrono::steady_clock::now();
+        signal_to_publish_latency.reset();
+        write_to_reply_latency.reset();
+        read_to_publish_latency.reset();
+    }
+
+    std::ostringstream topic;
+    topic << "N/" << unique_vrm_id << "/dbus-flashmq/stats";
+    flashmq_publish_message(topic.str(), 0, false, j.dump());
+}
+
+/**
+ * @brief State::reconcile_snapshot_service is for when a service restored from the snapshot is scanned. If the instance is the same, and
+ * no items disappeared, the live values are just applied, which only publishes what changed. Otherwise, the restored service is removed
+ * first (with its empty publishes) and treated as new.
+ */
+void State::reconcile_snapshot_service(const std::string &service, const std::unordered_map<std::string, Item> &items)
+{
+    if (unverified_snapshot_services.erase(service) == 0)
+        return;
+
+    bool keep = false;
+
+    auto pos_service = dbus_service_items.find(service);
+    auto pos_instance = service_names_to_instance.find(service);
+
+    if (pos_service != dbus_service_items.end() && pos_instance != service_names_to_instance.end())
+    {
+        keep = get_instance_from_items(items).getValue() == pos_instance->second.getValue();
+
+        for (auto it = pos_service->second.begin(); keep && it != pos_service->second.end(); ++it)
+        {
+            keep = items.contains(it->first);
+        }
+    }
+
+    if (!keep)
+    {
+        flashmq_logf(LOG_INFO, "Snapshot of service '%s' is outdated. Replacing it.", service.c_str());
+        remove_dbus_service(service);
+    }
+}
+
+/**
+ * @brief State::scan_service gets the name owner of the service, and then its items. Only to be called with a slot from the scan scheduler,
+ * which is given back when the coroutine is done.
+ */
+DbusTask State::scan_service(std::string service)
+{
+    ScanCompletion scan_completion(this);
+
     // We have to know the :1.66 like name for com.victronenergy.system and such, because in signals, we only have :1.66 as sender.
-    std::vector<VeVariant> args {service};
-    dbus_uint32_t s = call_method("org.freedesktop.DBus", "/org/freedesktop/DBus", "org.freedesktop.DBus", "GetNameOwner", args);
-    auto handler = std::bind(get_name_owner_handler, this, service, std::placeholders::_1);
-    this->async_handlers[s] = handler;
+    const VeVariant arg(service);
+    const DbusReply name_owner_reply = co_await dbus_call(this, "org.freedesktop.DBus", "/org/freedesktop/DBus", "org.freedesktop.DBus", "GetNameOwner",
+                                                          {&arg, 1});
+
+    if (name_owner_reply.is_error())
+    {
+        flashmq_logf(LOG_ERR, "Error on 'GetNameOwner' of %s: %s", service.c_str(), name_owner_reply.get_error_name().c_str());
+        co_return;
+    }
+
+    const std::string name_owner = get_string_from_reply(name_owner_reply.get());
+    service_id_to_names[name_owner] = service;
+
+    const DbusReply items_reply = co_await dbus_call(this, service, "/", "com.victronenergy.BusItem", "GetItems");
+    std::unordered_map<std::string, Item> items;
+
+    if (items_reply.is_error())
+    {
+        const std::string error = items_reply.get_error_name();
+
+        if (error != "org.freedesktop.DBus.Error.UnknownMethod")
+        {
+            flashmq_logf(LOG_ERR, "Error on 'GetItems' from %s: %s", service.c_str(), error.c_str());
+            co_return;
+        }
+
+        /*
+         * The current preferred way of getting values is GetItems, which uses async IO in Python. But, but not
+         * all services support that. So, if we error here with (org.freedesktop.DBus.Error.UnknownObject
+         * or) org.freedesktop.DBus.Error.UnknownMethod, we have to use the traditional GetValue on /.
+         */
+
+        // TODO: and if this fails, introspect it? For now, we decided to not do this. QWACS is the only thing so far that seems to need it.
+
+        const DbusReply value_reply = co_await dbus_call(this, service, "/", "com.victronenergy.BusItem", "GetValue");
+
+        if (value_reply.is_error())
+        {
+            flashmq_logf(LOG_ERR, "Error on 'GetValue' from %s: %s", service.c_str(), value_reply.get_error_name().c_str());
+            co_return;
+        }
+
+        items = get_from_get_value_on_root(value_reply.get(), "/");
+    }
+    else
+    {
+        items = get_from_dict_with_dict_with_text_and_value(items_reply.get());
+    }
+
+    reconcile_snapshot_service(service, items);
+    add_dbus_to_mqtt_mapping(service, items, false);
 }
 
 void State::remove_dbus_service(const std::string &service)
 {
+    service_removals[service]++;
+    snapshot_dirty = true;
+    scan_scheduler.cancel(service);
+    unverified_snapshot_services.erase(service);
+
     {
         auto pos = dbus_service_items.find(service);
         if (pos != dbus_service_items.end())
@@ -895,11 +1907,18 @@ void State::remove_dbus_service(const std::string &service)
             for (auto &p : items)
             {
                 Item &item = p.second;
-                item.publish(true);
+                publish_item(item, true);
+                topic_index.remove(item);
             }
+
+            std::erase_if(pending_publishes, [&service](const Item *item) { return item->get_service_name() == service; });
+
+            if (full_publish_job)
+                full_publish_job->forget_service(service);
         }
     }
 
+    dbus_service_path_tries.erase(service);
     dbus_service_items.erase(service);
     service_names_to_instance.erase(service);
 
@@ -935,9 +1954,16 @@ void State::remove_dbus_service(const std::string &service)
 
 void State::setDispatchable()
 {
+    if (dispatch_pending)
+        return;
+
+    dispatch_pending = true;
+
     uint64_t one = 1;
     if (write(dispatch_event_fd, &one, sizeof(uint64_t)) < 0)
     {
+        // Nothing was armed, so the next call has to try again, or dispatching would stop for good.
+        dispatch_pending = false;
         const char *err = strerror(errno);
         flashmq_logf(LOG_ERR, err);
     }
@@ -1097,6 +2123,31 @@ IsPrivilegedUser State::is_privileged_user(const std::string &clientid, const st
     return result;
 }
 
+/**
+ * @brief State::get_client_profile gives the profile made at login, or makes one now. The bridges, for one, don't go through the login check.
+ *
+ * A profile is only kept when the client was found. Otherwise, the result is only valid until the next call.
+ */
+const ClientProfile &State::get_client_profile(const std::string &clientid, const std::string &username)
+{
+    const ClientProfile *profile = client_profiles.find(clientid, username);
+
+    if (profile)
+        return *profile;
+
+    const IsPrivilegedUser priv = is_privileged_user(clientid, username);
+    ClientProfile new_profile(username, priv.privileged, localhost_client(priv.client));
+
+    if (new_profile.bridge || !priv.client.expired())
+    {
+        client_profiles.set(clientid, std::move(new_profile));
+        return *client_profiles.find(clientid, username);
+    }
+
+    unprofiled_client = std::move(new_profile);
+    return unprofiled_client;
+}
+
 void State::register_user_and_clientid(const std::string &username, const std::string &clientid)
 {
     if (username.empty() || clientid.empty())
@@ -1106,6 +2157,58 @@ void State::register_user_and_clientid(const std::string &username, const std::s
     client_ids.insert(clientid);
 }
 
+/**
+ * @brief State::client_logging_in forgets what we knew of a previous connection with this client id, at the start of a login check.
+ */
+void State::client_logging_in(const std::string &clientid, const std::string &username)
+{
+    if (trace_recorder)
+    {
+        TraceEvent event;
+        event.type = TraceEventType::LoginCheck;
+        event.clientid = clientid;
+        event.username = username;
+        trace_recorder->record(event);
+    }
+
+    // A profile of a previous connection with this client id must not be used anymore. It's set again on success.
+    client_profiles.remove(clientid);
+}
+
+/**
+ * @brief State::client_logged_in stores everything the ACL checks want to know about the client, now that we have it at hand.
+ * @param lan Successful logins that aren't 'lan' are always localhost ones.
+ */
+void State::client_logged_in(const std::string &username, const std::string &clientid, const std::weak_ptr<Client> &client, bool privileged, bool lan)
+{
+    if (trace_recorder)
+    {
+        TraceEvent event;
+        event.type = TraceEventType::LoginSucceeded;
+        event.clientid = clientid;
+        event.username = username;
+        event.privileged = privileged;
+        event.lan = lan;
+        trace_recorder->record(event);
+    }
+
+    if (lan)
+        lan_clients.try_emplace(clientid, ClientData{username, clientid, client});
+    register_user_and_clientid(username, clientid);
+    client_profiles.set(clientid, ClientProfile(username, privileged, !lan));
+
+    // A client with a persistent session doesn't have to subscribe again.
+    subscription_tracker.client_connected(clientid);
+}
+
+/**
+ * @brief State::get_service_removals gives the entry of the service in service_removals, which stays valid as long as the state.
+ */
+const std::pair<const std::string, uint64_t> *State::get_service_removals(const std::string &service)
+{
+    return &*service_removals.try_emplace(service).first;
+}
+
 void State::disconnect_all_connections_of_user(const std::string &username)
 {
     flashmq_logf(LOG_NOTICE, "Removing all sessions of '%s'", username.c_str());
@@ -13,9 +13,27 @@
 #include <optional>
 #include <unordered_set>
 #include <set>
+#include <span>
 #include "serviceidentifier.h"
 #include "network.h"
 #include "guicustomizations.h"
+#include "topicindex.h"
+#include "itempathtrie.h"
+#include "publishratelimiter.h"
+#include "fullpublishjob.h"
+#include "subscriptiontracker.h"
+#include "scanscheduler.h"
+#include "asynchandlers.h"
+#include "dbuscoroutine.h"
+#include "dispatcharena.h"
+#include "clientprofile.h"
+#include "topicclassifier.h"
+#include "credentialscache.h"
+#include "cryptworkers.h"
+#include "pluginstats.h"
+#include "latencyhistogram.h"
+#include "trace.h"
+#include "snapshot.h"
 
 #include "vendor/flashmq_plugin.h"
 
@@ -25,6 +43,25 @@
 #define ONE_MINUTE_TIMER_INTERVAL 60000
 #define LOGIN_TOKENS_SHORT_TERM 20
 #define LOGIN_TOKENS_LONG_TERM 150
+#define FULL_PUBLISH_SLICE_ITEMS 500
+#define FULL_PUBLISH_SLICE_MICROSECONDS 10000
+#define KEEPALIVE_COALESCE_MILLISECONDS 100
+#define DISCONNECTED_SUBSCRIPTIONS_EXPIRY_SECONDS 3600
+#define SCAN_MAX_IN_FLIGHT 8
+#define SCAN_PRIORITY_SERVICE_TYPES "settings,system"
+#define SNAPSHOT_INTERVAL_SECONDS 300
+#define SNAPSHOT_SLICE_ITEMS 1000
+#define DBUS_CALL_TIMEOUT_MILLISECONDS 25000
+#define DBUS_CALL_LOST_GRACE_MILLISECONDS 10000
+#define DISPATCH_ARENA_INITIAL_SIZE 16384
+#define DISPATCH_ARENA_MAX_SIZE 1048576
+#define DISPATCH_BUDGET_MESSAGES 500
+#define DISPATCH_BUDGET_MICROSECONDS 5000
+#define TOKENS_FILE_PATH "/data/conf/tokens.json"
+#define VNC_PASSWORD_FILE_PATH "/data/conf/vncpassword.txt"
+#define CRYPT_WORKER_THREADS 2
+#define STATS_INTERVAL_SECONDS 10
+#define UNIQUE_ID_FILE_PATH "/data/venus/unique-id"
 
 namespace dbus_flashmq
 {
@@ -107,6 +144,10 @@ struct State
     std::set<std::weak_ptr<Client>, std::owner_less<std::weak_ptr<Client>>> privileged_network_clients;
     std::unordered_map<std::string, ClientData> security_profile_password_clients;
     std::unordered_map<std::string, ClientData> lan_clients;
+    ClientProfiles client_profiles;
+    ClientProfile unprofiled_client; // For clients we can't make a lasting profile of yet.
+    CredentialsCache credentials_cache {TOKENS_FILE_PATH, VNC_PASSWORD_FILE_PATH};
+    CryptWorkers crypt_workers;
 
     static std::atomic_int instance_counter;
     std::string unique_vrm_id;
@@ -117,7 +158,8 @@ struct State
     /*
      * TODO: Maybe implement the selective keep-alive mechanism like dbus-mqtt had.
      *
-     * We're putting that on hold for now though. Apparently it back-fired, in terms of load.
+     * We're putting that on hold for now though. Apparently it back-fired, in terms of load. The opt-in alternative is
+     * subscription_aware_publishing, which doesn't need anything from clients.
      */
     bool alive = false;
 
@@ -128,18 +170,77 @@ struct State
     uint32_t write_all_bridge_states_task_id = 0;
 
     int dispatch_event_fd = -1;
+    bool dispatch_pending = false; // The eventfd is written and not read yet, so writing it again is pointless.
+    size_t dispatch_budget_messages = DISPATCH_BUDGET_MESSAGES; // Per wake-up, so MQTT clients get their turn during bursts.
+    std::chrono::microseconds dispatch_budget_duration = std::chrono::microseconds(DISPATCH_BUDGET_MICROSECONDS);
     DBusConnection *con = nullptr;
-    std::unordered_map<dbus_uint32_t, std::function<void(DBusMessage *msg)>> async_handlers;
+    std::unique_ptr<TraceRecorder> trace_recorder; // With the plugin option 'trace_file'.
+
+    // When set, method calls go here, instead of to the bus, which isn't opened then. For replaying traces.
+    std::function<void(DBusMessage *msg)> method_call_sink;
+    dbus_uint32_t method_call_sink_serial = 0;
+    AsyncHandlers async_handlers;
+    std::chrono::milliseconds dbus_call_timeout = std::chrono::milliseconds(DBUS_CALL_TIMEOUT_MILLISECONDS);
+    DispatchArena dispatch_arena {DISPATCH_ARENA_INITIAL_SIZE, DISPATCH_ARENA_MAX_SIZE}; // Reset after each dispatch batch.
+    std::string dbus_path_buffer; // Reused for item lookups in signal handling.
     std::unordered_map<int, std::shared_ptr<Watch>> watches;
     std::unordered_map<std::string, std::string> service_id_to_names; // like 1:31 to com.victronenergy.settings
     std::unordered_map<ShortServiceName, std::string> service_type_and_instance_to_full_service; // like 'solarcharger/258' to 'com.victronenergy.solarcharger.ttyO2'
     std::unordered_map<std::string, ServiceIdentifier> service_names_to_instance; // like 'com.victronenergy.solarcharger.ttyO2' to 258
     std::unordered_map<std::string, std::unordered_map<std::string, Item>> dbus_service_items; // keyed by service, then by dbus path, without instance.
+    TopicIndex topic_index; // like 'solarcharger/258/Dc/0/Voltage' to the item in dbus_service_items.
+    std::unordered_map<std::string, ItemPathTrie> dbus_service_path_tries; // keyed by service, over the items in dbus_service_items.
+
+    // How often each service was removed, for reply handlers holding on to Item pointers of it. Never erased, so the handlers can hold a
+    // pointer to an entry, which is also a service name that's not going anywhere.
+    std::unordered_map<std::string, uint64_t> service_removals;
     std::vector<QueuedChangedItem> delayed_changed_values;
+    PublishRateLimiter publish_rate_limiter;
+    std::vector<Item*> pending_publishes; // rate limited items with a newer value than published, pointing into dbus_service_items.
+    uint32_t pending_publishes_task_id = 0;
+    std::chrono::time_point<std::chrono::steady_clock> pending_publishes_due_at;
+    std::optional<FullPublishJob> full_publish_job;
+    std::vector<std::optional<std::string>> full_publish_queued_echos; // of the keepalives that joined the next full publish.
+    bool full_publish_queued = false;
+    uint32_t full_publish_task_id = 0;
+    uint32_t full_publish_coalesce_task_id = 0;
+    std::chrono::milliseconds keepalive_coalesce_window = std::chrono::milliseconds(KEEPALIVE_COALESCE_MILLISECONDS);
+    bool subscription_aware_publishing = false;
+    SubscriptionTracker subscription_tracker;
+    ScanScheduler scan_scheduler;
+    std::string snapshot_path; // Empty when snapshots are disabled.
+    std::chrono::seconds snapshot_interval = std::chrono::seconds(SNAPSHOT_INTERVAL_SECONDS);
+    uint32_t snapshot_task_id = 0;
+    bool snapshot_dirty = false; // Whether the item store changed since the last snapshot was started.
+    std::optional<SnapshotSerializer> snapshot_job;
+    uint32_t snapshot_job_task_id = 0;
+    size_t snapshot_slice_items = SNAPSHOT_SLICE_ITEMS;
+    std::thread snapshot_writer; // Writes and syncs a finished snapshot, which can take a while on flash.
+    std::unordered_set<std::string> unverified_snapshot_services; // Restored from the snapshot, and not scanned yet.
+    size_t full_publish_slice_items = FULL_PUBLISH_SLICE_ITEMS;
+    std::chrono::microseconds full_publish_slice_duration = std::chrono::microseconds(FULL_PUBLISH_SLICE_MICROSECONDS);
     std::chrono::time_point<std::chrono::steady_clock> vrmBridgeInterestTime;
+    bool vrm_bridge_interest = false; // Refreshed every second, so the ACL checks don't have to look at the clock.
     int keepAliveTokens = KEEPALIVE_TOKENS;
     bool warningAboutNTopicsLogged = false;
 
+    PluginStats stats;
+    PluginStats stats_at_last_publish;
+    std::chrono::time_point<std::chrono::steady_clock> stats_last_published_at = std::chrono::steady_clock::now();
+    std::chrono::seconds stats_interval = std::chrono::seconds(STATS_INTERVAL_SECONDS); // 0 is only on read.
+    uint32_t stats_task_id = 0;
+
+    // Latencies since the last periodic stats publish.
+    LatencyHistogram signal_to_publish_latency;
+    LatencyHistogram write_to_reply_latency;
+    LatencyHistogram read_to_publish_latency;
+    std::optional<std::chrono::time_point<std::chrono::steady_clock>> dbus_data_read_at; // Of the oldest data not dispatched yet.
+    std::optional<std::chrono::time_point<std::chrono::steady_clock>> signal_read_at; // Only set while a value signal is applied.
+
+    // Reset every minute, after logging.
+    size_t changed_values_count = 0;
+    size_t unchanged_values_count = 0;
+
     std::unordered_set<std::string> passwordHistory;
     int loginTokensShortTerm = LOGIN_TOKENS_SHORT_TERM;
     int loginTokensLongTerm = LOGIN_TOKENS_LONG_TERM;
@@ -153,43 +254,89 @@ struct State
     ~State();
     void add_dbus_to_mqtt_mapping(const std::string &serivce, std::unordered_map<std::string, Item> &items, bool instance_must_be_known, bool force_publish=false);
     void add_dbus_to_mqtt_mapping(const std::string &service, ServiceIdentifier instance, Item &item, bool force_publish);
-    const Item &find_item_by_mqtt_path(const std::string &topic) const;
+    void apply_items_changed(const std::string &service, DBusMessage *msg);
+    void apply_properties_changed(const std::string &service, DBusMessage *msg);
+    void apply_item_change(const std::string &service, ServiceIdentifier instance, std::unordered_map<std::string, Item> &items,
+                           const std::string &path, const ValueMinMax &value);
+    void handle_item_update(Item &item, bool changed, bool force_publish);
+    bool count_value_change(bool changed);
+    void publish_item(Item &item, bool null_payload=false);
+    void publish_changed_item(Item &item);
+    bool has_vrm_bridge_interest() const;
+    void mark_vrm_bridge_interest();
+    void update_vrm_bridge_interest();
+    bool is_wanted(Item &item) const;
+    void schedule_pending_publishes(std::chrono::milliseconds delay);
+    void publish_pending_publishes();
+    const Item &find_item_by_mqtt_path(std::string_view topic) const;
+    Item &find_item_by_mqtt_path(std::string_view topic);
+    const Item &find_item_by_mqtt_path_slow(const std::string &topic) const;
     Item &find_matching_active_item(const Item &item);
     Item &find_by_service_and_dbus_path(const std::string &service, const std::string &dbus_path);
     void attempt_to_process_delayed_changes();
-    void get_unique_id();
+    void get_unique_id(const std::string &path);
     void open();
     void scan_all_dbus_services();
-    void get_value(const std::string &service, const std::string &path, bool force_publish=false);
+    void get_value(const std::string &service, const std::string &path, bool force_publish=false,
+                   std::optional<std::chrono::time_point<std::chrono::steady_clock>> read_at = {});
     void scan_dbus_service(const std::string &service);
+    void start_queued_scans();
+    DbusTask scan_service(std::string service);
+    void scan_finished();
+    void check_initial_scan_completed();
+    void load_snapshot();
+    void forget_snapshot_service(const std::string &service);
+    const std::pair<const std::string, uint64_t> *get_service_removals(const std::string &service);
+    void write_snapshot();
+    void start_snapshot_job();
+    void continue_snapshot_job();
+    void wait_for_snapshot_writer();
+    void start_snapshot_timer();
+    void start_stats_timer();
+    nlohmann::json get_stats_json() const;
+    void publish_stats(bool periodic);
+    void log_latencies() const;
+    void reconcile_snapshot_service(const std::string &service, const std::unordered_map<std::string, Item> &items);
     void remove_dbus_service(const std::string &service);
     void setDispatchable();
-    dbus_uint32_t call_method(const std::string &service, const std::string &path, const std::string &interface, const std::string &method,
-                              const std::vector<VeVariant> &args = std::vector<VeVariant>(), bool wrap_arguments_in_variant=false);
+    dbus_uint32_t call_method(const std::string &service, const std::string &path, const char *interface, const char *method,
+                              AsyncHandler &&handler, std::span<const VeVariant> args = {}, bool wrap_arguments_in_variant=false,
+                              std::optional<std::chrono::milliseconds> timeout = {});
     void write_to_dbus(const std::string &topic, const std::string &payload);
     ServiceIdentifier store_and_get_instance_from_service(const std::string &service, const std::unordered_map<std::string, Item> &items, bool instance_must_be_known);
     void handle_keepalive(const std::string &payload);
     void unset_keepalive();
     void heartbeat();
     void publish_all(const std::optional<std::string> &payload_echo);
+    void start_full_publish(std::vector<std::optional<std::string>> &&payload_echos);
+    void start_queued_full_publish();
+    void continue_full_publish();
+    void publish_full_publish_completed(const std::optional<std::string> &payload_echo);
     void set_new_id_to_owner(const std::string &owner, const std::string &name);
-    void get_named_owner(std::string &sender) const;
+    const std::string &get_named_owner(const std::string &sender) const;
     void remove_id_to_owner(const std::string &owner);
-    void handle_read(const std::string &topic, const std::vector<std::string> &subtopics);
+    void handle_read(const std::string &topic, const std::vector<std::string> &subtopics, const std::string &payload);
+    size_t publish_sub_tree_from_cache(const std::string &service, const std::string &path);
     void initiate_broker_registration(uint32_t delay);
+    DbusTask register_at_vrm();
     void per_second_action();
     void start_one_second_timer();
     void per_minute_action();
     void start_one_minute_timer();
     bool match_local_net(const struct sockaddr *addr) const;
-    void write_bridge_connection_state(const std::string &bridge, const std::optional<bool> connected, const std::string &msg);
+    DbusTask write_bridge_connection_state(std::string bridge, const std::optional<bool> connected, std::string msg);
     void write_all_bridge_connection_states_debounced();
     void decrement_login_tokens();
+    void refund_login_token();
+    void start_crypt_workers(size_t thread_count);
     void clear_expired_privileged_clients();
     void disconnect_all_applicable_lan_clients(const MqttLocalMode m);
     bool localhost_client(const std::weak_ptr<Client> &client) const;
     IsPrivilegedUser is_privileged_user(const std::string &clientid, const std::string &username) const;
+    const ClientProfile &get_client_profile(const std::string &clientid, const std::string &username);
     void register_user_and_clientid(const std::string &username, const std::string &clientid);
+    void client_logging_in(const std::string &clientid, const std::string &username);
+    void client_logged_in(const std::string &username, const std::string &clientid, const std::weak_ptr<Client> &client, bool privileged, bool lan);
     void disconnect_all_connections_of_user(const std::string &username);
     void purge_old_usernames_to_clientids();
 
@@ -0,0 +1,159 @@
+#include "subscriptiontracker.h"
+
+#include "utils.h"
+
+using namespace dbus_flashmq;
+
+/**
+ * @brief SubscriptionTracker::strip_share_name makes '$share/myshare/N/#' into 'N/#'. The on-unsubscribe hook already gives us
+ * filters without it, so this makes them the same.
+ */
+std::string_view SubscriptionTracker::strip_share_name(std::string_view filter)
+{
+    if (!filter.starts_with("$share/"))
+        return filter;
+
+    const size_t name_end = filter.find('/', 7);
+
+    if (name_end == std::string_view::npos)
+        return std::string_view();
+
+    return filter.substr(name_end + 1);
+}
+
+bool SubscriptionTracker::can_match_notifications(std::string_view filter)
+{
+    return filter.starts_with("N/") || filter.starts_with("+/") || filter == "#" || filter == "N" || filter == "+";
+}
+
+void SubscriptionTracker::subscribe(const std::string &clientid, std::string_view filter)
+{
+    unknown_clients.erase(clientid);
+
+    filter = strip_share_name(filter);
+
+    if (!can_match_notifications(filter))
+        return;
+
+    const std::string f(filter);
+    ClientSubscriptions &client = clients[clientid];
+    client.disconnected_at.reset();
+
+    if (!client.filters.insert(f).second)
+        return;
+
+    Filter &entry = filters[f];
+
+    if (entry.count++ == 0)
+    {
+        entry.subtopics = splitToVector(f, '/');
+        generation++;
+    }
+}
+
+void SubscriptionTracker::unsubscribe(const std::string &clientid, std::string_view filter)
+{
+    filter = strip_share_name(filter);
+
+    auto pos = clients.find(clientid);
+    if (pos == clients.end())
+        return;
+
+    const std::string f(filter);
+
+    if (pos->second.filters.erase(f) == 0)
+        return;
+
+    remove_filter(f);
+
+    if (pos->second.filters.empty())
+        clients.erase(pos);
+}
+
+void SubscriptionTracker::remove_filter(const std::string &filter)
+{
+    auto pos = filters.find(filter);
+    if (pos == filters.end())
+        return;
+
+    if (--pos->second.count > 0)
+        return;
+
+    filters.erase(pos);
+    generation++;
+}
+
+void SubscriptionTracker::client_connected(const std::string &clientid)
+{
+    auto pos = clients.find(clientid);
+    if (pos == clients.end())
+    {
+        unknown_clients.insert(clientid);
+        return;
+    }
+
+    pos->second.disconnected_at.reset();
+}
+
+void SubscriptionTracker::client_disconnected(const std::string &clientid)
+{
+    unknown_clients.erase(clientid);
+
+    auto pos = clients.find(clientid);
+    if (pos == clients.end())
+        return;
+
+    pos->second.disconnected_at = std::chrono::steady_clock::now();
+}
+
+void SubscriptionTracker::purge_disconnected_clients(std::chrono::seconds max_age)
+{
+    const auto now = std::chrono::steady_clock::now();
+
+    auto pos = clients.begin();
+    while (pos != clients.end())
+    {
+        auto cur = pos++;
+        const ClientSubscriptions &client = cur->second;
+
+        if (!client.disconnected_at || client.disconnected_at.value() + max_age > now)
+            continue;
+
+        for (const std::string &filter : client.filters)
+        {
+            remove_filter(filter);
+        }
+
+        clients.erase(cur);
+    }
+}
+
+bool SubscriptionTracker::has_subscriber(Item &item) const
+{
+    if (!unknown_clients.empty())
+        return true;
+
+    bool matched = false;
+
+    if (item.get_subscriber_match(generation, matched))
+        return matched;
+
+    const std::string_view topic = item.get_mqtt_topic();
+
+    for (const auto &p : filters)
+    {
+        if (mqtt_filter_matches(p.second.subtopics, topic))
+        {
+            matched = true;
+            break;
+        }
+    }
+
+    item.set_subscriber_match(generation, matched);
+    return matched;
+}
+
+size_t SubscriptionTracker::filter_count() const
+{
+    return filters.size();
+}
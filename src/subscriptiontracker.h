@@ -0,0 +1,65 @@
+#ifndef SUBSCRIPTIONTRACKER_H
+#define SUBSCRIPTIONTRACKER_H
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <unordered_map>
+#include <unordered_set>
+#include <optional>
+#include <chrono>
+
+#include "types.h"
+
+namespace dbus_flashmq
+{
+
+/**
+ * @brief The SubscriptionTracker class keeps the subscription filters of clients that can match our notifications, so we can skip
+ * rendering and publishing items nobody is subscribed to.
+ *
+ * Filters are kept per client id, and counted, because several clients usually subscribe to the same thing. We don't see sessions
+ * expire, only clients disconnect, so to not miss persistent sessions that come back without subscribing again, the filters of
+ * disconnected clients are kept around until they have been gone for a while.
+ *
+ * That doesn't cover sessions FlashMQ restored from before a restart of the broker: we never saw their subscriptions. So a client
+ * that logs in without filters we know of is taken to want everything, until it subscribes to something or disconnects.
+ *
+ * Matching is done once per item until the filters change, which is tracked with a generation number that is cached in the item.
+ */
+class SubscriptionTracker
+{
+    struct Filter
+    {
+        std::vector<std::string> subtopics;
+        size_t count = 0;
+    };
+
+    struct ClientSubscriptions
+    {
+        std::unordered_set<std::string> filters;
+        std::optional<std::chrono::time_point<std::chrono::steady_clock>> disconnected_at;
+    };
+
+    std::unordered_map<std::string, Filter> filters;
+    std::unordered_map<std::string, ClientSubscriptions> clients;
+    std::unordered_set<std::string> unknown_clients; // Connected, without subscribing since, and without filters we know of.
+    uint64_t generation = 1;
+
+    static std::string_view strip_share_name(std::string_view filter);
+    static bool can_match_notifications(std::string_view filter);
+    void remove_filter(const std::string &filter);
+
+public:
+    void subscribe(const std::string &clientid, std::string_view filter);
+    void unsubscribe(const std::string &clientid, std::string_view filter);
+    void client_connected(const std::string &clientid);
+    void client_disconnected(const std::string &clientid);
+    void purge_disconnected_clients(std::chrono::seconds max_age);
+    bool has_subscriber(Item &item) const;
+    size_t filter_count() const;
+};
+
+}
+
+#endif // SUBSCRIPTIONTRACKER_H
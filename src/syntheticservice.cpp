@@ -0,0 +1,334 @@
+#include "syntheticservice.h"
+
+#include <stdexcept>
+#include <string_view>
+#include <algorithm>
+
+#include "dbusmessageguard.h"
+#include "dbusmessageiteropencontainerguard.h"
+#include "dbuserrorguard.h"
+#include "vendor/json.hpp"
+
+using namespace dbus_flashmq;
+
+SyntheticService::SyntheticService(const std::string &name, uint32_t device_instance, size_t item_count) :
+    name(name)
+{
+    items["/DeviceInstance"] = VeVariant(nlohmann::json(device_instance));
+    items["/ProductName"] = VeVariant("Synthetic load service");
+    items["/Mgmt/ProcessName"] = VeVariant("flashmq-dbus-plugin-load");
+
+    for (size_t i = 0; i < item_count; i++)
+    {
+        const std::string path = "/Synthetic/" + std::to_string(i / 50) + "/Value" + std::to_string(i % 50);
+
+        switch (i % 4)
+        {
+        case 1:
+            items[path] = VeVariant(nlohmann::json(static_cast<int32_t>(i)));
+            break;
+        case 3:
+            items[path] = VeVariant("text " + std::to_string(i));
+            continue;
+        default:
+            items[path] = VeVariant(nlohmann::json(static_cast<double>(i) + 0.5));
+            break;
+        }
+
+        changing_paths.push_back(path);
+    }
+}
+
+SyntheticService::~SyntheticService()
+{
+    if (connection)
+    {
+        dbus_connection_close(connection);
+        dbus_connection_unref(connection);
+        connection = nullptr;
+    }
+}
+
+/**
+ * @brief SyntheticService::connect opens a private connection to the system bus, and takes the service name.
+ */
+void SyntheticService::connect()
+{
+    DBusErrorGuard err;
+    connection = dbus_bus_get_private(DBusBusType::DBUS_BUS_SYSTEM, err.get());
+    err.throw_error();
+
+    dbus_connection_set_exit_on_disconnect(connection, false);
+
+    const int result = dbus_bus_request_name(connection, name.c_str(), DBUS_NAME_FLAG_DO_NOT_QUEUE, err.get());
+    err.throw_error();
+
+    if (result != DBUS_REQUEST_NAME_REPLY_PRIMARY_OWNER)
+        throw std::runtime_error("Can't become the owner of " + name);
+}
+
+int SyntheticService::get_fd() const
+{
+    int fd = -1;
+    if (!connection || !dbus_connection_get_unix_fd(connection, &fd))
+        return -1;
+    return fd;
+}
+
+/**
+ * @brief SyntheticService::process does the IO that can be done without blocking, and answers the method calls that came in.
+ */
+void SyntheticService::process()
+{
+    dbus_connection_read_write(connection, 0);
+
+    DBusMessage *msg = nullptr;
+    while ((msg = dbus_connection_pop_message(connection)))
+    {
+        DBusMessageGuard msg_guard(msg);
+        handle_message(msg);
+    }
+
+    dbus_connection_flush(connection);
+}
+
+/**
+ * @brief SyntheticService::append_item appends a path with its Value and Text, in the form of GetItems and ItemsChanged.
+ */
+void SyntheticService::append_item(DBusMessageIter *iter, const std::string &path, const VeVariant &value) const
+{
+    const VeVariant text(value.as_text());
+
+    DBusMessageIterOpenContainerGuard item_iter(iter, DBUS_TYPE_DICT_ENTRY, nullptr);
+    const char *key = path.c_str();
+    dbus_message_iter_append_basic(item_iter.get_array_iter(), DBUS_TYPE_STRING, &key);
+
+    DBusMessageIterOpenContainerGuard props_iter(item_iter.get_array_iter(), DBUS_TYPE_ARRAY, "{sv}");
+
+    for (const auto &[prop_name, v] : {std::pair<const char*, const VeVariant*>("Value", &value), std::pair<const char*, const VeVariant*>("Text", &text)})
+    {
+        DBusMessageIterOpenContainerGuard prop_iter(props_iter.get_array_iter(), DBUS_TYPE_DICT_ENTRY, nullptr);
+        dbus_message_iter_append_basic(prop_iter.get_array_iter(), DBUS_TYPE_STRING, &prop_name);
+        DBusMessageIterOpenContainerGuard variant_iter(prop_iter.get_array_iter(), DBUS_TYPE_VARIANT, v->get_dbus_type_as_string_recursive().c_str());
+        v->append_args_to_dbus_message(variant_iter.get_array_iter());
+    }
+}
+
+void SyntheticService::send_reply(DBusMessage *reply)
+{
+    if (!reply)
+        throw std::runtime_error("Out of memory making a reply.");
+
+    DBusMessageGuard reply_guard(reply);
+    dbus_connection_send(connection, reply, nullptr);
+}
+
+void SyntheticService::send_properties_changed(const std::string &path, const VeVariant &value)
+{
+    const VeVariant text(value.as_text());
+
+    DBusMessage *signal = dbus_message_new_signal(path.c_str(), "com.victronenergy.BusItem", "PropertiesChanged");
+    DBusMessageGuard signal_guard(signal);
+
+    {
+        DBusMessageIter iter;
+        dbus_message_iter_init_append(signal, &iter);
+        DBusMessageIterOpenContainerGuard props_iter(&iter, DBUS_TYPE_ARRAY, "{sv}");
+
+        for (const auto &[prop_name, v] : {std::pair<const char*, const VeVariant*>("Value", &value), std::pair<const char*, const VeVariant*>("Text", &text)})
+        {
+            DBusMessageIterOpenContainerGuard prop_iter(props_iter.get_array_iter(), DBUS_TYPE_DICT_ENTRY, nullptr);
+            dbus_message_iter_append_basic(prop_iter.get_array_iter(), DBUS_TYPE_STRING, &prop_name);
+            DBusMessageIterOpenContainerGuard variant_iter(prop_iter.get_array_iter(), DBUS_TYPE_VARIANT, v->get_dbus_type_as_string_recursive().c_str());
+            v->append_args_to_dbus_message(variant_iter.get_array_iter());
+        }
+    }
+
+    dbus_connection_send(connection, signal, nullptr);
+}
+
+void SyntheticService::handle_get_items(DBusMessage *msg)
+{
+    DBusMessage *reply = dbus_message_new_method_return(msg);
+    DBusMessageGuard reply_guard(reply);
+
+    {
+        DBusMessageIter iter;
+        dbus_message_iter_init_append(reply, &iter);
+        DBusMessageIterOpenContainerGuard array_iter(&iter, DBUS_TYPE_ARRAY, "{sa{sv}}");
+
+        for (const auto &[path, value] : items)
+        {
+            append_item(array_iter.get_array_iter(), path, value);
+        }
+    }
+
+    dbus_connection_send(connection, reply, nullptr);
+}
+
+/**
+ * @brief SyntheticService::handle_get_value answers with the value of an item, or with a dict of the values below the path, with the
+ * paths relative to it, like GetValue on '/'.
+ */
+void SyntheticService::handle_get_value(DBusMessage *msg)
+{
+    const std::string path = dbus_message_get_path(msg);
+
+    auto pos = items.find(path);
+    if (pos != items.end())
+    {
+        DBusMessage *reply = dbus_message_new_method_return(msg);
+        DBusMessageGuard reply_guard(reply);
+
+        {
+            DBusMessageIter iter;
+            dbus_message_iter_init_append(reply, &iter);
+            DBusMessageIterOpenContainerGuard variant_iter(&iter, DBUS_TYPE_VARIANT, pos->second.get_dbus_type_as_string_recursive().c_str());
+            pos->second.append_args_to_dbus_message(variant_iter.get_array_iter());
+        }
+
+        dbus_connection_send(connection, reply, nullptr);
+        return;
+    }
+
+    const std::string prefix = path == "/" ? path : path + "/";
+    auto begin = items.lower_bound(prefix);
+
+    if (begin == items.end() || !begin->first.starts_with(prefix))
+    {
+        send_reply(dbus_message_new_error(msg, "org.freedesktop.DBus.Error.UnknownObject", "No such path"));
+        return;
+    }
+
+    DBusMessage *reply = dbus_message_new_method_return(msg);
+    DBusMessageGuard reply_guard(reply);
+
+    {
+        DBusMessageIter iter;
+        dbus_message_iter_init_append(reply, &iter);
+        DBusMessageIterOpenContainerGuard variant_iter(&iter, DBUS_TYPE_VARIANT, "a{sv}");
+        DBusMessageIterOpenContainerGuard array_iter(variant_iter.get_array_iter(), DBUS_TYPE_ARRAY, "{sv}");
+
+        for (auto it = begin; it != items.end() && it->first.starts_with(prefix); ++it)
+        {
+            const std::string relative_path = it->first.substr(prefix.length());
+            const char *key = relative_path.c_str();
+
+            DBusMessageIterOpenContainerGuard entry_iter(array_iter.get_array_iter(), DBUS_TYPE_DICT_ENTRY, nullptr);
+            dbus_message_iter_append_basic(entry_iter.get_array_iter(), DBUS_TYPE_STRING, &key);
+            DBusMessageIterOpenContainerGuard value_iter(entry_iter.get_array_iter(), DBUS_TYPE_VARIANT, it->second.get_dbus_type_as_string_recursive().c_str());
+            it->second.append_args_to_dbus_message(value_iter.get_array_iter());
+        }
+    }
+
+    dbus_connection_send(connection, reply, nullptr);
+}
+
+/**
+ * @brief SyntheticService::handle_set_value stores the value, answers 0 like the Venus services do on success, and sends PropertiesChanged.
+ */
+void SyntheticService::handle_set_value(DBusMessage *msg)
+{
+    const std::string path = dbus_message_get_path(msg);
+    set_value_calls++;
+
+    auto pos = items.find(path);
+    DBusMessageIter iter;
+    if (pos == items.end() || !dbus_message_iter_init(msg, &iter) || dbus_message_iter_get_arg_type(&iter) != DBUS_TYPE_VARIANT)
+    {
+        send_reply(dbus_message_new_error(msg, "org.freedesktop.DBus.Error.InvalidArgs", "Unknown path or no variant"));
+        return;
+    }
+
+    DBusMessageIter variant_iter;
+    dbus_message_iter_recurse(&iter, &variant_iter);
+    pos->second = VeVariant(&variant_iter);
+
+    DBusMessage *reply = dbus_message_new_method_return(msg);
+    const dbus_int32_t result = 0;
+    dbus_message_append_args(reply, DBUS_TYPE_INT32, &result, DBUS_TYPE_INVALID);
+    send_reply(reply);
+
+    send_properties_changed(path, pos->second);
+}
+
+void SyntheticService::handle_message(DBusMessage *msg)
+{
+    if (dbus_message_get_type(msg) != DBUS_MESSAGE_TYPE_METHOD_CALL)
+        return;
+
+    if (dbus_message_is_method_call(msg, "com.victronenergy.BusItem", "GetItems"))
+        handle_get_items(msg);
+    else if (dbus_message_is_method_call(msg, "com.victronenergy.BusItem", "GetValue"))
+        handle_get_value(msg);
+    else if (dbus_message_is_method_call(msg, "com.victronenergy.BusItem", "SetValue"))
+        handle_set_value(msg);
+    else
+        send_reply(dbus_message_new_error(msg, "org.freedesktop.DBus.Error.UnknownMethod", "Unknown method"));
+}
+
+VeVariant SyntheticService::next_value(const VeVariant &current)
+{
+    if (current.get_type() == VeVariantType::Double)
+        return VeVariant(nlohmann::json(static_cast<double>(current.as_int<int64_t>() + 1) + 0.5));
+
+    return VeVariant(nlohmann::json(current.as_int<int32_t>() + 1));
+}
+
+/**
+ * @brief SyntheticService::emit_changes changes the next items, round robin, and sends the change as one ItemsChanged, or as one
+ * PropertiesChanged per item.
+ * @return The number of items changed.
+ */
+size_t SyntheticService::emit_changes(size_t count, bool properties_changed)
+{
+    count = std::min(count, changing_paths.size());
+
+    if (count == 0)
+        return 0;
+
+    if (properties_changed)
+    {
+        for (size_t i = 0; i < count; i++)
+        {
+            const std::string &path = changing_paths.at(next_change++ % changing_paths.size());
+            VeVariant &value = items[path];
+            value = next_value(value);
+            send_properties_changed(path, value);
+        }
+    }
+    else
+    {
+        DBusMessage *signal = dbus_message_new_signal("/", "com.victronenergy.BusItem", "ItemsChanged");
+        DBusMessageGuard signal_guard(signal);
+
+        {
+            DBusMessageIter iter;
+            dbus_message_iter_init_append(signal, &iter);
+            DBusMessageIterOpenContainerGuard array_iter(&iter, DBUS_TYPE_ARRAY, "{sa{sv}}");
+
+            for (size_t i = 0; i < count; i++)
+            {
+                const std::string &path = changing_paths.at(next_change++ % changing_paths.size());
+                VeVariant &value = items[path];
+                value = next_value(value);
+                append_item(array_iter.get_array_iter(), path, value);
+            }
+        }
+
+        dbus_connection_send(connection, signal, nullptr);
+    }
+
+    next_change %= changing_paths.size();
+    return count;
+}
+
+size_t SyntheticService::get_item_count() const
+{
+    return items.size();
+}
+
+uint64_t SyntheticService::get_set_value_calls() const
+{
+    return set_value_calls;
+}
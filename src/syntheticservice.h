@@ -0,0 +1,55 @@
+#ifndef SYNTHETICSERVICE_H
+#define SYNTHETICSERVICE_H
+
+#include <string>
+#include <vector>
+#include <map>
+#include <cstdint>
+#include <dbus-1.0/dbus/dbus.h>
+
+#include "vevariant.h"
+
+namespace dbus_flashmq
+{
+
+/**
+ * @brief The SyntheticService class is a fake com.victronenergy service for the load harness, on its own private connection to the bus.
+ *
+ * It answers GetItems, GetValue and SetValue like the Venus services do, and sends ItemsChanged or PropertiesChanged signals on
+ * request. The items are a mix of doubles, integers and strings, of which the doubles and integers change.
+ */
+class SyntheticService
+{
+    std::string name;
+    DBusConnection *connection = nullptr;
+    std::map<std::string, VeVariant> items;
+    std::vector<std::string> changing_paths;
+    size_t next_change = 0;
+    uint64_t set_value_calls = 0;
+
+    void append_item(DBusMessageIter *iter, const std::string &path, const VeVariant &value) const;
+    void send_reply(DBusMessage *reply);
+    void send_properties_changed(const std::string &path, const VeVariant &value);
+    void handle_get_items(DBusMessage *msg);
+    void handle_get_value(DBusMessage *msg);
+    void handle_set_value(DBusMessage *msg);
+    void handle_message(DBusMessage *msg);
+    VeVariant next_value(const VeVariant &current);
+
+public:
+    SyntheticService(const std::string &name, uint32_t device_instance, size_t item_count);
+    SyntheticService(const SyntheticService &other) = delete;
+    ~SyntheticService();
+    SyntheticService &operator=(const SyntheticService &other) = delete;
+
+    void connect();
+    int get_fd() const;
+    void process();
+    size_t emit_changes(size_t count, bool properties_changed);
+    size_t get_item_count() const;
+    uint64_t get_set_value_calls() const;
+};
+
+}
+
+#endif // SYNTHETICSERVICE_H
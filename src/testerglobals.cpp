@@ -1,8 +1,12 @@
 #include "testerglobals.h"
 #include "sys/epoll.h"
 #include <cstring>
+#include <algorithm>
+#include <cerrno>
 #include "vendor/flashmq_plugin.h"
 
+#define MAX_EVENTS 25
+
 int testCount;
 int failCount;
 
@@ -67,3 +71,78 @@ void TesterGlobals::pollExternalRemove(int fd)
         flashmq_logf(LOG_ERR, "Removing externally watched fd %d from epoll produced error: %s", fd, strerror(errno));
     }
 }
+
+/**
+ * @brief TesterGlobals::run_event_loop stands in for FlashMQ's event loop: it performs the delayed tasks, and gives the plugin its fd events.
+ * @param duration How long to run. Without it, it runs forever.
+ */
+void TesterGlobals::run_event_loop(void *thread_data, std::optional<std::chrono::milliseconds> duration)
+{
+    const auto end = std::chrono::steady_clock::now() + duration.value_or(std::chrono::milliseconds(0));
+
+    struct epoll_event events[MAX_EVENTS];
+    memset(&events, 0, sizeof (struct epoll_event)*MAX_EVENTS);
+
+    while (!duration || std::chrono::steady_clock::now() < end)
+    {
+        uint32_t next_task_delay = delayedTasks.getTimeTillNext();
+
+        if (duration)
+        {
+            const auto remaining = std::chrono::ceil<std::chrono::milliseconds>(end - std::chrono::steady_clock::now());
+            next_task_delay = std::min<uint32_t>(next_task_delay, static_cast<uint32_t>(std::max<int64_t>(remaining.count(), 1)));
+        }
+
+        const uint32_t epoll_wait_time = std::min<uint32_t>(next_task_delay, 100);
+
+        const int num_fds = epoll_wait(epoll_fd, events, MAX_EVENTS, static_cast<int>(epoll_wait_time));
+
+        if (epoll_wait_time == 0)
+        {
+            delayedTasks.performAll();
+        }
+
+        if (num_fds < 0)
+        {
+            if (errno == EINTR)
+                continue;
+        }
+
+        for (int i = 0; i < num_fds; i++)
+        {
+            int cur_fd = events[i].data.fd;
+
+            auto pos = watchedFds.find(cur_fd);
+            if (pos != watchedFds.end())
+            {
+                std::weak_ptr<void> &p = pos->second;
+                flashmq_plugin_poll_event_received(thread_data, cur_fd, events[i].events, p);
+            }
+        }
+    }
+}
+
+/**
+ * @brief TesterGlobals::run_due_tasks performs the tasks that are due, including the ones they add without delay, without waiting for fds.
+ */
+void TesterGlobals::run_due_tasks()
+{
+    while (delayedTasks.getTimeTillNext() == 0)
+    {
+        delayedTasks.performAll();
+    }
+}
+
+/**
+ * @brief TesterGlobals::add_to_checksum adds data to the FNV-1a output checksum, with a terminating zero, so that 'ab','c' differs from 'a','bc'.
+ */
+void TesterGlobals::add_to_checksum(std::string_view data)
+{
+    for (const char c : data)
+    {
+        output_checksum ^= static_cast<uint8_t>(c);
+        output_checksum *= 1099511628211ULL;
+    }
+
+    output_checksum *= 1099511628211ULL;
+}
@@ -3,6 +3,12 @@
 
 #include <unordered_map>
 #include <memory>
+#include <cstdint>
+#include <chrono>
+#include <optional>
+#include <string_view>
+#include <string>
+#include <vector>
 #include "queuedtasks.h"
 #include "vendor/flashmq_plugin.h"
 
@@ -38,9 +44,26 @@ public:
     int epoll_fd = -1;
     QueuedTasks delayedTasks;
 
+    // For the benchmarks: publishes are only counted, not printed, and only warnings and errors are logged.
+    bool count_publishes_only = false;
+    bool quiet = false;
+    uint64_t publish_count = 0;
+    uint64_t publish_bytes = 0;
+
+    // For trace replays: a checksum of what the plugin puts out, to compare replays by.
+    bool checksum_output = false;
+    uint64_t output_checksum = 14695981039346656037ULL; // The FNV-1a offset basis.
+
+    // For tests that check what was published, as topic and payload.
+    bool record_publishes = false;
+    std::vector<std::pair<std::string, std::string>> recorded_publishes;
+
     static TesterGlobals *getInstance();
     void pollExternalFd(int fd, uint32_t events, const std::weak_ptr<void> &p);
     void pollExternalRemove(int fd);
+    void run_event_loop(void *thread_data, std::optional<std::chrono::milliseconds> duration = {});
+    void run_due_tasks();
+    void add_to_checksum(std::string_view data);
 };
 
 }
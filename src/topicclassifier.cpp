@@ -0,0 +1,77 @@
+#include "topicclassifier.h"
+
+#include <algorithm>
+
+using namespace dbus_flashmq;
+
+namespace
+{
+
+char to_lower_ascii(char c)
+{
+    return (c >= 'A' && c <= 'Z') ? static_cast<char>(c + ('a' - 'A')) : c;
+}
+
+TopicAction parse_action(const std::string &action)
+{
+    if (action.length() != 1)
+        return TopicAction::Other;
+
+    switch (action[0])
+    {
+    case 'N':
+        return TopicAction::N;
+    case 'R':
+        return TopicAction::R;
+    case 'W':
+        return TopicAction::W;
+    case 'P':
+        return TopicAction::P;
+    case 'I':
+        return TopicAction::I;
+    default:
+        return TopicAction::Other;
+    }
+}
+
+}
+
+/**
+ * @brief contains_case_insensitive is a search for an ASCII needle, without making a lowercase copy of the haystack.
+ * @param lower_needle must be lowercase already.
+ */
+bool dbus_flashmq::contains_case_insensitive(std::string_view haystack, std::string_view lower_needle)
+{
+    auto pos = std::search(haystack.begin(), haystack.end(), lower_needle.begin(), lower_needle.end(), [](char a, char b) {
+        return to_lower_ascii(a) == b;
+    });
+
+    return pos != haystack.end() || lower_needle.empty();
+}
+
+/**
+ * @brief classify_topic works out everything the ACL checks need to know about a topic, in one go.
+ * @param vrm_id our portal id.
+ */
+TopicClass dbus_flashmq::classify_topic(std::string_view topic, const std::vector<std::string> &subtopics, const std::string &vrm_id)
+{
+    TopicClass result;
+
+    if (subtopics.size() < 2)
+        return result;
+
+    result.action = parse_action(subtopics[0]);
+    result.for_us = subtopics[1] == vrm_id;
+    result.local = subtopics[1] == "local";
+    result.direction_in = subtopics.size() >= 3 && subtopics[2] == "in";
+
+    if (result.action != TopicAction::W)
+        return result;
+
+    result.platform_security_api = subtopics.size() >= 3 && subtopics[2] == "platform" && topic.find("/Security/Api") != std::string_view::npos;
+
+    const bool access_point_password = subtopics.size() >= 7 && subtopics[2] == "settings" && subtopics[6] == "AccessPointPassword";
+    result.sensitive = result.platform_security_api || access_point_password || contains_case_insensitive(topic, "password");
+
+    return result;
+}
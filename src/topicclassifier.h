@@ -0,0 +1,42 @@
+#ifndef TOPICCLASSIFIER_H
+#define TOPICCLASSIFIER_H
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <cstdint>
+
+namespace dbus_flashmq
+{
+
+enum class TopicAction : uint8_t
+{
+    Other,
+    N,
+    R,
+    W,
+    P,
+    I
+};
+
+/**
+ * @brief The TopicClass struct holds the properties of a topic the ACL checks care about, like 'W/<portalid>/platform/0/Security/Api'.
+ *
+ * It's made once per check by classify_topic(), by looking at the subtopics FlashMQ already split, so without allocating.
+ */
+struct TopicClass
+{
+    TopicAction action = TopicAction::Other;
+    bool for_us = false; // The second subtopic is our portal id.
+    bool local = false; // The second subtopic is 'local', as in I/local/in/evcharger/HQ2401ABCDE/vregset.
+    bool direction_in = false; // The third subtopic is 'in'.
+    bool platform_security_api = false;
+    bool sensitive = false; // Only classified for W topics: passwords, and the security API.
+};
+
+TopicClass classify_topic(std::string_view topic, const std::vector<std::string> &subtopics, const std::string &vrm_id);
+bool contains_case_insensitive(std::string_view haystack, std::string_view lower_needle);
+
+}
+
+#endif // TOPICCLASSIFIER_H
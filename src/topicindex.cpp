@@ -0,0 +1,57 @@
+#include "topicindex.h"
+
+#include <cassert>
+
+using namespace dbus_flashmq;
+
+void TopicIndex::add(Item &item)
+{
+    const std::string_view key = item.get_mqtt_topic_suffix();
+
+    assert(!key.empty());
+
+    if (key.empty())
+        return;
+
+    auto pos = index.find(key);
+
+    if (pos != index.end())
+    {
+        if (pos->second == &item)
+            return;
+
+        // Another service maps to the same topic, like a device that re-enumerated on another tty before its old name is gone. The
+        // key is a view into the topic of the other item, which may be erased before this one, so it's replaced by our own.
+        index.erase(pos);
+    }
+
+    index.emplace(key, &item);
+}
+
+/**
+ * @brief TopicIndex::remove removes the item, if it's the one the topic maps to. When another item took over the topic, that one stays.
+ */
+void TopicIndex::remove(const Item &item)
+{
+    auto pos = index.find(item.get_mqtt_topic_suffix());
+
+    if (pos == index.end() || pos->second != &item)
+        return;
+
+    index.erase(pos);
+}
+
+Item *TopicIndex::find(std::string_view topic_suffix) const
+{
+    auto pos = index.find(topic_suffix);
+
+    if (pos == index.end())
+        return nullptr;
+
+    return pos->second;
+}
+
+size_t TopicIndex::size() const
+{
+    return index.size();
+}
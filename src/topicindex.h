@@ -0,0 +1,32 @@
+#ifndef TOPICINDEX_H
+#define TOPICINDEX_H
+
+#include <string_view>
+#include <unordered_map>
+
+#include "types.h"
+
+namespace dbus_flashmq
+{
+
+/**
+ * @brief The TopicIndex class maps MQTT topic suffixes like 'solarcharger/258/Dc/0/Voltage' straight to the Item in the item store.
+ *
+ * The keys are views into the publish topic of the items themselves, so the index doesn't store strings of its own, and lookups can be
+ * done with a view into an incoming topic, without allocating. This relies on the items being stable in memory, which they are as
+ * nodes in an unordered_map, until the service is removed. The owner must remove the items before erasing them.
+ */
+class TopicIndex
+{
+    std::unordered_map<std::string_view, Item*> index;
+
+public:
+    void add(Item &item);
+    void remove(const Item &item);
+    Item *find(std::string_view topic_suffix) const;
+    size_t size() const;
+};
+
+}
+
+#endif // TOPICINDEX_H
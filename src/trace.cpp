@@ -0,0 +1,418 @@
+#include "trace.h"
+
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "exceptions.h"
+#include "dbusmessageguard.h"
+#include "dbusmessageiteropencontainerguard.h"
+#include "dbusmessageitersignature.h"
+#include "topicclassifier.h"
+#include "vendor/flashmq_plugin.h"
+
+using namespace dbus_flashmq;
+
+namespace
+{
+
+constexpr std::string_view trace_magic{"DBFMQTRC"};
+constexpr uint32_t trace_version = 1;
+constexpr size_t trace_buffer_flush_size = 65536;
+
+/**
+ * @brief copy_redacted copies the arguments at 'from' to 'to'. Under a dict entry with a sensitive path as key, or everything when
+ * 'redact' is set, strings become empty and numbers zero, so the shape of the message stays the same.
+ */
+void copy_redacted(DBusMessageIter *from, DBusMessageIter *to, bool redact)
+{
+    int type = DBUS_TYPE_INVALID;
+
+    while ((type = dbus_message_iter_get_arg_type(from)) != DBUS_TYPE_INVALID)
+    {
+        if (dbus_type_is_basic(type))
+        {
+            DBusBasicValue value;
+            memset(&value, 0, sizeof(value));
+
+            if (!redact || type == DBUS_TYPE_OBJECT_PATH || type == DBUS_TYPE_SIGNATURE)
+                dbus_message_iter_get_basic(from, &value);
+            else if (type == DBUS_TYPE_STRING)
+                value.str = const_cast<char*>("");
+
+            if (!dbus_message_iter_append_basic(to, type, &value))
+                throw std::runtime_error("Out of memory copying dbus message for trace.");
+        }
+        else
+        {
+            DBusMessageIter from_sub;
+            dbus_message_iter_recurse(from, &from_sub);
+
+            std::string contained_signature;
+            if (type == DBUS_TYPE_ARRAY)
+                contained_signature = DBusMessageIterSignature(from).signature.substr(1);
+            else if (type == DBUS_TYPE_VARIANT)
+                contained_signature = DBusMessageIterSignature(&from_sub).signature;
+
+            DBusMessageIterOpenContainerGuard to_sub(to, type, contained_signature.empty() ? nullptr : contained_signature.c_str());
+            bool redact_sub = redact;
+
+            // Keys stay, because they say what the values are.
+            if (type == DBUS_TYPE_DICT_ENTRY && dbus_message_iter_get_arg_type(&from_sub) == DBUS_TYPE_STRING)
+            {
+                const char *key = nullptr;
+                dbus_message_iter_get_basic(&from_sub, &key);
+                redact_sub = redact_sub || TraceRecorder::is_sensitive_dbus_path(key);
+
+                if (!dbus_message_iter_append_basic(to_sub.get_array_iter(), DBUS_TYPE_STRING, &key))
+                    throw std::runtime_error("Out of memory copying dbus message for trace.");
+
+                dbus_message_iter_next(&from_sub);
+            }
+
+            copy_redacted(&from_sub, to_sub.get_array_iter(), redact_sub);
+        }
+
+        dbus_message_iter_next(from);
+    }
+}
+
+/**
+ * @brief redacted_copy makes a copy of the message with the headers that matter for handling it, and the arguments copied by
+ * copy_redacted(). The serial is kept, because a message without one can't be demarshalled.
+ */
+DBusMessage *redacted_copy(DBusMessage *msg, bool redact_all)
+{
+    DBusMessageGuard copy(dbus_message_new(dbus_message_get_type(msg)));
+
+    if (!copy.d)
+        throw std::runtime_error("Out of memory copying dbus message for trace.");
+
+    auto set_header = [](dbus_bool_t (*setter)(DBusMessage*, const char*), DBusMessage *m, const char *value) {
+        if (value && !setter(m, value))
+            throw std::runtime_error("Out of memory copying dbus message for trace.");
+    };
+
+    set_header(dbus_message_set_path, copy.d, dbus_message_get_path(msg));
+    set_header(dbus_message_set_interface, copy.d, dbus_message_get_interface(msg));
+    set_header(dbus_message_set_member, copy.d, dbus_message_get_member(msg));
+    set_header(dbus_message_set_error_name, copy.d, dbus_message_get_error_name(msg));
+    set_header(dbus_message_set_sender, copy.d, dbus_message_get_sender(msg));
+    set_header(dbus_message_set_destination, copy.d, dbus_message_get_destination(msg));
+
+    if (dbus_message_get_reply_serial(msg) && !dbus_message_set_reply_serial(copy.d, dbus_message_get_reply_serial(msg)))
+        throw std::runtime_error("Out of memory copying dbus message for trace.");
+
+    dbus_message_set_serial(copy.d, dbus_message_get_serial(msg));
+
+    DBusMessageIter from;
+    DBusMessageIter to;
+    dbus_message_iter_init(msg, &from);
+    dbus_message_iter_init_append(copy.d, &to);
+    copy_redacted(&from, &to, redact_all);
+
+    DBusMessage *result = copy.d;
+    copy.d = nullptr;
+    return result;
+}
+
+}
+
+/**
+ * @brief TraceRecorder::is_sensitive_dbus_path says whether the values of an item path, absolute or relative, are secrets, like the
+ * access point password, the BLE pincode and the security API. It's deliberately broad.
+ */
+bool TraceRecorder::is_sensitive_dbus_path(std::string_view path)
+{
+    return contains_case_insensitive(path, "password") || contains_case_insensitive(path, "pincode") || contains_case_insensitive(path, "security/api");
+}
+
+std::string TraceEvent::get_call_key() const
+{
+    std::string key;
+    key.reserve(destination.size() + path.size() + interface.size() + member.size() + 3);
+    key.append(destination).append(1, '\0').append(path).append(1, '\0').append(interface).append(1, '\0').append(member);
+    return key;
+}
+
+/**
+ * @brief TraceRecorder::TraceRecorder starts the trace with the VRM id, which is in all topics, and the plugin options, which a replay
+ * should use too.
+ */
+TraceRecorder::TraceRecorder(const std::string &path, const std::string &vrm_id, const std::unordered_map<std::string, std::string> &plugin_opts) :
+    fd(open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600))
+{
+    if (fd.get() < 0)
+        throw std::runtime_error("Can't open trace '" + path + "' for writing: " + strerror(errno));
+
+    SnapshotWriter writer(buffer);
+    buffer.append(trace_magic);
+    writer.write_u32(trace_version);
+    writer.write_string(vrm_id);
+
+    const std::map<std::string, std::string> sorted_opts(plugin_opts.begin(), plugin_opts.end());
+    writer.write_u32(static_cast<uint32_t>(sorted_opts.size()));
+    for (const auto &[name, value] : sorted_opts)
+    {
+        writer.write_string(name);
+        writer.write_string(value);
+    }
+}
+
+TraceRecorder::~TraceRecorder()
+{
+    flush();
+}
+
+/**
+ * @brief TraceRecorder::record stamps the event with the time, and appends only the fields of its type.
+ */
+void TraceRecorder::record(TraceEvent &event)
+{
+    event.time = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - started_at);
+
+    SnapshotWriter writer(buffer);
+    writer.write_u8(static_cast<uint8_t>(event.type));
+    writer.write_u64(static_cast<uint64_t>(event.time.count()));
+
+    switch (event.type)
+    {
+    case TraceEventType::DbusMessage:
+    case TraceEventType::DbusReply:
+        writer.write_string(event.message);
+        break;
+    case TraceEventType::DbusCall:
+        writer.write_u32(event.serial);
+        writer.write_string(event.destination);
+        writer.write_string(event.path);
+        writer.write_string(event.interface);
+        writer.write_string(event.member);
+        break;
+    case TraceEventType::AclCheck:
+        writer.write_u8(event.access);
+        writer.write_string(event.clientid);
+        writer.write_string(event.username);
+        writer.write_string(event.topic);
+        writer.write_string(event.payload);
+        writer.write_u8(event.retain);
+        break;
+    case TraceEventType::LoginCheck:
+        writer.write_string(event.clientid);
+        writer.write_string(event.username);
+        break;
+    case TraceEventType::LoginSucceeded:
+        writer.write_string(event.clientid);
+        writer.write_string(event.username);
+        writer.write_u8(event.privileged);
+        writer.write_u8(event.lan);
+        break;
+    case TraceEventType::ClientDisconnected:
+        writer.write_string(event.clientid);
+        break;
+    case TraceEventType::Subscribe:
+    case TraceEventType::Unsubscribe:
+        writer.write_string(event.clientid);
+        writer.write_string(event.topic);
+        break;
+    }
+
+    event_count++;
+
+    if (buffer.size() >= trace_buffer_flush_size)
+        flush();
+}
+
+void TraceRecorder::record_dbus_message(TraceEventType type, DBusMessage *msg)
+{
+    const char *path = dbus_message_get_path(msg);
+    bool redact_all = path && is_sensitive_dbus_path(path);
+
+    if (type == TraceEventType::DbusReply)
+        redact_all = sensitive_call_serials.erase(dbus_message_get_reply_serial(msg)) > 0;
+
+    char *marshalled = nullptr;
+    int len = 0;
+
+    try
+    {
+        DBusMessageGuard copy(redacted_copy(msg, redact_all));
+
+        if (!dbus_message_marshal(copy.d, &marshalled, &len))
+            throw std::runtime_error("Out of memory?");
+    }
+    catch (std::exception &ex)
+    {
+        flashmq_logf(LOG_ERR, "Can't marshal dbus message for trace: %s", ex.what());
+        return;
+    }
+
+    TraceEvent event;
+    event.type = type;
+    event.message.assign(marshalled, static_cast<size_t>(len));
+    dbus_free(marshalled);
+
+    record(event);
+}
+
+void TraceRecorder::record_dbus_call(DBusMessage *msg)
+{
+    auto safe = [](const char *s) { return s ? s : ""; };
+
+    TraceEvent event;
+    event.type = TraceEventType::DbusCall;
+    event.serial = dbus_message_get_serial(msg);
+    event.destination = safe(dbus_message_get_destination(msg));
+    event.path = safe(dbus_message_get_path(msg));
+    event.interface = safe(dbus_message_get_interface(msg));
+    event.member = safe(dbus_message_get_member(msg));
+
+    // The arguments aren't recorded, but the reply of a GetValue on a password is as much a secret.
+    if (is_sensitive_dbus_path(event.path))
+        sensitive_call_serials.insert(event.serial);
+
+    record(event);
+}
+
+void TraceRecorder::flush()
+{
+    const char *p = buffer.data();
+    size_t left = buffer.size();
+
+    while (left > 0)
+    {
+        const ssize_t n = write(fd.get(), p, left);
+
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+
+            flashmq_logf(LOG_ERR, "Error writing trace, dropping %lu bytes: %s", static_cast<unsigned long>(left), strerror(errno));
+            break;
+        }
+
+        p += n;
+        left -= static_cast<size_t>(n);
+    }
+
+    buffer.clear();
+}
+
+uint64_t TraceRecorder::get_event_count() const
+{
+    return event_count;
+}
+
+TraceReader::TraceReader(const std::string &path)
+{
+    std::ifstream file(path, std::ios::binary);
+
+    if (!file)
+        throw std::runtime_error("Can't open trace '" + path + "'.");
+
+    std::ostringstream contents;
+    contents << file.rdbuf();
+    data = contents.str();
+
+    const std::string_view view(data);
+
+    if (!view.starts_with(trace_magic))
+        throw ValueError("'" + path + "' is not a trace.");
+
+    reader.emplace(view.substr(trace_magic.size()));
+
+    const uint32_t version = reader->read_u32();
+    if (version != trace_version)
+        throw ValueError("Trace '" + path + "' is of unsupported version " + std::to_string(version) + ".");
+
+    vrm_id = reader->read_string();
+
+    const uint32_t opt_count = reader->read_u32();
+    for (uint32_t i = 0; i < opt_count; i++)
+    {
+        const std::string name(reader->read_string());
+        plugin_opts[name] = reader->read_string();
+    }
+}
+
+const std::string &TraceReader::get_vrm_id() const
+{
+    return vrm_id;
+}
+
+const std::map<std::string, std::string> &TraceReader::get_plugin_opts() const
+{
+    return plugin_opts;
+}
+
+/**
+ * @brief TraceReader::next gives the next event, or nothing at the end. A trace cut short by a crash ends at the last complete event.
+ */
+std::optional<TraceEvent> TraceReader::next()
+{
+    std::optional<TraceEvent> result;
+
+    if (reader->at_end())
+        return result;
+
+    try
+    {
+        TraceEvent &event = result.emplace();
+        event.type = static_cast<TraceEventType>(reader->read_u8());
+        event.time = std::chrono::microseconds(reader->read_u64());
+
+        switch (event.type)
+        {
+        case TraceEventType::DbusMessage:
+        case TraceEventType::DbusReply:
+            event.message = reader->read_string();
+            break;
+        case TraceEventType::DbusCall:
+            event.serial = reader->read_u32();
+            event.destination = reader->read_string();
+            event.path = reader->read_string();
+            event.interface = reader->read_string();
+            event.member = reader->read_string();
+            break;
+        case TraceEventType::AclCheck:
+            event.access = reader->read_u8();
+            event.clientid = reader->read_string();
+            event.username = reader->read_string();
+            event.topic = reader->read_string();
+            event.payload = reader->read_string();
+            event.retain = reader->read_u8();
+            break;
+        case TraceEventType::LoginCheck:
+            event.clientid = reader->read_string();
+            event.username = reader->read_string();
+            break;
+        case TraceEventType::LoginSucceeded:
+            event.clientid = reader->read_string();
+            event.username = reader->read_string();
+            event.privileged = reader->read_u8();
+            event.lan = reader->read_u8();
+            break;
+        case TraceEventType::ClientDisconnected:
+            event.clientid = reader->read_string();
+            break;
+        case TraceEventType::Subscribe:
+        case TraceEventType::Unsubscribe:
+            event.clientid = reader->read_string();
+            event.topic = reader->read_string();
+            break;
+        default:
+            throw ValueError("Unknown trace event type " + std::to_string(static_cast<int>(event.type)) + ".");
+        }
+    }
+    catch (ValueError &ex)
+    {
+        flashmq_logf(LOG_WARNING, "Trace ends in an incomplete or invalid event: %s", ex.what());
+        reader.emplace(std::string_view());
+        result.reset();
+    }
+
+    return result;
+}
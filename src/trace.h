@@ -0,0 +1,115 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <string>
+#include <string_view>
+#include <optional>
+#include <map>
+#include <unordered_map>
+#include <unordered_set>
+#include <chrono>
+#include <cstdint>
+#include <dbus-1.0/dbus/dbus.h>
+
+#include "fdguard.h"
+#include "snapshot.h"
+
+namespace dbus_flashmq
+{
+
+enum class TraceEventType : uint8_t
+{
+    DbusMessage = 1, // A message seen by dbus_handle_message(), marshalled.
+    DbusCall = 2, // A method call we made, with its serial, to match its reply on replay.
+    DbusReply = 3, // The reply to one of our method calls, marshalled.
+    AclCheck = 4,
+    LoginCheck = 5, // Without the password.
+    LoginSucceeded = 6,
+    ClientDisconnected = 7,
+    Subscribe = 8,
+    Unsubscribe = 9
+};
+
+/**
+ * @brief The TraceEvent struct is one event in a trace. Which fields are used depends on the type.
+ */
+struct TraceEvent
+{
+    TraceEventType type = TraceEventType::DbusMessage;
+    std::chrono::microseconds time {0}; // Since the start of the recording.
+
+    std::string message; // Marshalled dbus message.
+
+    dbus_uint32_t serial = 0;
+    std::string destination;
+    std::string path;
+    std::string interface;
+    std::string member;
+
+    uint8_t access = 0;
+    std::string clientid;
+    std::string username;
+    std::string topic;
+    std::string payload;
+    bool retain = false;
+    bool privileged = false;
+    bool lan = false;
+
+    std::string get_call_key() const;
+};
+
+/**
+ * @brief The TraceRecorder class writes what comes into the plugin to a trace file, for replaying with flashmq-dbus-plugin-replay.
+ *
+ * Events are buffered, and written when the buffer is full, on flush(), and on destruction. Errors are logged, not thrown, because
+ * recording must not get in the way of the plugin.
+ *
+ * Traces end up attached to field reports, so secrets are left out: the values of items with paths like passwords, in the D-Bus
+ * messages and in the replies to calls on those paths, are blanked. The caller blanks the payloads of sensitive writes.
+ *
+ * The encoding is that of the snapshot, so traces are only to be replayed on machines of the same byte order.
+ */
+class TraceRecorder
+{
+    FdGuard fd;
+    std::string buffer;
+    const std::chrono::time_point<std::chrono::steady_clock> started_at = std::chrono::steady_clock::now();
+    uint64_t event_count = 0;
+    std::unordered_set<dbus_uint32_t> sensitive_call_serials; // Of calls on sensitive paths, whose replies are blanked.
+
+public:
+    TraceRecorder(const std::string &path, const std::string &vrm_id, const std::unordered_map<std::string, std::string> &plugin_opts);
+    TraceRecorder(const TraceRecorder &other) = delete;
+    ~TraceRecorder();
+
+    void record(TraceEvent &event);
+    void record_dbus_message(TraceEventType type, DBusMessage *msg);
+    void record_dbus_call(DBusMessage *msg);
+    void flush();
+    uint64_t get_event_count() const;
+
+    static bool is_sensitive_dbus_path(std::string_view path);
+};
+
+/**
+ * @brief The TraceReader class reads a trace file into memory, and gives its events one by one.
+ */
+class TraceReader
+{
+    std::string data;
+    std::optional<SnapshotReader> reader;
+    std::string vrm_id;
+    std::map<std::string, std::string> plugin_opts;
+
+public:
+    TraceReader(const std::string &path);
+    TraceReader(const TraceReader &other) = delete;
+
+    const std::string &get_vrm_id() const;
+    const std::map<std::string, std::string> &get_plugin_opts() const;
+    std::optional<TraceEvent> next();
+};
+
+}
+
+#endif // TRACE_H
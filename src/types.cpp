@@ -1,13 +1,41 @@
 #include "types.h"
 
 #include <sstream>
+#include <cstring>
 
 #include "exceptions.h"
+#include "jsonwriter.h"
 #include "vendor/flashmq_plugin.h"
 #include "vendor/json.hpp"
 
 using namespace dbus_flashmq;
 
+namespace
+{
+
+/**
+ * @brief select_bus_item_field maps a BusItem dict key onto the field it's stored in, or nullptr for keys we don't use, like 'Text' and
+ * 'Default'. Those are then skipped without being decoded.
+ */
+VeVariant *select_bus_item_field(ValueMinMax &v, const char *key)
+{
+    switch (key[0])
+    {
+    case 'V':
+        return std::strcmp(key + 1, "alue") == 0 ? &v.value : nullptr;
+    case 'M':
+        if (std::strcmp(key + 1, "in") == 0)
+            return &v.min;
+        if (std::strcmp(key + 1, "ax") == 0)
+            return &v.max;
+        return nullptr;
+    default:
+        return nullptr;
+    }
+}
+
+}
+
 
 ValueMinMax &ValueMinMax::operator=(const ValueMinMax &other)
 {
@@ -29,6 +57,70 @@ ValueMinMax &ValueMinMax::operator=(const ValueMinMax &other)
     return *this;
 }
 
+/**
+ * @brief ValueMinMax::from_dict reads the a{sv} of one item, as in GetItems, ItemsChanged and PropertiesChanged, like {"Value": 5, "Text": "5 W"}.
+ * @param iter pointing at the array. The caller must have checked the message signature, so the keys are known to be strings.
+ *
+ * Only the Value, Min and Max are decoded, and scalars go straight into the VeVariant without intermediate containers.
+ * @param arena to decode long strings into, when the result is only compared against the item store.
+ */
+ValueMinMax ValueMinMax::from_dict(DBusMessageIter *iter, DispatchArena *arena)
+{
+    if (dbus_message_iter_get_arg_type(iter) != DBUS_TYPE_ARRAY)
+        throw ValueError("Dict value should be array.");
+
+    DBusMessageIter array_iter;
+    dbus_message_iter_recurse(iter, &array_iter);
+
+    ValueMinMax value;
+
+    int value_type = 0;
+    while ((value_type = dbus_message_iter_get_arg_type(&array_iter)) != DBUS_TYPE_INVALID)
+    {
+        if (value_type != DBUS_TYPE_DICT_ENTRY)
+        {
+            throw ValueError("Item can only be created from dict entries.");
+        }
+
+        DBusMessageIter one_item_iter;
+        dbus_message_iter_recurse(&array_iter, &one_item_iter);
+
+        DBusBasicValue key_v;
+        dbus_message_iter_get_basic(&one_item_iter, &key_v);
+
+        VeVariant *field = select_bus_item_field(value, key_v.str);
+
+        if (field)
+        {
+            dbus_message_iter_next(&one_item_iter);
+
+            if (dbus_message_iter_get_arg_type(&one_item_iter) != DBUS_TYPE_VARIANT)
+                throw ValueError("Value/Text elements in dict must be variant.");
+
+            *field = VeVariant(&one_item_iter, arena);
+        }
+
+        dbus_message_iter_next(&array_iter);
+    }
+
+    return value;
+}
+
+/**
+ * @brief ValueMinMax::would_change tells whether assigning other changes anything, with the same rules as operator=.
+ */
+bool ValueMinMax::would_change(const ValueMinMax &other) const
+{
+    if (other.value && !(this->value == other.value))
+        return true;
+    if (other.min && !(this->min == other.min))
+        return true;
+    if (other.max && !(this->max == other.max))
+        return true;
+
+    return false;
+}
+
 
 std::string Item::join_paths_with_slash(const std::string &a, const std::string &b)
 {
@@ -132,55 +224,14 @@ Item Item::from_get_items(DBusMessageIter *iter)
 
     dbus_message_iter_next(&dict_iter);
 
-    if (dbus_message_iter_get_arg_type(&dict_iter) != DBUS_TYPE_ARRAY)
-        throw ValueError("Dict value should be array.");
-
-    DBusMessageIter array_iter;
-    dbus_message_iter_recurse(&dict_iter, &array_iter);
-
-    ValueMinMax value;
-
-    int value_type = 0;
-    while ((value_type = dbus_message_iter_get_arg_type(&array_iter)) != DBUS_TYPE_INVALID)
-    {
-        if (value_type != DBUS_TYPE_DICT_ENTRY)
-        {
-            throw ValueError("Item can only be created from dict entries.");
-        }
-
-        DBusMessageIter one_item_iter;
-        dbus_message_iter_recurse(&array_iter, &one_item_iter);
-
-        DBusBasicValue key_v;
-        dbus_message_iter_get_basic(&one_item_iter, &key_v);
-
-        std::string key(key_v.str);
-
-        dbus_message_iter_next(&one_item_iter);
-
-        if (dbus_message_iter_get_arg_type(&one_item_iter) != DBUS_TYPE_VARIANT)
-            throw ValueError("Value/Text elements in dict must be variant.");
-
-        VeVariant val(&one_item_iter);
-
-        if (key == "Value")
-        {
-            value.value = std::move(val);
-        }
-
-        if (key == "Max")
-        {
-            value.max = std::move(val);
-        }
-
-        if (key == "Min")
-        {
-            value.min = std::move(val);
-        }
+    ValueMinMax value = ValueMinMax::from_dict(&dict_iter);
 
-        dbus_message_iter_next(&array_iter);
-    }
+    Item item(path, std::move(value));
+    return item;
+}
 
+Item Item::from_path_and_value(const std::string &path, ValueMinMax &&value)
+{
     Item item(path, std::move(value));
     return item;
 }
@@ -275,39 +326,78 @@ Item Item::from_properties_changed(DBusMessage *msg)
     if (msg_type != DBUS_MESSAGE_TYPE_SIGNAL)
         throw std::runtime_error("In from_properties_changed: message is not a signal.");
 
+    if (!dbus_message_has_signature(msg, "a{sv}"))
+        throw ValueError("PropertiesChanged is not the correct signature.");
+
     DBusMessageIter iter;
     dbus_message_iter_init(msg, &iter);
 
-    const int type = dbus_message_iter_get_arg_type(&iter);
-    if (type != DBUS_TYPE_ARRAY)
-        throw ValueError("Expected array from dbus when constructing item.");
-
     const std::string path = dbus_message_get_path(msg);
 
-    VeVariant v(&iter);
+    ValueMinMax v = ValueMinMax::from_dict(&iter);
 
-    ValueMinMax v2;
-    v2.value = v.get_dict_val("Value");
+    if (!v.value && !v.min && !v.max)
+        throw ValueError("PropertiesChanged for '" + path + "' has no Value, Min or Max.");
 
-    Item item(path, std::move(v2));
+    Item item(path, std::move(v));
     return item;
 }
 
-std::string Item::as_json()
+/**
+ * @brief Item::as_json renders the payload into the cache, reusing its buffer. Keys are in the same (sorted) order nlohmann would have.
+ */
+const std::string &Item::as_json()
 {
     if (!cache_json.v.empty())
         return cache_json.v;
 
     const bool mask = is_pincode() || is_ap_password();
-    nlohmann::json j { {"value", value.value.as_json_value(mask)} };
 
-    if (value.min)
-        j["min"] = value.min.as_json_value();
+    std::string &out = cache_json.v;
+    JsonWriter writer(out);
+
+    try
+    {
+        write_json_payload(writer, mask);
+    }
+    catch (std::exception&)
+    {
+        // Don't leave a partial payload in the cache.
+        out.clear();
+        throw;
+    }
+
+    return out;
+}
+
+/**
+ * @brief Item::restore_json_cache is for items loaded from a snapshot, which has the JSON as rendered by as_json() back then.
+ */
+void Item::restore_json_cache(std::string_view json)
+{
+    cache_json.v = json;
+}
+
+void Item::write_json_payload(JsonWriter &writer, bool mask) const
+{
+    writer.write_raw('{');
+
     if (value.max)
-        j["max"] = value.max.as_json_value();
+    {
+        writer.write_raw("\"max\":");
+        value.max.write_json(writer);
+        writer.write_raw(',');
+    }
+    if (value.min)
+    {
+        writer.write_raw("\"min\":");
+        value.min.write_json(writer);
+        writer.write_raw(',');
+    }
 
-    cache_json.v = j.dump();
-    return cache_json.v;
+    writer.write_raw("\"value\":");
+    value.value.write_json(writer, mask);
+    writer.write_raw('}');
 }
 
 void Item::set_partial_mapping_details(const std::string &service)
@@ -328,19 +418,24 @@ void Item::set_mapping_details(const std::string &vrm_id, const std::string &ser
     this->mqtt_publish_topic = topic_stream.str();
 }
 
-void Item::publish(bool null_payload)
+/**
+ * @brief Item::publish
+ * @return The size of the topic and payload published, or 0 when nothing was published.
+ */
+size_t Item::publish(bool null_payload)
 {
+    // Any publish carries the latest value, so it satisfies a pending one. So does finding that there's nothing to publish.
+    this->publish_pending = false;
+
     if (this->mqtt_publish_topic.get().empty())
-        return;
+        return 0;
 
     // Blocked entries
     if ((short_service_name.service_type() == "vebus" && path.get() == "/Interfaces/Mk2/Tunnel") || (short_service_name.service_type() == "paygo" && path.get() == "/LVD/Threshold"))
-        return;
-
-    std::string payload;
+        return 0;
 
-    if (!null_payload)
-        payload = as_json();
+    static const std::string empty_payload;
+    const std::string &payload = null_payload ? empty_payload : as_json();
 
     const bool retain = should_be_retained();
 
@@ -350,7 +445,15 @@ void Item::publish(bool null_payload)
         // Note that FlashMQ merely appends the packet to the TCP client's output buffer as bytes, and once you return control
         // to the main loop, this buffer is flushed. This is a prerequisite to being fast.
         flashmq_publish_message(this->mqtt_publish_topic.get(), 0, retain, payload);
+
+        // The rate limit is about what actually went out.
+        if (this->min_publish_interval.count() > 0)
+            this->last_publish_time = std::chrono::steady_clock::now();
+
+        return this->mqtt_publish_topic.get().size() + payload.size();
     }
+
+    return 0;
 }
 
 /**
@@ -362,10 +465,18 @@ const ValueMinMax &Item::get_value() const
     return this->value;
 }
 
-void Item::set_value(const ValueMinMax &val)
+/**
+ * @brief Item::set_value only touches the value, and with it the rendered JSON, when it actually changes.
+ * @return whether the value changed.
+ */
+bool Item::set_value(const ValueMinMax &val)
 {
+    if (!this->value.would_change(val))
+        return false;
+
     this->cache_json.v.clear();
     this->value = val;
+    return true;
 }
 
 const std::string &Item::get_path() const
@@ -387,6 +498,31 @@ const std::string &Item::get_service_name() const
     return service;
 }
 
+std::string_view Item::get_mqtt_topic() const
+{
+    return this->mqtt_publish_topic.get();
+}
+
+/**
+ * @brief Item::get_mqtt_topic_suffix gives the publish topic without 'N/<portalid>/', like 'solarcharger/258/Dc/0/Voltage'.
+ * @return A view into the topic of this item, so it's valid as long as the item is.
+ */
+std::string_view Item::get_mqtt_topic_suffix() const
+{
+    const std::string &topic = this->mqtt_publish_topic.get();
+
+    if (topic.empty())
+        return std::string_view();
+
+    // Like 'N/48e7da87942f/'
+    const size_t prefix_length = 3 + this->vrm_id.get().length();
+
+    if (prefix_length >= topic.length())
+        return std::string_view();
+
+    return std::string_view(topic).substr(prefix_length);
+}
+
 /**
  * @brief Even though we don't use retained message anymore, some paths are still handy to have as retained.
  * @return
@@ -416,13 +552,54 @@ bool Item::is_mqtt_local() const
     return short_service_name.service_type() == "settings" && path.get() == "/Settings/Services/MqttLocal";
 }
 
+void Item::set_min_publish_interval(std::chrono::milliseconds interval)
+{
+    this->min_publish_interval = interval;
+}
 
+/**
+ * @brief Item::get_publish_delay says how long a publish has to wait for the rate limit of this item.
+ * @return 0 when it can be published now.
+ */
+std::chrono::milliseconds Item::get_publish_delay(std::chrono::time_point<std::chrono::steady_clock> now) const
+{
+    if (this->min_publish_interval.count() <= 0)
+        return std::chrono::milliseconds(0);
 
+    const auto next_allowed = this->last_publish_time + this->min_publish_interval;
 
+    if (now >= next_allowed)
+        return std::chrono::milliseconds(0);
 
+    // Rounding up, because a timer that fires a fraction too early would just have to reschedule.
+    return std::chrono::ceil<std::chrono::milliseconds>(next_allowed - now);
+}
 
+bool Item::is_publish_pending() const
+{
+    return this->publish_pending;
+}
 
+void Item::set_publish_pending(bool pending)
+{
+    this->publish_pending = pending;
+}
 
+/**
+ * @brief Item::get_subscriber_match gives the cached result of the subscription match, if it's still valid for the generation.
+ * @return whether matched is valid.
+ */
+bool Item::get_subscriber_match(uint64_t generation, bool &matched) const
+{
+    if (this->subscriber_match_generation != generation)
+        return false;
 
+    matched = this->subscriber_match;
+    return true;
+}
 
-
+void Item::set_subscriber_match(uint64_t generation, bool matched)
+{
+    this->subscriber_match_generation = generation;
+    this->subscriber_match = matched;
+}
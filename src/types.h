@@ -2,8 +2,10 @@
 #define TYPES_H
 
 #include <string>
+#include <string_view>
 #include <dbus-1.0/dbus/dbus.h>
 #include <stdexcept>
+#include <chrono>
 #include "vevariant.h"
 #include "shortservicename.h"
 #include "cachedstring.h"
@@ -41,6 +43,9 @@ struct ValueMinMax
     ValueMinMax() = default;
     ValueMinMax (const ValueMinMax&) = default;
     ValueMinMax &operator=(const ValueMinMax &other);
+    bool would_change(const ValueMinMax &other) const;
+
+    static ValueMinMax from_dict(DBusMessageIter *iter, DispatchArena *arena=nullptr);
 };
 
 class Item
@@ -55,6 +60,16 @@ class Item
 
     CachedString cache_json;
 
+    // Only used when a publish rate limit applies to this item.
+    std::chrono::milliseconds min_publish_interval = std::chrono::milliseconds(0);
+    std::chrono::time_point<std::chrono::steady_clock> last_publish_time;
+    bool publish_pending = false;
+
+    // Whether any subscription matches, as of the subscription generation stored with it.
+    uint64_t subscriber_match_generation = 0;
+    bool subscriber_match = false;
+
+    void write_json_payload(JsonWriter &writer, bool mask) const;
     static std::string join_paths_with_slash(const std::string &a, const std::string &b);
     static std::string prefix_path_with_slash(const std::string &s);
     Item(const std::string &path, const ValueMinMax &&value);
@@ -62,22 +77,32 @@ public:
     Item();
 
     static Item from_get_items(DBusMessageIter *iter);
+    static Item from_path_and_value(const std::string &path, ValueMinMax &&value);
     static Item from_get_value(DBusMessageIter *iter, const std::string &path_prefix);
     static Item from_properties_changed(DBusMessage *msg);
 
-    std::string as_json();
+    const std::string &as_json();
+    void restore_json_cache(std::string_view json);
     void set_partial_mapping_details(const std::string &service);
     void set_mapping_details(const std::string &vrm_id, const std::string &service, ServiceIdentifier instance);
-    void publish(bool null_payload=false);
+    size_t publish(bool null_payload=false);
     const ValueMinMax &get_value() const;
-    void set_value(const ValueMinMax &val);
+    bool set_value(const ValueMinMax &val);
     const std::string &get_path() const;
     const std::string &get_service_name() const;
+    std::string_view get_mqtt_topic() const;
+    std::string_view get_mqtt_topic_suffix() const;
     bool should_be_retained() const;
     bool is_ap_password() const;
     bool is_pincode() const;
     bool is_vrm_portal_mode() const;
     bool is_mqtt_local() const;
+    void set_min_publish_interval(std::chrono::milliseconds interval);
+    std::chrono::milliseconds get_publish_delay(std::chrono::time_point<std::chrono::steady_clock> now) const;
+    bool is_publish_pending() const;
+    void set_publish_pending(bool pending);
+    bool get_subscriber_match(uint64_t generation, bool &matched) const;
+    void set_subscriber_match(uint64_t generation, bool matched);
 };
 
 }
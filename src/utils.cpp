@@ -295,6 +295,35 @@ std::string &dbus_flashmq::str_make_lower(std::string &s)
     return s;
 }
 
+/**
+ * @brief mqtt_filter_matches matches a topic against a subscription filter that is already split on '/', with the usual '+' and '#'
+ * wildcards.
+ */
+bool dbus_flashmq::mqtt_filter_matches(const std::vector<std::string> &filter, std::string_view topic)
+{
+    size_t start = 0;
+
+    for (const std::string &part : filter)
+    {
+        if (part == "#")
+            return true;
+
+        if (start > topic.size())
+            return false;
+
+        size_t end = topic.find('/', start);
+        if (end == std::string_view::npos)
+            end = topic.size();
+
+        if (part != "+" && topic.substr(start, end - start) != part)
+            return false;
+
+        start = end + 1;
+    }
+
+    return start > topic.size();
+}
+
 
 
 std::string dbus_flashmq::hash_file(const std::filesystem::path &p)
@@ -3,6 +3,7 @@
 
 #include <dbus-1.0/dbus/dbus.h>
 #include <string>
+#include <string_view>
 #include <vector>
 #include <unordered_map>
 #include <filesystem>
@@ -26,6 +27,7 @@ std::string get_stdout_from_process(const std::string &process);
 std::string get_stdout_from_process(const std::string &process, pid_t &out_pid);
 std::string dbus_message_get_error_name_safe(DBusMessage *msg);
 std::string &str_make_lower(std::string &s);
+bool mqtt_filter_matches(const std::vector<std::string> &filter, std::string_view topic);
 
 template<class T>
 T get_random()
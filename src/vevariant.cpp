@@ -1,34 +1,28 @@
 #include "vevariant.h"
 
 #include <sstream>
+#include <algorithm>
 #include <cassert>
+#include <cstring>
 
 #include "vendor/flashmq_plugin.h"
 #include "exceptions.h"
 #include "dbusmessageiteropencontainerguard.h"
 #include "dbusmessageitersignature.h"
+#include "jsonwriter.h"
+#include "snapshot.h"
+#include "dispatcharena.h"
 
 using namespace dbus_flashmq;
 
-VeVariantArray::VeVariantArray(const VeVariantArray &other)
+VeVariant::VeVariant() :
+    u64(0)
 {
-    *this = other;
-}
-
-VeVariantArray &VeVariantArray::operator=(const VeVariantArray &other)
-{
-    if (other.arr)
-    {
-        this->arr = std::make_unique<std::vector<VeVariant>>();
-        (*this->arr) = (*other.arr);
-    }
 
-    this->contained_dbus_type = other.contained_dbus_type;
-
-    return *this;
 }
 
-VeVariant::VeVariant(DBusMessageIter *iter)
+VeVariant::VeVariant(DBusMessageIter *iter, DispatchArena *arena) :
+    u64(0)
 {
     int dbus_type = dbus_message_iter_get_arg_type(iter);
 
@@ -96,8 +90,7 @@ VeVariant::VeVariant(DBusMessageIter *iter)
         break;
     case DBUS_TYPE_STRING:
         dbus_message_iter_get_basic(_iter, &value);
-        this->str = value.str;
-        this->type = VeVariantType::String;
+        set_string(value.str, strlen(value.str), arena);
         break;
     case DBUS_TYPE_STRUCT:
         flashmq_logf(LOG_WARNING, "Struct not implemented. In C++, it would have to be a map/array to be dynamic");
@@ -110,17 +103,18 @@ VeVariant::VeVariant(DBusMessageIter *iter)
         const int array_type = dbus_message_iter_get_arg_type(&peek_iter);
 
         DBusMessageIterSignature signature(&peek_iter);
-        this->contained_array_type_as_string = signature.signature;
 
         if (array_type == DBUS_TYPE_DICT_ENTRY)
         {
-            this->type = VeVariantType::Dict;
             this->dict = make_dict(_iter);
+            this->dict->contained_type = signature.signature;
+            this->type = VeVariantType::Dict;
         }
         else
         {
+            this->arr = make_array(_iter);
+            this->arr->contained_type = signature.signature;
             this->type = VeVariantType::Array;
-            arr = make_array(_iter);
         }
 
         break;
@@ -136,34 +130,131 @@ VeVariant::VeVariant(DBusMessageIter *iter)
     }
 }
 
-VeVariant::VeVariant(const std::string &v) :
-    str(v),
-    type(VeVariantType::String)
+/**
+ * @brief VeVariant::from_snapshot reads what write_snapshot() wrote, including the dbus types, so that a restored item is exactly like it was.
+ */
+VeVariant VeVariant::from_snapshot(SnapshotReader &reader)
 {
+    VeVariant result;
+    const VeVariantType t = static_cast<VeVariantType>(reader.read_u8());
 
+    switch (t)
+    {
+    case VeVariantType::Unknown:
+        break;
+    case VeVariantType::IntegerSigned16:
+        result.i16 = static_cast<dbus_int16_t>(reader.read_u64());
+        break;
+    case VeVariantType::IntegerSigned32:
+        result.i32 = static_cast<dbus_int32_t>(reader.read_u64());
+        break;
+    case VeVariantType::IntegerSigned64:
+        result.i64 = static_cast<dbus_int64_t>(reader.read_u64());
+        break;
+    case VeVariantType::IntegerUnsigned8:
+        result.u8 = static_cast<uint8_t>(reader.read_u64());
+        break;
+    case VeVariantType::IntegerUnsigned16:
+        result.u16 = static_cast<dbus_uint16_t>(reader.read_u64());
+        break;
+    case VeVariantType::IntegerUnsigned32:
+        result.u32 = static_cast<dbus_uint32_t>(reader.read_u64());
+        break;
+    case VeVariantType::IntegerUnsigned64:
+        result.u64 = reader.read_u64();
+        break;
+    case VeVariantType::Double:
+    {
+        const uint64_t bits = reader.read_u64();
+        std::memcpy(&result.d, &bits, sizeof(result.d));
+        break;
+    }
+    case VeVariantType::Boolean:
+        result.bool_val = reader.read_u8();
+        break;
+    case VeVariantType::String:
+    {
+        const std::string_view s = reader.read_string();
+        result.set_string(s.data(), s.size());
+        break;
+    }
+    case VeVariantType::Array:
+    {
+        std::unique_ptr<VeVariantArrayData> new_arr = std::make_unique<VeVariantArrayData>();
+        new_arr->contained_type = reader.read_string();
+        const uint32_t n = reader.read_u32();
+
+        for (uint32_t i = 0; i < n; i++)
+        {
+            new_arr->items.push_back(from_snapshot(reader));
+        }
+
+        result.arr = new_arr.release();
+        break;
+    }
+    case VeVariantType::Dict:
+    {
+        std::unique_ptr<VeVariantDictData> new_dict = std::make_unique<VeVariantDictData>();
+        new_dict->contained_type = reader.read_string();
+        const uint32_t n = reader.read_u32();
+
+        for (uint32_t i = 0; i < n; i++)
+        {
+            VeVariant key = from_snapshot(reader);
+            VeVariant val = from_snapshot(reader);
+            new_dict->items[std::move(key)] = std::move(val);
+        }
+
+        result.dict = new_dict.release();
+        break;
+    }
+    default:
+        throw ValueError("Unknown VeVariant type in snapshot.");
+    }
+
+    result.type = t;
+    return result;
+}
+
+VeVariant::VeVariant(const std::string &v) :
+    u64(0)
+{
+    set_string(v.data(), v.length());
 }
 
 VeVariant::VeVariant(const std::optional<std::string> &v) :
-    str(v.value_or(std::string())),
-    type(v.has_value() ? VeVariantType::String : VeVariantType::Array),
-    contained_array_type_as_string(v.has_value() ? std::string() : EMPTY_ARRAY_AS_NULL_VALUE_TYPE)
+    u64(0)
 {
+    if (v.has_value())
+    {
+        set_string(v.value().data(), v.value().length());
+        return;
+    }
 
+    this->arr = new VeVariantArrayData();
+    this->arr->contained_type = EMPTY_ARRAY_AS_NULL_VALUE_TYPE;
+    this->type = VeVariantType::Array;
 }
 
 VeVariant::VeVariant(const char *s) :
-    str(s),
-    type(VeVariantType::String)
+    u64(0)
 {
-
+    set_string(s, strlen(s));
 }
 
 VeVariant::VeVariant(const std::optional<bool> b) :
-    bool_val(static_cast<dbus_bool_t>(b.value_or(0))),
-    type(b.has_value() ? VeVariantType::Boolean : VeVariantType::Array),
-    contained_array_type_as_string(b.has_value() ? std::string() : EMPTY_ARRAY_AS_NULL_VALUE_TYPE)
+    u64(0)
 {
+    if (b.has_value())
+    {
+        this->bool_val = static_cast<dbus_bool_t>(b.value());
+        this->type = VeVariantType::Boolean;
+        return;
+    }
 
+    this->arr = new VeVariantArrayData();
+    this->arr->contained_type = EMPTY_ARRAY_AS_NULL_VALUE_TYPE;
+    this->type = VeVariantType::Array;
 }
 
 /**
@@ -172,7 +263,8 @@ VeVariant::VeVariant(const std::optional<bool> b) :
  *
  * It uses 32 bit ints if it fits, otherwise 64. Just like velib_python.
  */
-VeVariant::VeVariant(const nlohmann::json &j)
+VeVariant::VeVariant(const nlohmann::json &j) :
+    u64(0)
 {
     if (j.is_number_integer())
     {
@@ -191,8 +283,8 @@ VeVariant::VeVariant(const nlohmann::json &j)
     }
     else if (j.is_string())
     {
-        this->str = j.get<std::string>();
-        this->type = VeVariantType::String;
+        const std::string &s = j.get_ref<const std::string&>();
+        set_string(s.data(), s.length());
     }
     else if (j.is_number_float())
     {
@@ -208,9 +300,8 @@ VeVariant::VeVariant(const nlohmann::json &j)
     {
         // We can't know here is someone is really trying to write an empty array, or null. We also support json null now; see below.
 
-        this->arr = std::make_unique<std::vector<VeVariant>>();
-        type = VeVariantType::Array;
-        contained_array_type_as_string = VALID_EMPTY_ARRAY_VALUE_TYPE;
+        std::unique_ptr<VeVariantArrayData> new_arr = std::make_unique<VeVariantArrayData>();
+        new_arr->contained_type = VALID_EMPTY_ARRAY_VALUE_TYPE;
 
         bool type_anchored = false;
         int last_type = 0;
@@ -222,13 +313,16 @@ VeVariant::VeVariant(const nlohmann::json &j)
             if (type_anchored && last_type != v2.get_dbus_type())
                 throw ValueError("Dbus doesn't support arrays of mixed type");
 
-            this->arr->push_back(std::move(v2));
-
-            contained_array_type_as_string = v2.get_dbus_type_as_string_flat();
+            new_arr->contained_type = v2.get_dbus_type_as_string_flat();
 
             type_anchored = true;
             last_type = v2.get_dbus_type();
+
+            new_arr->items.push_back(std::move(v2));
         }
+
+        this->arr = new_arr.release();
+        type = VeVariantType::Array;
     }
     else if (j.is_object())
     {
@@ -237,9 +331,9 @@ VeVariant::VeVariant(const nlohmann::json &j)
     }
     else if (j.is_null())
     {
-        this->arr = std::make_unique<std::vector<VeVariant>>();
+        this->arr = new VeVariantArrayData();
+        this->arr->contained_type = EMPTY_ARRAY_AS_NULL_VALUE_TYPE;
         type = VeVariantType::Array;
-        contained_array_type_as_string = EMPTY_ARRAY_AS_NULL_VALUE_TYPE;
     }
     else
     {
@@ -248,17 +342,132 @@ VeVariant::VeVariant(const nlohmann::json &j)
     }
 }
 
-VeVariant::VeVariant(const VeVariant &other)
+VeVariant::VeVariant(const VeVariant &other) :
+    u64(0)
+{
+    switch (other.type)
+    {
+    case VeVariantType::String:
+        set_string(other.str_data(), other.str_size());
+        break;
+    case VeVariantType::Array:
+        this->arr = other.arr ? new VeVariantArrayData(*other.arr) : new VeVariantArrayData();
+        this->type = VeVariantType::Array;
+        break;
+    case VeVariantType::Dict:
+        this->dict = other.dict ? new VeVariantDictData(*other.dict) : new VeVariantDictData();
+        this->type = VeVariantType::Dict;
+        break;
+    default:
+        this->u64 = other.u64;
+        this->type = other.type;
+        break;
+    }
+}
+
+VeVariant::VeVariant(VeVariant &&other) noexcept :
+    u64(0)
+{
+    *this = std::move(other);
+}
+
+VeVariant::~VeVariant()
+{
+    clear();
+}
+
+/**
+ * @brief VeVariant::clear frees what we own, and makes us 'Unknown'.
+ */
+void VeVariant::clear()
+{
+    switch (this->type)
+    {
+    case VeVariantType::String:
+        if (long_string && !arena_string)
+            delete[] long_str.data;
+        break;
+    case VeVariantType::Array:
+        delete arr;
+        break;
+    case VeVariantType::Dict:
+        delete dict;
+        break;
+    default:
+        break;
+    }
+
+    this->u64 = 0;
+    this->long_string = false;
+    this->arena_string = false;
+    this->type = VeVariantType::Unknown;
+}
+
+/**
+ * @brief VeVariant::set_string stores short strings inline, and longer ones in their own allocation, or in the arena if given. All are
+ * null terminated, for dbus.
+ */
+void VeVariant::set_string(const char *s, size_t len, DispatchArena *arena)
 {
-    *this = other;
+    clear();
+
+    if (len <= small_string_capacity)
+    {
+        std::memcpy(small_str.data, s, len);
+        small_str.data[len] = 0;
+        small_str.size = static_cast<uint8_t>(len);
+    }
+    else
+    {
+        char *data = nullptr;
+
+        if (arena)
+        {
+            data = arena->copy_string(s, len);
+        }
+        else
+        {
+            data = new char[len + 1];
+            std::memcpy(data, s, len);
+            data[len] = 0;
+        }
+
+        long_str.data = data;
+        long_str.size = len;
+        long_string = true;
+        arena_string = arena != nullptr;
+    }
+
+    type = VeVariantType::String;
 }
 
-std::unique_ptr<std::vector<VeVariant> > VeVariant::make_array(DBusMessageIter *iter)
+const char *VeVariant::str_data() const
+{
+    if (type != VeVariantType::String)
+        return "";
+
+    return long_string ? long_str.data : small_str.data;
+}
+
+size_t VeVariant::str_size() const
+{
+    if (type != VeVariantType::String)
+        return 0;
+
+    return long_string ? long_str.size : small_str.size;
+}
+
+std::string_view VeVariant::get_string_view() const
+{
+    return std::string_view(str_data(), str_size());
+}
+
+VeVariantArrayData *VeVariant::make_array(DBusMessageIter *iter)
 {
     if (dbus_message_iter_get_arg_type(iter) != DBUS_TYPE_ARRAY)
         throw ValueError("Calling make_array() on something other than array.");
 
-    std::unique_ptr<std::vector<VeVariant>> result = std::make_unique<std::vector<VeVariant>>();
+    std::unique_ptr<VeVariantArrayData> result = std::make_unique<VeVariantArrayData>();
 
     DBusMessageIter array_iter;
     dbus_message_iter_recurse(iter, &array_iter);
@@ -266,20 +475,20 @@ std::unique_ptr<std::vector<VeVariant> > VeVariant::make_array(DBusMessageIter *
 
     while (dbus_message_iter_get_arg_type(&array_iter) != DBUS_TYPE_INVALID)
     {
-        result->emplace_back(&array_iter);
+        result->items.emplace_back(&array_iter);
         dbus_message_iter_next(&array_iter);
     }
 
-    return result;
+    return result.release();
 }
 
-std::unique_ptr<std::unordered_map<VeVariant, VeVariant>> VeVariant::make_dict(DBusMessageIter *iter)
+VeVariantDictData *VeVariant::make_dict(DBusMessageIter *iter)
 {
     if (dbus_message_iter_get_arg_type(iter) != DBUS_TYPE_ARRAY)
         throw ValueError("Calling make_dict() on something other than array.");
 
-    std::unique_ptr<std::unordered_map<VeVariant, VeVariant>> result = std::make_unique<std::unordered_map<VeVariant, VeVariant>>();
-    std::unordered_map<VeVariant, VeVariant> &r = *result;
+    std::unique_ptr<VeVariantDictData> result = std::make_unique<VeVariantDictData>();
+    std::unordered_map<VeVariant, VeVariant> &r = result->items;
 
     DBusMessageIter array_iter;
     dbus_message_iter_recurse(iter, &array_iter);
@@ -297,12 +506,12 @@ std::unique_ptr<std::unordered_map<VeVariant, VeVariant>> VeVariant::make_dict(D
         dbus_message_iter_next(&dict_iter);
         VeVariant val(&dict_iter);
 
-        r[key] = val;
+        r[std::move(key)] = std::move(val);
 
         dbus_message_iter_next(&array_iter);
     }
 
-    return result;
+    return result.release();
 }
 
 std::string VeVariant::as_text() const
@@ -334,7 +543,7 @@ std::string VeVariant::as_text() const
         break;
     case VeVariantType::String:
     {
-        o << str;
+        o << get_string_view();
         break;
     }
     case VeVariantType::Double:
@@ -346,8 +555,10 @@ std::string VeVariant::as_text() const
     case VeVariantType::Array:
     case VeVariantType::Dict:
     {
-        auto v = as_json_value();
-        o << v.dump();
+        std::string json;
+        JsonWriter writer(json);
+        write_json(writer);
+        o << json;
         break;
     }
     default:
@@ -382,7 +593,7 @@ nlohmann::json VeVariant::as_json_value(bool mask) const
         {
             return "******";
         }
-        return str;
+        return get_string_view();
     }
     case VeVariantType::Double:
         return d;
@@ -403,10 +614,10 @@ nlohmann::json VeVariant::as_json_value(bool mask) const
         if (this->arr)
         {
             // I disabled the EMPTY_ARRAY_AS_NULL_VALUE_TYPE check, because there are dbus services that don't seem to stick to that rule.
-            if (this->arr->empty()) // && this->contained_array_type_as_string == EMPTY_ARRAY_AS_NULL_VALUE_TYPE)
+            if (this->arr->items.empty()) // && this->arr->contained_type == EMPTY_ARRAY_AS_NULL_VALUE_TYPE)
                 return nlohmann::json();
 
-            for (VeVariant &v : *this->arr)
+            for (const VeVariant &v : this->arr->items)
             {
                 array.push_back(v.as_json_value());
             }
@@ -420,7 +631,7 @@ nlohmann::json VeVariant::as_json_value(bool mask) const
 
         if (this->dict)
         {
-            for (auto &p : *this->dict)
+            for (auto &p : this->dict->items)
             {
                 const VeVariant &key = p.first;
 
@@ -438,6 +649,115 @@ nlohmann::json VeVariant::as_json_value(bool mask) const
     }
 }
 
+/**
+ * @brief VeVariant::write_json writes the same as as_json_value().dump() would, but without building a json document in between.
+ */
+void VeVariant::write_json(JsonWriter &writer, bool mask) const
+{
+    switch (this->type)
+    {
+    case VeVariantType::IntegerSigned16:
+        writer.write_int(i16);
+        break;
+    case VeVariantType::IntegerSigned32:
+        writer.write_int(i32);
+        break;
+    case VeVariantType::IntegerSigned64:
+        writer.write_int(i64);
+        break;
+    case VeVariantType::IntegerUnsigned8:
+        writer.write_int(u8);
+        break;
+    case VeVariantType::IntegerUnsigned16:
+        writer.write_int(u16);
+        break;
+    case VeVariantType::IntegerUnsigned32:
+        writer.write_int(u32);
+        break;
+    case VeVariantType::IntegerUnsigned64:
+        writer.write_int(u64);
+        break;
+    case VeVariantType::String:
+    {
+        if (mask)
+        {
+            writer.write_string("******");
+            break;
+        }
+        writer.write_string(get_string_view());
+        break;
+    }
+    case VeVariantType::Double:
+        writer.write_double(d);
+        break;
+    case VeVariantType::Boolean:
+        writer.write_bool(static_cast<bool>(bool_val));
+        break;
+    case VeVariantType::Array:
+    {
+        // Empty arrays are null, see as_json_value().
+        if (!this->arr || this->arr->items.empty())
+        {
+            writer.write_null();
+            break;
+        }
+
+        char separator = '[';
+
+        for (const VeVariant &v : this->arr->items)
+        {
+            writer.write_raw(separator);
+            v.write_json(writer);
+            separator = ',';
+        }
+
+        writer.write_raw(']');
+        break;
+    }
+    case VeVariantType::Dict:
+    {
+        if (!this->dict || this->dict->items.empty())
+        {
+            writer.write_raw("{}");
+            break;
+        }
+
+        // JSON objects are written with sorted keys.
+        std::vector<const std::pair<const VeVariant, VeVariant>*> sorted;
+        sorted.reserve(this->dict->items.size());
+
+        for (const auto &p : this->dict->items)
+        {
+            if (p.first.get_type() != VeVariantType::String)
+                throw ValueError("JSON dict keys must be string.");
+
+            sorted.push_back(&p);
+        }
+
+        std::sort(sorted.begin(), sorted.end(), [](const auto *a, const auto *b) {
+            return a->first.get_string_view() < b->first.get_string_view();
+        });
+
+        char separator = '{';
+
+        for (const auto *p : sorted)
+        {
+            writer.write_raw(separator);
+            writer.write_string(p->first.get_string_view());
+            writer.write_raw(':');
+            p->second.write_json(writer);
+            separator = ',';
+        }
+
+        writer.write_raw('}');
+        break;
+    }
+    default:
+        writer.write_string("unknown_type");
+        break;
+    }
+}
+
 int VeVariant::get_dbus_type() const
 {
     switch (this->type)
@@ -521,11 +841,17 @@ std::string VeVariant::get_dbus_type_as_string_recursive() const
  */
 std::string VeVariant::get_contained_type_as_string() const
 {
-    std::string recursive = this->contained_array_type_as_string;
+    if (type == VeVariantType::Dict && dict)
+        return dict->contained_type;
+
+    if (type != VeVariantType::Array || !arr)
+        return std::string();
 
-    if (arr && !arr->empty())
+    std::string recursive = arr->contained_type;
+
+    if (!arr->items.empty())
     {
-        const VeVariant &first = arr->front();
+        const VeVariant &first = arr->items.front();
         recursive += first.get_contained_type_as_string();
     }
 
@@ -577,7 +903,7 @@ void VeVariant::append_args_to_dbus_message(DBusMessageIter *iter) const
     }
     case VeVariantType::String:
     {
-        const char *mystr = str.c_str();
+        const char *mystr = str_data();
         dbus_message_iter_append_basic(iter, get_dbus_type(), &mystr);
         break;
     }
@@ -602,7 +928,7 @@ void VeVariant::append_args_to_dbus_message(DBusMessageIter *iter) const
             DBusMessageIterOpenContainerGuard array_iter(iter, DBUS_TYPE_ARRAY, get_contained_type_as_string().c_str());
             int last_type = 0;
             bool type_anchored = false;
-            for(const VeVariant &v : *arr)
+            for(const VeVariant &v : arr->items)
             {
                 if (type_anchored && v.get_dbus_type() != last_type)
                     throw ValueError("You can't put different types in a dbus array.");
@@ -625,42 +951,102 @@ void VeVariant::append_args_to_dbus_message(DBusMessageIter *iter) const
 
 VeVariant &VeVariant::operator=(const VeVariant &other)
 {
-    if (other.arr)
-    {
-        this->arr = std::make_unique<std::vector<VeVariant>>();
-        (*this->arr) = (*other.arr);
-    }
-    else
-    {
-        this->arr.reset();
-    }
+    if (this == &other)
+        return *this;
 
-    if (other.dict)
-    {
-        this->dict = std::make_unique<std::unordered_map<VeVariant, VeVariant>>();
-        (*this->dict) = (*other.dict);
-    }
-    else
-    {
-        this->dict.reset();
-    }
+    // Copying first, because other may live inside what we are about to free.
+    VeVariant copy(other);
+    *this = std::move(copy);
+    return *this;
+}
+
+/**
+ * @brief VeVariant::operator= takes over the payload of other, leaving it 'Unknown'.
+ */
+VeVariant &VeVariant::operator=(VeVariant &&other) noexcept
+{
+    if (this == &other)
+        return *this;
+
+    // The union members are trivial, so copying the largest member's bytes moves any of them, including owned pointers.
+    static_assert(sizeof(SmallString) >= sizeof(LongString));
+    SmallString payload;
+    std::memcpy(&payload, &other.small_str, sizeof(SmallString));
+    const VeVariantType other_type = other.type;
+    const bool other_long_string = other.long_string;
+    const bool other_arena_string = other.arena_string;
 
-    this->u8 = other.u8;
-    this->i16 = other.i16;
-    this->u16 = other.u16;
-    this->i32 = other.i32;
-    this->u32 = other.u32;
-    this->bool_val = other.bool_val;
-    this->i64 = other.i64;
-    this->u64 = other.u64;
-    this->str = other.str;
-    this->d = other.d;
-    this->type = other.type;
-    this->contained_array_type_as_string = other.contained_array_type_as_string;
+    other.u64 = 0;
+    other.long_string = false;
+    other.arena_string = false;
+    other.type = VeVariantType::Unknown;
+
+    clear();
+
+    std::memcpy(&this->small_str, &payload, sizeof(SmallString));
+    this->type = other_type;
+    this->long_string = other_long_string;
+    this->arena_string = other_arena_string;
 
     return *this;
 }
 
+void VeVariant::write_snapshot(SnapshotWriter &writer) const
+{
+    writer.write_u8(static_cast<uint8_t>(type));
+
+    switch (type)
+    {
+    case VeVariantType::Unknown:
+        break;
+    case VeVariantType::IntegerSigned16:
+    case VeVariantType::IntegerSigned32:
+    case VeVariantType::IntegerSigned64:
+        writer.write_u64(static_cast<uint64_t>(as_int<int64_t>()));
+        break;
+    case VeVariantType::IntegerUnsigned8:
+    case VeVariantType::IntegerUnsigned16:
+    case VeVariantType::IntegerUnsigned32:
+    case VeVariantType::IntegerUnsigned64:
+        writer.write_u64(as_int<uint64_t>());
+        break;
+    case VeVariantType::Double:
+    {
+        uint64_t bits;
+        std::memcpy(&bits, &d, sizeof(bits));
+        writer.write_u64(bits);
+        break;
+    }
+    case VeVariantType::Boolean:
+        writer.write_u8(bool_val ? 1 : 0);
+        break;
+    case VeVariantType::String:
+        writer.write_string(get_string_view());
+        break;
+    case VeVariantType::Array:
+        if (!arr)
+            throw ValueError("VeVariant array without data.");
+        writer.write_string(arr->contained_type);
+        writer.write_u32(static_cast<uint32_t>(arr->items.size()));
+        for (const VeVariant &v : arr->items)
+        {
+            v.write_snapshot(writer);
+        }
+        break;
+    case VeVariantType::Dict:
+        if (!dict)
+            throw ValueError("VeVariant dict without data.");
+        writer.write_string(dict->contained_type);
+        writer.write_u32(static_cast<uint32_t>(dict->items.size()));
+        for (const auto &p : dict->items)
+        {
+            p.first.write_snapshot(writer);
+            p.second.write_snapshot(writer);
+        }
+        break;
+    }
+}
+
 bool VeVariant::operator==(const VeVariant &other) const
 {
     if (this->type != other.type)
@@ -685,7 +1071,7 @@ bool VeVariant::operator==(const VeVariant &other) const
     case VeVariantType::IntegerUnsigned64:
         return this->u64 == other.u64;
     case VeVariantType::String:
-        return this->str == other.str;
+        return this->get_string_view() == other.get_string_view();
     case VeVariantType::Double:
         return this->d == other.d;
     case VeVariantType::Boolean:
@@ -698,7 +1084,7 @@ bool VeVariant::operator==(const VeVariant &other) const
         if (!this->arr || !other.arr)
             return false;
 
-        return *this->arr == *other.arr;
+        return this->arr->items == other.arr->items;
     }
     case VeVariantType::Dict:
     {
@@ -708,7 +1094,7 @@ bool VeVariant::operator==(const VeVariant &other) const
         if (!this->dict || !other.dict)
             return false;
 
-        return *this->dict == *other.dict;
+        return this->dict->items == other.dict->items;
     }
     default:
         throw ValueError("Shouldn't end up here.");
@@ -746,7 +1132,7 @@ std::size_t VeVariant::hash() const
     case VeVariantType::IntegerUnsigned64:
         return std::hash<dbus_uint64_t>()(0);
     case VeVariantType::String:
-        return std::hash<std::string>()(str);
+        return std::hash<std::string_view>()(get_string_view());
     case VeVariantType::Double:
         return std::hash<double>()(d);
     case VeVariantType::Boolean:
@@ -758,7 +1144,7 @@ std::size_t VeVariant::hash() const
 
         size_t hash = 0;
 
-        for (const VeVariant &v : *this->arr)
+        for (const VeVariant &v : this->arr->items)
         {
             hash ^= v.hash();
         }
@@ -774,7 +1160,7 @@ VeVariant &VeVariant::operator[](const VeVariant &v)
 {
     if (type != VeVariantType::Dict || !dict)
         throw ValueError("VeVariant is not a dict or the dict is null.");
-    std::unordered_map<VeVariant, VeVariant> &d = *dict;
+    std::unordered_map<VeVariant, VeVariant> &d = dict->items;
     return d[v];
 }
 
@@ -783,8 +1169,8 @@ VeVariant &VeVariant::get_dict_val(const VeVariant &key)
     if (type != VeVariantType::Dict || !dict)
         throw ValueError("VeVariant is not a dict or the dict is null.");
 
-    auto pos = dict->find(key);
-    if (pos == dict->end())
+    auto pos = dict->items.find(key);
+    if (pos == dict->items.end())
         throw ValueError("Key '" + key.as_text() + "' not found.");
 
     return pos->second;
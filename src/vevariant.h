@@ -3,6 +3,7 @@
 
 #include <dbus-1.0/dbus/dbus.h>
 #include <string>
+#include <string_view>
 #include <vector>
 #include <memory>
 #include <optional>
@@ -16,7 +17,7 @@
 namespace dbus_flashmq
 {
 
-enum class VeVariantType
+enum class VeVariantType : uint8_t
 {
     Unknown,
     IntegerSigned16,
@@ -33,61 +34,86 @@ enum class VeVariantType
     Dict
 };
 
-class VeVariant;
-
-// TODO: finish? Or remove?
-class VeVariantArray
-{
-    std::unique_ptr<std::vector<VeVariant>> arr;
-    char contained_dbus_type = 0;
-
-public:
-    VeVariantArray() = default;
-    VeVariantArray(const VeVariantArray &other);
-    VeVariantArray& operator=(const VeVariantArray &other);
-};
+struct VeVariantArrayData;
+struct VeVariantDictData;
+class JsonWriter;
+class SnapshotWriter;
+class SnapshotReader;
+class DispatchArena;
 
 /**
  * @brief The VeVariant class is a little less uniony and prone to type confusion than a normal variant, and is recursive.
+ *
+ * On the inside it is a union though, because every item holds three of them. Scalars share one 8 byte slot, short strings are stored
+ * inline and only long strings, arrays and dicts go on the heap. The contained type signature is only needed for arrays and dicts, so
+ * it's stored with their data.
+ *
+ * When decoded with a DispatchArena, long strings are stored in the arena instead. Such a VeVariant is only a temporary of the dispatch;
+ * copies of it always go on the heap again.
  */
 class VeVariant
 {
-    // TODO: put these unique pointers in separate class, so I can remove the custom assignment operator and such.
-    //VeVariantArray arr2;
-    std::unique_ptr<std::vector<VeVariant>> arr;
-    std::unique_ptr<std::unordered_map<VeVariant, VeVariant>> dict;
-
-    std::string str;
-
-    // Not using DBusBasicValues because a C union is not default constructed, has no operators, etc.
-    uint8_t       u8 = 0;
-    dbus_int16_t  i16 = 0;
-    dbus_uint16_t u16 = 0;
-    dbus_int32_t  i32 = 0;
-    dbus_uint32_t u32 = 0;
-    dbus_bool_t   bool_val = 0; // must be 32 bit in dbus
-    dbus_int64_t  i64 = 0;
-    dbus_uint64_t u64 = 0;
-    double d = 0.0;
+    static constexpr size_t small_string_capacity = 14;
+
+    struct SmallString
+    {
+        char data[small_string_capacity + 1];
+        uint8_t size;
+    };
+
+    struct LongString
+    {
+        char *data;
+        size_t size;
+    };
+
+    // Not using DBusBasicValues because it has no string storage of its own.
+    union
+    {
+        uint8_t       u8;
+        dbus_int16_t  i16;
+        dbus_uint16_t u16;
+        dbus_int32_t  i32;
+        dbus_uint32_t u32;
+        dbus_bool_t   bool_val; // must be 32 bit in dbus
+        dbus_int64_t  i64;
+        dbus_uint64_t u64;
+        double d;
+        SmallString small_str;
+        LongString long_str;
+        VeVariantArrayData *arr;
+        VeVariantDictData *dict;
+    };
 
     VeVariantType type = VeVariantType::Unknown;
-    std::string contained_array_type_as_string;
+    bool long_string = false;
+    bool arena_string = false;
+
+    static VeVariantArrayData *make_array(DBusMessageIter *iter);
+    static VeVariantDictData *make_dict(DBusMessageIter *iter);
 
-    static std::unique_ptr<std::vector<VeVariant>> make_array(DBusMessageIter *iter);
-    static std::unique_ptr<std::unordered_map<VeVariant, VeVariant>> make_dict(DBusMessageIter *iter);
+    void set_string(const char *s, size_t len, DispatchArena *arena=nullptr);
+    const char *str_data() const;
+    size_t str_size() const;
+    void clear();
 
 public:
-    VeVariant() = default;
-    VeVariant(VeVariant &&other) = default;
+    VeVariant();
+    VeVariant(VeVariant &&other) noexcept;
     VeVariant(const VeVariant &other);
-    VeVariant(DBusMessageIter *iter);
+    VeVariant(DBusMessageIter *iter, DispatchArena *arena=nullptr);
     VeVariant(const std::string &v);
     explicit VeVariant(const std::optional<std::string> &v);
     VeVariant(const char *s);
     VeVariant(const nlohmann::json &j);
     explicit VeVariant(const std::optional<bool> b);
+    ~VeVariant();
     std::string as_text() const;
     nlohmann::json as_json_value(bool mask=false) const;
+    void write_json(JsonWriter &writer, bool mask=false) const;
+    void write_snapshot(SnapshotWriter &writer) const;
+    static VeVariant from_snapshot(SnapshotReader &reader);
+    std::string_view get_string_view() const;
 
     template<std::integral T>
     T as_int() const
@@ -127,6 +153,7 @@ public:
     void append_args_to_dbus_message(DBusMessageIter *iter) const;
 
     VeVariant& operator=(const VeVariant &other);
+    VeVariant& operator=(VeVariant &&other) noexcept;
     bool operator==(const VeVariant &other) const;
     operator bool() const;
     VeVariantType get_type() const;
@@ -150,4 +177,21 @@ namespace std {
 
 }
 
+namespace dbus_flashmq
+{
+
+struct VeVariantArrayData
+{
+    std::vector<VeVariant> items;
+    std::string contained_type;
+};
+
+struct VeVariantDictData
+{
+    std::unordered_map<VeVariant, VeVariant> items;
+    std::string contained_type;
+};
+
+}
+
 #endif // VEVARIANT_H